@@ -24,6 +24,12 @@ endif()
 
 find_package(nlohmann_json)
 
+if(RESOLUTE_WITH_STORESCP)
+  find_package(DCMTK REQUIRED)
+  include_directories(${DCMTK_INCLUDE_DIRS})
+  add_definitions(-DRESOLUTE_WITH_STORESCP)
+endif()
+
 #ANTS
 # find ANTS includes
 
@@ -23,10 +23,10 @@
 #ifndef _ANTSREG_HPP_
 #define _ANTSREG_HPP_ 
 
-#include <nlohmann/json.hpp>
 #include <boost/filesystem.hpp>
 #include <glog/logging.h>
 
+#include <memory>
 #include <string>
 
 #include <itkImageFileReader.h>
@@ -34,17 +34,15 @@
 #include <antsRegistrationTemplateHeader.h>
 #include <include/ants.h>
 
-#include <boost/algorithm/string/classification.hpp>
-#include <boost/algorithm/string/split.hpp>
-#include <boost/algorithm/string/replace.hpp>
-#include <boost/regex.hpp>
-#include <boost/algorithm/string/regex.hpp>
+#include "StageTimer.hpp"
+#include "RegistrationBackend.hpp"
 
 
 namespace reg {
 
+//regName "ANTS": the legacy ANTS command line.
 template <class TImage>
-class ANTsReg
+class ANTsReg : public RegistrationBackend<TImage>
 {
 
 public:
@@ -53,32 +51,50 @@ public:
   //DicomReader();
   ANTsReg();
 
-  void SetParams(const nlohmann::json &params);
-  void SetOutputDirectory(const boost::filesystem::path outDir);
-  void SetOutputPrefix(const std::string &s){ _prefix = s; };
-  void SetReferenceFileName(const boost::filesystem::path refFileName);
-  void SetFloatingFileName(const boost::filesystem::path floatFileName);
-
-  void Update();
+  std::string GetName() const override { return "ANTS"; };
+  std::string GetDefaultArgs() const override { return _defaultArgs; };
+  std::string GetDefaultAffineArgs() const override {
+    return "3 -m MI[<%%REF%%>,<%%FLOAT%%>,1,32] -i 0 -o <%%PREFIX%%>";
+  };
 
   typename TImage::ConstPointer GetOutputImage();
   typename TImage::ConstPointer GetOutputInverseImage();
 
 protected:
 
-  void InsertParam(const std::string &key, const std::string &info);
+  void Register(const boost::filesystem::path &fullPrefix) override;
 
-  std::string _prefix;
-  boost::filesystem::path _outDir;
-  boost::filesystem::path _refFileName;
-  boost::filesystem::path _floatFileName;
+  const std::string _defaultArgs = "3 -m CC[<%%REF%%>,<%%FLOAT%%>,1,4] -i 10x5x2 -o <%%PREFIX%%> -t SyN[0.5] -r Gauss[3,0] -G";
 
-  nlohmann::json _regParams;
-  bool _bDefaultParams = true;
+};
 
-  const std::string _defaultArgs = "3 -m CC[<%%REF%%>,<%%FLOAT%%>,1,4] -i 10x5x2 -o <%%PREFIX%%> -t SyN[0.5] -r Gauss[3,0] -G";
+//regName "antsRegistration": the current ANTs command line, in single
+//precision by default. Its results are renamed to the ANTS convention.
+template <class TImage>
+class ANTsRegistrationReg : public RegistrationBackend<TImage>
+{
+
+public:
+  typedef TImage ImageType;
 
-  std::string _argList;
+  ANTsRegistrationReg(){};
+
+  std::string GetName() const override { return "antsRegistration"; };
+  std::string GetDefaultArgs() const override {
+    return GetDefaultAffineArgs() +
+      " --transform SyN[0.1,3,0] --metric CC[<%%REF%%>,<%%FLOAT%%>,1,4]"
+      " --convergence [50x20x10,1e-6,10] --shrink-factors 4x2x1 --smoothing-sigmas 2x1x0vox";
+  };
+  std::string GetDefaultAffineArgs() const override {
+    return "--dimensionality 3 --float 1 --output <%%PREFIX%%> --interpolation Linear"
+      " --winsorize-image-intensities [0.005,0.995] --initial-moving-transform [<%%REF%%>,<%%FLOAT%%>,1]"
+      " --transform Affine[0.1] --metric MI[<%%REF%%>,<%%FLOAT%%>,1,32,Regular,0.25]"
+      " --convergence [1000x500x250,1e-6,10] --shrink-factors 4x2x1 --smoothing-sigmas 2x1x0vox";
+  };
+
+protected:
+
+  void Register(const boost::filesystem::path &fullPrefix) override;
 
 };
 
@@ -89,16 +105,13 @@ ANTsReg<TImage>::ANTsReg()
 
   DLOG(INFO) << "Initialised ANTsReg.";
 
-  //Use defaults unless set otherwise via SetParams;
-  _argList = _defaultArgs;
-
 }
 
 template <typename TImage>
 typename TImage::ConstPointer ANTsReg<TImage>::GetOutputImage(){
 
-  boost::filesystem::path tImagePath = _outDir;
-  tImagePath /= _prefix;
+  boost::filesystem::path tImagePath = this->_outDir;
+  tImagePath /= this->_prefix;
   tImagePath += "Warped.nii.gz";
 
   typedef typename itk::ImageFileReader<TImage> ReaderType;
@@ -122,8 +135,8 @@ typename TImage::ConstPointer ANTsReg<TImage>::GetOutputImage(){
 template <typename TImage>
 typename TImage::ConstPointer ANTsReg<TImage>::GetOutputInverseImage(){
 
-  boost::filesystem::path iImagePath = _outDir;
-  iImagePath /= _prefix;
+  boost::filesystem::path iImagePath = this->_outDir;
+  iImagePath /= this->_prefix;
   iImagePath += "InverseWarped.nii.gz";
 
   typedef typename itk::ImageFileReader<TImage> ReaderType;
@@ -145,135 +158,90 @@ typename TImage::ConstPointer ANTsReg<TImage>::GetOutputInverseImage(){
 }
 
 template <typename TImage>
-void ANTsReg<TImage>::SetOutputDirectory(const boost::filesystem::path outDir){
-
-  if ( boost::filesystem::exists(outDir) ){
-    if (!boost::filesystem::is_directory(outDir)){
-      LOG(ERROR) << "Output directory: " << outDir << "does not appear to be a directory!";
-      throw(false);
-    }
-  } else {
-    try {
-      boost::filesystem::create_directories(outDir);
-    } catch (const boost::filesystem::filesystem_error &e){
-      LOG(ERROR) << "Cannot create output folder : " << outDir;
-      throw(false);
-    }
-  }
-
-  _outDir = outDir;
-
-}
-
-template <typename TImage>
-void ANTsReg<TImage>::SetReferenceFileName(const boost::filesystem::path refFileName){
-
-  try {
-    if (!boost::filesystem::is_regular_file(refFileName)){
-      LOG(ERROR) << "Cannot find reference image file : " << refFileName;
-      throw(false);      
-    }
-  } catch (const boost::filesystem::filesystem_error &e){
-      LOG(ERROR) << "File system error reading : " << refFileName;
-      throw(false);
-    }
-  
-  _refFileName = refFileName;
-  
-}
-
-template <typename TImage>
-void ANTsReg<TImage>::SetFloatingFileName(const boost::filesystem::path floatFileName){
+void ANTsReg<TImage>::Register(const boost::filesystem::path &fullPrefix){
 
-  try {
-    if (!boost::filesystem::is_regular_file(floatFileName)){
-      LOG(ERROR) << "Cannot find floating image file : " << floatFileName;
-      throw(false);      
-    }
-  } catch (const boost::filesystem::filesystem_error &e){
-      LOG(ERROR) << "File system error reading : " << floatFileName;
-      throw(false);
-    }
-  
-  _floatFileName = floatFileName;
-  
-}
-
-template <typename TImage>
-void ANTsReg<TImage>::SetParams(const nlohmann::json &params){ 
+  this->InsertParam("FLOAT", this->_floatFileName.string());
+  this->InsertParam("REF", this->_refFileName.string());
+  this->InsertParam("PREFIX", fullPrefix.string());
 
-  _argList = params.get<std::string>();
-  _bDefaultParams = false;
+  LOG(INFO) << "Registration parameters:";
+  LOG(INFO) << "";
+  LOG(INFO) << this->_argList;
+  LOG(INFO) << "";
 
-};
+  const std::vector<std::string> finalArgs = this->SplitArgs();
 
-template <typename TImage>
-void ANTsReg<TImage>::InsertParam(const std::string &key, const std::string &info){
+  for (std::size_t i = 0; i + 1 < finalArgs.size(); ++i)
+    if (finalArgs[i] == "-i" || finalArgs[i] == "--number-of-iterations")
+      this->_iterations += this->SumSchedule(finalArgs[i + 1]);
 
-  std::string target = "<%%" + key + "%%>";
-  std::string::size_type n = _argList.find(target);
+  LOG(INFO) << "Starting ANTs registration. This will take a while...";
+  google::FlushLogFiles(google::INFO);
 
-  if (n == std::string::npos){
-    LOG(WARNING) << "Replacement key: " << target << " not found!";
-  }
+  ants::ANTS( finalArgs, &std::cout);
 
-  boost::replace_all(_argList, target, info);
 }
 
 template <typename TImage>
-void ANTsReg<TImage>::Update(){
+void ANTsRegistrationReg<TImage>::Register(const boost::filesystem::path &fullPrefix){
 
-  boost::filesystem::path fullPrefix = _outDir;
-  fullPrefix /= _prefix;
-
-  boost::filesystem::path tImagePath = fullPrefix;
-  tImagePath += "Warped.nii.gz";
+  this->InsertParam("FLOAT", this->_floatFileName.string());
+  this->InsertParam("REF", this->_refFileName.string());
+  this->InsertParam("PREFIX", fullPrefix.string());
 
-  boost::filesystem::path iImagePath = fullPrefix;
-  iImagePath += "InverseWarped.nii.gz";
+  LOG(INFO) << "Registration parameters:";
+  LOG(INFO) << "";
+  LOG(INFO) << this->_argList;
+  LOG(INFO) << "";
 
-  InsertParam("FLOAT", _floatFileName.string());
-  InsertParam("REF", _refFileName.string());
-  InsertParam("PREFIX", fullPrefix.string());
-  //InsertParam("WARPEDIMG", tImagePath.string());
-  //InsertParam("INVWARPEDIMG", iImagePath.string());
+  const std::vector<std::string> finalArgs = this->SplitArgs();
 
-  std::vector<std::string> args;
+  for (std::size_t i = 0; i + 1 < finalArgs.size(); ++i)
+    if (finalArgs[i] == "--convergence" || finalArgs[i] == "-c")
+      this->_iterations += this->SumSchedule(finalArgs[i + 1]);
 
-  boost::split_regex( args, _argList, boost::regex( " " ) ) ;
+  LOG(INFO) << "Starting antsRegistration. This will take a while...";
+  google::FlushLogFiles(google::INFO);
 
-  if (_bDefaultParams){
-    LOG(WARNING) << "No registration parameters set. Using defaults!";
+  if (ants::antsRegistration( finalArgs, &std::cout) != EXIT_SUCCESS){
+    LOG(ERROR) << "antsRegistration failed.";
+    throw false;
   }
 
-  LOG(INFO) << "Registration parameters:";
-  LOG(INFO) << "";
-  LOG(INFO) << _argList;
-  LOG(INFO) << "";
-
-  std::vector<std::string> finalArgs;
+  //With the default collapsed output: prefix0GenericAffine.mat, and
+  //prefix1Warp.nii.gz and prefix1InverseWarp.nii.gz for SyN.
+  boost::filesystem::path affFile = fullPrefix;
+  affFile += "0GenericAffine.mat";
 
-  int x=1;
-  for (auto a : args){
-    if (a != "") {
-      finalArgs.push_back(a);
-      DLOG(INFO) << x << "\t\t" << a;
-      x++;
-    }
+  try {
+    itk::TransformFileReader::Pointer affReader = itk::TransformFileReader::New();
+    affReader->SetFileName(affFile.string());
+    affReader->Update();
+    SaveTransforms<DisplacementFieldType>(affReader->GetTransformList()->front(), nullptr, fullPrefix);
+  } catch (itk::ExceptionObject &ex){
+    LOG(ERROR) << ex;
+    LOG(ERROR) << "Cannot convert " << affFile;
+    throw false;
   }
 
-  LOG(INFO) << "Starting ANTs registration. This will take a while...";
-  google::FlushLogFiles(google::INFO);
+  boost::filesystem::remove(affFile);
 
-  //ants::antsRegistration( finalArgs, &std::cout);
-  ants::ANTS( finalArgs, &std::cout);
+  const char *const warps[] = { "Warp.nii.gz", "InverseWarp.nii.gz" };
+  for (const char *w : warps){
+    boost::filesystem::path src = fullPrefix;
+    src += std::string("1") + w;
+    boost::filesystem::path dst = fullPrefix;
+    dst += w;
 
-  LOG(INFO) << "Registration complete!";
+    boost::system::error_code ec;
+    boost::filesystem::remove(dst, ec);
+    if (boost::filesystem::exists(src))
+      boost::filesystem::rename(src, dst);
+  }
 
-  
 }
 
 } //namespace reg
 
 
-#endif
\ No newline at end of file
+#endif
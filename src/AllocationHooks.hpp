@@ -0,0 +1,96 @@
+/*
+   AllocationHooks.hpp
+
+   Author:      Benjamin A. Thomas
+
+   Copyright 2018 Institute of Nuclear Medicine, University College London.
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+
+ */
+
+#pragma once
+
+#ifndef _ALLOCATIONHOOKS_HPP_
+#define _ALLOCATIONHOOKS_HPP_
+
+/*
+  Replacement global operator new/delete that report large blocks to
+  mon::MemoryMonitor. These are definitions, not declarations: include this
+  file in exactly one translation unit of an executable.
+
+  Blocks are classified by malloc_usable_size() on both allocation and
+  release, so no header is needed and small allocations only pay for one
+  extra call.
+*/
+
+#include <cstdlib>
+#include <new>
+#include <malloc.h>
+
+#include "MemoryMonitor.hpp"
+
+namespace mon {
+namespace detail {
+
+inline void *HookedAllocate(std::size_t size){
+
+  if (size == 0)
+    size = 1;
+
+  void *p = nullptr;
+  while ((p = std::malloc(size)) == nullptr){
+    std::new_handler handler = std::get_new_handler();
+    if (handler == nullptr)
+      throw std::bad_alloc();
+    handler();
+  }
+
+  const std::size_t usable = malloc_usable_size(p);
+  if (usable >= LARGE_ALLOCATION_BYTES)
+    OnLargeAllocation(usable);
+
+  return p;
+}
+
+inline void HookedFree(void *p){
+
+  if (p == nullptr)
+    return;
+
+  const std::size_t usable = malloc_usable_size(p);
+  if (usable >= LARGE_ALLOCATION_BYTES)
+    OnLargeDeallocation(usable);
+
+  std::free(p);
+}
+
+}// namespace detail
+}// namespace mon
+
+void *operator new(std::size_t size){ return mon::detail::HookedAllocate(size); }
+void *operator new[](std::size_t size){ return mon::detail::HookedAllocate(size); }
+
+void *operator new(std::size_t size, const std::nothrow_t &) noexcept {
+  try { return mon::detail::HookedAllocate(size); } catch (...) { return nullptr; }
+}
+
+void *operator new[](std::size_t size, const std::nothrow_t &) noexcept {
+  try { return mon::detail::HookedAllocate(size); } catch (...) { return nullptr; }
+}
+
+void operator delete(void *p) noexcept { mon::detail::HookedFree(p); }
+void operator delete[](void *p) noexcept { mon::detail::HookedFree(p); }
+void operator delete(void *p, const std::nothrow_t &) noexcept { mon::detail::HookedFree(p); }
+void operator delete[](void *p, const std::nothrow_t &) noexcept { mon::detail::HookedFree(p); }
+
+#endif
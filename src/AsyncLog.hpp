@@ -0,0 +1,330 @@
+/*
+   AsyncLog.hpp
+
+   Author:      Benjamin A. Thomas
+
+   Copyright 2018 Institute of Nuclear Medicine, University College London.
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+
+ */
+
+#pragma once
+
+#ifndef _ASYNCLOG_HPP_
+#define _ASYNCLOG_HPP_
+
+#include <glog/logging.h>
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdio>
+#include <cstdlib>
+#include <ctime>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+
+#include <unistd.h>
+
+#include "Metrics.hpp"
+
+/*
+  Asynchronous glog output. Install() puts a proxy in front of the logger
+  of each severity. glog still formats a record on the calling thread, but
+  the proxy only copies it to a queue, and a background thread writes it
+  to the log files. With echoToStderr, the thread also writes the records
+  that glog would only have sent to stderr for FLAGS_alsologtostderr.
+
+  The queue holds at most a fixed number of bytes. When it is full,
+  records are dropped and counted rather than blocking the caller.
+  google::FlushLogFiles() only asks the thread to flush. A FATAL record,
+  exit and a crash signal write out the queue first.
+*/
+
+namespace mon {
+
+class AsyncLog {
+
+public:
+
+  static AsyncLog &GetInstance(){
+    static AsyncLog instance;
+    return instance;
+  };
+
+  //Starts the writer thread and installs the proxies. queueBytes bounds
+  //the memory held by queued records.
+  void Install(std::size_t queueBytes, bool echoToStderr);
+
+  //Blocks until every queued record is written and the files are flushed.
+  void Drain();
+
+  //Drains, restores the original loggers and stops the thread.
+  void Shutdown();
+
+  uint64_t GetDroppedCount() const { return _dropped.load(); };
+
+protected:
+
+  struct Record {
+    google::base::Logger *target;
+    time_t timestamp;
+    std::string message;
+    bool bForceFlush;
+    bool bEcho;
+  };
+
+  class Proxy : public google::base::Logger {
+
+  public:
+    Proxy(AsyncLog &log, google::base::Logger *target, bool echo) : _log(log), _target(target), _bEcho(echo) {};
+
+    void Write(bool forceFlush, time_t timestamp, const char *message, int length) override;
+    void Flush() override { _log.RequestFlush(); };
+    google::uint32 LogSize() override { return _target->LogSize(); };
+
+  private:
+    AsyncLog &_log;
+    google::base::Logger *_target;
+    bool _bEcho;
+  };
+
+  AsyncLog(){};
+
+  void Enqueue(Record &r);
+  void RequestFlush();
+  void Run();
+  void WriteRecord(const Record &r);
+
+  //Writes out the queue without waiting for the thread, which may be the
+  //one that crashed.
+  void DrainUnsafe();
+  static void OnFailureWrite(const char *data, int size);
+
+  std::mutex _mutex;
+  std::condition_variable _cv, _drained;
+  std::deque<Record> _queue;
+  std::size_t _queuedBytes = 0;
+  std::size_t _maxBytes = 0;
+  bool _bFlushRequested = false;
+  bool _bWriting = false;
+  bool _bStop = false;
+  bool _bInstalled = false;
+
+  std::atomic<uint64_t> _dropped{0};
+  std::thread _thread;
+
+  google::base::Logger *_originals[google::NUM_SEVERITIES];
+  std::unique_ptr<Proxy> _proxies[google::NUM_SEVERITIES];
+
+private:
+
+  AsyncLog(const AsyncLog &); //purposely not implemented
+  void operator=(const AsyncLog &);  //purposely not implemented
+
+};
+
+inline void AsyncLog::Proxy::Write(bool forceFlush, time_t timestamp, const char *message, int length){
+
+  Record r = { _target, timestamp, std::string(message, length), forceFlush, _bEcho };
+  _log.Enqueue(r);
+
+  //glog aborts once the FATAL record has been written.
+  if (length > 0 && message[0] == 'F')
+    _log.Drain();
+
+}
+
+inline void AsyncLog::Install(std::size_t queueBytes, bool echoToStderr){
+
+  if (_bInstalled)
+    return;
+
+  _maxBytes = queueBytes;
+  _bStop = false;
+  _thread = std::thread(&AsyncLog::Run, this);
+
+  //Every record reaches the INFO logger, so only that one echoes.
+  for (int s = 0; s < google::NUM_SEVERITIES; ++s){
+    _originals[s] = google::base::GetLogger(s);
+    _proxies[s].reset(new Proxy(*this, _originals[s], echoToStderr && s == google::INFO));
+    google::base::SetLogger(s, _proxies[s].get());
+  }
+
+  google::InstallFailureSignalHandler();
+  google::InstallFailureWriter(&AsyncLog::OnFailureWrite);
+
+  static bool bRegistered = false;
+  if (!bRegistered){
+    std::atexit([](){ AsyncLog::GetInstance().Shutdown(); });
+    bRegistered = true;
+  }
+
+  _bInstalled = true;
+
+}
+
+inline void AsyncLog::Enqueue(Record &r){
+
+  {
+    std::lock_guard<std::mutex> lock(_mutex);
+
+    if (_queuedBytes + r.message.size() <= _maxBytes){
+      _queuedBytes += r.message.size();
+      _queue.push_back(std::move(r));
+      _cv.notify_one();
+      return;
+    }
+  }
+
+  _dropped++;
+  MetricsRegistry::GetInstance().Increment("resolute_log_records_dropped_total");
+
+}
+
+inline void AsyncLog::RequestFlush(){
+
+  std::lock_guard<std::mutex> lock(_mutex);
+  _bFlushRequested = true;
+  _cv.notify_one();
+
+}
+
+inline void AsyncLog::Drain(){
+
+  std::unique_lock<std::mutex> lock(_mutex);
+
+  if (!_thread.joinable() || std::this_thread::get_id() == _thread.get_id())
+    return;
+
+  _bFlushRequested = true;
+  _cv.notify_one();
+  _drained.wait(lock, [this](){ return _queue.empty() && !_bWriting && !_bFlushRequested; });
+
+}
+
+inline void AsyncLog::Shutdown(){
+
+  if (!_bInstalled)
+    return;
+
+  Drain();
+
+  for (int s = 0; s < google::NUM_SEVERITIES; ++s)
+    google::base::SetLogger(s, _originals[s]);
+
+  {
+    std::lock_guard<std::mutex> lock(_mutex);
+    _bStop = true;
+    _cv.notify_one();
+  }
+
+  //Anything queued after the drain is written before the thread exits.
+  _thread.join();
+
+  for (int s = 0; s < google::NUM_SEVERITIES; ++s)
+    _proxies[s].reset();
+
+  _bInstalled = false;
+
+  LOG_IF(WARNING, _dropped.load() > 0) << "Asynchronous logging dropped " << _dropped.load() << " records.";
+
+}
+
+inline void AsyncLog::WriteRecord(const Record &r){
+
+  r.target->Write(r.bForceFlush, r.timestamp, r.message.data(), static_cast<int>(r.message.size()));
+
+  if (!r.bEcho)
+    return;
+
+  //glog has already written records at or above the threshold to stderr.
+  const std::string severities = "IWEF";
+  const std::size_t severity = r.message.empty() ? 0 : severities.find(r.message[0]);
+  if (severity < static_cast<std::size_t>(FLAGS_stderrthreshold))
+    fwrite(r.message.data(), 1, r.message.size(), stderr);
+
+}
+
+inline void AsyncLog::Run(){
+
+  std::unique_lock<std::mutex> lock(_mutex);
+
+  for (;;){
+    _cv.wait(lock, [this](){ return _bStop || _bFlushRequested || !_queue.empty(); });
+
+    std::deque<Record> records;
+    records.swap(_queue);
+    _queuedBytes = 0;
+
+    const bool bFlush = _bFlushRequested;
+    _bFlushRequested = false;
+    _bWriting = true;
+
+    lock.unlock();
+
+    for (const Record &r : records)
+      WriteRecord(r);
+
+    if (bFlush){
+      for (int s = 0; s < google::NUM_SEVERITIES; ++s)
+        _originals[s]->Flush();
+      fflush(stderr);
+    }
+
+    lock.lock();
+    _bWriting = false;
+
+    if (_queue.empty() && !_bFlushRequested){
+      _drained.notify_all();
+      if (_bStop)
+        return;
+    }
+  }
+
+}
+
+inline void AsyncLog::DrainUnsafe(){
+
+  std::unique_lock<std::mutex> lock(_mutex, std::try_to_lock);
+  if (!lock.owns_lock())
+    return;
+
+  for (const Record &r : _queue)
+    WriteRecord(r);
+  _queue.clear();
+  _queuedBytes = 0;
+
+  for (int s = 0; s < google::NUM_SEVERITIES; ++s)
+    _originals[s]->Flush();
+
+}
+
+inline void AsyncLog::OnFailureWrite(const char *data, int size){
+
+  //Called for each line of the crash report: write out the queue before
+  //the first one.
+  static std::atomic<bool> bDrained(false);
+  if (!bDrained.exchange(true))
+    GetInstance().DrainUnsafe();
+
+  if (write(STDERR_FILENO, data, size) < 0)
+    return;
+
+}
+
+}// namespace mon
+
+#endif
@@ -0,0 +1,283 @@
+/*
+   BatchScheduler.hpp
+
+   Author:      Benjamin A. Thomas
+
+   Copyright 2018 Institute of Nuclear Medicine, University College London.
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+
+ */
+
+#pragma once
+
+#ifndef _BATCHSCHEDULER_HPP_
+#define _BATCHSCHEDULER_HPP_
+
+#include <glog/logging.h>
+
+#include <algorithm>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+/*
+  Runs a list of jobs through a fixed sequence of stages. Each stage has
+  its own worker pool, so different jobs can be in different stages at the
+  same time. For example, one study loads while the previous one
+  registers and the one before that exports. Jobs enter the pipeline in
+  order, and only while their estimated memory fits in the budget.
+*/
+
+namespace ns {
+
+//A budget shared by the jobs in flight. A budget of 0 is unlimited.
+class MemoryBudget {
+
+public:
+
+  explicit MemoryBudget(std::size_t bytes) : _budget(bytes) {};
+
+  //Blocks until bytes fit. With nothing reserved it always succeeds, so a
+  //job larger than the whole budget still runs, on its own.
+  void Acquire(std::size_t bytes);
+  void Release(std::size_t bytes);
+
+  std::size_t GetReserved() const { std::lock_guard<std::mutex> lock(_mutex); return _reserved; };
+
+protected:
+
+  std::size_t _budget;
+  std::size_t _reserved = 0;
+
+  mutable std::mutex _mutex;
+  std::condition_variable _cv;
+
+};
+
+inline void MemoryBudget::Acquire(std::size_t bytes){
+
+  std::unique_lock<std::mutex> lock(_mutex);
+  _cv.wait(lock, [this, bytes]{
+    return _budget == 0 || _reserved == 0 || _reserved + bytes <= _budget;
+  });
+  _reserved += bytes;
+
+}
+
+inline void MemoryBudget::Release(std::size_t bytes){
+
+  {
+    std::lock_guard<std::mutex> lock(_mutex);
+    _reserved -= std::min(bytes, _reserved);
+  }
+  _cv.notify_all();
+
+}
+
+template< typename TJob >
+class PipelineScheduler {
+
+public:
+
+  //Returns false (or throws) if the job failed. It then leaves the pipeline.
+  typedef std::function<bool(TJob &)> StageFunctionType;
+  //Estimated peak memory of a job, reserved from admission until it leaves.
+  typedef std::function<std::size_t(const TJob &)> CostFunctionType;
+
+  explicit PipelineScheduler(std::size_t memoryBudgetBytes) : _budget(memoryBudgetBytes) {};
+
+  void AddStage(const std::string &name, unsigned int workers, const StageFunctionType &fn);
+  void SetCostFunction(const CostFunctionType &fn){ _cost = fn; };
+
+  //Maximum number of jobs in the pipeline at once (0: no limit besides
+  //memory). Defaults to one per worker plus one waiting.
+  void SetMaxJobsInFlight(std::size_t n){ _maxInFlight = n; _bMaxInFlightSet = true; };
+
+  //Runs every job through every stage, and returns the number that
+  //completed them all.
+  std::size_t Run(std::vector<TJob> &jobs);
+
+protected:
+
+  struct Stage {
+    std::string name;
+    unsigned int workers;
+    StageFunctionType fn;
+    std::deque<std::size_t> queue;
+    unsigned int alive;
+    bool closed;
+  };
+
+  void Worker(std::size_t s, std::vector<TJob> &jobs);
+  void Leave(std::size_t job);
+
+  std::vector<Stage> _stages;
+  CostFunctionType _cost;
+  MemoryBudget _budget;
+
+  std::size_t _maxInFlight = 0;
+  bool _bMaxInFlightSet = false;
+
+  std::mutex _mutex;
+  std::condition_variable _cv;
+  bool _bAdmissionDone = false;
+  std::size_t _inFlight = 0;
+  std::size_t _completed = 0;
+  std::vector<std::size_t> _costs;
+
+};
+
+template< typename TJob >
+void PipelineScheduler<TJob>::AddStage(const std::string &name, unsigned int workers, const StageFunctionType &fn){
+
+  Stage s;
+  s.name = name;
+  s.workers = std::max(1u, workers);
+  s.fn = fn;
+  s.alive = 0;
+  s.closed = false;
+  _stages.push_back(s);
+
+}
+
+//Called with _mutex held.
+template< typename TJob >
+void PipelineScheduler<TJob>::Leave(std::size_t job){
+
+  _budget.Release(_costs[job]);
+  _inFlight--;
+  _cv.notify_all();
+
+}
+
+template< typename TJob >
+void PipelineScheduler<TJob>::Worker(std::size_t s, std::vector<TJob> &jobs){
+
+  Stage &stage = _stages[s];
+
+  for (;;){
+    std::size_t job;
+
+    {
+      std::unique_lock<std::mutex> lock(_mutex);
+
+      //Wait for work, or for the upstream stage to finish for good.
+      _cv.wait(lock, [this, &stage, s]{
+        const bool upstreamDone = (s == 0) ? _bAdmissionDone : _stages[s - 1].closed;
+        return !stage.queue.empty() || upstreamDone;
+      });
+
+      if (stage.queue.empty()){
+        if (--stage.alive == 0){
+          stage.closed = true;
+          _cv.notify_all();
+        }
+        return;
+      }
+
+      job = stage.queue.front();
+      stage.queue.pop_front();
+    }
+
+    bool ok = false;
+    try {
+      ok = stage.fn(jobs[job]);
+    } catch (...) {
+      ok = false;
+    }
+
+    std::lock_guard<std::mutex> lock(_mutex);
+
+    if (!ok){
+      LOG(ERROR) << "Job " << job << " failed in stage '" << stage.name << "'";
+      Leave(job);
+    }
+    else if (s + 1 < _stages.size()){
+      _stages[s + 1].queue.push_back(job);
+      _cv.notify_all();
+    }
+    else {
+      _completed++;
+      Leave(job);
+    }
+  }
+
+}
+
+template< typename TJob >
+std::size_t PipelineScheduler<TJob>::Run(std::vector<TJob> &jobs){
+
+  if (_stages.empty())
+    return 0;
+
+  std::size_t maxInFlight = _maxInFlight;
+  if (!_bMaxInFlightSet){
+    maxInFlight = 1;
+    for (const Stage &s : _stages)
+      maxInFlight += s.workers;
+  }
+
+  _costs.assign(jobs.size(), 0);
+  _bAdmissionDone = false;
+  _inFlight = 0;
+  _completed = 0;
+
+  for (Stage &s : _stages){
+    s.queue.clear();
+    s.alive = s.workers;
+    s.closed = false;
+  }
+
+  std::vector<std::thread> threads;
+  for (std::size_t s = 0; s < _stages.size(); ++s){
+    for (unsigned int w = 0; w < _stages[s].workers; ++w)
+      threads.push_back(std::thread(&PipelineScheduler::Worker, this, s, std::ref(jobs)));
+  }
+
+  //Admission, in order.
+  for (std::size_t j = 0; j < jobs.size(); ++j){
+    _costs[j] = _cost ? _cost(jobs[j]) : 0;
+
+    {
+      std::unique_lock<std::mutex> lock(_mutex);
+      _cv.wait(lock, [this, maxInFlight]{ return maxInFlight == 0 || _inFlight < maxInFlight; });
+    }
+
+    _budget.Acquire(_costs[j]);
+
+    std::lock_guard<std::mutex> lock(_mutex);
+    _inFlight++;
+    _stages.front().queue.push_back(j);
+    _cv.notify_all();
+  }
+
+  {
+    std::lock_guard<std::mutex> lock(_mutex);
+    _bAdmissionDone = true;
+    _cv.notify_all();
+  }
+
+  for (auto &t : threads)
+    t.join();
+
+  return _completed;
+}
+
+}// namespace ns
+
+#endif
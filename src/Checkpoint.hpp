@@ -0,0 +1,309 @@
+/*
+   Checkpoint.hpp
+
+   Author:      Benjamin A. Thomas
+
+   Copyright 2018 Institute of Nuclear Medicine, University College London.
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+
+ */
+
+#pragma once
+
+#ifndef _CHECKPOINT_HPP_
+#define _CHECKPOINT_HPP_
+
+#include <boost/filesystem.hpp>
+#include <glog/logging.h>
+#include <nlohmann/json.hpp>
+
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <fstream>
+#include <string>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/file.h>
+#include <unistd.h>
+
+/*
+  Stage checkpoints. Each stage is identified by a fingerprint of its
+  inputs and parameters. Once it completes, the fingerprint and the files
+  it wrote are recorded in checkpoints.json in the output directory. A
+  later run with the same fingerprint can reuse those files, as long as
+  they are all still there and the same size.
+*/
+
+namespace ck {
+
+//64-bit FNV-1a. Fast, but not cryptographic: it detects changes, it does
+//not authenticate them.
+class Hasher {
+
+public:
+
+  Hasher &Add(const void *data, std::size_t n);
+
+  //Length-prefixed, so that ("ab", "c") and ("a", "bc") differ.
+  Hasher &Add(const std::string &s);
+
+  template< typename T >
+  Hasher &AddValue(const T &v){ return Add(&v, sizeof(T)); };
+
+  //Geometry and pixel buffer of an ITK image.
+  template< typename TImage >
+  Hasher &AddImage(const TImage *img);
+
+  uint64_t Get() const { return _h; };
+  std::string GetHex() const;
+
+protected:
+
+  uint64_t _h = 14695981039346656037ULL;
+
+};
+
+inline Hasher &Hasher::Add(const void *data, std::size_t n){
+
+  const unsigned char *p = static_cast<const unsigned char *>(data);
+  for (std::size_t i = 0; i < n; ++i){
+    _h ^= p[i];
+    _h *= 1099511628211ULL;
+  }
+  return *this;
+
+}
+
+inline Hasher &Hasher::Add(const std::string &s){
+
+  AddValue<uint64_t>(s.size());
+  return Add(s.data(), s.size());
+
+}
+
+template< typename TImage >
+Hasher &Hasher::AddImage(const TImage *img){
+
+  const typename TImage::RegionType region = img->GetBufferedRegion();
+
+  for (unsigned int d = 0; d < TImage::ImageDimension; ++d){
+    AddValue<int64_t>(region.GetIndex()[d]);
+    AddValue<uint64_t>(region.GetSize()[d]);
+    AddValue<double>(img->GetSpacing()[d]);
+    AddValue<double>(img->GetOrigin()[d]);
+    for (unsigned int e = 0; e < TImage::ImageDimension; ++e)
+      AddValue<double>(img->GetDirection()[d][e]);
+  }
+
+  return Add(img->GetBufferPointer(), region.GetNumberOfPixels() * sizeof(typename TImage::PixelType));
+
+}
+
+inline std::string Hasher::GetHex() const {
+
+  char buf[17];
+  std::snprintf(buf, sizeof(buf), "%016llx", static_cast<unsigned long long>(_h));
+  return std::string(buf);
+
+}
+
+//Hash of a file's contents, or "" if it cannot be read.
+inline std::string HashFile(const boost::filesystem::path &p){
+
+  std::ifstream ifs(p.string(), std::ios::binary);
+  if (!ifs.good())
+    return "";
+
+  Hasher h;
+  std::vector<char> buf(1 << 16);
+  while (ifs){
+    ifs.read(buf.data(), buf.size());
+    h.Add(buf.data(), static_cast<std::size_t>(ifs.gcount()));
+  }
+  return h.GetHex();
+
+}
+
+//Exclusive advisory lock on a file, held for the object's lifetime.
+//Serialises updates to shared caches between processes.
+class FileLock {
+
+public:
+
+  explicit FileLock(const boost::filesystem::path &p);
+  ~FileLock();
+
+  //False if the lock file could not be opened or locked.
+  bool IsLocked() const { return _bLocked; };
+
+private:
+
+  int _fd;
+  bool _bLocked = false;
+
+  FileLock(const FileLock &); //purposely not implemented
+  void operator=(const FileLock &);  //purposely not implemented
+
+};
+
+inline FileLock::FileLock(const boost::filesystem::path &p){
+
+  _fd = open(p.string().c_str(), O_CREAT | O_RDWR | O_CLOEXEC, 0644);
+  if (_fd >= 0){
+    int r;
+    do {
+      r = flock(_fd, LOCK_EX);
+    } while (r != 0 && errno == EINTR);
+    _bLocked = (r == 0);
+  }
+
+  LOG_IF(WARNING, !_bLocked) << "Unable to lock " << p;
+
+}
+
+inline FileLock::~FileLock(){
+
+  if (_fd >= 0){
+    flock(_fd, LOCK_UN);
+    close(_fd);
+  }
+
+}
+
+class CheckpointStore {
+
+public:
+
+  //Reads dir/checkpoints.json if there is one.
+  explicit CheckpointStore(const boost::filesystem::path &dir);
+
+  //True if stage completed with this fingerprint and its outputs are intact.
+  bool IsValid(const std::string &stage, const std::string &fingerprint) const;
+
+  //Forgets a stage before it runs, so an interrupted run is never reused.
+  void Invalidate(const std::string &stage);
+
+  //Records a completed stage. Outputs must be directly in the directory.
+  void Commit(const std::string &stage, const std::string &fingerprint,
+    const std::vector<boost::filesystem::path> &outputs);
+
+protected:
+
+  void Save() const;
+
+  boost::filesystem::path _dir;
+  boost::filesystem::path _file;
+  nlohmann::json _records;
+
+  CheckpointStore(const CheckpointStore &); //purposely not implemented
+  void operator=(const CheckpointStore &);  //purposely not implemented
+
+};
+
+inline CheckpointStore::CheckpointStore(const boost::filesystem::path &dir) : _dir(dir) {
+
+  _file = _dir / "checkpoints.json";
+  _records = nlohmann::json::object();
+
+  if (!boost::filesystem::exists(_file))
+    return;
+
+  try {
+    std::ifstream ifs(_file.string());
+    _records = nlohmann::json::parse(ifs);
+  } catch (...) {
+    LOG(WARNING) << "Ignoring unreadable checkpoints in " << _file;
+    _records = nlohmann::json::object();
+  }
+
+}
+
+inline bool CheckpointStore::IsValid(const std::string &stage, const std::string &fingerprint) const {
+
+  if (_records.find(stage) == _records.end())
+    return false;
+
+  const nlohmann::json &r = _records.at(stage);
+  if (r.value("fingerprint", std::string()) != fingerprint)
+    return false;
+
+  boost::system::error_code ec;
+  for (const nlohmann::json &o : r.at("outputs")){
+    const boost::filesystem::path p = _dir / o.at("file").get<std::string>();
+    const uintmax_t size = boost::filesystem::file_size(p, ec);
+    if (ec || size != o.at("bytes").get<uintmax_t>()){
+      LOG(INFO) << "Checkpoint for " << stage << " is missing " << p.filename();
+      return false;
+    }
+  }
+
+  return true;
+}
+
+inline void CheckpointStore::Invalidate(const std::string &stage){
+
+  if (_records.find(stage) == _records.end())
+    return;
+
+  _records.erase(stage);
+  Save();
+
+}
+
+inline void CheckpointStore::Commit(const std::string &stage, const std::string &fingerprint,
+  const std::vector<boost::filesystem::path> &outputs){
+
+  nlohmann::json files = nlohmann::json::array();
+
+  for (const boost::filesystem::path &p : outputs){
+    boost::system::error_code ec;
+    const uintmax_t size = boost::filesystem::file_size(p, ec);
+    if (ec){
+      LOG(WARNING) << "Not checkpointing " << stage << ": " << p << " was not written.";
+      return;
+    }
+    files.push_back({ {"file", p.filename().string()}, {"bytes", size} });
+  }
+
+  _records[stage] = { {"fingerprint", fingerprint}, {"outputs", files} };
+  Save();
+
+}
+
+//Written to a temporary file and renamed, so a full disk or a crash
+//cannot leave a truncated record behind.
+inline void CheckpointStore::Save() const {
+
+  boost::filesystem::path tmp = _file;
+  tmp += ".tmp";
+
+  {
+    std::ofstream ofs(tmp.string());
+    ofs << _records.dump(2) << std::endl;
+    if (!ofs.good()){
+      LOG(WARNING) << "Could not write checkpoints to " << tmp;
+      return;
+    }
+  }
+
+  boost::system::error_code ec;
+  boost::filesystem::rename(tmp, _file, ec);
+  LOG_IF(WARNING, ec) << "Could not update " << _file << ": " << ec.message();
+
+}
+
+}// namespace ck
+
+#endif
@@ -0,0 +1,364 @@
+/*
+   DemonsReg.hpp
+
+   Author:      Benjamin A. Thomas
+
+   Copyright 2018 Institute of Nuclear Medicine, University College London.
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+
+ */
+
+#pragma once
+
+#ifndef _DEMONSREG_HPP_
+#define _DEMONSREG_HPP_
+
+#include <boost/filesystem.hpp>
+#include <boost/algorithm/string/classification.hpp>
+#include <boost/algorithm/string/split.hpp>
+#include <glog/logging.h>
+
+#include <string>
+#include <vector>
+
+#include <itkAffineTransform.h>
+#include <itkCommand.h>
+#include <itkCenteredTransformInitializer.h>
+#include <itkDiffeomorphicDemonsRegistrationFilter.h>
+#include <itkHistogramMatchingImageFilter.h>
+#include <itkImageMaskSpatialObject.h>
+#include <itkImageRegistrationMethodv4.h>
+#include <itkMattesMutualInformationImageToImageMetricv4.h>
+#include <itkMultiResolutionPDEDeformableRegistration.h>
+#include <itkRegistrationParameterScalesFromPhysicalShift.h>
+#include <itkRegularStepGradientDescentOptimizerv4.h>
+#include <itkResampleImageFilter.h>
+
+#include "RegistrationBackend.hpp"
+
+/*
+  regName "demons": ITK only, multi-threaded throughout. A Mattes mutual
+  information affine (reference -> floating), then multi-resolution
+  diffeomorphic demons between the floating image and the template
+  resampled through that affine. Demons compares intensities directly,
+  so the resampled template is histogram matched to the floating image
+  first. The demons field is on the floating grid and is written as
+  InverseWarp.nii.gz; no forward Warp.nii.gz is written.
+
+  Arguments:
+    --affine-iterations N   per level, 3 levels (shrink 4, 2, 1)
+    --iterations AxBxC      demons iterations per level, coarse first;
+                            0 for affine only
+    --sigma S               field smoothing (voxels)
+    --histogram-match 0|1
+    -x MASK                 reference image mask for the affine metric
+*/
+
+namespace reg {
+
+template <class TImage>
+class DemonsReg : public RegistrationBackend<TImage>
+{
+
+public:
+  typedef TImage ImageType;
+
+  DemonsReg(){};
+
+  std::string GetName() const override { return "demons"; };
+  std::string GetDefaultArgs() const override {
+    return "--affine-iterations 200 --iterations 40x20x10 --sigma 1.5 --histogram-match 1";
+  };
+  std::string GetDefaultAffineArgs() const override {
+    return "--affine-iterations 200 --iterations 0";
+  };
+
+protected:
+
+  typedef itk::Image<float, 3> InternalImageType;
+  typedef itk::Image<unsigned char, 3> MaskImageType;
+  typedef itk::Image<itk::Vector<float, 3>, 3> FieldType;
+  typedef itk::AffineTransform<double, 3> AffineType;
+
+  struct Options {
+    unsigned int affineIterations = 200;
+    std::vector<unsigned int> iterations;
+    double sigma = 1.5;
+    bool bHistogramMatch = true;
+    boost::filesystem::path mask;
+  };
+
+  Options ParseArgs() const;
+
+  AffineType::Pointer RegisterAffine(const InternalImageType *reference, const InternalImageType *floating,
+    const Options &options);
+
+  FieldType::Pointer RegisterDemons(const InternalImageType *reference, const InternalImageType *floating,
+    const AffineType *affine, const Options &options);
+
+  void Register(const boost::filesystem::path &fullPrefix) override;
+
+  //Counts the iterations of an optimizer or demons filter.
+  class IterationCounter : public itk::Command {
+  public:
+    typedef IterationCounter Self;
+    typedef itk::SmartPointer<Self> Pointer;
+    itkNewMacro(Self);
+
+    void Execute(itk::Object *caller, const itk::EventObject &event) override {
+      Execute(static_cast<const itk::Object *>(caller), event);
+    };
+    void Execute(const itk::Object *, const itk::EventObject &event) override {
+      if (itk::IterationEvent().CheckEvent(&event))
+        count++;
+    };
+
+    uint64_t count = 0;
+
+  protected:
+    IterationCounter(){};
+  };
+
+};
+
+template <typename TImage>
+typename DemonsReg<TImage>::Options DemonsReg<TImage>::ParseArgs() const {
+
+  const std::vector<std::string> args = this->SplitArgs();
+  Options o;
+  o.iterations = { 40, 20, 10 };
+
+  for (std::size_t i = 0; i < args.size(); ++i){
+    if (i + 1 >= args.size()){
+      LOG(ERROR) << "Missing value for demons argument " << args[i];
+      throw false;
+    }
+
+    const std::string &key = args[i];
+    const std::string &value = args[++i];
+
+    try {
+      if (key == "--affine-iterations")
+        o.affineIterations = std::stoul(value);
+      else if (key == "--iterations"){
+        std::vector<std::string> levels;
+        boost::split(levels, value, boost::is_any_of("x"));
+        o.iterations.clear();
+        for (const std::string &l : levels)
+          if (std::stoul(l) > 0)
+            o.iterations.push_back(std::stoul(l));
+      }
+      else if (key == "--sigma")
+        o.sigma = std::stod(value);
+      else if (key == "--histogram-match")
+        o.bHistogramMatch = (value != "0");
+      else if (key == "-x")
+        o.mask = value;
+      else {
+        LOG(ERROR) << "Unknown demons argument " << key;
+        throw false;
+      }
+    } catch (const std::logic_error &){
+      LOG(ERROR) << "Invalid value for demons argument " << key << ": " << value;
+      throw false;
+    }
+  }
+
+  return o;
+}
+
+template <typename TImage>
+typename DemonsReg<TImage>::AffineType::Pointer DemonsReg<TImage>::RegisterAffine(
+  const InternalImageType *reference, const InternalImageType *floating, const Options &options){
+
+  typedef itk::MattesMutualInformationImageToImageMetricv4<InternalImageType, InternalImageType> MetricType;
+  typedef itk::RegularStepGradientDescentOptimizerv4<double> OptimizerType;
+  typedef itk::RegistrationParameterScalesFromPhysicalShift<MetricType> ScalesEstimatorType;
+  typedef itk::ImageRegistrationMethodv4<InternalImageType, InternalImageType, AffineType> RegistrationType;
+
+  //Maps reference points to floating points, as ANTS does.
+  AffineType::Pointer affine = AffineType::New();
+
+  typedef itk::CenteredTransformInitializer<AffineType, InternalImageType, InternalImageType> InitializerType;
+  typename InitializerType::Pointer initializer = InitializerType::New();
+  initializer->SetTransform(affine);
+  initializer->SetFixedImage(reference);
+  initializer->SetMovingImage(floating);
+  initializer->MomentsOn();
+  initializer->InitializeTransform();
+
+  typename MetricType::Pointer metric = MetricType::New();
+  metric->SetNumberOfHistogramBins(32);
+
+  if (!options.mask.empty()){
+    typedef itk::ImageFileReader<MaskImageType> MaskReaderType;
+    typename MaskReaderType::Pointer maskReader = MaskReaderType::New();
+    maskReader->SetFileName(options.mask.string());
+    maskReader->Update();
+
+    typedef itk::ImageMaskSpatialObject<3> MaskType;
+    typename MaskType::Pointer mask = MaskType::New();
+    mask->SetImage(maskReader->GetOutput());
+    mask->Update();
+    metric->SetFixedImageMask(mask);
+  }
+
+  typename ScalesEstimatorType::Pointer scales = ScalesEstimatorType::New();
+  scales->SetMetric(metric);
+
+  typename OptimizerType::Pointer optimizer = OptimizerType::New();
+  optimizer->SetLearningRate(1.0);
+  optimizer->SetMinimumStepLength(1e-3);
+  optimizer->SetRelaxationFactor(0.5);
+  optimizer->SetNumberOfIterations(options.affineIterations);
+  optimizer->SetScalesEstimator(scales);
+  optimizer->SetDoEstimateLearningRateOnce(true);
+
+  typename IterationCounter::Pointer counter = IterationCounter::New();
+  optimizer->AddObserver(itk::IterationEvent(), counter);
+
+  typename RegistrationType::Pointer registration = RegistrationType::New();
+  registration->SetFixedImage(reference);
+  registration->SetMovingImage(floating);
+  registration->SetMetric(metric);
+  registration->SetOptimizer(optimizer);
+  registration->SetInitialTransform(affine);
+  registration->InPlaceOn();
+
+  typename RegistrationType::ShrinkFactorsArrayType shrink(3);
+  typename RegistrationType::SmoothingSigmasArrayType sigmas(3);
+  shrink[0] = 4; shrink[1] = 2; shrink[2] = 1;
+  sigmas[0] = 2; sigmas[1] = 1; sigmas[2] = 0;
+  registration->SetNumberOfLevels(3);
+  registration->SetShrinkFactorsPerLevel(shrink);
+  registration->SetSmoothingSigmasPerLevel(sigmas);
+  registration->SetSmoothingSigmasAreSpecifiedInPhysicalUnits(false);
+
+  //A fixed sample keeps the result reproducible.
+  registration->SetMetricSamplingStrategy(RegistrationType::REGULAR);
+  registration->SetMetricSamplingPercentage(0.25);
+
+  registration->Update();
+  this->_iterations += counter->count;
+
+  LOG(INFO) << "Demons backend: affine metric " << optimizer->GetValue() << " after "
+            << optimizer->GetCurrentIteration() << " iterations at the finest level.";
+
+  return affine;
+}
+
+template <typename TImage>
+typename DemonsReg<TImage>::FieldType::Pointer DemonsReg<TImage>::RegisterDemons(
+  const InternalImageType *reference, const InternalImageType *floating, const AffineType *affine,
+  const Options &options){
+
+  //The template on the floating grid: floating points -> reference points.
+  AffineType::Pointer inverse = AffineType::New();
+  if (!affine->GetInverse(inverse)){
+    LOG(ERROR) << "Cannot invert the demons affine.";
+    throw false;
+  }
+
+  typedef itk::ResampleImageFilter<InternalImageType, InternalImageType, double> ResampleFilterType;
+  typename ResampleFilterType::Pointer resampler = ResampleFilterType::New();
+  resampler->SetInput(reference);
+  resampler->SetTransform(inverse);
+  resampler->SetReferenceImage(floating);
+  resampler->UseReferenceImageOn();
+  resampler->SetDefaultPixelValue(0);
+  resampler->Update();
+
+  InternalImageType::Pointer moving = resampler->GetOutput();
+
+  if (options.bHistogramMatch){
+    typedef itk::HistogramMatchingImageFilter<InternalImageType, InternalImageType> MatchingFilterType;
+    typename MatchingFilterType::Pointer matcher = MatchingFilterType::New();
+    matcher->SetInput(moving);
+    matcher->SetReferenceImage(floating);
+    matcher->SetNumberOfHistogramLevels(256);
+    matcher->SetNumberOfMatchPoints(15);
+    matcher->ThresholdAtMeanIntensityOn();
+    matcher->Update();
+    moving = matcher->GetOutput();
+  }
+
+  typedef itk::DiffeomorphicDemonsRegistrationFilter<InternalImageType, InternalImageType, FieldType> DemonsFilterType;
+  typename DemonsFilterType::Pointer demons = DemonsFilterType::New();
+  demons->SetStandardDeviations(options.sigma);
+  demons->SetMaximumUpdateStepLength(2.0);
+  demons->SetUseGradientType(DemonsFilterType::Symmetric);
+  demons->SmoothDisplacementFieldOn();
+
+  typename IterationCounter::Pointer counter = IterationCounter::New();
+  demons->AddObserver(itk::IterationEvent(), counter);
+
+  //Fixed = floating image, so the field is on its grid, and
+  //moving(p + field(p)) matches floating(p).
+  typedef itk::MultiResolutionPDEDeformableRegistration<InternalImageType, InternalImageType, FieldType, float>
+    MultiResolutionType;
+  typename MultiResolutionType::Pointer multiRes = MultiResolutionType::New();
+  multiRes->SetRegistrationFilter(demons);
+  multiRes->SetNumberOfLevels(options.iterations.size());
+  multiRes->SetNumberOfIterations(options.iterations);
+  multiRes->SetFixedImage(floating);
+  multiRes->SetMovingImage(moving);
+  multiRes->Update();
+  this->_iterations += counter->count;
+
+  LOG(INFO) << "Demons backend: demons metric " << demons->GetMetric() << ".";
+
+  FieldType::Pointer field = multiRes->GetOutput();
+  field->DisconnectPipeline();
+  return field;
+}
+
+template <typename TImage>
+void DemonsReg<TImage>::Register(const boost::filesystem::path &fullPrefix){
+
+  const Options options = ParseArgs();
+
+  typedef itk::ImageFileReader<InternalImageType> ReaderType;
+  typename ReaderType::Pointer refReader = ReaderType::New();
+  typename ReaderType::Pointer floatReader = ReaderType::New();
+
+  try {
+    refReader->SetFileName(this->_refFileName.string());
+    refReader->Update();
+    floatReader->SetFileName(this->_floatFileName.string());
+    floatReader->Update();
+
+    AffineType::Pointer affine = RegisterAffine(refReader->GetOutput(), floatReader->GetOutput(), options);
+
+    FieldType::Pointer field;
+    if (!options.iterations.empty())
+      field = RegisterDemons(refReader->GetOutput(), floatReader->GetOutput(), affine, options);
+
+    //Any warp from an earlier run with this prefix would be stale.
+    boost::filesystem::path oldWarp = fullPrefix;
+    oldWarp += "InverseWarp.nii.gz";
+    boost::system::error_code ec;
+    boost::filesystem::remove(oldWarp, ec);
+
+    SaveTransforms<FieldType>(affine, field, fullPrefix);
+  } catch (itk::ExceptionObject &ex){
+    LOG(ERROR) << ex;
+    LOG(ERROR) << "Demons registration failed.";
+    throw false;
+  }
+
+}
+
+} //namespace reg
+
+
+#endif
@@ -27,10 +27,19 @@
 #include <boost/filesystem.hpp>
 #include <glog/logging.h>
 
+#include <boost/algorithm/string/case_conv.hpp>
+#include <boost/algorithm/string/classification.hpp>
+#include <boost/algorithm/string/predicate.hpp>
+#include <boost/algorithm/string/split.hpp>
+#include <boost/algorithm/string/trim.hpp>
+
+#include <map>
+#include <set>
 #include <string>
 
 //GDCM includes
 #include "gdcmReader.h"
+#include "gdcmSequenceOfItems.h"
 
 #include <itkImage.h>
 #include <itkImageSeriesReader.h>
@@ -38,6 +47,8 @@
 #include <itkImageDuplicator.h>
 #include <itkGDCMImageIO.h>
 
+#include "StageTimer.hpp"
+#include "Metrics.hpp"
 
 namespace dcm {
 
@@ -68,7 +79,7 @@ const nlohmann::json InstanceRecord = R"(
 
 typedef std::set<nlohmann::json> InstanceListType, SeriesListType, StudyListType;
 
-bool GetDicomInfo(const boost::filesystem::path srcPath, gdcm::DataSet &ds){
+inline bool GetDicomInfo(const boost::filesystem::path srcPath, gdcm::DataSet &ds){
 
   //Create reader, set filename and check if reading succeeds.
   std::unique_ptr<gdcm::Reader> DICOMreader(new gdcm::Reader);
@@ -86,7 +97,7 @@ bool GetDicomInfo(const boost::filesystem::path srcPath, gdcm::DataSet &ds){
 }
 
 
-bool GetTagInfo(const gdcm::DataSet &ds, const gdcm::Tag tag, std::string &dst){
+inline bool GetTagInfo(const gdcm::DataSet &ds, const gdcm::Tag tag, std::string &dst){
 
   //Extracts information for a given DICOM tag from a gdcm dataset.
   //Tag contents are returned as a string in dst variable.
@@ -114,6 +125,80 @@ bool GetTagInfo(const gdcm::DataSet &ds, const gdcm::Tag tag, std::string &dst){
   return true;
 }
 
+//Reads the header of a file up to, but not including, tag. Pixel data is
+//not read.
+inline bool GetDicomInfoUpTo(const boost::filesystem::path srcPath, const gdcm::Tag &tag, gdcm::DataSet &ds){
+
+  std::unique_ptr<gdcm::Reader> DICOMreader(new gdcm::Reader);
+  DICOMreader->SetFileName(srcPath.string().c_str());
+
+  if (!DICOMreader->ReadUpToTag(tag, std::set<gdcm::Tag>()))
+    return false;
+
+  ds = DICOMreader->GetFile().GetDataSet();
+  return true;
+}
+
+//Tag contents without the space or NUL padding.
+inline std::string GetTrimmedTagInfo(const gdcm::DataSet &ds, const gdcm::Tag tag){
+
+  std::string value;
+  GetTagInfo(ds, tag, value);
+  boost::algorithm::trim_if(value, boost::algorithm::is_any_of(std::string(" \0", 2)));
+  return value;
+}
+
+//The DICOMDIR file in dir, if there is one. Media file names are upper
+//case, but copies are often not.
+inline bool FindDicomDir(const boost::filesystem::path &dir, boost::filesystem::path &dicomDir){
+
+  boost::system::error_code ec;
+  for (boost::filesystem::directory_iterator it(dir, ec), end; !ec && it != end; it.increment(ec)){
+    if (boost::algorithm::to_upper_copy(it->path().filename().string()) == "DICOMDIR" &&
+        boost::filesystem::is_regular_file(it->status())){
+      dicomDir = it->path();
+      return true;
+    }
+  }
+
+  return false;
+}
+
+//Path of a Referenced File ID ("DIR\SUBDIR\FILE") relative to the
+//DICOMDIR folder, matching each component without regard to case.
+inline bool ResolveFileID(const boost::filesystem::path &root, const std::string &fileID, boost::filesystem::path &dst){
+
+  std::vector<std::string> components;
+  boost::split(components, fileID, boost::is_any_of("\\"));
+
+  dst = root;
+  for (std::string c : components){
+    boost::algorithm::trim(c);
+    if (c.empty())
+      continue;
+
+    if (boost::filesystem::exists(dst / c)){
+      dst /= c;
+      continue;
+    }
+
+    bool bFound = false;
+    boost::system::error_code ec;
+    for (boost::filesystem::directory_iterator it(dst, ec), end; !ec && it != end; it.increment(ec)){
+      if (boost::algorithm::iequals(it->path().filename().string(), c)){
+        dst = it->path();
+        bFound = true;
+        break;
+      }
+    }
+
+    if (!bFound)
+      return false;
+  }
+
+  return boost::filesystem::is_regular_file(dst);
+}
+
 
 class StudyTree {
 
@@ -121,6 +206,10 @@ public:
   //StudyTree(){};
   explicit StudyTree(boost::filesystem::path rootPath){ _rootPath = rootPath; PopulateLists(); };
 
+  //Adds one file to the index, e.g. as it is received. Returns false if
+  //it is not DICOM.
+  bool AddFile(const boost::filesystem::path &pth);
+
   int GetNoOfStudies(){ return _studyList.size(); };
   std::string GetStudyUID( unsigned int pos );
 
@@ -135,7 +224,13 @@ public:
 
 protected:
 
+  //For trees built up with AddFile().
+  StudyTree(){};
+
   void PopulateLists();
+  //Indexes the files listed in a DICOMDIR from its directory records,
+  //without opening them. Returns false if it cannot be used.
+  bool PopulateFromDicomDir(const boost::filesystem::path &dicomDir);
   void AddStudyRecord(const gdcm::DataSet &ds);
   void AddSeriesRecord(const gdcm::DataSet &ds);
 
@@ -144,6 +239,8 @@ protected:
   void GetBasicInstanceInfo(const gdcm::DataSet &ds, nlohmann::json &instance);
 
   virtual void AddInstanceRecord(const gdcm::DataSet &ds, const boost::filesystem::path pth);
+  //From a DICOMDIR IMAGE record, with the instance fields already filled in.
+  virtual void AddDirectoryInstanceRecord(const gdcm::DataSet &record, nlohmann::json &instance);
 
   StudyListType _studyList;
   SeriesListType  _seriesList;
@@ -153,14 +250,30 @@ protected:
 
 };
 
-void StudyTree::PopulateLists(){
+inline void StudyTree::PopulateLists(){
+
+  mon::ScopedTimer timer("StudyTree::PopulateLists", "dicom");
+
   _studyList.clear();
   _seriesList.clear();
   _instanceList.clear();
 
+  boost::filesystem::path dicomDir;
+  if (FindDicomDir(_rootPath, dicomDir)){
+    if (PopulateFromDicomDir(dicomDir)){
+      LOG(INFO) << _instanceList.size() << " DICOM files listed in " << dicomDir;
+      LOG(INFO) << "\t" << _studyList.size() << " studies, " << _seriesList.size() << " series";
+      return;
+    }
+
+    LOG(WARNING) << "Cannot use " << dicomDir << ", reading every file instead.";
+    _studyList.clear();
+    _seriesList.clear();
+    _instanceList.clear();
+  }
+
   uint64_t count = 0;
 
-  gdcm::DataSet ds;
   try
   {
     for (auto &entry : boost::make_iterator_range(boost::filesystem::recursive_directory_iterator(_rootPath), {}))
@@ -168,12 +281,8 @@ void StudyTree::PopulateLists(){
       if (boost::filesystem::is_regular_file(entry.status()))
       {
         //DLOG(INFO) << "Reading " << entry.path();
-        if (GetDicomInfo(entry.path(), ds)) {
-          AddStudyRecord(ds);
-          AddSeriesRecord(ds);
-          this->AddInstanceRecord(ds, entry.path());
+        if (AddFile(entry.path()))
           count++;
-        }
       }
     }
   }
@@ -197,7 +306,124 @@ void StudyTree::PopulateLists(){
 
 }
 
-void StudyTree::AddStudyRecord(const gdcm::DataSet &ds){
+inline bool StudyTree::AddFile(const boost::filesystem::path &pth){
+
+  gdcm::DataSet ds;
+  if (!GetDicomInfo(pth, ds))
+    return false;
+
+  AddStudyRecord(ds);
+  AddSeriesRecord(ds);
+  this->AddInstanceRecord(ds, pth);
+
+  mon::MetricsRegistry::GetInstance().Increment("resolute_files_indexed_total");
+
+  return true;
+}
+
+inline bool StudyTree::PopulateFromDicomDir(const boost::filesystem::path &dicomDir){
+
+  mon::ScopedTimer timer("StudyTree::PopulateFromDicomDir", "dicom");
+
+  gdcm::Reader reader;
+  reader.SetFileName(dicomDir.string().c_str());
+
+  if (!reader.Read()){
+    LOG(WARNING) << "Cannot read " << dicomDir;
+    return false;
+  }
+
+  const gdcm::DataSet &ds = reader.GetFile().GetDataSet();
+  const gdcm::Tag recordSequence(0x0004,0x1220);
+
+  if (!ds.FindDataElement(recordSequence)){
+    LOG(WARNING) << dicomDir << " has no directory records.";
+    return false;
+  }
+
+  gdcm::SmartPointer<gdcm::SequenceOfItems> records = ds.GetDataElement(recordSequence).GetValueAsSQ();
+  if (!records)
+    return false;
+
+  //Records are listed depth first: each IMAGE follows its SERIES, and each
+  //SERIES its STUDY.
+  std::string studyUID, seriesUID;
+  std::map<std::string, nlohmann::json> series;
+  std::map<std::string, boost::filesystem::path> firstFiles;
+  const boost::filesystem::path root = dicomDir.parent_path();
+
+  try {
+    for (gdcm::SequenceOfItems::SizeType i = 1; i <= records->GetNumberOfItems(); ++i){
+      const gdcm::DataSet &record = records->GetItem(i).GetNestedDataSet();
+      const std::string type = GetTrimmedTagInfo(record, gdcm::Tag(0x0004,0x1430));
+
+      if (type == "STUDY"){
+        GetTagInfo(record, gdcm::Tag(0x0020,0x000d), studyUID);
+        AddStudyRecord(record);
+        seriesUID.clear();
+      }
+      else if (type == "SERIES"){
+        seriesUID.clear();
+        GetTagInfo(record, gdcm::Tag(0x0020,0x000e), seriesUID);
+
+        std::string seriesDesc, seriesNo;
+        GetTagInfo(record, gdcm::Tag(0x0008,0x103e), seriesDesc);
+        GetTagInfo(record, gdcm::Tag(0x0020,0x0011), seriesNo);
+
+        nlohmann::json s = SeriesRecord;
+        s["StudyUID"] = studyUID;
+        s["SeriesUID"] = seriesUID;
+        s["SeriesDesc"] = seriesDesc;
+        s["SeriesNo"] = seriesNo.empty() ? 0 : std::stoi(seriesNo);
+        series[seriesUID] = s;
+      }
+      else if (type == "IMAGE" && !seriesUID.empty()){
+        boost::filesystem::path filePath;
+        const std::string fileID = GetTrimmedTagInfo(record, gdcm::Tag(0x0004,0x1500));
+        if (!ResolveFileID(root, fileID, filePath)){
+          LOG(WARNING) << dicomDir << " lists missing file " << fileID;
+          return false;
+        }
+
+        std::string instanceUID, imageNo;
+        GetTagInfo(record, gdcm::Tag(0x0004,0x1511), instanceUID);
+        GetTagInfo(record, gdcm::Tag(0x0020,0x0013), imageNo);
+
+        nlohmann::json instance = InstanceRecord;
+        instance["SeriesUID"] = seriesUID;
+        instance["InstanceUID"] = instanceUID;
+        instance["ImageNo"] = std::stoi(imageNo);
+        instance["FilePath"] = filePath.string();
+        this->AddDirectoryInstanceRecord(record, instance);
+
+        if (firstFiles.find(seriesUID) == firstFiles.end())
+          firstFiles[seriesUID] = filePath;
+      }
+    }
+  } catch (const std::logic_error &){
+    LOG(WARNING) << "Invalid directory record in " << dicomDir;
+    return false;
+  }
+
+  //Series Description is optional in a SERIES record. Without it, read
+  //one header of the series.
+  for (auto &s : series){
+    if (s.second["SeriesDesc"] == "" && firstFiles.count(s.first) > 0){
+      gdcm::DataSet header;
+      std::string seriesDesc;
+      if (GetDicomInfoUpTo(firstFiles[s.first], gdcm::Tag(0x0008,0x103f), header))
+        GetTagInfo(header, gdcm::Tag(0x0008,0x103e), seriesDesc);
+      s.second["SeriesDesc"] = seriesDesc;
+    }
+    _seriesList.insert(s.second);
+  }
+
+  mon::MetricsRegistry::GetInstance().Increment("resolute_files_indexed_total", _instanceList.size());
+
+  return !_instanceList.empty();
+}
+
+inline void StudyTree::AddStudyRecord(const gdcm::DataSet &ds){
 
   nlohmann::json study = StudyRecord;
 
@@ -211,7 +437,7 @@ void StudyTree::AddStudyRecord(const gdcm::DataSet &ds){
 
 }
 
-void StudyTree::AddSeriesRecord(const gdcm::DataSet &ds){
+inline void StudyTree::AddSeriesRecord(const gdcm::DataSet &ds){
 
   nlohmann::json series = SeriesRecord;
 
@@ -237,7 +463,7 @@ void StudyTree::AddSeriesRecord(const gdcm::DataSet &ds){
 
 }
 
-void StudyTree::GetBasicInstanceInfo(const gdcm::DataSet &ds, nlohmann::json &instance){
+inline void StudyTree::GetBasicInstanceInfo(const gdcm::DataSet &ds, nlohmann::json &instance){
 
   std::string seriesUID;
   GetTagInfo(ds,gdcm::Tag(0x0020,0x00e), seriesUID); 
@@ -254,7 +480,7 @@ void StudyTree::GetBasicInstanceInfo(const gdcm::DataSet &ds, nlohmann::json &in
 
 }
 
-void StudyTree::AddInstanceRecord(const gdcm::DataSet &ds, const boost::filesystem::path pth){
+inline void StudyTree::AddInstanceRecord(const gdcm::DataSet &ds, const boost::filesystem::path pth){
 
   nlohmann::json instance = InstanceRecord;
   GetBasicInstanceInfo(ds,instance);
@@ -265,7 +491,13 @@ void StudyTree::AddInstanceRecord(const gdcm::DataSet &ds, const boost::filesyst
 
 }
 
-int StudyTree::GetNoOfSeries(const std::string &studyUID){
+inline void StudyTree::AddDirectoryInstanceRecord(const gdcm::DataSet &record, nlohmann::json &instance){
+
+  _instanceList.insert(instance);
+
+}
+
+inline int StudyTree::GetNoOfSeries(const std::string &studyUID){
 
   int noFound = 0;
 
@@ -277,7 +509,7 @@ int StudyTree::GetNoOfSeries(const std::string &studyUID){
   return noFound;
 }
 
-std::string StudyTree::GetStudyUID( unsigned int pos ){
+inline std::string StudyTree::GetStudyUID( unsigned int pos ){
 
   if ( (pos > _studyList.size()) || (pos == 0)) {
     throw false;
@@ -296,7 +528,7 @@ std::string StudyTree::GetStudyUID( unsigned int pos ){
 
 }
 
-std::vector<std::string> StudyTree::GetSeriesUIDList(const std::string &studyUID){
+inline std::vector<std::string> StudyTree::GetSeriesUIDList(const std::string &studyUID){
 
   int noOfSeries = GetNoOfSeries(studyUID);
 
@@ -315,7 +547,7 @@ std::vector<std::string> StudyTree::GetSeriesUIDList(const std::string &studyUID
   return outList;
 }
 
-unsigned int StudyTree::GetNoOfImages(const std::string &seriesUID){
+inline unsigned int StudyTree::GetNoOfImages(const std::string &seriesUID){
 
   unsigned int count=0;
 
@@ -326,7 +558,7 @@ unsigned int StudyTree::GetNoOfImages(const std::string &seriesUID){
   return count;
 }
 
-nlohmann::json StudyTree::GetSeriesRecord(const std::string &seriesUID){
+inline nlohmann::json StudyTree::GetSeriesRecord(const std::string &seriesUID){
 
   for (auto const& x : _seriesList){
     if (x["SeriesUID"] == seriesUID)
@@ -336,7 +568,7 @@ nlohmann::json StudyTree::GetSeriesRecord(const std::string &seriesUID){
   return {};
 }
 
-std::vector<nlohmann::json> StudyTree::GetInstanceList(const std::string &seriesUID){
+inline std::vector<nlohmann::json> StudyTree::GetInstanceList(const std::string &seriesUID){
 
   std::vector<nlohmann::json> outList;
 
@@ -348,7 +580,7 @@ std::vector<nlohmann::json> StudyTree::GetInstanceList(const std::string &series
   return outList;
 }
 
-std::vector<boost::filesystem::path> StudyTree::GetSeriesFileList(const std::string &seriesUID){
+inline std::vector<boost::filesystem::path> StudyTree::GetSeriesFileList(const std::string &seriesUID){
 
   const int totalNoSlices = GetNoOfImages(seriesUID);
   DLOG(INFO) << totalNoSlices << " in " << seriesUID;
@@ -371,19 +603,28 @@ std::vector<boost::filesystem::path> StudyTree::GetSeriesFileList(const std::str
 class UTETree : public StudyTree {
  
 public:
-  explicit UTETree(boost::filesystem::path rootPath): StudyTree(rootPath){ _rootPath = rootPath; PopulateLists(); };
+  UTETree(){};
+  explicit UTETree(boost::filesystem::path rootPath){ _rootPath = rootPath; PopulateLists(); };
 
   std::string FindMuMapUID(const std::string &studyUID, const std::string &tag);
   std::string FindUTEUID(const std::string &studyUID, const std::string &tag, const std::string &TE);
 
+  //As above, but return false rather than log and throw if there is no
+  //match (yet).
+  bool TryFindMuMapUID(const std::string &studyUID, const std::string &tag, std::string &uid);
+  bool TryFindUTEUID(const std::string &studyUID, const std::string &tag, const std::string &TE, std::string &uid);
+
 protected:
   void AddInstanceRecord(const gdcm::DataSet &ds, const boost::filesystem::path pth) override; 
+  void AddDirectoryInstanceRecord(const gdcm::DataSet &record, nlohmann::json &instance) override;
 
   bool CheckSeriesTE(const std::string &seriesUID, const std::string &TE);
+  //Reads the TE of instances indexed from a DICOMDIR without one.
+  void LoadSeriesTE(const std::string &seriesUID);
 
 };
 
-void UTETree::AddInstanceRecord(const gdcm::DataSet &ds, const boost::filesystem::path pth) {
+inline void UTETree::AddInstanceRecord(const gdcm::DataSet &ds, const boost::filesystem::path pth) {
 
   nlohmann::json instance = InstanceRecord;
   GetBasicInstanceInfo(ds,instance);
@@ -399,35 +640,80 @@ void UTETree::AddInstanceRecord(const gdcm::DataSet &ds, const boost::filesystem
 
 }
 
-std::string UTETree::FindMuMapUID(const std::string &studyUID, const std::string &tag){
+//IMAGE records rarely carry the echo time. It is then read later, and
+//only for candidate UTE series.
+inline void UTETree::AddDirectoryInstanceRecord(const gdcm::DataSet &record, nlohmann::json &instance){
+
+  std::string echoTime;
+  if (GetTagInfo(record, gdcm::Tag(0x0018,0x0081), echoTime))
+    instance["TE"] = echoTime;
+
+  _instanceList.insert(instance);
+
+}
+
+inline void UTETree::LoadSeriesTE(const std::string &seriesUID){
 
-  std::vector<std::string> seriesToEval = GetSeriesUIDList(studyUID);
+  mon::ScopedTimer timer("UTETree::LoadSeriesTE", "dicom");
 
-  if (seriesToEval.size() == 0) {
-    LOG(ERROR) << "No mu-map found";
-    throw false;
-    return "";
+  for (nlohmann::json i : GetInstanceList(seriesUID)){
+    if (i.find("TE") != i.end())
+      continue;
+
+    gdcm::DataSet ds;
+    std::string echoTime;
+    if (GetDicomInfoUpTo(i["FilePath"].get<std::string>(), gdcm::Tag(0x0018,0x0082), ds))
+      GetTagInfo(ds, gdcm::Tag(0x0018,0x0081), echoTime);
+
+    _instanceList.erase(i);
+    i["TE"] = echoTime;
+    _instanceList.insert(i);
   }
 
-  for (auto const &s : seriesToEval){
+}
+
+inline bool UTETree::TryFindMuMapUID(const std::string &studyUID, const std::string &tag, std::string &uid){
+
+  if (GetNoOfSeries(studyUID) == 0)
+    return false;
+
+  for (auto const &s : GetSeriesUIDList(studyUID)){
     nlohmann::json seriesRec = GetSeriesRecord(s);
     std::string desc = seriesRec["SeriesDesc"];
     if (desc.find(tag) != std::string::npos){
-      LOG(INFO) << "Identified mu-map series: " << seriesRec["SeriesUID"];
-      return seriesRec["SeriesUID"];
+      uid = seriesRec["SeriesUID"];
+      return true;
     }
   }
 
-  LOG(ERROR) << "No mu-map found!";
-  throw false;
+  return false;
+}
 
-  return "";
+inline std::string UTETree::FindMuMapUID(const std::string &studyUID, const std::string &tag){
+
+  std::string uid;
+
+  if (!TryFindMuMapUID(studyUID, tag, uid)){
+    LOG(ERROR) << "No mu-map found!";
+    throw false;
+  }
+
+  LOG(INFO) << "Identified mu-map series: " << uid;
+  return uid;
 }
 
-bool UTETree::CheckSeriesTE(const std::string &seriesUID, const std::string &TE){
+inline bool UTETree::CheckSeriesTE(const std::string &seriesUID, const std::string &TE){
 
   std::vector<nlohmann::json> instList = GetInstanceList(seriesUID);
 
+  for (auto const& i : instList){
+    if (i.find("TE") == i.end()){
+      LoadSeriesTE(seriesUID);
+      instList = GetInstanceList(seriesUID);
+      break;
+    }
+  }
+
   for (auto const& i : instList){
     if (i["TE"] != TE)
       return false;
@@ -436,33 +722,36 @@ bool UTETree::CheckSeriesTE(const std::string &seriesUID, const std::string &TE)
   return true;
 }
 
-std::string UTETree::FindUTEUID(const std::string &studyUID, const std::string &tag, const std::string &TE){
-
-  std::vector<std::string> seriesToEval = GetSeriesUIDList(studyUID);
+inline bool UTETree::TryFindUTEUID(const std::string &studyUID, const std::string &tag, const std::string &TE, std::string &uid){
 
-  if (seriesToEval.size() == 0) {
-    LOG(ERROR) << "No UTE series found";
-    throw false;
-    return "";
-  }
+  if (GetNoOfSeries(studyUID) == 0)
+    return false;
 
-  for (auto const &s : seriesToEval){
+  for (auto const &s : GetSeriesUIDList(studyUID)){
     nlohmann::json seriesRec = GetSeriesRecord(s);
     std::string desc = seriesRec["SeriesDesc"];
-    if (desc.find(tag) != std::string::npos){
 
-      //If series has TE
-      if (CheckSeriesTE(s,TE)) {
-        LOG(INFO) << "Identified UTE series (TE = " << TE << "): " << seriesRec["SeriesUID"];
-        return seriesRec["SeriesUID"];
-      }
+    //If series has TE
+    if ((desc.find(tag) != std::string::npos) && CheckSeriesTE(s,TE)){
+      uid = seriesRec["SeriesUID"];
+      return true;
     }
   }
 
-  LOG(ERROR) << "No UTE found!";
-  throw false;
+  return false;
+}
 
-  return "";
+inline std::string UTETree::FindUTEUID(const std::string &studyUID, const std::string &tag, const std::string &TE){
+
+  std::string uid;
+
+  if (!TryFindUTEUID(studyUID, tag, TE, uid)){
+    LOG(ERROR) << "No UTE found!";
+    throw false;
+  }
+
+  LOG(INFO) << "Identified UTE series (TE = " << TE << "): " << uid;
+  return uid;
 }
 
 template <class TImage>
@@ -508,6 +797,8 @@ template <typename TImage>
 void ReadDicomSeries<TImage>::Read()
 {
 
+  mon::ScopedTimer timer("ReadDicomSeries::Read", "dicom");
+
   typename ReaderType::Pointer dicomReader = ReaderType::New();
 
   std::vector<std::string> srcFiles;
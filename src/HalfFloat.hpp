@@ -0,0 +1,168 @@
+/*
+   HalfFloat.hpp
+
+   Author:      Benjamin A. Thomas
+
+   Copyright 2018 Institute of Nuclear Medicine, University College London.
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+
+ */
+
+#pragma once
+
+#ifndef _HALFFLOAT_HPP_
+#define _HALFFLOAT_HPP_
+
+#include <cstdint>
+#include <cstring>
+
+#include <itkImage.h>
+
+#include "Parallel.hpp"
+
+/*
+  IEEE 754 half precision (binary16) storage for intermediate volumes:
+  11 significant bits, so a relative error of at most 2^-11 over
+  6.1e-5 .. 65504. Values are kept as uint16_t and converted to float at
+  kernel boundaries. The conversions are portable and need no F16C.
+*/
+
+namespace ns {
+
+typedef itk::Image<uint16_t, 3> HalfImageType;
+
+//Round to nearest, ties to even. Overflow gives +-inf, NaN stays NaN.
+inline uint16_t FloatToHalf(float f){
+
+  uint32_t x;
+  std::memcpy(&x, &f, sizeof(x));
+
+  const uint16_t sign = static_cast<uint16_t>((x >> 16) & 0x8000u);
+  const uint32_t absx = x & 0x7fffffffu;
+
+  //Inf and NaN.
+  if (absx >= 0x7f800000u)
+    return static_cast<uint16_t>(sign | 0x7c00u | ((absx > 0x7f800000u) ? 0x200u : 0u));
+
+  //65520 and above round to inf.
+  if (absx >= 0x477ff000u)
+    return static_cast<uint16_t>(sign | 0x7c00u);
+
+  //Below the smallest normal half (2^-14): subnormal or zero.
+  if (absx < 0x38800000u){
+    if (absx < 0x33000000u)
+      return sign;
+
+    const uint32_t mant = (absx & 0x007fffffu) | 0x00800000u;
+    const uint32_t shift = 126u - (absx >> 23);
+    uint32_t h = mant >> shift;
+    const uint32_t rem = mant & ((1u << shift) - 1u);
+    const uint32_t halfway = 1u << (shift - 1u);
+    if (rem > halfway || (rem == halfway && (h & 1u)))
+      h++;
+    return static_cast<uint16_t>(sign | h);
+  }
+
+  //Normal: rebias the exponent and round the mantissa. A carry into the
+  //exponent is still correct.
+  uint32_t h = (absx - 0x38000000u) >> 13;
+  const uint32_t rem = absx & 0x1fffu;
+  if (rem > 0x1000u || (rem == 0x1000u && (h & 1u)))
+    h++;
+  return static_cast<uint16_t>(sign | h);
+
+}
+
+inline float HalfToFloat(uint16_t h){
+
+  const uint32_t sign = static_cast<uint32_t>(h & 0x8000u) << 16;
+  const uint32_t exponent = (h >> 10) & 0x1fu;
+  uint32_t mant = h & 0x3ffu;
+  uint32_t x;
+
+  if (exponent == 0x1fu)
+    x = sign | 0x7f800000u | (mant << 13);
+  else if (exponent != 0)
+    x = sign | ((exponent + 112u) << 23) | (mant << 13);
+  else if (mant == 0)
+    x = sign;
+  else {
+    //Subnormal: normalise it.
+    uint32_t e = 113;
+    while (!(mant & 0x400u)){
+      mant <<= 1;
+      e--;
+    }
+    x = sign | (e << 23) | ((mant & 0x3ffu) << 13);
+  }
+
+  float f;
+  std::memcpy(&f, &x, sizeof(f));
+  return f;
+
+}
+
+//Half precision copy of a float volume, with the same geometry.
+template< typename TImage >
+HalfImageType::Pointer CompressToHalf(const TImage *img){
+
+  HalfImageType::Pointer dst = HalfImageType::New();
+  dst->CopyInformation(img);
+  dst->SetRegions(img->GetLargestPossibleRegion());
+  dst->Allocate();
+
+  const typename TImage::PixelType *src = img->GetBufferPointer();
+  uint16_t *buf = dst->GetBufferPointer();
+
+  ParallelFor(0, img->GetLargestPossibleRegion().GetNumberOfPixels(), [&](std::size_t first, std::size_t last){
+    for (std::size_t i = first; i < last; ++i)
+      buf[i] = FloatToHalf(static_cast<float>(src[i]));
+  });
+
+  return dst;
+}
+
+//Float copy of region of a half precision volume. The copy is buffered
+//over region alone, e.g. one slab.
+template< typename TImage >
+typename TImage::Pointer ExpandFromHalf(const HalfImageType *img, const typename TImage::RegionType &region){
+
+  typename TImage::Pointer dst = TImage::New();
+  dst->CopyInformation(img);
+  dst->SetBufferedRegion(region);
+  dst->SetRequestedRegion(region);
+  dst->Allocate();
+
+  //Each x row of region is contiguous in both buffers.
+  const std::size_t rowLength = region.GetSize()[0];
+  const std::size_t rows = region.GetNumberOfPixels() / rowLength;
+  typename TImage::PixelType *out = dst->GetBufferPointer();
+
+  ParallelFor(0, rows, [&](std::size_t first, std::size_t last){
+    for (std::size_t r = first; r < last; ++r){
+      typename HalfImageType::IndexType idx = region.GetIndex();
+      idx[1] += r % region.GetSize()[1];
+      idx[2] += r / region.GetSize()[1];
+
+      const uint16_t *in = img->GetBufferPointer() + img->ComputeOffset(idx);
+      for (std::size_t x = 0; x < rowLength; ++x)
+        out[r * rowLength + x] = static_cast<typename TImage::PixelType>(HalfToFloat(in[x]));
+    }
+  });
+
+  return dst;
+}
+
+}// namespace ns
+
+#endif
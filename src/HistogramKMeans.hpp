@@ -0,0 +1,350 @@
+/*
+   HistogramKMeans.hpp
+
+   Author:      Benjamin A. Thomas
+
+   Copyright 2018 Institute of Nuclear Medicine, University College London.
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+
+ */
+
+#pragma once
+
+#ifndef _HISTOGRAMKMEANS_HPP_
+#define _HISTOGRAMKMEANS_HPP_
+
+#include <glog/logging.h>
+
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+namespace ns {
+
+/*
+  Two-class k-means on a 2-D joint histogram, clustered in the joint
+  (x, y, count) domain used previously by ITK's JointDomainImageToListSampleAdaptor.
+
+  Only the non-zero bins are stored and classified individually. Empty bins
+  all sit on the plane count = 0, so for a given pair of centroids the empty
+  bins belonging to each class form a half-plane of the grid; their counts
+  and coordinate sums are accumulated in closed form, one row at a time.
+  Each iteration is therefore O(non-zero bins + rows) and gives the same
+  centroids as Lloyd's algorithm over every bin.
+*/
+class HistogramKMeans {
+
+public:
+
+  struct Centroid {
+    double x, y, c;
+  };
+
+  HistogramKMeans();
+
+  //Histogram bins are stored x-fastest. Bin (i,j) sits at (ox + i*sx, oy + j*sy).
+  void SetHistogram(const float *buffer, unsigned int nx, unsigned int ny);
+  void SetOrigin(double ox, double oy){ _ox = ox; _oy = oy; };
+  void SetSpacing(double sx, double sy){ _sx = sx; _sy = sy; };
+
+  //Convergence is reached when the summed squared centroid movement <= tolerance.
+  void SetTolerance(double t){ _tolerance = t; };
+  void SetMaximumIterations(unsigned int n){ _maxIterations = n; };
+
+  //Optional. If not set, initial centroids are derived from the data.
+  void SetInitialCentroids(const Centroid &c0, const Centroid &c1);
+
+  void Compute();
+
+  //Class 0 is the high-count (soft-tissue) cluster.
+  const Centroid &GetCentroid(unsigned int k) const { return _centroids[k]; };
+  unsigned int GetNumberOfIterations() const { return _iterations; };
+  std::size_t GetNumberOfNonZeroBins() const { return _v.size(); };
+
+  //Writes 1 for bins in class 0 and 0 otherwise.
+  void Classify(float *labels) const;
+
+protected:
+
+  struct Accumulator {
+    double n, x, y, c;
+  };
+
+  void InitialiseCentroids();
+  void GetDecisionPlane(double &a, double &b, double &g, double &k) const;
+  void AccumulateEmptyBins(double a, double b, double k, Accumulator &acc) const;
+
+  //Non-zero bins (structure of arrays so the distance loop vectorises).
+  std::vector<double> _x;
+  std::vector<double> _y;
+  std::vector<double> _v;
+  std::vector<std::size_t> _offsets;
+
+  unsigned int _nx = 0;
+  unsigned int _ny = 0;
+  double _ox = 0.0;
+  double _oy = 0.0;
+  double _sx = 1.0;
+  double _sy = 1.0;
+
+  double _tolerance = 1e-6;
+  unsigned int _maxIterations = 500;
+  unsigned int _iterations = 0;
+
+  bool _bUserCentroids = false;
+  Centroid _centroids[2];
+
+};
+
+inline HistogramKMeans::HistogramKMeans(){
+
+  _centroids[0] = {0.0, 0.0, 0.0};
+  _centroids[1] = {0.0, 0.0, 0.0};
+
+}
+
+inline void HistogramKMeans::SetHistogram(const float *buffer, unsigned int nx, unsigned int ny){
+
+  _nx = nx;
+  _ny = ny;
+
+  _x.clear();
+  _y.clear();
+  _v.clear();
+  _offsets.clear();
+
+  for (unsigned int j = 0; j < ny; ++j){
+    const float *row = buffer + static_cast<std::size_t>(j) * nx;
+    for (unsigned int i = 0; i < nx; ++i){
+      if (row[i] != 0){
+        _x.push_back(i);
+        _y.push_back(j);
+        _v.push_back(row[i]);
+        _offsets.push_back(static_cast<std::size_t>(j) * nx + i);
+      }
+    }
+  }
+
+}
+
+inline void HistogramKMeans::SetInitialCentroids(const Centroid &c0, const Centroid &c1){
+
+  _centroids[0] = c0;
+  _centroids[1] = c1;
+  _bUserCentroids = true;
+
+}
+
+inline void HistogramKMeans::InitialiseCentroids(){
+
+  //Both clusters start at the count-weighted centre of the histogram. The
+  //soft-tissue cluster starts at the count-weighted mean count, the
+  //background cluster on the empty plane.
+  double sw = 0.0, sx = 0.0, sy = 0.0, sc = 0.0;
+
+  for (std::size_t p = 0; p < _v.size(); ++p){
+    const double w = std::fabs(_v[p]);
+    sw += w;
+    sx += w * (_ox + _x[p] * _sx);
+    sy += w * (_oy + _y[p] * _sy);
+    sc += w * _v[p];
+  }
+
+  if (sw == 0.0){
+    _centroids[0] = {_ox, _oy, 0.0};
+    _centroids[1] = {_ox, _oy, 0.0};
+    return;
+  }
+
+  _centroids[0] = {sx / sw, sy / sw, sc / sw};
+  _centroids[1] = {sx / sw, sy / sw, 0.0};
+
+}
+
+inline void HistogramKMeans::GetDecisionPlane(double &a, double &b, double &g, double &k) const {
+
+  //|p - c0|^2 <= |p - c1|^2  <=>  a*x + b*y + g*v >= k
+  //Ties go to class 0, as with ITK's minimum decision rule.
+  const Centroid &c0 = _centroids[0];
+  const Centroid &c1 = _centroids[1];
+
+  a = 2.0 * (c0.x - c1.x);
+  b = 2.0 * (c0.y - c1.y);
+  g = 2.0 * (c0.c - c1.c);
+  k = (c0.x * c0.x + c0.y * c0.y + c0.c * c0.c)
+    - (c1.x * c1.x + c1.y * c1.y + c1.c * c1.c);
+
+}
+
+inline void HistogramKMeans::AccumulateEmptyBins(double a, double b, double k, Accumulator &acc) const {
+
+  //Sums every grid point with a*x + b*y >= k (class 0 on the count = 0 plane).
+  acc = {0.0, 0.0, 0.0, 0.0};
+
+  for (unsigned int j = 0; j < _ny; ++j){
+    const double y = _oy + j * _sy;
+
+    long first = 0;
+    long last = static_cast<long>(_nx) - 1;
+
+    if (a * _sx == 0.0){
+      if (a * _ox + b * y < k)
+        continue;
+    } else {
+      //Estimate the boundary, then step to the exact first/last member.
+      const double bound = (k - b * y - a * _ox) / (a * _sx);
+      long edge = std::isfinite(bound) ?
+        static_cast<long>(std::max(-1.0, std::min(static_cast<double>(_nx), std::floor(bound)))) : 0;
+
+      auto inside = [&](long i){ return a * (_ox + i * _sx) + b * y >= k; };
+
+      if (a * _sx > 0){
+        while (edge > 0 && inside(edge - 1)) --edge;
+        while (edge < static_cast<long>(_nx) && (edge < 0 || !inside(edge))) ++edge;
+        first = edge;
+      } else {
+        while (edge < static_cast<long>(_nx) - 1 && inside(edge + 1)) ++edge;
+        while (edge >= 0 && (edge >= static_cast<long>(_nx) || !inside(edge))) --edge;
+        last = edge;
+      }
+    }
+
+    if (last < first)
+      continue;
+
+    const double n = static_cast<double>(last - first + 1);
+    acc.n += n;
+    acc.x += n * _ox + _sx * 0.5 * n * static_cast<double>(first + last);
+    acc.y += n * y;
+  }
+
+}
+
+inline void HistogramKMeans::Compute(){
+
+  if (!_bUserCentroids)
+    InitialiseCentroids();
+
+  const std::size_t nBins = static_cast<std::size_t>(_nx) * _ny;
+  const std::size_t nPts = _v.size();
+
+  //Coordinate totals over every bin.
+  double allX = 0.0, allY = 0.0;
+  for (unsigned int i = 0; i < _nx; ++i) allX += _ox + i * _sx;
+  for (unsigned int j = 0; j < _ny; ++j) allY += _oy + j * _sy;
+  allX *= _ny;
+  allY *= _nx;
+
+  std::vector<double> px(nPts), py(nPts);
+  for (std::size_t p = 0; p < nPts; ++p){
+    px[p] = _ox + _x[p] * _sx;
+    py[p] = _oy + _y[p] * _sy;
+  }
+
+  const double *xs = px.data();
+  const double *ys = py.data();
+  const double *vs = _v.data();
+
+  for (_iterations = 1; _iterations <= _maxIterations; ++_iterations){
+
+    const Centroid c0 = _centroids[0];
+    const Centroid c1 = _centroids[1];
+
+    double a, b, g, k;
+    GetDecisionPlane(a, b, g, k);
+
+    //Non-zero bins. The sums are reductions, which the compiler only
+    //vectorises when allowed to reorder them: -fopenmp-simd enables the
+    //pragma without linking OpenMP.
+    double n0 = 0.0, x0 = 0.0, y0 = 0.0, v0 = 0.0, vAll = 0.0;
+    double shadowN = 0.0, shadowX = 0.0, shadowY = 0.0;
+
+#pragma omp simd reduction(+:n0,x0,y0,v0,vAll,shadowN,shadowX,shadowY)
+    for (std::size_t p = 0; p < nPts; ++p){
+      const double s = a * xs[p] + b * ys[p];
+      const double in = (s + g * vs[p] >= k) ? 1.0 : 0.0;
+      const double shadow = (s >= k) ? 1.0 : 0.0;
+
+      n0 += in;
+      x0 += in * xs[p];
+      y0 += in * ys[p];
+      v0 += in * vs[p];
+      vAll += vs[p];
+
+      //These bins are counted by the half-plane sum but are not empty.
+      shadowN += shadow;
+      shadowX += shadow * xs[p];
+      shadowY += shadow * ys[p];
+    }
+
+    Accumulator empty0;
+    AccumulateEmptyBins(a, b, k, empty0);
+    empty0.n -= shadowN;
+    empty0.x -= shadowX;
+    empty0.y -= shadowY;
+
+    Accumulator cls0 = {n0 + empty0.n, x0 + empty0.x, y0 + empty0.y, v0};
+    Accumulator cls1 = {
+      static_cast<double>(nBins) - cls0.n,
+      allX - cls0.x,
+      allY - cls0.y,
+      vAll - v0
+    };
+
+    //Empty clusters keep their previous position.
+    Centroid next0 = c0, next1 = c1;
+    if (cls0.n > 0.5)
+      next0 = {cls0.x / cls0.n, cls0.y / cls0.n, cls0.c / cls0.n};
+    if (cls1.n > 0.5)
+      next1 = {cls1.x / cls1.n, cls1.y / cls1.n, cls1.c / cls1.n};
+
+    const double change =
+      (next0.x - c0.x) * (next0.x - c0.x) + (next0.y - c0.y) * (next0.y - c0.y) + (next0.c - c0.c) * (next0.c - c0.c) +
+      (next1.x - c1.x) * (next1.x - c1.x) + (next1.y - c1.y) * (next1.y - c1.y) + (next1.c - c1.c) * (next1.c - c1.c);
+
+    _centroids[0] = next0;
+    _centroids[1] = next1;
+
+    if (change <= _tolerance)
+      break;
+  }
+
+  _iterations = std::min(_iterations, _maxIterations);
+
+  DLOG(INFO) << "k-means: " << nPts << " non-zero bins, " << _iterations << " iterations";
+
+}
+
+inline void HistogramKMeans::Classify(float *labels) const {
+
+  double a, b, g, k;
+  GetDecisionPlane(a, b, g, k);
+
+  for (unsigned int j = 0; j < _ny; ++j){
+    const double y = _oy + j * _sy;
+    float *row = labels + static_cast<std::size_t>(j) * _nx;
+    for (unsigned int i = 0; i < _nx; ++i){
+      row[i] = (a * (_ox + i * _sx) + b * y >= k) ? 1 : 0;
+    }
+  }
+
+  for (std::size_t p = 0; p < _v.size(); ++p){
+    const double s = a * (_ox + _x[p] * _sx) + b * (_oy + _y[p] * _sy);
+    labels[_offsets[p]] = (s + g * _v[p] >= k) ? 1 : 0;
+  }
+
+}
+
+}// namespace ns
+
+#endif
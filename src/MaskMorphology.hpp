@@ -0,0 +1,358 @@
+/*
+   MaskMorphology.hpp
+
+   Author:      Benjamin A. Thomas
+
+   Copyright 2018 Institute of Nuclear Medicine, University College London.
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+
+ */
+
+#pragma once
+
+#ifndef _MASKMORPHOLOGY_HPP_
+#define _MASKMORPHOLOGY_HPP_
+
+#include <algorithm>
+#include <cstdint>
+#include <limits>
+#include <vector>
+
+#include "Parallel.hpp"
+#include "SlabScheduler.hpp"
+
+/*
+  Binary mask operations on raw x-fastest 3-D buffers (non-zero = foreground).
+
+  Closing uses exact squared Euclidean distance transforms (Felzenszwalb &
+  Huttenlocher), so its cost is linear in the number of voxels whatever the
+  radius. Connected components and hole filling use a union-find that is
+  built slab-by-slab in parallel and merged across slab boundaries.
+*/
+
+namespace ns {
+
+namespace detail {
+
+const float EDT_INF = std::numeric_limits<float>::max();
+
+//Lower envelope of parabolas along one line. f and d may not alias.
+inline void DistanceTransform1D(const float *f, std::size_t n, float *d,
+  std::vector<std::size_t> &v, std::vector<double> &z){
+
+  std::size_t first = 0;
+  while (first < n && f[first] == EDT_INF) ++first;
+
+  if (first == n){
+    for (std::size_t q = 0; q < n; ++q) d[q] = EDT_INF;
+    return;
+  }
+
+  std::size_t k = 0;
+  v[0] = first;
+  z[0] = -std::numeric_limits<double>::max();
+  z[1] = std::numeric_limits<double>::max();
+
+  for (std::size_t q = first + 1; q < n; ++q){
+    if (f[q] == EDT_INF)
+      continue;
+
+    const double fq = f[q] + double(q) * q;
+    double s = (fq - (f[v[k]] + double(v[k]) * v[k])) / (2.0 * q - 2.0 * v[k]);
+    while (s <= z[k]){
+      --k;
+      s = (fq - (f[v[k]] + double(v[k]) * v[k])) / (2.0 * q - 2.0 * v[k]);
+    }
+
+    ++k;
+    v[k] = q;
+    z[k] = s;
+    z[k+1] = std::numeric_limits<double>::max();
+  }
+
+  k = 0;
+  for (std::size_t q = 0; q < n; ++q){
+    while (z[k+1] < q) ++k;
+    const double dq = double(q) - double(v[k]);
+    d[q] = static_cast<float>(dq * dq + f[v[k]]);
+  }
+
+}
+
+//Runs the 1-D transform along every line parallel to axis.
+inline void DistanceTransformAxis(std::vector<float> &dist, const std::size_t size[3], unsigned int axis){
+
+  const std::size_t stride[3] = {1, size[0], size[0] * size[1]};
+  const std::size_t n = size[axis];
+  const std::size_t nLines = (size[0] * size[1] * size[2]) / n;
+
+  const unsigned int a1 = (axis == 0) ? 1 : 0;
+  const unsigned int a2 = (axis == 2) ? 1 : 2;
+
+  ParallelFor(0, nLines, [&](std::size_t firstLine, std::size_t lastLine){
+    std::vector<float> f(n), d(n);
+    std::vector<std::size_t> v(n);
+    std::vector<double> z(n + 1);
+
+    for (std::size_t line = firstLine; line < lastLine; ++line){
+      const std::size_t i1 = line % size[a1];
+      const std::size_t i2 = line / size[a1];
+      const std::size_t start = i1 * stride[a1] + i2 * stride[a2];
+
+      for (std::size_t q = 0; q < n; ++q)
+        f[q] = dist[start + q * stride[axis]];
+
+      DistanceTransform1D(f.data(), n, d.data(), v, z);
+
+      for (std::size_t q = 0; q < n; ++q)
+        dist[start + q * stride[axis]] = d[q];
+    }
+  });
+
+}
+
+inline uint32_t FindRoot(const std::vector<uint32_t> &parent, std::size_t j){
+
+  uint32_t i = static_cast<uint32_t>(j);
+  while (parent[i] != i)
+    i = parent[i];
+  return i;
+}
+
+//Roots are always the lowest index in their set, so parent[i] <= i.
+inline void Union(std::vector<uint32_t> &parent, std::size_t i, std::size_t j){
+
+  uint32_t a = static_cast<uint32_t>(i);
+  uint32_t b = static_cast<uint32_t>(j);
+
+  while (parent[a] != a){ parent[a] = parent[parent[a]]; a = parent[a]; }
+  while (parent[b] != b){ parent[b] = parent[parent[b]]; b = parent[b]; }
+
+  if (a < b)
+    parent[b] = a;
+  else if (b < a)
+    parent[a] = b;
+
+}
+
+}// namespace detail
+
+//Exact squared distance (in voxels) from each voxel to the nearest voxel
+//where (mask != 0) == toForeground. Voxels with no such target get EDT_INF.
+inline void SquaredDistanceTransform(const unsigned char *mask, const std::size_t size[3],
+  bool toForeground, std::vector<float> &dist){
+
+  const std::size_t nVox = size[0] * size[1] * size[2];
+  dist.resize(nVox);
+
+  ParallelFor(0, nVox, [&](std::size_t first, std::size_t last){
+    for (std::size_t i = first; i < last; ++i)
+      dist[i] = ((mask[i] != 0) == toForeground) ? 0.0f : detail::EDT_INF;
+  });
+
+  for (unsigned int axis = 0; axis < 3; ++axis)
+    detail::DistanceTransformAxis(dist, size, axis);
+
+}
+
+//Same result as itk::BinaryMorphologicalClosingImageFilter with an
+//itk::BinaryBallStructuringElement of the given radius (index units) and
+//SafeBorder on. The result is written back to mask as 0/1.
+inline void BinaryClosingBall(unsigned char *mask, const std::size_t size[3], unsigned int radius){
+
+  //The ITK ball holds every offset with |d|^2 <= (r + 0.5)^2.
+  const float r2 = static_cast<float>(radius) * radius + radius;
+
+  const std::size_t ps[3] = {size[0] + 2 * radius, size[1] + 2 * radius, size[2] + 2 * radius};
+  std::vector<unsigned char> padded(ps[0] * ps[1] * ps[2], 0);
+
+  for (std::size_t z = 0; z < size[2]; ++z)
+    for (std::size_t y = 0; y < size[1]; ++y)
+      for (std::size_t x = 0; x < size[0]; ++x)
+        padded[((z + radius) * ps[1] + y + radius) * ps[0] + x + radius] =
+          mask[(z * size[1] + y) * size[0] + x] != 0;
+
+  std::vector<float> dist;
+
+  //Dilation: within the ball of a foreground voxel.
+  SquaredDistanceTransform(padded.data(), ps, true, dist);
+  for (std::size_t i = 0; i < padded.size(); ++i)
+    padded[i] = (dist[i] <= r2);
+
+  //Erosion: no background voxel inside the ball. Outside the padded
+  //volume counts as foreground, as in ITK's erosion.
+  SquaredDistanceTransform(padded.data(), ps, false, dist);
+
+  for (std::size_t z = 0; z < size[2]; ++z)
+    for (std::size_t y = 0; y < size[1]; ++y)
+      for (std::size_t x = 0; x < size[0]; ++x){
+        const std::size_t i = (z * size[1] + y) * size[0] + x;
+        const std::size_t p = ((z + radius) * ps[1] + y + radius) * ps[0] + x + radius;
+        mask[i] = (dist[p] > r2 || mask[i] != 0) ? 1 : 0;
+      }
+
+}
+
+//BinaryClosingBall of in, written to out, one z-slab at a time. A closed
+//voxel depends on the mask within 2 * radius of it, so each slab is closed
+//with that many halo planes on either side and the result is the same as
+//closing the whole volume. The distance maps then only cover one slab,
+//sized by budgetBytes (0 closes the volume in one go). in and out may not
+//alias.
+inline void BinaryClosingBallInSlabs(const unsigned char *in, unsigned char *out,
+  const std::size_t size[3], unsigned int radius, std::size_t budgetBytes){
+
+  const std::size_t plane = size[0] * size[1];
+
+  //Padded mask and float distances per plane, plus the unpadded copy.
+  const std::size_t bytesPerPlane =
+    (size[0] + 2 * radius) * (size[1] + 2 * radius) * (1 + sizeof(float)) + plane;
+
+  const std::vector<Slab> slabs = MakeSlabs(size[2], bytesPerPlane, budgetBytes, 2 * radius);
+
+  std::vector<unsigned char> slabMask;
+
+  for (const Slab &slab : slabs){
+    const std::size_t slabSize[3] = { size[0], size[1], slab.haloLast - slab.haloFirst };
+
+    slabMask.assign(in + slab.haloFirst * plane, in + slab.haloLast * plane);
+    BinaryClosingBall(slabMask.data(), slabSize, radius);
+
+    std::copy(slabMask.begin() + (slab.first - slab.haloFirst) * plane,
+              slabMask.begin() + (slab.last - slab.haloFirst) * plane,
+              out + slab.first * plane);
+  }
+
+}
+
+//Face-connected (6-neighbour) labelling of the voxels where
+//(mask != 0) == foreground. Labels run from 1 in raster order of each
+//component's first voxel, as with itk::ConnectedComponentImageFilter.
+//Returns the number of components.
+inline unsigned long LabelConnectedComponents(const unsigned char *mask, const std::size_t size[3],
+  std::vector<uint32_t> &labels, bool foreground = true){
+
+  const std::size_t nx = size[0], ny = size[1], nz = size[2];
+  const std::size_t plane = nx * ny;
+  const std::size_t nVox = plane * nz;
+
+  std::vector<uint32_t> parent(nVox);
+  labels.assign(nVox, 0);
+
+  auto inSet = [&](std::size_t i){ return (mask[i] != 0) == foreground; };
+
+  //Build the forest slab by slab; each slab only touches its own voxels.
+  const std::size_t nSlabs = std::min<std::size_t>(GetNumberOfWorkerThreads(), nz);
+  std::vector<std::size_t> slabStart(nSlabs + 1);
+  for (std::size_t s = 0; s <= nSlabs; ++s)
+    slabStart[s] = (nz * s) / std::max<std::size_t>(nSlabs, 1);
+
+  ParallelFor(0, nSlabs, [&](std::size_t firstSlab, std::size_t lastSlab){
+    for (std::size_t s = firstSlab; s < lastSlab; ++s){
+      for (std::size_t z = slabStart[s]; z < slabStart[s+1]; ++z){
+        for (std::size_t y = 0; y < ny; ++y){
+          for (std::size_t x = 0; x < nx; ++x){
+            const std::size_t i = (z * ny + y) * nx + x;
+            parent[i] = static_cast<uint32_t>(i);
+
+            if (!inSet(i))
+              continue;
+
+            if (x > 0 && inSet(i - 1))
+              detail::Union(parent, i, i - 1);
+            if (y > 0 && inSet(i - nx))
+              detail::Union(parent, i, i - nx);
+            if (z > slabStart[s] && inSet(i - plane))
+              detail::Union(parent, i, i - plane);
+          }
+        }
+      }
+    }
+  }, nSlabs);
+
+  //Stitch neighbouring slabs together.
+  for (std::size_t s = 1; s < nSlabs; ++s){
+    const std::size_t z = slabStart[s];
+    for (std::size_t i = z * plane; i < (z + 1) * plane; ++i){
+      if (inSet(i) && inSet(i - plane))
+        detail::Union(parent, i, i - plane);
+    }
+  }
+
+  ParallelFor(0, nVox, [&](std::size_t first, std::size_t last){
+    for (std::size_t i = first; i < last; ++i){
+      if (inSet(i))
+        labels[i] = detail::FindRoot(parent, i);
+    }
+  });
+
+  //Number the roots in raster order (parent is reused as the lookup table).
+  unsigned long count = 0;
+  for (std::size_t i = 0; i < nVox; ++i){
+    if (inSet(i) && labels[i] == i)
+      parent[i] = ++count;
+  }
+
+  ParallelFor(0, nVox, [&](std::size_t first, std::size_t last){
+    for (std::size_t i = first; i < last; ++i)
+      labels[i] = inSet(i) ? parent[labels[i]] : 0;
+  });
+
+  return count;
+}
+
+//fraction of the 99th percentile of the positive values of img, e.g. to
+//find the head in a T1 template. 0 if none are positive.
+template <typename T>
+T GetForegroundThreshold(const T *img, std::size_t n, double fraction){
+
+  std::vector<T> positive;
+  for (std::size_t i = 0; i < n; ++i)
+    if (img[i] > 0)
+      positive.push_back(img[i]);
+
+  if (positive.empty())
+    return 0;
+
+  typename std::vector<T>::iterator p99 = positive.begin() + (positive.size() * 99) / 100;
+  std::nth_element(positive.begin(), p99, positive.end());
+  return static_cast<T>(fraction * *p99);
+}
+
+//Sets every background region that does not touch the volume border to 1.
+inline void FillHoles(unsigned char *mask, const std::size_t size[3]){
+
+  std::vector<uint32_t> labels;
+  const unsigned long nRegions = LabelConnectedComponents(mask, size, labels, false);
+
+  std::vector<unsigned char> open(nRegions + 1, 0);
+
+  for (std::size_t z = 0; z < size[2]; ++z)
+    for (std::size_t y = 0; y < size[1]; ++y)
+      for (std::size_t x = 0; x < size[0]; ++x){
+        const bool border = (x == 0 || y == 0 || z == 0 ||
+          x == size[0] - 1 || y == size[1] - 1 || z == size[2] - 1);
+        if (border)
+          open[labels[(z * size[1] + y) * size[0] + x]] = 1;
+      }
+
+  for (std::size_t i = 0; i < labels.size(); ++i){
+    if (labels[i] != 0 && !open[labels[i]])
+      mask[i] = 1;
+  }
+
+}
+
+}// namespace ns
+
+#endif
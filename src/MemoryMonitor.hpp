@@ -0,0 +1,321 @@
+/*
+   MemoryMonitor.hpp
+
+   Author:      Benjamin A. Thomas
+
+   Copyright 2018 Institute of Nuclear Medicine, University College London.
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+
+ */
+
+#pragma once
+
+#ifndef _MEMORYMONITOR_HPP_
+#define _MEMORYMONITOR_HPP_
+
+#include <glog/logging.h>
+#include <nlohmann/json.hpp>
+#include <boost/filesystem.hpp>
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <fstream>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+/*
+  Per-stage memory instrumentation.
+
+  Large heap blocks (>= LARGE_ALLOCATION_BYTES) are counted by the global
+  operator new/delete replacements in AllocationHooks.hpp. ITK pixel
+  containers allocate through new[], so the live large bytes track the
+  image buffers alive at any point. The process high-water mark comes from
+  /proc/self/status. Without the hooks linked in, only the /proc values
+  are reported.
+
+  Stages nest per thread. The counters are process-wide, so a stage's
+  peaks are those of the whole process while it was open, including work
+  done by other threads at the same time.
+*/
+
+namespace mon {
+
+const std::size_t LARGE_ALLOCATION_BYTES = 1 << 20;
+
+namespace detail {
+
+struct AllocationCounters {
+  std::atomic<int64_t> liveLargeBytes;
+  std::atomic<int64_t> peakLargeBytes;
+  std::atomic<uint64_t> largeAllocations;
+};
+
+//Constant-initialised, so it is safe to use from operator new before main.
+inline AllocationCounters &GetAllocationCounters(){
+  static AllocationCounters counters = {{0}, {0}, {0}};
+  return counters;
+}
+
+inline void OnLargeAllocation(std::size_t bytes){
+
+  AllocationCounters &c = GetAllocationCounters();
+  const int64_t live = c.liveLargeBytes.fetch_add(bytes) + static_cast<int64_t>(bytes);
+  c.largeAllocations.fetch_add(1);
+
+  int64_t peak = c.peakLargeBytes.load();
+  while (live > peak && !c.peakLargeBytes.compare_exchange_weak(peak, live)) {}
+
+}
+
+inline void OnLargeDeallocation(std::size_t bytes){
+  GetAllocationCounters().liveLargeBytes.fetch_sub(bytes);
+}
+
+//Leading number of a "Key: n ..." line in a /proc file (0 if absent).
+inline uint64_t ReadProcValue(const char *file, const std::string &key){
+
+  std::ifstream status(file);
+  std::string line;
+
+  while (std::getline(status, line)){
+    if (line.compare(0, key.size() + 1, key + ":") == 0)
+      return std::stoull(line.substr(key.size() + 1));
+  }
+
+  return 0;
+}
+
+inline uint64_t ReadProcStatusValue(const std::string &key){
+  return ReadProcValue("/proc/self/status", key);
+}
+
+//Value of a "Key: n kB" line in /proc/self/status, in bytes.
+inline uint64_t ReadProcStatusBytes(const std::string &key){
+  return ReadProcStatusValue(key) * 1024;
+}
+
+//Restarts VmHWM from the current RSS (Linux >= 4.0).
+inline bool ResetHighWaterMark(){
+
+  std::ofstream clearRefs("/proc/self/clear_refs");
+  clearRefs << "5";
+  return clearRefs.good();
+
+}
+
+}// namespace detail
+
+class MemoryMonitor {
+
+public:
+
+  static MemoryMonitor &GetInstance(){
+    static MemoryMonitor instance;
+    return instance;
+  };
+
+  //Stages may nest. A stage's peaks include those of its children.
+  void BeginStage(const std::string &name);
+  void EndStage();
+
+  //Drops all closed stages, e.g. between studies.
+  void Clear();
+
+  nlohmann::json GetReport() const;
+  void WriteReport(const boost::filesystem::path &dst) const;
+
+protected:
+
+  struct StageRecord {
+    std::string name;
+    unsigned int depth;
+    int64_t startLargeBytes, endLargeBytes, peakLargeBytes;
+    uint64_t startAllocations, largeAllocations;
+    uint64_t peakRSS, endRSS;
+  };
+
+  MemoryMonitor(){};
+
+  //Folds the peaks reached so far into every open stage, before the
+  //counters are restarted.
+  void FoldPeaks();
+
+  mutable std::mutex _mutex;
+  std::vector<StageRecord> _stages;
+  //Open stages of each thread, innermost last.
+  std::map<std::thread::id, std::vector<std::size_t> > _open;
+  bool _bCanResetHWM = true;
+
+};
+
+inline void MemoryMonitor::FoldPeaks(){
+
+  const int64_t peakLarge = detail::GetAllocationCounters().peakLargeBytes.load();
+  const uint64_t peakRSS = detail::ReadProcStatusBytes("VmHWM");
+
+  for (auto &t : _open){
+    for (std::size_t i : t.second){
+      _stages[i].peakLargeBytes = std::max(_stages[i].peakLargeBytes, peakLarge);
+      _stages[i].peakRSS = std::max(_stages[i].peakRSS, peakRSS);
+    }
+  }
+
+}
+
+inline void MemoryMonitor::BeginStage(const std::string &name){
+
+  std::lock_guard<std::mutex> lock(_mutex);
+  detail::AllocationCounters &c = detail::GetAllocationCounters();
+
+  //Restart the peaks so that this stage's are its own. Open stages keep
+  //what they have reached so far.
+  FoldPeaks();
+
+  if (_bCanResetHWM)
+    _bCanResetHWM = detail::ResetHighWaterMark();
+
+  const int64_t live = c.liveLargeBytes.load();
+  c.peakLargeBytes.store(live);
+
+  std::vector<std::size_t> &open = _open[std::this_thread::get_id()];
+
+  StageRecord r;
+  r.name = name;
+  r.depth = open.size();
+  r.startLargeBytes = live;
+  r.endLargeBytes = live;
+  r.peakLargeBytes = live;
+  r.startAllocations = c.largeAllocations.load();
+  r.largeAllocations = 0;
+  r.peakRSS = 0;
+  r.endRSS = 0;
+
+  open.push_back(_stages.size());
+  _stages.push_back(r);
+
+}
+
+inline void MemoryMonitor::EndStage(){
+
+  std::lock_guard<std::mutex> lock(_mutex);
+
+  auto t = _open.find(std::this_thread::get_id());
+
+  if (t == _open.end() || t->second.empty()){
+    LOG(WARNING) << "MemoryMonitor: EndStage() without BeginStage().";
+    return;
+  }
+
+  detail::AllocationCounters &c = detail::GetAllocationCounters();
+
+  //This stage and any enclosing ones get the peaks reached so far.
+  FoldPeaks();
+
+  StageRecord &r = _stages[t->second.back()];
+  t->second.pop_back();
+
+  if (t->second.empty())
+    _open.erase(t);
+
+  r.endLargeBytes = c.liveLargeBytes.load();
+  r.largeAllocations = c.largeAllocations.load() - r.startAllocations;
+  r.endRSS = detail::ReadProcStatusBytes("VmRSS");
+
+  LOG(INFO) << "[memory] " << r.name << ": peak RSS = " << (r.peakRSS >> 20) << " MB, peak images = "
+            << (r.peakLargeBytes >> 20) << " MB, large allocations = " << r.largeAllocations;
+
+  //Open stages continue from here.
+  c.peakLargeBytes.store(r.endLargeBytes);
+
+}
+
+inline void MemoryMonitor::Clear(){
+
+  std::lock_guard<std::mutex> lock(_mutex);
+
+  if (!_open.empty()){
+    LOG(WARNING) << "MemoryMonitor: Clear() with open stages.";
+    return;
+  }
+
+  _stages.clear();
+
+}
+
+inline nlohmann::json MemoryMonitor::GetReport() const {
+
+  std::lock_guard<std::mutex> lock(_mutex);
+
+  nlohmann::json stages = nlohmann::json::array();
+
+  for (std::size_t i = 0; i < _stages.size(); ++i){
+    const StageRecord &r = _stages[i];
+    stages.push_back({
+      {"index", i},
+      {"name", r.name},
+      {"depth", r.depth},
+      {"liveImageBytesStart", r.startLargeBytes},
+      {"liveImageBytesEnd", r.endLargeBytes},
+      {"peakImageBytes", r.peakLargeBytes},
+      {"largeAllocations", r.largeAllocations},
+      {"peakRSSBytes", r.peakRSS},
+      {"endRSSBytes", r.endRSS}
+    });
+  }
+
+  nlohmann::json report;
+  report["largeAllocationThresholdBytes"] = LARGE_ALLOCATION_BYTES;
+  report["perStagePeakRSS"] = _bCanResetHWM;
+  //VmHWM restarts at each stage, so the process peak is the largest seen.
+  uint64_t processPeak = detail::ReadProcStatusBytes("VmHWM");
+  for (const StageRecord &r : _stages)
+    processPeak = std::max(processPeak, r.peakRSS);
+
+  report["processPeakRSSBytes"] = processPeak;
+  report["stages"] = stages;
+
+  return report;
+}
+
+inline void MemoryMonitor::WriteReport(const boost::filesystem::path &dst) const {
+
+  std::ofstream ofs(dst.string());
+  ofs << GetReport().dump(2) << std::endl;
+
+  if (!ofs.good())
+    LOG(WARNING) << "Could not write memory report to " << dst;
+  else
+    LOG(INFO) << "Memory report written to " << dst;
+
+}
+
+//Records the enclosing scope as a stage.
+class ScopedMemoryStage {
+
+public:
+  explicit ScopedMemoryStage(const std::string &name){ MemoryMonitor::GetInstance().BeginStage(name); };
+  ~ScopedMemoryStage(){ MemoryMonitor::GetInstance().EndStage(); };
+
+private:
+  ScopedMemoryStage(const ScopedMemoryStage &); //purposely not implemented
+  void operator=(const ScopedMemoryStage &);  //purposely not implemented
+
+};
+
+}// namespace mon
+
+#endif
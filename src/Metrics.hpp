@@ -0,0 +1,284 @@
+/*
+   Metrics.hpp
+
+   Author:      Benjamin A. Thomas
+
+   Copyright 2018 Institute of Nuclear Medicine, University College London.
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+
+ */
+
+#pragma once
+
+#ifndef _METRICS_HPP_
+#define _METRICS_HPP_
+
+#include <glog/logging.h>
+#include <nlohmann/json.hpp>
+#include <boost/filesystem.hpp>
+
+#include <algorithm>
+#include <ctime>
+#include <fstream>
+#include <iomanip>
+#include <map>
+#include <mutex>
+#include <sstream>
+#include <string>
+
+#include <unistd.h>
+
+#include "MemoryMonitor.hpp"
+#include "StageTimer.hpp"
+
+/*
+  Counters and gauges in the Prometheus text format, written as a
+  node-exporter textfile (a .prom file in the folder given to its
+  --collector.textfile.directory). Counters accumulate for the life of
+  the process, so in service mode they cover every study processed. The
+  per-stage gauges are those of the last run.
+*/
+
+namespace mon {
+
+class MetricsRegistry {
+
+public:
+
+  typedef std::map<std::string, std::string> LabelsType;
+
+  static MetricsRegistry &GetInstance(){
+    static MetricsRegistry instance;
+    return instance;
+  };
+
+  //Adds delta to a counter. Counter names end in _total.
+  void Increment(const std::string &name, double delta = 1.0, const LabelsType &labels = LabelsType());
+
+  void Set(const std::string &name, double value, const LabelsType &labels = LabelsType());
+
+  //Value of one sample (0 if absent).
+  double Get(const std::string &name, const LabelsType &labels = LabelsType()) const;
+
+  //Folds the timing and memory reports of a finished run in, as stage
+  //gauges of this run and stage counters.
+  void RecordRun(bool success);
+
+  std::string GetText() const;
+
+  //Written beside dst and renamed, so the exporter never reads a partial
+  //file.
+  void WriteTextfile(const boost::filesystem::path &dst) const;
+
+protected:
+
+  struct Family {
+    std::string type;
+    std::map<LabelsType, double> samples;
+  };
+
+  MetricsRegistry(){};
+
+  static std::string GetHelp(const std::string &name);
+
+  mutable std::mutex _mutex;
+  std::map<std::string, Family> _families;
+
+private:
+
+  MetricsRegistry(const MetricsRegistry &); //purposely not implemented
+  void operator=(const MetricsRegistry &);  //purposely not implemented
+
+};
+
+inline std::string MetricsRegistry::GetHelp(const std::string &name){
+
+  static const std::map<std::string, std::string> help = {
+    { "resolute_runs_total", "Runs finished, by result." },
+    { "resolute_failures_total", "Failed runs, by the stage that failed." },
+    { "resolute_last_run_duration_seconds", "Wall time of the last run." },
+    { "resolute_last_run_timestamp_seconds", "Unix time at which the last run finished." },
+    { "resolute_peak_rss_bytes", "Peak resident memory of the last run." },
+    { "resolute_stage_duration_seconds", "Wall time of each stage in the last run." },
+    { "resolute_stage_cpu_seconds", "Process CPU time during each stage in the last run." },
+    { "resolute_stage_read_bytes", "Bytes read by the process during each stage in the last run." },
+    { "resolute_stage_written_bytes", "Bytes written by the process during each stage in the last run." },
+    { "resolute_stage_peak_rss_bytes", "Peak resident memory during each stage in the last run." },
+    { "resolute_stage_seconds_total", "Wall time spent in each stage." },
+    { "resolute_stage_read_bytes_total", "Bytes read by the process during each stage." },
+    { "resolute_stage_written_bytes_total", "Bytes written by the process during each stage." },
+    { "resolute_files_indexed_total", "DICOM files indexed." },
+    { "resolute_registration_iterations_total", "Registration iterations, by backend. Scheduled maxima for the ANTs backends." },
+    { "resolute_registration_cache_requests_total", "Registration cache lookups, by result." },
+    { "resolute_registration_cache_evictions_total", "Registration cache entries evicted." },
+    { "resolute_checkpoint_requests_total", "Checkpointed stages, by stage and whether they were reused." },
+    { "resolute_log_records_dropped_total", "Log records dropped because the asynchronous log queue was full." }
+  };
+
+  auto it = help.find(name);
+  return (it == help.end()) ? std::string() : it->second;
+}
+
+inline void MetricsRegistry::Increment(const std::string &name, double delta, const LabelsType &labels){
+
+  std::lock_guard<std::mutex> lock(_mutex);
+  Family &f = _families[name];
+  f.type = "counter";
+  f.samples[labels] += delta;
+
+}
+
+inline void MetricsRegistry::Set(const std::string &name, double value, const LabelsType &labels){
+
+  std::lock_guard<std::mutex> lock(_mutex);
+  Family &f = _families[name];
+  f.type = "gauge";
+  f.samples[labels] = value;
+
+}
+
+inline double MetricsRegistry::Get(const std::string &name, const LabelsType &labels) const {
+
+  std::lock_guard<std::mutex> lock(_mutex);
+
+  auto f = _families.find(name);
+  if (f == _families.end())
+    return 0.0;
+
+  auto s = f->second.samples.find(labels);
+  return (s == f->second.samples.end()) ? 0.0 : s->second;
+}
+
+inline void MetricsRegistry::RecordRun(bool success){
+
+  const nlohmann::json timing = TimingRecorder::GetInstance().GetSummary();
+  const nlohmann::json memory = MemoryMonitor::GetInstance().GetReport();
+
+  {
+    //Stages of an earlier run that did not happen in this one are dropped.
+    std::lock_guard<std::mutex> lock(_mutex);
+    const char *const lastRun[] = {
+      "resolute_stage_duration_seconds", "resolute_stage_cpu_seconds", "resolute_stage_read_bytes",
+      "resolute_stage_written_bytes", "resolute_stage_peak_rss_bytes"
+    };
+    for (const char *name : lastRun)
+      _families.erase(name);
+  }
+
+  for (const nlohmann::json &s : timing["stages"]){
+    if (s["category"] != "stage")
+      continue;
+
+    const LabelsType stage = { { "stage", s["name"].get<std::string>() } };
+    Set("resolute_stage_duration_seconds", s["wallSeconds"].get<double>(), stage);
+    Set("resolute_stage_cpu_seconds", s["cpuSeconds"].get<double>(), stage);
+    Set("resolute_stage_read_bytes", s["readBytes"].get<double>(), stage);
+    Set("resolute_stage_written_bytes", s["writtenBytes"].get<double>(), stage);
+    Increment("resolute_stage_seconds_total", s["wallSeconds"].get<double>(), stage);
+    Increment("resolute_stage_read_bytes_total", s["readBytes"].get<double>(), stage);
+    Increment("resolute_stage_written_bytes_total", s["writtenBytes"].get<double>(), stage);
+  }
+
+  //A stage may run more than once, e.g. in a batch: keep its highest peak.
+  std::map<std::string, double> stagePeaks;
+  for (const nlohmann::json &s : memory["stages"]){
+    double &peak = stagePeaks[s["name"].get<std::string>()];
+    peak = std::max(peak, s["peakRSSBytes"].get<double>());
+  }
+  for (const auto &p : stagePeaks)
+    Set("resolute_stage_peak_rss_bytes", p.second, { { "stage", p.first } });
+
+  Set("resolute_peak_rss_bytes", memory["processPeakRSSBytes"].get<double>());
+  Set("resolute_last_run_duration_seconds", timing["totalWallSeconds"].get<double>());
+  Set("resolute_last_run_timestamp_seconds", static_cast<double>(std::time(0)));
+  Increment("resolute_runs_total", 1.0, { { "result", success ? "success" : "failure" } });
+
+}
+
+//Label values escaped as the text format requires.
+inline std::string EscapeLabelValue(const std::string &value){
+
+  std::string escaped;
+  for (char c : value){
+    if (c == '\\' || c == '"')
+      escaped += '\\';
+    if (c == '\n')
+      escaped += "\\n";
+    else
+      escaped += c;
+  }
+  return escaped;
+}
+
+inline std::string MetricsRegistry::GetText() const {
+
+  std::lock_guard<std::mutex> lock(_mutex);
+
+  std::ostringstream os;
+  os << std::setprecision(15);
+
+  for (const auto &f : _families){
+    const std::string help = GetHelp(f.first);
+    if (!help.empty())
+      os << "# HELP " << f.first << " " << help << "\n";
+    os << "# TYPE " << f.first << " " << f.second.type << "\n";
+
+    for (const auto &s : f.second.samples){
+      os << f.first;
+      if (!s.first.empty()){
+        os << "{";
+        bool first = true;
+        for (const auto &l : s.first){
+          os << (first ? "" : ",") << l.first << "=\"" << EscapeLabelValue(l.second) << "\"";
+          first = false;
+        }
+        os << "}";
+      }
+      os << " " << s.second << "\n";
+    }
+  }
+
+  return os.str();
+}
+
+inline void MetricsRegistry::WriteTextfile(const boost::filesystem::path &dst) const {
+
+  boost::filesystem::path tmp = dst;
+  tmp += "." + std::to_string(getpid()) + ".tmp";
+
+  {
+    std::ofstream ofs(tmp.string());
+    ofs << GetText();
+
+    if (!ofs.good()){
+      LOG(WARNING) << "Could not write metrics to " << tmp;
+      return;
+    }
+  }
+
+  boost::system::error_code ec;
+  boost::filesystem::rename(tmp, dst, ec);
+
+  if (ec){
+    LOG(WARNING) << "Could not write metrics to " << dst << ": " << ec.message();
+    boost::filesystem::remove(tmp, ec);
+    return;
+  }
+
+  DLOG(INFO) << "Metrics written to " << dst;
+
+}
+
+}// namespace mon
+
+#endif
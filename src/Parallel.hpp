@@ -0,0 +1,107 @@
+/*
+   Parallel.hpp
+
+   Author:      Benjamin A. Thomas
+
+   Copyright 2018 Institute of Nuclear Medicine, University College London.
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+
+ */
+
+#pragma once
+
+#ifndef _PARALLEL_HPP_
+#define _PARALLEL_HPP_
+
+#include <algorithm>
+#include <atomic>
+#include <exception>
+#include <thread>
+#include <vector>
+
+namespace ns {
+
+namespace detail {
+
+inline std::atomic<unsigned int> &WorkerThreadOverride(){
+  static std::atomic<unsigned int> n(0);
+  return n;
+}
+
+}// namespace detail
+
+//Caps the threads used by ParallelFor. 0 restores the hardware default.
+inline void SetNumberOfWorkerThreads(unsigned int n){
+  detail::WorkerThreadOverride().store(n);
+}
+
+inline unsigned int GetNumberOfWorkerThreads(){
+
+  const unsigned int user = detail::WorkerThreadOverride().load();
+  if (user > 0)
+    return user;
+
+  const unsigned int n = std::thread::hardware_concurrency();
+  return (n > 0) ? n : 1;
+
+}
+
+//Splits [begin, end) into contiguous chunks and calls fn(first, last) for
+//each chunk on its own thread. The first exception thrown is rethrown
+//once every thread has finished.
+template <typename TFunction>
+void ParallelFor(std::size_t begin, std::size_t end, TFunction fn, unsigned int threads = 0){
+
+  if (end <= begin)
+    return;
+
+  if (threads == 0)
+    threads = GetNumberOfWorkerThreads();
+
+  const std::size_t total = end - begin;
+  const std::size_t nChunks = std::min<std::size_t>(threads, total);
+
+  if (nChunks <= 1){
+    fn(begin, end);
+    return;
+  }
+
+  std::vector<std::thread> workers;
+  std::vector<std::exception_ptr> errors(nChunks);
+
+  for (std::size_t c = 0; c < nChunks; ++c){
+    const std::size_t first = begin + (total * c) / nChunks;
+    const std::size_t last = begin + (total * (c + 1)) / nChunks;
+
+    workers.push_back(std::thread([&fn, &errors, c, first, last](){
+      try {
+        fn(first, last);
+      } catch (...){
+        errors[c] = std::current_exception();
+      }
+    }));
+  }
+
+  for (auto &w : workers)
+    w.join();
+
+  for (auto &e : errors){
+    if (e)
+      std::rethrow_exception(e);
+  }
+
+}
+
+}// namespace ns
+
+#endif
@@ -49,7 +49,7 @@ namespace ns {
     std::string regArgs;
   };
 
-  void to_json(nlohmann::json &j, const params &p){
+  inline void to_json(nlohmann::json &j, const params &p){
 
     j=nlohmann::json{ 
         {"version", p.version},
@@ -71,7 +71,7 @@ namespace ns {
     };
   }
 
-  void from_json(const nlohmann::json &j, params &p){
+  inline void from_json(const nlohmann::json &j, params &p){
     //LOG(INFO) << j.dump(4);
     p.version = j.at("version").get<std::string>();
     p.destFileType = j.at("destFileType").get<std::string>();
@@ -111,7 +111,7 @@ namespace ns {
     //"--verbose 0 --dimensionality 3 --float 1 --collapse-output-transforms 1 --output [<%%PREFIX%%>,<%%WARPEDIMG%%>,<%%INVWARPEDIMG%%>] --interpolation Linear --use-histogram-matching 0 --winsorize-image-intensities [0.005,0.995] --initial-moving-transform [<%%REF%%>,<%%FLOAT%%>,1] --transform Affine[0.1] --metric MI[<%%REF%%>,<%%FLOAT%%>,1,32,Regular,0.25] --convergence [1000x500x250x100,1e-6,10] --shrink-factors 8x4x2x1 --smoothing-sigmas 3x2x1x0vox --transform SyN[0.5,3,0] --metric CC[<%%REF%%>,<%%FLOAT%%>,1,4] --convergence [10x5x2,1e-6,10] --shrink-factors 4x2x1 --smoothing-sigmas 2x1x0mm",
   };
 
-bool ValidateJSON(const nlohmann::json j){
+inline bool ValidateJSON(const nlohmann::json j){
 
   ns::params pr;
 
@@ -170,7 +170,7 @@ bool ValidateJSON(const nlohmann::json j){
   return true;
 }
 
-void WriteJSONSkeleton(const boost::filesystem::path &outFile){
+inline void WriteJSONSkeleton(const boost::filesystem::path &outFile){
   //Write an initial JSON parameter file to outFile.
 
   DLOG(ERROR) << "outFile = " << outFile;
@@ -0,0 +1,74 @@
+/*
+   Preview.hpp
+
+   Author:      Benjamin A. Thomas
+
+   Copyright 2018 Institute of Nuclear Medicine, University College London.
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+
+ */
+
+#pragma once
+
+#ifndef _PREVIEW_HPP_
+#define _PREVIEW_HPP_
+
+#include <itkBinShrinkImageFilter.h>
+#include <itkNearestNeighborInterpolateImageFunction.h>
+#include <itkResampleImageFilter.h>
+
+/*
+  Grid changes for the preview mu-map: the inputs are shrunk by an integer
+  factor, and the region decisions made on the shrunk grid are copied back
+  onto the full resolution grid.
+*/
+
+namespace ns {
+
+//Shrinks img by factor along each axis, averaging each bin.
+template< typename TImage >
+typename TImage::Pointer ShrinkImage(const TImage *img, unsigned int factor){
+
+  typedef itk::BinShrinkImageFilter<TImage, TImage> ShrinkFilterType;
+  typename ShrinkFilterType::Pointer shrink = ShrinkFilterType::New();
+  shrink->SetInput(img);
+  shrink->SetShrinkFactors(factor);
+  shrink->Update();
+
+  typename TImage::Pointer output = shrink->GetOutput();
+  output->DisconnectPipeline();
+  return output;
+}
+
+//Resamples the decision map onto the grid of reference. The map is
+//piecewise constant (one mu per region), so nearest neighbour keeps every
+//voxel at a value that one of the regions assigned.
+template< typename TImage >
+typename TImage::Pointer UpsampleDecisions(const TImage *decisions, const TImage *reference){
+
+  typedef itk::ResampleImageFilter<TImage, TImage> ResampleFilterType;
+  typename ResampleFilterType::Pointer resampler = ResampleFilterType::New();
+  resampler->SetInput(decisions);
+  resampler->SetInterpolator(itk::NearestNeighborInterpolateImageFunction<TImage, double>::New());
+  resampler->SetOutputParametersFromImage(reference);
+  resampler->SetDefaultPixelValue(0);
+  resampler->Update();
+
+  typename TImage::Pointer output = resampler->GetOutput();
+  output->DisconnectPipeline();
+  return output;
+}
+
+}// namespace ns
+
+#endif
@@ -0,0 +1,459 @@
+/*
+   RegistrationBackend.hpp
+
+   Author:      Benjamin A. Thomas
+
+   Copyright 2018 Institute of Nuclear Medicine, University College London.
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+
+ */
+
+#pragma once
+
+#ifndef _REGISTRATIONBACKEND_HPP_
+#define _REGISTRATIONBACKEND_HPP_
+
+#include <boost/filesystem.hpp>
+#include <boost/algorithm/string/classification.hpp>
+#include <boost/algorithm/string/replace.hpp>
+#include <boost/algorithm/string/split.hpp>
+#include <boost/algorithm/string/regex.hpp>
+#include <boost/regex.hpp>
+#include <glog/logging.h>
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <itkCompositeTransform.h>
+#include <itkDisplacementFieldTransform.h>
+#include <itkImageFileReader.h>
+#include <itkImageFileWriter.h>
+#include <itkMatrixOffsetTransformBase.h>
+#include <itkTransformFactory.h>
+#include <itkTransformFileReader.h>
+#include <itkTransformFileWriter.h>
+
+#include "StageTimer.hpp"
+#include "Metrics.hpp"
+#include "RegistrationCache.hpp"
+
+/*
+  Registration of the floating image (UTE2) to the reference image (T1
+  template), selected by regName. Every backend leaves the same files
+  behind, in the ANTS convention, so that the checkpoints and the cache do
+  not depend on the backend:
+
+    <prefix>Affine.txt          reference -> floating points (required)
+    <prefix>Warp.nii.gz         (optional)
+    <prefix>InverseWarp.nii.gz  applied to floating points before the
+                                inverse affine (absent if affine-only)
+
+  and they are read back into the same in-memory Transforms.
+*/
+
+namespace reg {
+
+typedef itk::MatrixOffsetTransformBase<double, 3, 3> AffineTransformType;
+typedef itk::DisplacementFieldTransform<double, 3> DisplacementTransformType;
+typedef DisplacementTransformType::DisplacementFieldType DisplacementFieldType;
+typedef itk::CompositeTransform<double, 3> CompositeTransformType;
+
+struct Transforms {
+  AffineTransformType::Pointer affine;
+  DisplacementFieldType::Pointer inverseWarp;
+
+  //Floating -> reference points, i.e. for resampling template images
+  //onto the floating grid. Equivalent to antsApplyTransforms
+  //-t [Affine.txt,1] -t InverseWarp.nii.gz.
+  CompositeTransformType::Pointer GetInverse() const;
+};
+
+inline CompositeTransformType::Pointer Transforms::GetInverse() const {
+
+  AffineTransformType::Pointer inverseAffine = AffineTransformType::New();
+  if (!affine || !affine->GetInverse(inverseAffine)){
+    LOG(ERROR) << "Cannot invert affine transform.";
+    itk::ExceptionObject ex;
+    throw(ex);
+  }
+
+  //The last transform added is applied first.
+  CompositeTransformType::Pointer inverse = CompositeTransformType::New();
+  inverse->AddTransform(inverseAffine);
+
+  if (inverseWarp){
+    DisplacementTransformType::Pointer warp = DisplacementTransformType::New();
+    warp->SetDisplacementField(inverseWarp);
+    inverse->AddTransform(warp);
+  }
+
+  return inverse;
+}
+
+//Reads prefix + Affine.txt and, if present, prefix + InverseWarp.nii.gz.
+inline Transforms LoadTransforms(const boost::filesystem::path &prefix){
+
+  boost::filesystem::path affFile = prefix;
+  affFile += "Affine.txt";
+
+  boost::filesystem::path warpFile = prefix;
+  warpFile += "InverseWarp.nii.gz";
+
+  itk::TransformFactory<AffineTransformType>::RegisterTransform();
+
+  Transforms t;
+
+  itk::TransformFileReader::Pointer affReader = itk::TransformFileReader::New();
+  affReader->SetFileName(affFile.string());
+  affReader->Update();
+
+  //Any affine type (MatrixOffsetTransformBase, AffineTransform, ...) will do.
+  const AffineTransformType *affine =
+    dynamic_cast<const AffineTransformType *>(affReader->GetTransformList()->front().GetPointer());
+
+  if (affine == nullptr){
+    LOG(ERROR) << "No affine transform in " << affFile;
+    itk::ExceptionObject ex;
+    throw(ex);
+  }
+
+  t.affine = AffineTransformType::New();
+  t.affine->SetFixedParameters(affine->GetFixedParameters());
+  t.affine->SetParameters(affine->GetParameters());
+
+  if (boost::filesystem::exists(warpFile)){
+    typedef itk::ImageFileReader<DisplacementFieldType> FieldReaderType;
+    FieldReaderType::Pointer fieldReader = FieldReaderType::New();
+    fieldReader->SetFileName(warpFile.string());
+    fieldReader->Update();
+    t.inverseWarp = fieldReader->GetOutput();
+    t.inverseWarp->DisconnectPipeline();
+  }
+
+  return t;
+}
+
+//Writes affine to prefix + Affine.txt and, if given, inverseWarp to
+//prefix + InverseWarp.nii.gz.
+template <typename TField>
+void SaveTransforms(const itk::TransformBase *affine, const TField *inverseWarp,
+  const boost::filesystem::path &prefix){
+
+  boost::filesystem::path affFile = prefix;
+  affFile += "Affine.txt";
+
+  itk::TransformFileWriter::Pointer affWriter = itk::TransformFileWriter::New();
+  affWriter->SetFileName(affFile.string());
+  affWriter->SetInput(affine);
+  affWriter->Update();
+
+  if (inverseWarp){
+    boost::filesystem::path warpFile = prefix;
+    warpFile += "InverseWarp.nii.gz";
+
+    typedef itk::ImageFileWriter<TField> FieldWriterType;
+    typename FieldWriterType::Pointer fieldWriter = FieldWriterType::New();
+    fieldWriter->SetFileName(warpFile.string());
+    fieldWriter->SetInput(inverseWarp);
+    fieldWriter->Update();
+  }
+}
+
+//args with a metric mask: "-x <%%MASK%%>" is appended unless they already
+//place <%%MASK%%>. ANTS, antsRegistration and demons all take -x as a
+//reference (template) space mask.
+inline std::string AddMaskArgument(const std::string &args){
+
+  if (args.find("<%%MASK%%>") != std::string::npos)
+    return args;
+
+  return args + " -x <%%MASK%%>";
+}
+
+template <class TImage>
+class RegistrationBackend
+{
+
+public:
+  typedef TImage ImageType;
+
+  virtual ~RegistrationBackend(){};
+
+  //The regName that selects this backend.
+  virtual std::string GetName() const = 0;
+  //Used when regArgs is empty, and with regTiered for the first tier.
+  virtual std::string GetDefaultArgs() const = 0;
+  virtual std::string GetDefaultAffineArgs() const = 0;
+
+  //Arguments with <%%REF%%>, <%%FLOAT%%>, <%%PREFIX%%> and <%%MASK%%>
+  //placeholders. Empty uses GetDefaultArgs().
+  void SetParams(const std::string &args){ _argList = args; };
+  void SetOutputDirectory(const boost::filesystem::path outDir);
+  void SetOutputPrefix(const std::string &s){ _prefix = s; };
+  void SetReferenceFileName(const boost::filesystem::path refFileName);
+  void SetFloatingFileName(const boost::filesystem::path floatFileName);
+  //Substituted for <%%MASK%%>, e.g. -x <%%MASK%%> for a reference image mask.
+  void SetMaskFileName(const boost::filesystem::path &maskFileName){ _maskFileName = maskFileName; };
+
+  //Results are looked up here before registering, and stored after.
+  void SetCache(const std::shared_ptr<RegistrationCache> &cache){ _cache = cache; };
+
+  void Update();
+
+  //The result of Update(), read back from the output directory.
+  Transforms GetTransforms() const { return LoadTransforms(_outDir / _prefix); };
+
+protected:
+
+  RegistrationBackend(){};
+
+  //Registers with _argList (<%%MASK%%> already filled in) and writes
+  //the results to fullPrefix as described above.
+  virtual void Register(const boost::filesystem::path &fullPrefix) = 0;
+
+  void InsertParam(const std::string &key, const std::string &info);
+  //The arguments split on spaces, without empty ones.
+  std::vector<std::string> SplitArgs() const;
+  //Total of an iteration schedule, e.g. 175 for "100x50x25" or
+  //"[100x50x25,1e-6,10]".
+  static uint64_t SumSchedule(const std::string &schedule);
+  typename TImage::Pointer ReadImage(const boost::filesystem::path &src);
+
+  std::string _prefix;
+  boost::filesystem::path _outDir;
+  boost::filesystem::path _refFileName;
+  boost::filesystem::path _floatFileName;
+  boost::filesystem::path _maskFileName;
+
+  std::string _argList;
+
+  //Set by Register() for the metrics: iterations run, or scheduled.
+  uint64_t _iterations = 0;
+
+  std::shared_ptr<RegistrationCache> _cache;
+
+private:
+
+  RegistrationBackend(const RegistrationBackend &); //purposely not implemented
+  void operator=(const RegistrationBackend &);  //purposely not implemented
+
+};
+
+template <typename TImage>
+void RegistrationBackend<TImage>::SetOutputDirectory(const boost::filesystem::path outDir){
+
+  if ( boost::filesystem::exists(outDir) ){
+    if (!boost::filesystem::is_directory(outDir)){
+      LOG(ERROR) << "Output directory: " << outDir << "does not appear to be a directory!";
+      throw(false);
+    }
+  } else {
+    try {
+      boost::filesystem::create_directories(outDir);
+    } catch (const boost::filesystem::filesystem_error &e){
+      LOG(ERROR) << "Cannot create output folder : " << outDir;
+      throw(false);
+    }
+  }
+
+  _outDir = outDir;
+
+}
+
+template <typename TImage>
+void RegistrationBackend<TImage>::SetReferenceFileName(const boost::filesystem::path refFileName){
+
+  try {
+    if (!boost::filesystem::is_regular_file(refFileName)){
+      LOG(ERROR) << "Cannot find reference image file : " << refFileName;
+      throw(false);
+    }
+  } catch (const boost::filesystem::filesystem_error &e){
+      LOG(ERROR) << "File system error reading : " << refFileName;
+      throw(false);
+    }
+
+  _refFileName = refFileName;
+
+}
+
+template <typename TImage>
+void RegistrationBackend<TImage>::SetFloatingFileName(const boost::filesystem::path floatFileName){
+
+  try {
+    if (!boost::filesystem::is_regular_file(floatFileName)){
+      LOG(ERROR) << "Cannot find floating image file : " << floatFileName;
+      throw(false);
+    }
+  } catch (const boost::filesystem::filesystem_error &e){
+      LOG(ERROR) << "File system error reading : " << floatFileName;
+      throw(false);
+    }
+
+  _floatFileName = floatFileName;
+
+}
+
+template <typename TImage>
+void RegistrationBackend<TImage>::InsertParam(const std::string &key, const std::string &info){
+
+  std::string target = "<%%" + key + "%%>";
+  std::string::size_type n = _argList.find(target);
+
+  if (n == std::string::npos){
+    LOG(WARNING) << "Replacement key: " << target << " not found!";
+  }
+
+  boost::replace_all(_argList, target, info);
+}
+
+template <typename TImage>
+std::vector<std::string> RegistrationBackend<TImage>::SplitArgs() const {
+
+  std::vector<std::string> args;
+  boost::split_regex( args, _argList, boost::regex( " " ) ) ;
+
+  std::vector<std::string> finalArgs;
+
+  int x=1;
+  for (auto a : args){
+    if (a != "") {
+      finalArgs.push_back(a);
+      DLOG(INFO) << x << "\t\t" << a;
+      x++;
+    }
+  }
+
+  return finalArgs;
+}
+
+template <typename TImage>
+uint64_t RegistrationBackend<TImage>::SumSchedule(const std::string &schedule){
+
+  const std::size_t first = schedule.find_first_not_of('[');
+  if (first == std::string::npos)
+    return 0;
+
+  std::vector<std::string> levels;
+  boost::split(levels, schedule.substr(first, schedule.find_first_of(",]", first) - first), boost::is_any_of("x"));
+
+  uint64_t total = 0;
+  for (const std::string &l : levels){
+    try {
+      total += std::stoull(l);
+    } catch (const std::logic_error &){
+      return 0;
+    }
+  }
+
+  return total;
+}
+
+template <typename TImage>
+typename TImage::Pointer RegistrationBackend<TImage>::ReadImage(const boost::filesystem::path &src){
+
+  typedef typename itk::ImageFileReader<TImage> ReaderType;
+  typename ReaderType::Pointer reader = ReaderType::New();
+
+  try {
+    reader->SetFileName( src.string() );
+    reader->Update();
+  }
+  catch (itk::ExceptionObject &ex)
+  {
+    LOG(ERROR) << ex;
+    LOG(ERROR) << "Unable to read image " << src;
+    throw false;
+  }
+
+  return reader->GetOutput();
+}
+
+template <typename TImage>
+void RegistrationBackend<TImage>::Update(){
+
+  boost::filesystem::path fullPrefix = _outDir;
+  fullPrefix /= _prefix;
+
+  //An earlier run's warp would otherwise be loaded with an affine-only
+  //result, whether fetched or registered.
+  RemoveRegistrationFiles(fullPrefix);
+
+  if (_argList.empty()){
+    LOG(WARNING) << "No registration parameters set. Using defaults!";
+    _argList = GetDefaultArgs();
+  }
+
+  //Keyed on the argument template, before the output paths are filled in.
+  std::string cacheKey;
+
+  if (_cache){
+    mon::ScopedTimer timer("Registration cache lookup", "registration");
+
+    //Legacy ANTS keys are unchanged, so existing caches stay valid.
+    std::string keyArgs = _argList;
+    if (GetName() != "ANTS")
+      keyArgs = GetName() + " " + keyArgs;
+    if (!_maskFileName.empty()){
+      ck::Hasher mask;
+      mask.AddImage(ReadImage(_maskFileName).GetPointer());
+      keyArgs += " " + mask.GetHex();
+    }
+    cacheKey = RegistrationCache::MakeKey<TImage>(
+      ReadImage(_floatFileName).GetPointer(), ReadImage(_refFileName).GetPointer(), keyArgs);
+
+    if (_cache->Fetch(cacheKey, fullPrefix)){
+      mon::MetricsRegistry::GetInstance().Increment("resolute_registration_cache_requests_total", 1.0, { { "result", "hit" } });
+      const RegistrationCache::Statistics s = _cache->GetStatistics();
+      LOG(INFO) << "Registration cache hit " << cacheKey << " (" << s.hits << " hits, "
+                << s.misses << " misses so far).";
+      return;
+    }
+
+    mon::MetricsRegistry::GetInstance().Increment("resolute_registration_cache_requests_total", 1.0, { { "result", "miss" } });
+    LOG(INFO) << "Registration cache miss " << cacheKey;
+  }
+
+  if (!_maskFileName.empty())
+    InsertParam("MASK", _maskFileName.string());
+
+  LOG(INFO) << "Registration backend: " << GetName();
+
+  _iterations = 0;
+
+  {
+    mon::ScopedTimer timer(GetName() + " registration", "registration");
+    Register(fullPrefix);
+  }
+
+  mon::MetricsRegistry::GetInstance().Increment("resolute_registration_iterations_total",
+    static_cast<double>(_iterations), { { "backend", GetName() } });
+
+  LOG(INFO) << "Registration complete!";
+
+  if (_cache){
+    _cache->Store(cacheKey, fullPrefix);
+
+    const RegistrationCache::Statistics s = _cache->GetStatistics();
+    LOG(INFO) << "Registration cache: " << s.entries << " entries, " << s.bytes / (1024 * 1024) << " MB, "
+              << s.hits << " hits, " << s.misses << " misses, " << s.evictions << " evictions.";
+  }
+
+}
+
+} //namespace reg
+
+
+#endif
@@ -0,0 +1,514 @@
+/*
+   RegistrationCache.hpp
+
+   Author:      Benjamin A. Thomas
+
+   Copyright 2018 Institute of Nuclear Medicine, University College London.
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+
+ */
+
+#pragma once
+
+#ifndef _REGISTRATIONCACHE_HPP_
+#define _REGISTRATIONCACHE_HPP_
+
+#include <boost/filesystem.hpp>
+#include <glog/logging.h>
+#include <nlohmann/json.hpp>
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <fstream>
+#include <limits>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <itkImage.h>
+#include <itkImageFileReader.h>
+#include <itkImageFileWriter.h>
+#include <itkImageRegionConstIterator.h>
+#include <itkImageRegionIterator.h>
+#include <itkVector.h>
+
+#include "Checkpoint.hpp"
+#include "Metrics.hpp"
+
+/*
+  Content-addressed cache of registration results, shared by every study
+  and process that points at the same directory. An entry is keyed by the
+  floating and reference images and the registration arguments. It holds
+  the affine transform as written, and the displacement fields packed as
+  16-bit integers with one scale factor per field (error below half a
+  step, i.e. max |displacement| / 65534). The least recently used entries
+  are evicted once the cache exceeds its size limit.
+*/
+
+namespace reg {
+
+class RegistrationCache {
+
+public:
+
+  struct Statistics {
+    uint64_t hits, misses, stores, evictions;
+    uint64_t entries;
+    uintmax_t bytes;
+  };
+
+  RegistrationCache(const boost::filesystem::path &root, uintmax_t maxBytes);
+
+  //Key of a registration. args should be the argument template, before
+  //any output paths are substituted into it.
+  template< typename TImage >
+  static std::string MakeKey(const TImage *floating, const TImage *reference, const std::string &args);
+
+  //Writes a cached result to prefix + Affine.txt etc. and returns true,
+  //or returns false on a miss. Either way, any earlier files at prefix
+  //are removed first.
+  bool Fetch(const std::string &key, const boost::filesystem::path &prefix);
+
+  //Adds the result found at prefix, then evicts down to the size limit.
+  void Store(const std::string &key, const boost::filesystem::path &prefix);
+
+  //Totals over every process that has used this cache.
+  Statistics GetStatistics();
+
+protected:
+
+  typedef itk::Image< itk::Vector<float, 3>, 3 > FieldType;
+  typedef itk::Image< itk::Vector<short, 3>, 3 > PackedFieldType;
+
+  void Evict();
+  void Count(uint64_t hits, uint64_t misses, uint64_t stores, uint64_t evictions);
+
+  static double PackField(const boost::filesystem::path &src, const boost::filesystem::path &dst);
+  static void UnpackField(const boost::filesystem::path &src, double scale, const boost::filesystem::path &dst);
+
+  static uintmax_t GetDirectorySize(const boost::filesystem::path &dir);
+  static int64_t Now();
+
+  boost::filesystem::path _root;
+  uintmax_t _maxBytes;
+
+  RegistrationCache(const RegistrationCache &); //purposely not implemented
+  void operator=(const RegistrationCache &);  //purposely not implemented
+
+};
+
+//Files ANTS writes after the output prefix, and whether each is a field.
+inline const std::vector< std::pair<std::string, bool> > &GetCachedRegistrationFiles(){
+
+  static const std::vector< std::pair<std::string, bool> > files = {
+    { "Affine.txt", false },
+    { "Warp.nii.gz", true },
+    { "InverseWarp.nii.gz", true }
+  };
+  return files;
+}
+
+inline RegistrationCache::RegistrationCache(const boost::filesystem::path &root, uintmax_t maxBytes)
+  : _root(root), _maxBytes(maxBytes) {
+
+  try {
+    boost::filesystem::create_directories(_root);
+  } catch (const boost::filesystem::filesystem_error &e){
+    LOG(ERROR) << "Cannot create registration cache: " << _root;
+    throw false;
+  }
+
+}
+
+//For least recently used ordering; seconds are too coarse.
+inline int64_t RegistrationCache::Now(){
+
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+    std::chrono::system_clock::now().time_since_epoch()).count();
+}
+
+template< typename TImage >
+std::string RegistrationCache::MakeKey(const TImage *floating, const TImage *reference, const std::string &args){
+
+  ck::Hasher h;
+  h.AddImage(floating);
+  h.AddImage(reference);
+  h.Add(args);
+  return h.GetHex();
+}
+
+inline uintmax_t RegistrationCache::GetDirectorySize(const boost::filesystem::path &dir){
+
+  uintmax_t bytes = 0;
+  boost::system::error_code ec;
+
+  for (boost::filesystem::directory_iterator it(dir, ec), end; it != end; it.increment(ec)){
+    if (ec)
+      break;
+    if (boost::filesystem::is_regular_file(it->path()))
+      bytes += boost::filesystem::file_size(it->path(), ec);
+  }
+
+  return bytes;
+}
+
+//Quantises a displacement field to 16 bits. Returns the scale (mm/step).
+inline double RegistrationCache::PackField(const boost::filesystem::path &src, const boost::filesystem::path &dst){
+
+  typedef itk::ImageFileReader<FieldType> ReaderType;
+  ReaderType::Pointer reader = ReaderType::New();
+  reader->SetFileName(src.string());
+  reader->Update();
+
+  const FieldType *field = reader->GetOutput();
+  const FieldType::RegionType region = field->GetLargestPossibleRegion();
+
+  double maxAbs = 0.0;
+  for (itk::ImageRegionConstIterator<FieldType> it(field, region); !it.IsAtEnd(); ++it)
+    for (unsigned int d = 0; d < 3; ++d)
+      maxAbs = std::max(maxAbs, std::fabs(static_cast<double>(it.Get()[d])));
+
+  const double scale = (maxAbs > 0) ? maxAbs / std::numeric_limits<short>::max() : 1.0;
+
+  PackedFieldType::Pointer packed = PackedFieldType::New();
+  packed->CopyInformation(field);
+  packed->SetRegions(region);
+  packed->Allocate();
+
+  itk::ImageRegionConstIterator<FieldType> inIt(field, region);
+  itk::ImageRegionIterator<PackedFieldType> outIt(packed, region);
+
+  for (; !inIt.IsAtEnd(); ++inIt, ++outIt){
+    PackedFieldType::PixelType v;
+    for (unsigned int d = 0; d < 3; ++d)
+      v[d] = static_cast<short>(std::lround(inIt.Get()[d] / scale));
+    outIt.Set(v);
+  }
+
+  typedef itk::ImageFileWriter<PackedFieldType> WriterType;
+  WriterType::Pointer writer = WriterType::New();
+  writer->SetFileName(dst.string());
+  writer->SetInput(packed);
+  writer->Update();
+
+  return scale;
+}
+
+inline void RegistrationCache::UnpackField(const boost::filesystem::path &src, double scale, const boost::filesystem::path &dst){
+
+  typedef itk::ImageFileReader<PackedFieldType> ReaderType;
+  ReaderType::Pointer reader = ReaderType::New();
+  reader->SetFileName(src.string());
+  reader->Update();
+
+  const PackedFieldType *packed = reader->GetOutput();
+  const PackedFieldType::RegionType region = packed->GetLargestPossibleRegion();
+
+  FieldType::Pointer field = FieldType::New();
+  field->CopyInformation(packed);
+  field->SetRegions(region);
+  field->Allocate();
+
+  itk::ImageRegionConstIterator<PackedFieldType> inIt(packed, region);
+  itk::ImageRegionIterator<FieldType> outIt(field, region);
+
+  for (; !inIt.IsAtEnd(); ++inIt, ++outIt){
+    FieldType::PixelType v;
+    for (unsigned int d = 0; d < 3; ++d)
+      v[d] = static_cast<float>(inIt.Get()[d] * scale);
+    outIt.Set(v);
+  }
+
+  typedef itk::ImageFileWriter<FieldType> WriterType;
+  WriterType::Pointer writer = WriterType::New();
+  writer->SetFileName(dst.string());
+  writer->SetInput(field);
+  writer->Update();
+
+}
+
+//Removes whatever a previous run left at prefix, so a partial fetch can
+//never be mixed with stale files.
+inline void RemoveRegistrationFiles(const boost::filesystem::path &prefix){
+
+  boost::system::error_code ec;
+  for (const auto &f : GetCachedRegistrationFiles()){
+    boost::filesystem::path dst = prefix;
+    dst += f.first;
+    boost::filesystem::remove(dst, ec);
+  }
+
+}
+
+//The entry is validated and hard linked into a private folder with the
+//lock held. The slow unpacking then runs without it, so other studies can
+//use the cache meanwhile, and eviction cannot remove the files under it.
+inline bool RegistrationCache::Fetch(const std::string &key, const boost::filesystem::path &prefix){
+
+  RemoveRegistrationFiles(prefix);
+
+  const boost::filesystem::path entry = _root / key;
+  const boost::filesystem::path manifestPath = entry / "entry.json";
+  const boost::filesystem::path pinned = _root / boost::filesystem::unique_path(".fetch-%%%%-%%%%-%%%%");
+
+  nlohmann::json manifest;
+  bool bReadable = true;
+
+  {
+    ck::FileLock lock(_root / ".lock");
+
+    if (!boost::filesystem::exists(manifestPath)){
+      Count(0, 1, 0, 0);
+      return false;
+    }
+
+    try {
+      std::ifstream ifs(manifestPath.string());
+      manifest = nlohmann::json::parse(ifs);
+
+      boost::filesystem::create_directories(pinned);
+      for (const auto &f : GetCachedRegistrationFiles()){
+        const boost::filesystem::path src = entry / f.first;
+        if (!boost::filesystem::exists(src))
+          continue;
+
+        boost::system::error_code ec;
+        boost::filesystem::create_hard_link(src, pinned / f.first, ec);
+        if (ec)
+          boost::filesystem::copy_file(src, pinned / f.first);
+      }
+
+      //Last use, for eviction.
+      manifest["lastUsed"] = Now();
+      std::ofstream ofs(manifestPath.string());
+      ofs << manifest.dump(2) << std::endl;
+    } catch (...) {
+      bReadable = false;
+    }
+  }
+
+  try {
+    for (const auto &f : GetCachedRegistrationFiles()){
+      const boost::filesystem::path src = pinned / f.first;
+      if (!bReadable || !boost::filesystem::exists(src))
+        continue;
+
+      boost::filesystem::path dst = prefix;
+      dst += f.first;
+
+      if (f.second)
+        UnpackField(src, manifest.at("scales").at(f.first).get<double>(), dst);
+      else
+        boost::filesystem::copy_file(src, dst);
+    }
+  } catch (...) {
+    bReadable = false;
+  }
+
+  boost::system::error_code ec;
+  boost::filesystem::remove_all(pinned, ec);
+
+  ck::FileLock lock(_root / ".lock");
+
+  if (!bReadable){
+    LOG(WARNING) << "Registration cache: entry " << key << " is unreadable, discarding it.";
+    RemoveRegistrationFiles(prefix);
+    boost::filesystem::remove_all(entry, ec);
+    Count(0, 1, 0, 0);
+    return false;
+  }
+
+  Count(1, 0, 0, 0);
+  return true;
+}
+
+inline void RegistrationCache::Store(const std::string &key, const boost::filesystem::path &prefix){
+
+  //Packed into a private folder first, then renamed into place, so that
+  //other processes never see a partial entry.
+  const boost::filesystem::path tmp = _root / boost::filesystem::unique_path(".tmp-%%%%-%%%%-%%%%");
+  nlohmann::json manifest;
+  manifest["key"] = key;
+  manifest["scales"] = nlohmann::json::object();
+  manifest["lastUsed"] = Now();
+
+  try {
+    boost::filesystem::create_directories(tmp);
+
+    boost::filesystem::path affine = prefix;
+    affine += "Affine.txt";
+    if (!boost::filesystem::exists(affine)){
+      LOG(WARNING) << "Registration cache: no result at " << prefix << ", not storing.";
+      boost::filesystem::remove_all(tmp);
+      return;
+    }
+
+    for (const auto &f : GetCachedRegistrationFiles()){
+      boost::filesystem::path src = prefix;
+      src += f.first;
+      if (!boost::filesystem::exists(src))
+        continue;
+
+      if (f.second)
+        manifest["scales"][f.first] = PackField(src, tmp / f.first);
+      else
+        boost::filesystem::copy_file(src, tmp / f.first);
+    }
+
+    std::ofstream ofs((tmp / "entry.json").string());
+    ofs << manifest.dump(2) << std::endl;
+  } catch (...) {
+    LOG(WARNING) << "Registration cache: could not store " << key;
+    boost::system::error_code ec;
+    boost::filesystem::remove_all(tmp, ec);
+    return;
+  }
+
+  ck::FileLock lock(_root / ".lock");
+
+  boost::system::error_code ec;
+  if (boost::filesystem::exists(_root / key)){
+    //Another process got there first.
+    boost::filesystem::remove_all(tmp, ec);
+    return;
+  }
+
+  boost::filesystem::rename(tmp, _root / key, ec);
+  if (ec){
+    LOG(WARNING) << "Registration cache: could not store " << key << ": " << ec.message();
+    boost::filesystem::remove_all(tmp, ec);
+    return;
+  }
+
+  Count(0, 0, 1, 0);
+  Evict();
+
+}
+
+//Called with the lock held.
+inline void RegistrationCache::Evict(){
+
+  if (_maxBytes == 0)
+    return;
+
+  struct Entry {
+    boost::filesystem::path dir;
+    int64_t lastUsed;
+    uintmax_t bytes;
+  };
+
+  std::vector<Entry> entries;
+  uintmax_t total = 0;
+  boost::system::error_code ec;
+
+  for (boost::filesystem::directory_iterator it(_root, ec), end; it != end; it.increment(ec)){
+    if (ec)
+      break;
+    const boost::filesystem::path &p = it->path();
+    if (!boost::filesystem::is_directory(p) || p.filename().string()[0] == '.')
+      continue;
+
+    Entry e;
+    e.dir = p;
+    e.lastUsed = 0;
+    try {
+      std::ifstream ifs((p / "entry.json").string());
+      e.lastUsed = nlohmann::json::parse(ifs).value("lastUsed", int64_t(0));
+    } catch (...) {}
+    e.bytes = GetDirectorySize(p);
+    total += e.bytes;
+    entries.push_back(e);
+  }
+
+  std::sort(entries.begin(), entries.end(), [](const Entry &a, const Entry &b){
+    return a.lastUsed < b.lastUsed;
+  });
+
+  uint64_t evicted = 0;
+  for (const Entry &e : entries){
+    //Always keep the most recent entry, even if it alone is over the limit.
+    if (total <= _maxBytes || &e == &entries.back())
+      break;
+    boost::filesystem::remove_all(e.dir, ec);
+    total -= e.bytes;
+    evicted++;
+  }
+
+  if (evicted > 0){
+    LOG(INFO) << "Registration cache: evicted " << evicted << " entries.";
+    Count(0, 0, 0, evicted);
+    mon::MetricsRegistry::GetInstance().Increment("resolute_registration_cache_evictions_total", evicted);
+  }
+
+}
+
+//Called with the lock held.
+inline void RegistrationCache::Count(uint64_t hits, uint64_t misses, uint64_t stores, uint64_t evictions){
+
+  const boost::filesystem::path statsPath = _root / "stats.json";
+  nlohmann::json stats = { {"hits", 0}, {"misses", 0}, {"stores", 0}, {"evictions", 0} };
+
+  try {
+    std::ifstream ifs(statsPath.string());
+    if (ifs.good())
+      stats = nlohmann::json::parse(ifs);
+  } catch (...) {
+    LOG(WARNING) << "Registration cache: resetting unreadable " << statsPath;
+  }
+
+  stats["hits"] = stats.value("hits", 0ull) + hits;
+  stats["misses"] = stats.value("misses", 0ull) + misses;
+  stats["stores"] = stats.value("stores", 0ull) + stores;
+  stats["evictions"] = stats.value("evictions", 0ull) + evictions;
+
+  std::ofstream ofs(statsPath.string());
+  ofs << stats.dump(2) << std::endl;
+
+}
+
+inline RegistrationCache::Statistics RegistrationCache::GetStatistics(){
+
+  ck::FileLock lock(_root / ".lock");
+
+  Statistics s = {0, 0, 0, 0, 0, 0};
+
+  try {
+    std::ifstream ifs((_root / "stats.json").string());
+    if (ifs.good()){
+      const nlohmann::json stats = nlohmann::json::parse(ifs);
+      s.hits = stats.value("hits", 0ull);
+      s.misses = stats.value("misses", 0ull);
+      s.stores = stats.value("stores", 0ull);
+      s.evictions = stats.value("evictions", 0ull);
+    }
+  } catch (...) {}
+
+  boost::system::error_code ec;
+  for (boost::filesystem::directory_iterator it(_root, ec), end; it != end; it.increment(ec)){
+    if (ec)
+      break;
+    const boost::filesystem::path &p = it->path();
+    if (boost::filesystem::is_directory(p) && p.filename().string()[0] != '.'){
+      s.entries++;
+      s.bytes += GetDirectorySize(p);
+    }
+  }
+
+  return s;
+}
+
+}// namespace reg
+
+#endif
@@ -0,0 +1,57 @@
+/*
+   RegistrationFactory.hpp
+
+   Author:      Benjamin A. Thomas
+
+   Copyright 2018 Institute of Nuclear Medicine, University College London.
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+
+ */
+
+#pragma once
+
+#ifndef _REGISTRATIONFACTORY_HPP_
+#define _REGISTRATIONFACTORY_HPP_
+
+#include <glog/logging.h>
+
+#include <memory>
+#include <string>
+
+#include "RegistrationBackend.hpp"
+#include "ANTsReg.hpp"
+#include "DemonsReg.hpp"
+
+namespace reg {
+
+//The backend for regName: "ANTS", "antsRegistration" or "demons".
+//Throws false for anything else.
+template <class TImage>
+std::unique_ptr<RegistrationBackend<TImage>> CreateRegistrationBackend(const std::string &name){
+
+  if (name == "ANTS")
+    return std::unique_ptr<RegistrationBackend<TImage>>(new ANTsReg<TImage>);
+
+  if (name == "antsRegistration")
+    return std::unique_ptr<RegistrationBackend<TImage>>(new ANTsRegistrationReg<TImage>);
+
+  if (name == "demons")
+    return std::unique_ptr<RegistrationBackend<TImage>>(new DemonsReg<TImage>);
+
+  LOG(ERROR) << "Unknown registration backend (regName): " << name;
+  throw false;
+}
+
+} //namespace reg
+
+#endif
@@ -24,6 +24,7 @@
 
 #include <boost/filesystem.hpp>
 #include <boost/algorithm/string/replace.hpp>
+#include <boost/algorithm/string/trim.hpp>
 #include <boost/program_options.hpp>
 #include <glog/logging.h>
 #include <nlohmann/json.hpp>
@@ -39,8 +40,27 @@
 
 #include "EnvironmentInfo.h"
 #include "ParamSkeleton.hpp"
+#include "Preview.hpp"
 #include "ExtractDicomImages.hpp"
 #include "Resolute.hpp"
+#include "MemoryMonitor.hpp"
+#include "StageTimer.hpp"
+#include "Metrics.hpp"
+#include "AsyncLog.hpp"
+#include "AllocationHooks.hpp"
+#include "WatchFolder.hpp"
+#include "BatchScheduler.hpp"
+
+#ifdef RESOLUTE_WITH_STORESCP
+#include "StoreSCP.hpp"
+#include <algorithm>
+#include <cmath>
+#include <condition_variable>
+#include <future>
+#include <mutex>
+#include <set>
+#include <thread>
+#endif
 
 namespace po = boost::program_options;
 namespace fs = boost::filesystem;
@@ -97,7 +117,9 @@ int GetDICOMImageNumber(const fs::path src){
 void CreateDICOMSeriesFromMRAC(
     const ImageType::Pointer &img, 
     const std::vector<fs::path> &originalFiles,
-    const fs::path destDir){
+    const fs::path destDir,
+    const std::string &seriesDescription = "RESOLUTE MRAC",
+    int seriesNumber = 1999){
 
   typedef itk::CastImageFilter< ImageType, OutputImageType> CastFilterType;
   CastFilterType::Pointer castFilter = CastFilterType::New();
@@ -165,6 +187,7 @@ void CreateDICOMSeriesFromMRAC(
   seriesWriter->SetFileNames( outputNames->GetFileNames() );
 
   try {
+    mon::ScopedTimer timer("Write raw slices", "export");
     LOG(INFO) << "Writing raw files to " << dstPath;
     seriesWriter->Update();
   } catch (itk::ExceptionObject & err) {
@@ -176,6 +199,8 @@ void CreateDICOMSeriesFromMRAC(
 
   std::string exec = "dcmodify";
 
+  mon::ScopedTimer timer("dcmodify", "export");
+
   for (int x=0; x < originalFiles.size(); x++){
     fs::path outFilePath = dstPath;
     outFilePath /= "mumap-";
@@ -198,7 +223,8 @@ void CreateDICOMSeriesFromMRAC(
     DLOG(INFO) << "args= " << args;
     system( args.c_str() );
 
-    args = exec + " " + "-m 0008,103E=\"RESOLUTE MRAC\"" + " -m 0020,0011=1999 -m 0020,000E=" + newSeriesUID + " -gin \"" + outFilePath.string() + "\"";
+    args = exec + " " + "-m 0008,103E=\"" + seriesDescription + "\"" + " -m 0020,0011=" + boost::lexical_cast<std::string>(seriesNumber)
+      + " -m 0020,000E=" + newSeriesUID + " -gin \"" + outFilePath.string() + "\"";
     DLOG(INFO) << "args= " << args;
     system( args.c_str() );
 
@@ -229,285 +255,967 @@ void CreateDICOMSeriesFromMRAC(
 
 }
 
-int main(int argc, char **argv)
-{
+//The three series RESOLUTE needs from one study.
+struct StudySeries {
+  std::string studyUID;
+  std::string mumapUID, ute1UID, ute2UID;
+  std::vector<fs::path> mracFiles;
+  ImageType::ConstPointer mrac, ute1, ute2;
+};
 
-  const char* APP_NAME = "resolute";
+//Looks up the mu-map and UTE series of a study.
+bool FindStudySeries(dcm::UTETree &tree, const json &paramFile, StudySeries &study){
 
-  std::string inputDirectoryPath;
-  std::string logPath;
-  std::string jsonFile;
-  std::string outputDirectory;
-  std::string prefixName;
+  if (!tree.TryFindMuMapUID(study.studyUID, paramFile["MRACSeriesName"], study.mumapUID)){
+    LOG(ERROR) << "Could not find mu-map series with description \'" << paramFile["MRACSeriesName"] << "\'";
+    return false;
+  }
 
-  //Set-up command line options
-  po::options_description desc("Options");
-  desc.add_options()
-    ("help,h", "Print help information")
-    ("version","Print version number")
-    //("verbose,v", "Be verbose")
-    ("input,i", po::value<std::string>(&inputDirectoryPath), "Input DICOMDIR")
-    ("log,l", po::value<std::string>(&logPath), "Write log file")
-    ("json,j", po::value<std::string>(&jsonFile),  "Use JSON config file")
-    ("create-json", po::value<std::string>(&jsonFile),  "Write config JSON skeleton");
+  if (!tree.TryFindUTEUID(study.studyUID, paramFile["UTE1SeriesName"], paramFile["UTE1TE"].get<std::string>(), study.ute1UID)){
+    LOG(ERROR) << "Could not find UTE1 series with description \'" << paramFile["UTE1SeriesName"] << "\' and TE = " << paramFile["UTE1TE"];
+    return false;
+  }
 
+  if (!tree.TryFindUTEUID(study.studyUID, paramFile["UTE2SeriesName"], paramFile["UTE2TE"].get<std::string>(), study.ute2UID)){
+    LOG(ERROR) << "Could not find UTE2 series with description \'" << paramFile["UTE2SeriesName"] << "\' and TE = " << paramFile["UTE2TE"];
+    return false;
+  }
+
+  LOG(INFO) << "Identified mu-map series: " << study.mumapUID;
+  LOG(INFO) << "Identified UTE series (TE = " << paramFile["UTE1TE"] << "): " << study.ute1UID;
+  LOG(INFO) << "Identified UTE series (TE = " << paramFile["UTE2TE"] << "): " << study.ute2UID;
+
+  return true;
+}
+
+ImageType::ConstPointer ReadSeries(std::vector<fs::path> fileNames, const std::string &name){
+
+  dcm::ReadDicomSeries<ImageType> reader(fileNames);
 
-  //Evaluate command line options
-  po::variables_map vm;
   try {
-    po::store(po::parse_command_line(argc, argv, desc),
-      vm); // can throw
+    reader.Read();
+  } catch(bool){
+    LOG(ERROR) << "Could not read " << name << " series!";
+    throw false;
+  }
 
-    /** --help option
-    */
-    if (vm.count("help")) {
-      std::cout << APP_NAME << std::endl
-        << desc << std::endl;
-      return EXIT_SUCCESS;
-    }
+  return reader.GetOutput();
+}
 
-    if (vm.count("version") ) {
-      std::cout << APP_NAME << " : v" << VERSION_NO << std::endl;
-      return EXIT_SUCCESS;
+fs::path GetDestinationRoot(const StudySeries &study, const json &paramFile){
+
+  fs::path destRoot = paramFile["destDir"].get<std::string>();
+  destRoot /= study.studyUID;
+  return destRoot;
+}
+
+//Runs the RESOLUTE filter on loaded series. Throws false on failure.
+ImageType::Pointer ComputeResolute(const StudySeries &study, const json &paramFile,
+  const std::shared_ptr<tc::TemplateController> &templates){
+
+  fs::path destRoot = GetDestinationRoot(study, paramFile);
+
+  //Create out destination directory if it doesn't already exist.
+  if (!fs::exists(destRoot)){
+    try {
+      fs::create_directories(destRoot);
+    } catch (const fs::filesystem_error &e){
+      LOG(ERROR) << " cannot create destination folder : " << destRoot;
+      throw false;
     }
+  }
 
-    if ( (!vm.count("input")) && (!vm.count("create-json")) ){
-      std::cout << APP_NAME << std::endl
-        << desc << std::endl;
-      return EXIT_SUCCESS;   
+  std::string outputType = paramFile["destFileType"];
+
+  typedef ns::ResoluteImageFilter<ImageType,ImageType> ResoluteFilterType;
+  ResoluteFilterType::Pointer resoluteFilter = ResoluteFilterType::New();
+  resoluteFilter->SetTemplateController(templates);
+
+  try {
+    resoluteFilter->SetJSONParams(paramFile);
+  } catch (...){
+    LOG(ERROR) << "Failed to set path to template manifest!";
+    throw false;
+  }
+
+  resoluteFilter->SetOutputDirectory(destRoot);
+  resoluteFilter->SetOutputFileExtension(outputType);
+
+  resoluteFilter->SetMRACImage(study.mrac);
+  resoluteFilter->SetUTEImage1(study.ute1);
+  resoluteFilter->SetUTEImage2(study.ute2);
+  resoluteFilter->SetMaskImage(study.ute2);
+
+  try {
+    mon::ScopedStage filterStage("resolute");
+    resoluteFilter->Update();
+  } catch (itk::ExceptionObject &e) {
+    LOG(ERROR) << e;
+    LOG(ERROR) << "Failed to apply RESOLUTE filter!";
+    throw false;
+  }
+
+  ImageType::Pointer output = resoluteFilter->GetOutput();
+  output->DisconnectPipeline();
+  return output;
+}
+
+//Writes the scaled mu-map and the new DICOM series. A preview is only
+//written as DICOM, to its own folder and series. Throws false on failure.
+void ExportResolute(const StudySeries &study, const json &paramFile, const ImageType::Pointer &resolute,
+  bool preview = false){
+
+  mon::ScopedStage stage(preview ? "export preview" : "export");
+
+  fs::path destRoot = GetDestinationRoot(study, paramFile);
+
+  const float SIEMENS_VOX_SCALING = 10000.0;
+  typedef typename itk::MultiplyImageFilter<ImageType,ImageType> MultiplyFilterType;
+  typename MultiplyFilterType::Pointer mult = MultiplyFilterType::New();
+  mult->SetInput(resolute);
+  mult->SetConstant(SIEMENS_VOX_SCALING);
+
+  if (preview){
+    try {
+      mult->Update();
+    } catch (itk::ExceptionObject &ex){
+      LOG(ERROR) << "Could not scale RESOLUTE preview!";
+      throw false;
     }
 
-    po::notify(vm); // throws on error
+    fs::path finalDest = destRoot;
+    finalDest /= "DICOM-preview";
+    CreateDICOMSeriesFromMRAC(mult->GetOutput(), study.mracFiles, finalDest, "RESOLUTE MRAC PREVIEW", 1998);
+    return;
+  }
 
-  } catch (po::error& e) {
-    std::cerr << "ERROR: " << e.what() << std::endl << std::endl;
-    std::cerr << desc << std::endl;
-    return EXIT_FAILURE;
+  typedef itk::ImageFileWriter<ImageType> WriterType;
+  typename WriterType::Pointer writer = WriterType::New();
+
+  boost::filesystem::path outFileName = destRoot;
+  outFileName /= "RESOLUTE-mMR-scaling.nii.gz";
+  writer->SetFileName(outFileName.string());
+  writer->SetInput(mult->GetOutput());
+
+  try {
+    writer->Update();
+  } catch (itk::ExceptionObject &ex){
+    LOG(ERROR) << "Could not scaled RESOLUTE image!";
+    throw false;
   }
+  //Modify DICOM data here
 
-  if (vm.count("create-json") ) {
+  fs::path finalDest = destRoot;
+  finalDest /= "DICOM";
+  CreateDICOMSeriesFromMRAC(mult->GetOutput(), study.mracFiles, finalDest);
+
+}
+
+//Shrinks an input series by an integer factor, averaging each bin.
+ImageType::ConstPointer ShrinkSeries(const ImageType::ConstPointer &img, unsigned int factor){
+
+  return ImageType::ConstPointer(ns::ShrinkImage<ImageType>(img.GetPointer(), factor));
+}
+
+//Runs RESOLUTE on the loaded series shrunk by previewFactor, with an
+//affine registration, and resamples the result onto the MRAC grid. The
+//intermediates go to a "preview" folder of the study output folder.
+//Throws false on failure.
+ImageType::Pointer ComputePreview(const StudySeries &study, const json &paramFile,
+  const std::shared_ptr<tc::TemplateController> &templates){
+
+  mon::ScopedStage stage("preview");
+
+  const unsigned int factor = paramFile.value("previewFactor", 2u);
+  if (factor != 2 && factor != 4){
+    LOG(ERROR) << "previewFactor must be 2 or 4, not " << factor;
+    throw false;
+  }
+
+  //Shares the file lists and full resolution inputs of the study.
+  StudySeries shrunk = study;
+
+  try {
+    shrunk.mrac = ShrinkSeries(study.mrac, factor);
+    shrunk.ute1 = ShrinkSeries(study.ute1, factor);
+    shrunk.ute2 = ShrinkSeries(study.ute2, factor);
+  } catch (itk::ExceptionObject &ex){
+    LOG(ERROR) << ex;
+    LOG(ERROR) << "Could not downsample inputs for preview!";
+    throw false;
+  }
+
+  json previewParams = paramFile;
+  previewParams["destDir"] = (GetDestinationRoot(study, paramFile) / "preview").string();
+  previewParams["regTiered"] = false;
+  previewParams["writeIntermediates"] = false;
+  previewParams["checkpoint"] = false;
+  previewParams["regCacheDir"] = "";
+  previewParams["inputShrinkFactor"] = factor;
+
+  std::string regArgs = paramFile.value("previewRegArgs", std::string());
+  if (regArgs.empty()){
     try {
-      ns::WriteJSONSkeleton(jsonFile);
-    } catch (bool) {
-      std::cerr << "ERROR: Aborting!" << std::endl;
-      return EXIT_FAILURE;
+      regArgs = reg::CreateRegistrationBackend<ImageType>(paramFile.value("regName", std::string("ANTS")))->GetDefaultAffineArgs();
+    } catch (bool){
+      LOG(ERROR) << "Unknown registration backend: " << paramFile.value("regName", std::string("ANTS"));
+      throw false;
     }
-    return EXIT_SUCCESS;
   }
+  previewParams["regArgs"] = regArgs;
 
-  std::ifstream ifs(jsonFile);
-  json paramFile = json::parse(ifs);
+  ImageType::Pointer resolute = ComputeResolute(shrunk, previewParams, templates);
 
-  //Pretty coloured logging (if supported)
-  FLAGS_colorlogtostderr = 1;
-  FLAGS_alsologtostderr = 1;
+  //The filter output is the unsmoothed region decision map, so each
+  //voxel takes the mu of the nearest decision rather than a blend.
+  try {
+    return ns::UpsampleDecisions<ImageType>(resolute, study.mrac);
+  } catch (itk::ExceptionObject &ex){
+    LOG(ERROR) << ex;
+    LOG(ERROR) << "Could not upsample RESOLUTE preview!";
+    throw false;
+  }
+}
 
-  if (vm.count("log")){
-    paramFile["logDir"] = logPath;
+void WriteRunReports(const fs::path &destRoot){
+
+  fs::path reportPath = destRoot;
+  reportPath /= "memory_report.json";
+  mon::MemoryMonitor::GetInstance().WriteReport(reportPath);
+
+  reportPath = destRoot;
+  reportPath /= "timing.json";
+  mon::TimingRecorder::GetInstance().WriteSummary(reportPath);
+
+  reportPath = destRoot;
+  reportPath /= "trace.json";
+  mon::TimingRecorder::GetInstance().WriteChromeTrace(reportPath);
+
+}
+
+//Rewrites the metrics textfile, if metricsFile is set.
+void WriteMetrics(const json &paramFile){
+
+  const std::string metricsFile = paramFile.value("metricsFile", std::string());
+  if (!metricsFile.empty())
+    mon::MetricsRegistry::GetInstance().WriteTextfile(metricsFile);
+
+}
+
+//Adds a finished run to the metrics. failedStage is empty on success.
+void RecordRunMetrics(const json &paramFile, const std::string &failedStage){
+
+  mon::MetricsRegistry &metrics = mon::MetricsRegistry::GetInstance();
+
+  if (!failedStage.empty())
+    metrics.Increment("resolute_failures_total", 1.0, { { "stage", failedStage } });
+
+  metrics.RecordRun(failedStage.empty());
+  WriteMetrics(paramFile);
+
+}
+
+//Runs RESOLUTE on loaded series and exports the result.
+int RunResolute(const StudySeries &study, const json &paramFile,
+  const std::shared_ptr<tc::TemplateController> &templates){
+
+  const fs::path destRoot = GetDestinationRoot(study, paramFile);
+  bool previewWritten = false;
+
+  //A failed preview does not stop the full run.
+  if (paramFile.value("preview", false)){
+    try {
+      ImageType::Pointer preview = ComputePreview(study, paramFile, templates);
+      ExportResolute(study, paramFile, preview, true);
+      previewWritten = true;
+      LOG(INFO) << "Preview written after " << mon::TimingRecorder::GetInstance().GetElapsedSeconds() << " seconds";
+    } catch (bool){
+      LOG(WARNING) << "Could not create preview, continuing with the full run.";
+    }
   }
 
-  DLOG(INFO) << paramFile;
-  
+  std::string stage = "compute";
+
   try {
-    ns::ValidateJSON(paramFile);
-  } catch(bool) {
-    LOG(ERROR) << "Invalid JSON file!";
+    ImageType::Pointer resolute = ComputeResolute(study, paramFile, templates);
+    stage = "export";
+    ExportResolute(study, paramFile, resolute);
+  } catch (bool){
     LOG(ERROR) << "Aborting!";
+    RecordRunMetrics(paramFile, stage);
     return EXIT_FAILURE;
   }
 
-  //Configure logging
-  fs::path newLogPath = fs::complete(paramFile["logDir"].get<std::string>());
-  newLogPath /= APP_NAME;
-  newLogPath += "-";
+  //The full series replaces the preview.
+  if (previewWritten){
+    try {
+      fs::remove_all(destRoot / "DICOM-preview");
+      fs::remove_all(destRoot / "preview");
+    } catch (const fs::filesystem_error &e){
+      LOG(WARNING) << "Could not delete preview from " << destRoot;
+    }
+  }
 
-  google::InitGoogleLogging(argv[0]);
-  google::SetLogDestination(google::INFO, newLogPath.string().c_str());
+  WriteRunReports(destRoot);
+  RecordRunMetrics(paramFile, "");
 
-  std::time_t startTime = std::time( 0 ) ;
+  LOG(INFO) << "Time taken: " << mon::TimingRecorder::GetInstance().GetElapsedSeconds() << " seconds";
+  return EXIT_SUCCESS;
+}
 
-  //Application starts here
-  LOG(INFO) << "Started: " << std::asctime(std::localtime(&startTime));
-  LOG(INFO) << "Running '" << APP_NAME << "' version: " << VERSION_NO;
-  LOG(INFO) << "Log path = " << newLogPath;
-  LOG(INFO) << "Read JSON parameter file: " << jsonFile << std::endl << paramFile.dump(4);
+//Indexes a study folder and reads its mu-map and UTE series. Throws false
+//on failure.
+void LoadStudy(const fs::path &srcPath, const json &paramFile, StudySeries &study){
 
-  fs::path srcPath = inputDirectoryPath;
-  
   //Check if input path exists
   if (! fs::exists( srcPath ) )
   {
     LOG(ERROR) << "Input path: " << srcPath << " does not exist!";
-    return EXIT_FAILURE;
+    throw false;
   }
 
   //Check if it is a directory.
   if (! fs::is_directory( srcPath ) )
   {
     LOG(ERROR) << srcPath << " does not appear to be a directory!";
-    return EXIT_FAILURE;
+    throw false;
   }
 
   LOG(INFO) << "Input directory: " << fs::complete(srcPath);
 
   //Create DICOM UTE search object.
+  std::unique_ptr<mon::ScopedStage> stage(new mon::ScopedStage("index"));
   std::unique_ptr<dcm::UTETree> tree(new dcm::UTETree(srcPath));
+  stage.reset();
 
   //Total number of series found for first UID.
-  std::string studyUID = tree->GetStudyUID(1);
-  LOG(INFO) << "No. series in tree: " << tree->GetNoOfSeries(studyUID);
+  study.studyUID = tree->GetStudyUID(1);
+  LOG(INFO) << "No. series in tree: " << tree->GetNoOfSeries(study.studyUID);
+
+  if (!FindStudySeries(*tree, paramFile, study))
+    throw false;
 
-  //Get all Series UIDs associated with study
-  //std::vector<std::string> foundSeriesUIDs = tree->GetSeriesUIDList(tree->GetStudyUID(1));
+  stage.reset(new mon::ScopedStage("load"));
+
+  study.mracFiles = tree->GetSeriesFileList(study.mumapUID);
+  study.mrac = ReadSeries(study.mracFiles, "mu-map");
+  study.ute1 = ReadSeries(tree->GetSeriesFileList(study.ute1UID), "UTE1");
+  study.ute2 = ReadSeries(tree->GetSeriesFileList(study.ute2UID), "UTE2");
+
+}
 
-  std::string mumapUID;
-  std::string ute1UID;
-  std::string ute2UID;
+int ProcessStudy(const fs::path &srcPath, const json &paramFile,
+  const std::shared_ptr<tc::TemplateController> &templates){
+
+  StudySeries study;
 
   try {
-    //Find the mu-map
-    mumapUID = tree->FindMuMapUID(studyUID, paramFile["MRACSeriesName"]);
-  }
-  catch (bool){
-    LOG(ERROR) << "Could not find mu-map series with description \'" << paramFile["MRACSeriesName"] << "\'";
+    LoadStudy(srcPath, paramFile, study);
+  } catch(bool){
     LOG(ERROR) << "Aborting!";
+    RecordRunMetrics(paramFile, "load");
     return EXIT_FAILURE;
   }
 
+  return RunResolute(study, paramFile, templates);
+}
+
+//Reads the manifest and template volumes once, for services that process
+//many studies. Returns nullptr on failure.
+std::shared_ptr<tc::TemplateController> LoadWarmTemplates(const json &paramFile){
+
+  std::shared_ptr<tc::TemplateController> templates = std::make_shared<tc::TemplateController>();
+
+  const tc::ETemplateImages warmTemplates[] = {
+    tc::ETemplateImages::GM, tc::ETemplateImages::WM, tc::ETemplateImages::CSF,
+    tc::ETemplateImages::Brain, tc::ETemplateImages::Frontal, tc::ETemplateImages::Mastoid,
+    tc::ETemplateImages::Nasal, tc::ETemplateImages::Skull
+  };
+
   try {
-    //Find UTE 1
-    ute1UID = tree->FindUTEUID(studyUID, paramFile["UTE1SeriesName"], paramFile["UTE1TE"].get<std::string>());
+    templates->SetSharedStore(paramFile.value("sharedTemplateDir", std::string()));
+    templates->SetPath(paramFile["regTemplatePath"].get<std::string>());
+    for (auto t : warmTemplates)
+      templates->GetImage<ImageType>(t);
+  } catch (...) {
+    LOG(ERROR) << "Failed to load templates!";
+    return nullptr;
   }
-  catch (bool){
-    LOG(ERROR) << "Could not find UTE1 series with description \'" << paramFile["UTE1SeriesName"] << "\' and TE = " << paramFile["UTE1TE"];
+
+  return templates;
+}
+
+int RunWatchFolder(const fs::path &watchPath, const json &paramFile){
+
+  //Templates are read once and stay in memory for every study.
+  std::shared_ptr<tc::TemplateController> templates = LoadWarmTemplates(paramFile);
+
+  if (!templates){
     LOG(ERROR) << "Aborting!";
     return EXIT_FAILURE;
-  }  
+  }
+
+  std::unique_ptr<wf::WatchFolder> watcher;
 
   try {
-    //Find UTE 2
-    ute2UID = tree->FindUTEUID(studyUID, paramFile["UTE2SeriesName"], paramFile["UTE2TE"].get<std::string>());
-  }
-  catch (bool){
-    LOG(ERROR) << "Could not find UTE2 series with description \'" << paramFile["UTE2SeriesName"] << "\' and TE = " << paramFile["UTE2TE"];
+    watcher.reset(new wf::WatchFolder(watchPath));
+  } catch (bool) {
+    LOG(ERROR) << "Cannot watch " << watchPath;
     LOG(ERROR) << "Aborting!";
     return EXIT_FAILURE;
-  }  
+  }
 
-  fs::path destRoot = paramFile["destDir"].get<std::string>();
-  destRoot /= studyUID;
+  WriteMetrics(paramFile);
 
-  //Create out destination directory if it doesn't already exist.
-  if (!fs::exists(destRoot)){
+  watcher->SetQuiescenceSeconds(paramFile.value("watchQuiescenceSeconds", 30u));
+  watcher->SetMarkerFileName(paramFile.value("watchMarkerFile", std::string("COMPLETE")));
+
+  LOG(INFO) << "Watching " << fs::complete(watchPath) << " for new studies.";
+
+  for (;;){
+    fs::path studyPath = watcher->Next();
+
+    mon::TimingRecorder::GetInstance().Clear();
+    mon::MemoryMonitor::GetInstance().Clear();
+
+    int result = EXIT_FAILURE;
     try {
-      fs::create_directories(destRoot);
+      result = ProcessStudy(studyPath, paramFile, templates);
+    } catch (...) {
+      LOG(ERROR) << "Unhandled error processing " << studyPath;
+      RecordRunMetrics(paramFile, "unhandled");
+    }
+
+    //Move the study out of the way, so it is not picked up again.
+    fs::path archivePath = watchPath;
+    archivePath /= (result == EXIT_SUCCESS) ? ".done" : ".failed";
+    archivePath /= studyPath.filename();
+
+    if (fs::exists(archivePath))
+      archivePath += "-" + boost::lexical_cast<std::string>(std::time(0));
+
+    try {
+      fs::create_directories(archivePath.parent_path());
+      fs::rename(studyPath, archivePath);
+      LOG(INFO) << "Moved " << studyPath << " to " << archivePath;
     } catch (const fs::filesystem_error &e){
-      LOG(ERROR) << " cannot create destination folder : " << destRoot;
-      return EXIT_FAILURE;
+      LOG(WARNING) << "Could not move " << studyPath << " to " << archivePath;
     }
+
+    google::FlushLogFiles(google::INFO);
   }
 
-  std::string outputType = paramFile["destFileType"];
+  return EXIT_SUCCESS;
+}
 
-  typedef dcm::ReadDicomSeries<ImageType> SeriesReadType;
+//Writes the templates named in regTemplatePath to one bundle file, which
+//regTemplatePath can then point to.
+int CompileTemplates(const fs::path &bundlePath, const json &paramFile){
 
-  typedef ns::ResoluteImageFilter<ImageType,ImageType> ResoluteFilterType;
-  ResoluteFilterType::Pointer resoluteFilter = ResoluteFilterType::New();
+  tc::TemplateController templates;
 
   try {
-    resoluteFilter->SetJSONParams(paramFile);
-  } catch (...){
-    LOG(ERROR) << "Failed to set path to template manifest!";
+    templates.SetPath(paramFile["regTemplatePath"].get<std::string>());
+    templates.CompileBundle<ImageType>(bundlePath);
+  } catch (bool) {
+    LOG(ERROR) << "Aborting!";
+    return EXIT_FAILURE;
+  } catch (itk::ExceptionObject &ex) {
+    LOG(ERROR) << ex;
     LOG(ERROR) << "Aborting!";
-    return EXIT_FAILURE;   
+    return EXIT_FAILURE;
   }
 
-  resoluteFilter->SetOutputDirectory(destRoot);
-  resoluteFilter->SetOutputFileExtension(outputType);
+  return EXIT_SUCCESS;
+}
+
+//One study of a batch, as it passes through the pipeline.
+struct BatchJob {
+  fs::path srcPath;
+  StudySeries study;
+  ImageType::Pointer resolute;
+  std::string status;
+};
+
+//Reads a batch manifest: one input directory per line. Blank lines and
+//lines starting with '#' are skipped.
+std::vector<BatchJob> ReadBatchManifest(const fs::path &manifestPath){
+
+  std::ifstream ifs(manifestPath.string());
+  if (!ifs.good()){
+    LOG(ERROR) << "Cannot read batch manifest: " << manifestPath;
+    throw false;
+  }
+
+  std::vector<BatchJob> jobs;
+  std::string line;
+
+  while (std::getline(ifs, line)){
+    boost::algorithm::trim(line);
+    if (line.empty() || line[0] == '#')
+      continue;
+
+    BatchJob job;
+    job.srcPath = line;
+    job.status = "pending";
+    jobs.push_back(job);
+  }
+
+  return jobs;
+}
+
+int RunBatch(const fs::path &manifestPath, const json &paramFile){
 
-  std::vector<fs::path> fNames = tree->GetSeriesFileList(mumapUID);
-  std::unique_ptr<SeriesReadType> dcm(new SeriesReadType(fNames));
+  std::vector<BatchJob> jobs;
 
   try {
-    dcm->Read();
-  } catch(bool){
-      LOG(ERROR) << "Could not read mu-map series: " << mumapUID;
-      LOG(ERROR) << "Aborting!";
-      return EXIT_FAILURE;      
+    jobs = ReadBatchManifest(manifestPath);
+  } catch (bool) {
+    LOG(ERROR) << "Aborting!";
+    return EXIT_FAILURE;
+  }
+
+  LOG(INFO) << "Batch of " << jobs.size() << " studies from " << manifestPath;
+
+  std::shared_ptr<tc::TemplateController> templates = LoadWarmTemplates(paramFile);
+
+  if (!templates){
+    LOG(ERROR) << "Aborting!";
+    return EXIT_FAILURE;
+  }
+
+  //I/O, CPU and registration heavy phases run in separate pools, so one
+  //study can load while another registers and a third exports. Studies
+  //are admitted while their estimated peak memory fits in the budget.
+  const std::size_t MB = 1 << 20;
+  const std::size_t studyBytes = paramFile.value("batchStudyMemoryMB", 2048u) * MB;
+
+  ns::PipelineScheduler<BatchJob> scheduler(paramFile.value("batchMemoryMB", 0u) * MB);
+  scheduler.SetCostFunction([studyBytes](const BatchJob &){ return studyBytes; });
+
+  scheduler.AddStage("load", paramFile.value("batchLoadWorkers", 1u), [&paramFile](BatchJob &job){
+    job.status = "failed: load";
+    LoadStudy(job.srcPath, paramFile, job.study);
+    return true;
+  });
+
+  scheduler.AddStage("compute", paramFile.value("batchComputeWorkers", 1u), [&paramFile, &templates](BatchJob &job){
+    job.status = "failed: compute";
+    job.resolute = ComputeResolute(job.study, paramFile, templates);
+
+    //The inputs are no longer needed.
+    job.study.mrac = nullptr;
+    job.study.ute1 = nullptr;
+    job.study.ute2 = nullptr;
+    return true;
+  });
+
+  scheduler.AddStage("export", paramFile.value("batchExportWorkers", 1u), [&paramFile](BatchJob &job){
+    job.status = "failed: export";
+    ExportResolute(job.study, paramFile, job.resolute);
+    job.resolute = nullptr;
+    job.status = "done";
+    return true;
+  });
+
+  const std::size_t completed = scheduler.Run(jobs);
+
+  //Studies overlap, so the reports cover the whole batch.
+  fs::path destRoot = paramFile["destDir"].get<std::string>();
+  WriteRunReports(destRoot);
+
+  const std::string failedPrefix = "failed: ";
+  for (const BatchJob &job : jobs){
+    if (job.status.compare(0, failedPrefix.size(), failedPrefix) == 0)
+      mon::MetricsRegistry::GetInstance().Increment("resolute_failures_total", 1.0,
+        { { "stage", job.status.substr(failedPrefix.size()) } });
+  }
+  mon::MetricsRegistry::GetInstance().RecordRun(completed == jobs.size());
+  WriteMetrics(paramFile);
+
+  json summary;
+  summary["studies"] = json::array();
+  for (const BatchJob &job : jobs){
+    summary["studies"].push_back({
+      {"input", job.srcPath.string()},
+      {"studyUID", job.study.studyUID},
+      {"status", job.status}
+    });
+  }
+  summary["completed"] = completed;
+  summary["totalWallSeconds"] = mon::TimingRecorder::GetInstance().GetElapsedSeconds();
+
+  fs::path summaryPath = destRoot;
+  summaryPath /= "batch_summary.json";
+  std::ofstream ofs(summaryPath.string());
+  ofs << summary.dump(2) << std::endl;
+
+  LOG(INFO) << "Batch complete: " << completed << " of " << jobs.size() << " studies processed in "
+            << mon::TimingRecorder::GetInstance().GetElapsedSeconds() << " seconds";
+
+  return (completed == jobs.size()) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+#ifdef RESOLUTE_WITH_STORESCP
+
+//Indexes instances as they are received. Each required series is read as
+//soon as it is complete, and a study is processed as soon as its mu-map
+//and both UTEs have been read.
+class StreamingIngest {
+
+public:
+
+  StreamingIngest(const json &paramFile, const std::shared_ptr<tc::TemplateController> &templates)
+    : _paramFile(paramFile), _templates(templates) {
+    _seriesQuiescence = std::chrono::seconds(paramFile.value("storeSeriesQuiescence", 2u));
+    _seriesTimeout = std::chrono::seconds(paramFile.value("storeSeriesTimeout", 10u));
+  };
+
+  //Called by the storage SCP for each instance.
+  void OnInstance(const dcm::ReceivedInstance &r);
+
+  //Processes studies as they become ready. Does not return.
+  void Run();
+
+protected:
+
+  typedef std::chrono::steady_clock ClockType;
+
+  //One required series of a pending study.
+  struct SeriesLoad {
+    std::string uid;
+    std::vector<fs::path> files;
+    std::future<ImageType::ConstPointer> image;
+  };
+
+  struct PendingStudy {
+    SeriesLoad mrac, ute1, ute2;
+  };
+
+  bool IsComplete(const std::string &seriesUID);
+  void StartLoad(SeriesLoad &load, const std::string &name, bool found);
+  void ProcessReady(const std::string &studyUID, PendingStudy &p);
+
+  const json &_paramFile;
+  std::shared_ptr<tc::TemplateController> _templates;
+  ClockType::duration _seriesQuiescence, _seriesTimeout;
+
+  std::mutex _mutex;
+  std::condition_variable _cv;
+  dcm::UTETree _tree;
+  std::map<std::string, dcm::SeriesProgress> _series;
+  std::set<std::string> _studies, _processed;
+
+};
+
+void StreamingIngest::OnInstance(const dcm::ReceivedInstance &r){
+
+  std::lock_guard<std::mutex> lock(_mutex);
+
+  if (_processed.count(r.studyUID) > 0){
+    LOG(WARNING) << "Ignoring instance of study already processed: " << r.studyUID;
+    return;
+  }
+
+  if (!_tree.AddFile(r.filePath)){
+    LOG(WARNING) << "Could not index received file " << r.filePath;
+    return;
   }
 
-  resoluteFilter->SetMRACImage(dcm->GetOutput());
+  LOG_IF(INFO, _series.find(r.seriesUID) == _series.end()) << "Receiving series " << r.seriesUID;
+  _series[r.seriesUID].Add(r, ClockType::now());
+
+  _studies.insert(r.studyUID);
+  _cv.notify_one();
+
+}
+
+bool StreamingIngest::IsComplete(const std::string &seriesUID){
+
+  auto it = _series.find(seriesUID);
+  if (it == _series.end())
+    return false;
+
+  return it->second.IsComplete(ClockType::now(), _seriesQuiescence, _seriesTimeout);
+
+}
 
-  fNames = tree->GetSeriesFileList(ute1UID);
-  dcm.reset(new SeriesReadType(fNames));
+void StreamingIngest::StartLoad(SeriesLoad &load, const std::string &name, bool found){
+
+  if (!found || load.image.valid() || !IsComplete(load.uid))
+    return;
+
+  LOG(INFO) << "Series complete, reading " << name << ": " << load.uid;
+
+  load.files = _tree.GetSeriesFileList(load.uid);
+  load.image = std::async(std::launch::async, ReadSeries, load.files, name);
+
+}
+
+void StreamingIngest::ProcessReady(const std::string &studyUID, PendingStudy &p){
+
+  StudySeries study;
+  study.studyUID = studyUID;
+  study.mumapUID = p.mrac.uid;
+  study.ute1UID = p.ute1.uid;
+  study.ute2UID = p.ute2.uid;
+  study.mracFiles = p.mrac.files;
 
   try {
-    dcm->Read();
-  } catch(bool){
-      LOG(ERROR) << "Could not read UTE1 series: " << mumapUID;
-      LOG(ERROR) << "Aborting!";
-      return EXIT_FAILURE;      
+    study.mrac = p.mrac.image.get();
+    study.ute1 = p.ute1.image.get();
+    study.ute2 = p.ute2.image.get();
+  } catch (bool){
+    LOG(ERROR) << "Skipping study " << studyUID;
+    RecordRunMetrics(_paramFile, "load");
+    return;
   }
 
-  resoluteFilter->SetUTEImage1(dcm->GetOutput());
+  LOG(INFO) << "Processing received study " << studyUID;
+
+  int result = EXIT_FAILURE;
+  try {
+    result = RunResolute(study, _paramFile, _templates);
+  } catch (...) {
+    LOG(ERROR) << "Unhandled error processing " << studyUID;
+    RecordRunMetrics(_paramFile, "unhandled");
+  }
+
+  LOG_IF(ERROR, result != EXIT_SUCCESS) << "Failed to process study " << studyUID;
+
+  mon::TimingRecorder::GetInstance().Clear();
+  mon::MemoryMonitor::GetInstance().Clear();
+  google::FlushLogFiles(google::INFO);
+
+}
 
-  fNames = tree->GetSeriesFileList(ute2UID);
-  dcm.reset(new SeriesReadType(fNames));
+void StreamingIngest::Run(){
+
+  std::map<std::string, PendingStudy> pending;
+
+  for (;;){
+    std::vector<std::string> ready;
+
+    {
+      std::unique_lock<std::mutex> lock(_mutex);
+      _cv.wait_for(lock, std::chrono::seconds(1));
+
+      for (const std::string &studyUID : _studies){
+        PendingStudy &p = pending[studyUID];
+
+        StartLoad(p.mrac, "mu-map",
+          _tree.TryFindMuMapUID(studyUID, _paramFile["MRACSeriesName"], p.mrac.uid));
+        StartLoad(p.ute1, "UTE1",
+          _tree.TryFindUTEUID(studyUID, _paramFile["UTE1SeriesName"], _paramFile["UTE1TE"].get<std::string>(), p.ute1.uid));
+        StartLoad(p.ute2, "UTE2",
+          _tree.TryFindUTEUID(studyUID, _paramFile["UTE2SeriesName"], _paramFile["UTE2TE"].get<std::string>(), p.ute2.uid));
+
+        if (p.mrac.image.valid() && p.ute1.image.valid() && p.ute2.image.valid())
+          ready.push_back(studyUID);
+      }
+
+      for (const std::string &studyUID : ready){
+        _studies.erase(studyUID);
+        _processed.insert(studyUID);
+      }
+    }
+
+    //Reception carries on while a study is processed.
+    for (const std::string &studyUID : ready){
+      ProcessReady(studyUID, pending[studyUID]);
+      pending.erase(studyUID);
+    }
+  }
+
+}
+
+int RunStorageSCP(unsigned short port, const json &paramFile){
+
+  std::shared_ptr<tc::TemplateController> templates = LoadWarmTemplates(paramFile);
+
+  if (!templates){
+    LOG(ERROR) << "Aborting!";
+    return EXIT_FAILURE;
+  }
+
+  fs::path storeDir = paramFile["destDir"].get<std::string>();
+  storeDir /= "incoming";
+  storeDir = paramFile.value("storeDir", storeDir.string());
+
+  StreamingIngest ingest(paramFile, templates);
+  WriteMetrics(paramFile);
+
+  std::unique_ptr<dcm::StoreSCP> scp;
 
   try {
-    dcm->Read();
-  } catch(bool){
-      LOG(ERROR) << "Could not read UTE2 series: " << mumapUID;
-      LOG(ERROR) << "Aborting!";
-      return EXIT_FAILURE;      
+    scp.reset(new dcm::StoreSCP(paramFile.value("storeAETitle", std::string("RESOLUTE")), port, storeDir));
+  } catch (bool) {
+    LOG(ERROR) << "Aborting!";
+    return EXIT_FAILURE;
   }
 
-  resoluteFilter->SetUTEImage2(dcm->GetOutput());
-  resoluteFilter->SetMaskImage(dcm->GetOutput());
+  scp->SetCallback([&ingest](const dcm::ReceivedInstance &r){ ingest.OnInstance(r); });
 
+  std::thread worker(&StreamingIngest::Run, &ingest);
+  worker.detach();
 
   try {
-    resoluteFilter->Update();
-  } catch (itk::ExceptionObject &e) {
-    LOG(ERROR) << e;
-    LOG(ERROR) << "Failed to apply RESOLUTE filter!";
+    scp->Listen();
+  } catch (bool) {
+    //Does not unwind, so the worker's state stays valid until exit.
     LOG(ERROR) << "Aborting!";
-    return EXIT_FAILURE;    
+    std::exit(EXIT_FAILURE);
   }
 
-  const float SIEMENS_VOX_SCALING = 10000.0;
-  typedef typename itk::MultiplyImageFilter<ImageType,ImageType> MultiplyFilterType;
-  typename MultiplyFilterType::Pointer mult = MultiplyFilterType::New();
-  mult->SetInput(resoluteFilter->GetOutput());
-  mult->SetConstant(SIEMENS_VOX_SCALING);
+  return EXIT_SUCCESS;
+}
 
-  typedef itk::ImageFileWriter<ImageType> WriterType;
-  typename WriterType::Pointer writer = WriterType::New();
+#endif
 
-  boost::filesystem::path outFileName = destRoot;
-  outFileName /= "RESOLUTE-mMR-scaling.nii.gz";
-  writer->SetFileName(outFileName.string());
-  writer->SetInput(mult->GetOutput());
+int main(int argc, char **argv)
+{
+
+  const char* APP_NAME = "resolute";
 
+  std::string inputDirectoryPath;
+  std::string watchDirectoryPath;
+  std::string batchManifestPath;
+  std::string bundlePath;
+  unsigned short storePort = 0;
+  std::string logPath;
+  std::string jsonFile;
+  std::string outputDirectory;
+  std::string prefixName;
+
+  //Set-up command line options
+  po::options_description desc("Options");
+  desc.add_options()
+    ("help,h", "Print help information")
+    ("version","Print version number")
+    //("verbose,v", "Be verbose")
+    ("input,i", po::value<std::string>(&inputDirectoryPath), "Input DICOMDIR")
+    ("watch,w", po::value<std::string>(&watchDirectoryPath), "Watch folder: process each study exported to it")
+    ("batch,b", po::value<std::string>(&batchManifestPath), "Process every input directory listed in a manifest")
+#ifdef RESOLUTE_WITH_STORESCP
+    ("store-port", po::value<unsigned short>(&storePort), "Receive studies by DICOM C-STORE on this port")
+#endif
+    ("compile-templates", po::value<std::string>(&bundlePath), "Compile the templates in regTemplatePath to a bundle file")
+    ("log,l", po::value<std::string>(&logPath), "Write log file")
+    ("preview", "Write a fast preview mu-map before the full one")
+    ("json,j", po::value<std::string>(&jsonFile),  "Use JSON config file")
+    ("create-json", po::value<std::string>(&jsonFile),  "Write config JSON skeleton");
+
+
+  //Evaluate command line options
+  po::variables_map vm;
   try {
-    writer->Update();
-  } catch (itk::ExceptionObject &ex){
-    LOG(ERROR) << "Could not scaled RESOLUTE image!";
-    return EXIT_FAILURE;   
+    po::store(po::parse_command_line(argc, argv, desc),
+      vm); // can throw
+
+    /** --help option
+    */
+    if (vm.count("help")) {
+      std::cout << APP_NAME << std::endl
+        << desc << std::endl;
+      return EXIT_SUCCESS;
+    }
+
+    if (vm.count("version") ) {
+      std::cout << APP_NAME << " : v" << VERSION_NO << std::endl;
+      return EXIT_SUCCESS;
+    }
+
+    if ( (!vm.count("input")) && (!vm.count("watch")) && (!vm.count("batch")) && (!vm.count("store-port")) && (!vm.count("compile-templates")) && (!vm.count("create-json")) ){
+      std::cout << APP_NAME << std::endl
+        << desc << std::endl;
+      return EXIT_SUCCESS;   
+    }
+
+    po::notify(vm); // throws on error
+
+  } catch (po::error& e) {
+    std::cerr << "ERROR: " << e.what() << std::endl << std::endl;
+    std::cerr << desc << std::endl;
+    return EXIT_FAILURE;
   }
-  //Modify DICOM data here
 
-  std::vector<fs::path> mracfileNames = tree->GetSeriesFileList(mumapUID);
+  if (vm.count("create-json") ) {
+    try {
+      ns::WriteJSONSkeleton(jsonFile);
+    } catch (bool) {
+      std::cerr << "ERROR: Aborting!" << std::endl;
+      return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+  }
 
-  fs::path finalDest = destRoot;
-  finalDest /= "DICOM";
-  CreateDICOMSeriesFromMRAC(mult->GetOutput(), mracfileNames, finalDest);
+  std::ifstream ifs(jsonFile);
+  json paramFile = json::parse(ifs);
 
+  //Pretty coloured logging (if supported)
+  FLAGS_colorlogtostderr = 1;
+  FLAGS_alsologtostderr = 1;
+
+  if (vm.count("log")){
+    paramFile["logDir"] = logPath;
+  }
+
+  if (vm.count("preview")){
+    paramFile["preview"] = true;
+  }
+
+  DLOG(INFO) << paramFile;
+  
+  try {
+    ns::ValidateJSON(paramFile);
+  } catch(bool) {
+    LOG(ERROR) << "Invalid JSON file!";
+    LOG(ERROR) << "Aborting!";
+    return EXIT_FAILURE;
+  }
+
+  //Configure logging
+  fs::path newLogPath = fs::complete(paramFile["logDir"].get<std::string>());
+  newLogPath /= APP_NAME;
+  newLogPath += "-";
+
+  google::InitGoogleLogging(argv[0]);
+  google::SetLogDestination(google::INFO, newLogPath.string().c_str());
+
+  //Log files and stderr are written by a background thread, so slow log
+  //folders do not hold up processing. The queue is drained at exit.
+  if (paramFile.value("asyncLogging", true)){
+    FLAGS_alsologtostderr = 0;
+    mon::AsyncLog::GetInstance().Install(std::size_t(paramFile.value("asyncLogQueueMB", 16u)) << 20, true);
+  }
+
+  std::time_t startTime = std::time( 0 ) ;
+  mon::TimingRecorder::GetInstance(); //Starts the clock for the timing report.
+
+  //Application starts here
+  LOG(INFO) << "Started: " << std::asctime(std::localtime(&startTime));
+  LOG(INFO) << "Running '" << APP_NAME << "' version: " << VERSION_NO;
+  LOG(INFO) << "Log path = " << newLogPath;
+  LOG(INFO) << "Read JSON parameter file: " << jsonFile << std::endl << paramFile.dump(4);
+
+  if (vm.count("compile-templates"))
+    return CompileTemplates(bundlePath, paramFile);
+
+  if (vm.count("watch"))
+    return RunWatchFolder(watchDirectoryPath, paramFile);
+
+  if (vm.count("batch"))
+    return RunBatch(batchManifestPath, paramFile);
+
+#ifdef RESOLUTE_WITH_STORESCP
+  if (vm.count("store-port"))
+    return RunStorageSCP(storePort, paramFile);
+#endif
+
+  int result = ProcessStudy(inputDirectoryPath, paramFile, std::make_shared<tc::TemplateController>());
 
   //Print total execution time
   std::time_t stopTime = std::time( 0 ) ;
-  unsigned int totalTime = stopTime - startTime;
-  LOG(INFO) << "Time taken: " << totalTime << " seconds";
   LOG(INFO) << "Ended: " << std::asctime(std::localtime(&stopTime));
-  return EXIT_SUCCESS;
+  return result;
 }
@@ -27,6 +27,13 @@
 #include <boost/algorithm/string/split.hpp>
 #include <boost/algorithm/string/regex.hpp>
 
+#include <algorithm>
+#include <cmath>
+#include <fstream>
+#include <future>
+#include <map>
+#include <memory>
+
 #include <glog/logging.h>
 #include <nlohmann/json.hpp>
 
@@ -38,11 +45,8 @@
 #include <itkHistogramToIntensityImageFilter.h>
 #include <itkMinimumMaximumImageFilter.h>
 
-#include <itkKdTree.h>
-#include <itkKdTreeBasedKmeansEstimator.h>
 #include <itkScalarImageKmeansImageFilter.h>
 #include <itkImageToListSampleAdaptor.h>
-#include <itkJointDomainImageToListSampleAdaptor.h>
 #include <itkThresholdImageFilter.h>
 #include <itkBinaryThresholdImageFilter.h>
 #include <itkRescaleIntensityImageFilter.h>
@@ -59,17 +63,27 @@
 #include <itkNumericTraits.h>
 #include <itkNeighborhoodIterator.h>
 
-#include "itkBinaryMorphologicalClosingImageFilter.h"
-#include "itkBinaryBallStructuringElement.h"
-
 #include <itkLogImageFilter.h>
+#include <itkRegionOfInterestImageFilter.h>
 
-#include "ANTsReg.hpp"
+#include "RegistrationFactory.hpp"
 #include <antsRegistrationTemplateHeader.h>
-#include <antsApplyTransforms.h>
+
+#include <itkResampleImageFilter.h>
+#include <itkLinearInterpolateImageFunction.h>
+#include <itkNearestNeighborInterpolateImageFunction.h>
 
 #include "TemplateController.hpp"
-//#include "EnvironmentInfo.h"
+#include "HistogramKMeans.hpp"
+#include "GaussianSmoothing.hpp"
+#include "MaskMorphology.hpp"
+#include "SlabScheduler.hpp"
+#include "MemoryMonitor.hpp"
+#include "StageTimer.hpp"
+#include "Metrics.hpp"
+#include "Checkpoint.hpp"
+#include "HalfFloat.hpp"
+#include "EnvironmentInfo.h"
 
 
 
@@ -139,6 +153,10 @@ public:
   typedef typename itk::Image<float, 2 > HistoImageType;
   typedef itk::Image< unsigned char, 3 > InternalMaskImageType;
 
+  /** Template tissue probabilities in 8-bit fixed point. */
+  typedef itk::Image< unsigned char, 3 > ProbabilityImageType;
+  static const int PROBABILITY_ONE = 255;
+
 
   void SetMRACImage(const TInputImage* mrac);
   void SetUTEImage1(const TInputImage* ute1);
@@ -149,6 +167,16 @@ public:
   void SetOutputFileExtension (const std::string &s);
   void SetJSONParams(const nlohmann::json &j);
 
+  //Shares templates between filters, e.g. across studies in watch mode.
+  //Call before SetJSONParams.
+  void SetTemplateController(const std::shared_ptr<tc::TemplateController> &t){ _templateImageController = t; };
+
+  //Soft-tissue peak of the UTE joint histogram, found by k-means. Valid
+  //after Update().
+  unsigned int GetSoftTissuePeakUTE1() const { return _coords.x; };
+  unsigned int GetSoftTissuePeakUTE2() const { return _coords.y; };
+  bool IsCroppedToHead() const { return _bCropped; };
+
   //mu-values (cm-1)
   const float BRAIN_MU = 0.099;
   const float CSF_MU = 0.096;
@@ -164,6 +192,9 @@ public:
 
   const float FWHM = 3.0;
 
+  //Ball radius (voxels) used to close the patient volume mask.
+  const int PATIENT_VOLUME_CLOSING_RADIUS = 11;
+
 protected:
   ResoluteImageFilter();
   ~ResoluteImageFilter(){};
@@ -174,26 +205,121 @@ protected:
 
   typename TMaskImage::ConstPointer GetMaskImage();
 
+  template< typename TImage >
+  typename TImage::Pointer AllocateImage(const TInputImage *ref);
+
+  //Images that nothing later reads back. Skipped when writeIntermediates
+  //is false.
+  template< typename TImage >
+  void WriteIntermediate(const TImage *img, const std::string &fileName, const std::string &description);
+
+  void CropToHead();
+  //Crops to region, or to the head crop region if null.
+  typename TInputImage::Pointer CropImage(const TInputImage *img, const RegionType *region = nullptr);
+  typename TInputImage::Pointer UncropImage(const typename TInputImage::Pointer &img);
+
   void MakeAirMask();
   void MakePatientVolumeMask();
   void MakeR2s();
-  void PerformRegistration();
-  void InvertMasks(const boost::filesystem::path &src, const boost::filesystem::path &dst, const std::string &interp);
+  //With regPreprocess, writes the masked, cropped and downsampled UTE2 and
+  //a template foreground mask for ANTs. Otherwise ANTs gets ute2.nii.gz.
+  void PrepareRegistrationInputs();
+  void WriteTemplateMask(const boost::filesystem::path &dst);
+  //regArgs or regAffineArgs, or the default of the regName backend.
+  std::string GetRegistrationArgs(const std::string &key);
+  void PerformRegistration(const std::string &args, const std::string &prefix);
+  //Affine first, then regArgs only if the affine result is not good enough.
+  void PerformTieredRegistration();
+  void LoadInverseTransform(const std::string &prefix = "ANTs-");
+  typename TInputImage::Pointer ResampleTemplate(const tc::ETemplateImages e, const std::string &interp);
+  void InvertMasks(const tc::ETemplateImages e, const std::string &interp);
+
+  struct RegistrationQuality {
+    //Correlation of the warped T1 template with UTE2 in the patient volume.
+    double cc;
+    //Fraction of the warped brain mask on UTE soft tissue (not air,
+    //R2* <= 100, inside the patient volume). Not a Dice score: there is no
+    //subject brain segmentation to compare the mask with.
+    double brainOverlap;
+  };
+
+  //Scores the transform last loaded by LoadInverseTransform().
+  RegistrationQuality AssessRegistration();
   void ApplyAlgorithm();
 
+  //Fingerprint of the inputs and the parameters of the stages before
+  //registration. Later stages chain from it.
+  std::string GetInputFingerprint();
+  //True if a stage can be skipped, because it completed earlier with the
+  //same fingerprint. Once one stage runs, every later stage runs too.
+  bool ResumeStage(const std::string &stage, const std::string &fingerprint);
+  void CommitStage(const std::string &stage, const std::string &fingerprint,
+    const std::vector<boost::filesystem::path> &outputs);
+
   void LoadImageFromFile(const boost::filesystem::path &src, typename TInputImage::Pointer &dst);
 
+  //Budget (slabMemoryMB) for the working images of the stages that run one
+  //z-slab at a time. 0 runs each of them on the whole volume.
+  std::size_t GetSlabBudget() const;
+
+  //Backend for the Gaussian smoothing (smoothingBackend). The recursive
+  //filter restarts at each slab edge, so runs with a slab budget use the
+  //discrete one, which slabs reproduce exactly.
+  ESmoothingBackend GetSmoothingBackend() const;
+
+  //Factor by which the inputs have been shrunk (inputShrinkFactor, set by
+  //preview mode). The settings in voxels, or in voxel counts, were chosen
+  //for the full resolution series and are scaled by it.
+  unsigned int GetInputShrinkFactor() const;
+  int GetClosingRadius() const;
+
+  //Warped templates are held in 8 bits. Masks keep 0 and 1 exact. GM and
+  //WM are only used as GM + WM > 0.5, so they are held as one fixed point
+  //map of their sum (PROBABILITY_ONE = 1.0) that keeps that test exact.
+  static unsigned char ToMaskValue(PixelType v);
+  static unsigned char ToBrainTissue(PixelType gm, PixelType wm);
+  typename InternalMaskImageType::Pointer ConvertTemplate(const TInputImage *img);
+  typename ProbabilityImageType::Pointer MakeBrainTissue(const TInputImage *gm, const TInputImage *wm);
+  //Converts a warped template for the decision rules. GM is held in float
+  //until WM arrives; CSF is not used.
+  void StoreWarpedTemplate(const tc::ETemplateImages e, const TInputImage *img);
+  void ReadWarpedTemplate(const tc::ETemplateImages e);
+  //Kept from the warp stage if it ran, otherwise read once from its file.
+  typename InternalMaskImageType::Pointer GetWarpedTemplate(const tc::ETemplateImages e);
+  typename ProbabilityImageType::Pointer GetBrainTissue();
+
   typename HistoImageType::Pointer _histogram;
 
   typename TInputImage::Pointer _normUTE1;
   typename TInputImage::Pointer _normUTE2;
   typename TInputImage::Pointer _sumUTE;
   typename TInputImage::Pointer _R2s;
+
+  //With intermediatePrecision "half", _sumUTE is replaced by this after
+  //the R2* stage, and R2* is only ever stored in half. Both are expanded
+  //again one slab at a time.
+  bool _bHalfPrecision = false;
+  HalfImageType::Pointer _sumUTEHalf;
+  HalfImageType::Pointer _R2sHalf;
   typename TInputImage::Pointer _resolute;
 
   typename InternalMaskImageType::Pointer _airMask;
   typename InternalMaskImageType::Pointer _patVolMask;
 
+  //Warped templates used by the decision rules, see GetWarpedTemplate()
+  //and GetBrainTissue().
+  std::map<tc::ETemplateImages, typename InternalMaskImageType::Pointer> _warpedTemplates;
+  std::map<tc::ETemplateImages, typename TInputImage::ConstPointer> _warpedTissue;
+  typename ProbabilityImageType::Pointer _brainTissue;
+
+  //Inputs used after the histogram stage, cropped to the head if enabled.
+  typename TInputImage::ConstPointer _mrac;
+  typename TInputImage::ConstPointer _ute1;
+  typename TInputImage::ConstPointer _ute2;
+
+  RegionType _cropRegion;
+  bool _bCropped = false;
+
   boost::filesystem::path _dstDir;
 
   nlohmann::json _jsonParams;
@@ -209,12 +335,23 @@ protected:
   //typename ResoluteImageFilter::CoordListVector _coords;
   cluster_coord _coords;
 
-  typename tc::TemplateController _templateImageController;
+  std::shared_ptr<tc::TemplateController> _templateImageController;
+
+  //UTE2 -> template space, from the registration.
+  reg::CompositeTransformType::Pointer _inverseTransform;
+  typename TInputImage::Pointer _warpReference;
+
+  boost::filesystem::path _regFloatFileName;
+  boost::filesystem::path _regMaskFileName;
+
+  std::unique_ptr<ck::CheckpointStore> _checkpoints;
+  bool _bResuming = true;
 
   void CalculateHistogram();
   void GetKMeansMask(const HistoImageType::Pointer &h, HistoImageType::Pointer &outputImage);
   void FindClusterCoords();
   void NormaliseUTE();
+  void WriteRegistrationTarget();
 
   virtual void GenerateData() override;
 
@@ -229,6 +366,8 @@ ResoluteImageFilter<TInputImage,TMaskImage>
 {
   this->SetNumberOfRequiredInputs(4);
 
+  _templateImageController = std::make_shared<tc::TemplateController>();
+
   //Initialise histogram coords.
   _coords.x = 0;
   _coords.y = 0;
@@ -303,8 +442,10 @@ void ResoluteImageFilter<TInputImage, TMaskImage>::SetJSONParams(const nlohmann:
 { 
   _jsonParams = j; 
 
+  _templateImageController->SetSharedStore(_jsonParams.value("sharedTemplateDir", std::string()));
+
   try {
-    _templateImageController.SetPath(_jsonParams["regTemplatePath"].template get<std::string>());
+    _templateImageController->SetPath(_jsonParams["regTemplatePath"].template get<std::string>());
   } catch (...){
     LOG(ERROR) << "Failed to set path to template manifest!";
     throw false;
@@ -410,57 +551,197 @@ void ResoluteImageFilter<TInputImage, TMaskImage>::CalculateHistogram()
 
   _histogram = histogramToImageFilter->GetOutput();
 
-  typedef itk::ImageFileWriter<HistoImageType> WriterType;
-  WriterType::Pointer writer = WriterType::New();
+  WriteIntermediate<HistoImageType>(_histogram, "histogram.mhd", "histogram");
+
+}
+
+template< typename TInputImage, typename TMaskImage>
+template< typename TImage >
+typename TImage::Pointer ResoluteImageFilter<TInputImage, TMaskImage>::AllocateImage(const TInputImage *ref){
+
+  //Uninitialised image with the geometry of ref.
+  typename TImage::Pointer img = TImage::New();
+  img->CopyInformation(ref);
+  img->SetRegions(ref->GetLargestPossibleRegion());
+  img->Allocate();
+  return img;
+}
+
+template< typename TInputImage, typename TMaskImage>
+template< typename TImage >
+void ResoluteImageFilter<TInputImage, TMaskImage>::WriteIntermediate(const TImage *img,
+  const std::string &fileName, const std::string &description){
+
+  if (!_jsonParams.value("writeIntermediates", true))
+    return;
+
+  typedef itk::ImageFileWriter<TImage> WriterType;
+  typename WriterType::Pointer writer = WriterType::New();
 
   boost::filesystem::path outFileName = _dstDir;
-  outFileName /= "histogram.mhd";
+  outFileName /= fileName;
   writer->SetFileName(outFileName.string());
-  writer->SetInput(_histogram);
+  writer->SetInput(img);
 
   try {
     writer->Update();
   } catch (itk::ExceptionObject &ex){
-    LOG(ERROR) << "Could not write histogram!";
-    throw(ex);    
+    LOG(ERROR) << "Could not write " << description << "!";
+    throw(ex);
   }
 
 }
 
 template< typename TInputImage, typename TMaskImage>
-void ResoluteImageFilter<TInputImage, TMaskImage>::MakeAirMask(){
+void ResoluteImageFilter<TInputImage, TMaskImage>::CropToHead(){
+
+  //Finds the bounding box of the head (MRAC >= 1 or normalised UTE sum
+  //>= 1000) and crops the inputs to it, plus a margin. The margin must
+  //cover the patient volume closing and the Gaussian tails, so that the
+  //result pasted back into the full FOV matches the uncropped one.
+  _mrac = this->GetMRACImage();
+  _ute1 = this->GetUTEImage1();
+  _ute2 = this->GetUTEImage2();
+
+  const RegionType fullRegion = _mrac->GetLargestPossibleRegion();
+  _cropRegion = fullRegion;
+  _bCropped = false;
+
+  if (!_jsonParams.value("cropToHead", true)){
+    LOG(INFO) << "Head cropping disabled.";
+    return;
+  }
 
-  //Takes summed UTE images and creates binary mask of all voxels < 600 (air).
-  typedef itk::BinaryThresholdImageFilter <TInputImage, InternalMaskImageType> BinThresholdImageFilterType;
-  typename BinThresholdImageFilterType::Pointer binFilter = BinThresholdImageFilterType::New();
+  const float scaleFact1 = 1000.0/_coords.x;
+  const float scaleFact2 = 1000.0/_coords.y;
+
+  const SizeType size = fullRegion.GetSize();
+  const PixelType *mracBuf = _mrac->GetBufferPointer();
+  const PixelType *ute1Buf = _ute1->GetBufferPointer();
+  const PixelType *ute2Buf = _ute2->GetBufferPointer();
+
+  long lo[3] = { static_cast<long>(size[0]), static_cast<long>(size[1]), static_cast<long>(size[2]) };
+  long hi[3] = { -1, -1, -1 };
+
+  std::size_t i = 0;
+  for (long z = 0; z < static_cast<long>(size[2]); ++z)
+    for (long y = 0; y < static_cast<long>(size[1]); ++y)
+      for (long x = 0; x < static_cast<long>(size[0]); ++x, ++i){
+        const PixelType sum = static_cast<PixelType>(ute1Buf[i] * scaleFact1) +
+                              static_cast<PixelType>(ute2Buf[i] * scaleFact2);
+        if (mracBuf[i] >= 1 || sum >= 1000){
+          const long idx[3] = { x, y, z };
+          for (unsigned int d = 0; d < 3; ++d){
+            lo[d] = std::min(lo[d], idx[d]);
+            hi[d] = std::max(hi[d], idx[d]);
+          }
+        }
+      }
 
-  binFilter->SetInput( _sumUTE );
-  binFilter->SetLowerThreshold( 0 );
-  binFilter->SetUpperThreshold( 600 );
-  binFilter->SetInsideValue( 1 );
-  binFilter->Update();
+  if (hi[0] < 0){
+    LOG(WARNING) << "No head voxels found. Not cropping.";
+    return;
+  }
 
-  typedef itk::ImageDuplicator<InternalMaskImageType> DuplicatorType;
-  typename DuplicatorType::Pointer duplicator = DuplicatorType::New();
-  duplicator->SetInputImage(binFilter->GetOutput());
-  duplicator->Update();
-  _airMask = duplicator->GetOutput();
+  const double marginMM = _jsonParams.value("headCropMargin", 30.0);
+  const typename TInputImage::SpacingType spacing = _mrac->GetSpacing();
+  const IndexType fullStart = fullRegion.GetIndex();
 
-  typedef itk::ImageFileWriter<InternalMaskImageType> WriterType;
-  typename WriterType::Pointer writer = WriterType::New();
+  IndexType start;
+  SizeType cropSize;
 
-  boost::filesystem::path outFileName = _dstDir;
-  outFileName /= "air" + _fileExt;
-  writer->SetFileName(outFileName.string());
-  writer->SetInput(_airMask);
+  for (unsigned int d = 0; d < 3; ++d){
+    const long margin = std::max<long>( GetClosingRadius() + 1,
+      static_cast<long>(std::ceil(marginMM / spacing[d])) );
+    const long first = std::max(0L, lo[d] - margin);
+    const long last = std::min(static_cast<long>(size[d]) - 1, hi[d] + margin);
+    start[d] = fullStart[d] + first;
+    cropSize[d] = last - first + 1;
+  }
+
+  _cropRegion.SetIndex(start);
+  _cropRegion.SetSize(cropSize);
+
+  if (_cropRegion == fullRegion){
+    LOG(INFO) << "Head fills the field of view. Not cropping.";
+    return;
+  }
+
+  _bCropped = true;
+
+  LOG(INFO) << "Cropping to head: start = " << start << ", size = " << cropSize << " ("
+            << (100.0 * _cropRegion.GetNumberOfPixels()) / fullRegion.GetNumberOfPixels()
+            << "% of voxels).";
+
+  _mrac = CropImage(_mrac);
+  _ute1 = CropImage(_ute1);
+  _ute2 = CropImage(_ute2);
+
+}
+
+template< typename TInputImage, typename TMaskImage>
+typename TInputImage::Pointer ResoluteImageFilter<TInputImage, TMaskImage>::CropImage(const TInputImage *img,
+  const RegionType *region){
+
+  //The cropped image starts at index 0, with its origin moved to match.
+  typedef itk::RegionOfInterestImageFilter<TInputImage, TInputImage> ROIFilterType;
+  typename ROIFilterType::Pointer roiFilter = ROIFilterType::New();
+  roiFilter->SetInput(img);
+  roiFilter->SetRegionOfInterest(region ? *region : _cropRegion);
 
   try {
-    writer->Update();
+    roiFilter->Update();
   } catch (itk::ExceptionObject &ex){
-    LOG(ERROR) << "Could not write air mask!";
-    throw(ex);    
+    LOG(ERROR) << "Could not crop image to head!";
+    throw(ex);
   }
 
+  typename TInputImage::Pointer cropped = roiFilter->GetOutput();
+  cropped->DisconnectPipeline();
+  return cropped;
+}
+
+template< typename TInputImage, typename TMaskImage>
+typename TInputImage::Pointer ResoluteImageFilter<TInputImage, TMaskImage>::UncropImage(
+  const typename TInputImage::Pointer &img){
+
+  //Pastes img into a zero-filled image on the full MRAC grid.
+  if (!_bCropped)
+    return img;
+
+  typename TInputImage::ConstPointer mrac = this->GetMRACImage();
+
+  typename TInputImage::Pointer full = TInputImage::New();
+  full->CopyInformation(mrac);
+  full->SetRegions(mrac->GetLargestPossibleRegion());
+  full->Allocate();
+  full->FillBuffer(0);
+
+  itk::ImageRegionConstIterator<TInputImage> srcIt(img, img->GetLargestPossibleRegion());
+  itk::ImageRegionIterator<TInputImage> dstIt(full, _cropRegion);
+
+  for (; !srcIt.IsAtEnd(); ++srcIt, ++dstIt)
+    dstIt.Set(srcIt.Get());
+
+  return full;
+}
+
+template< typename TInputImage, typename TMaskImage>
+void ResoluteImageFilter<TInputImage, TMaskImage>::MakeAirMask(){
+
+  //Takes summed UTE images and creates binary mask of all voxels < 600 (air).
+  _airMask = AllocateImage<InternalMaskImageType>(_sumUTE);
+
+  const PixelType *sumBuf = _sumUTE->GetBufferPointer();
+  unsigned char *airBuf = _airMask->GetBufferPointer();
+
+  ParallelFor(0, _sumUTE->GetLargestPossibleRegion().GetNumberOfPixels(), [&](std::size_t first, std::size_t last){
+    for (std::size_t i = first; i < last; ++i)
+      airBuf[i] = (sumBuf[i] >= 0 && sumBuf[i] <= 600);
+  });
+
+  WriteIntermediate<InternalMaskImageType>(_airMask, "air" + _fileExt, "air mask");
+
 }
 
 template< typename TInputImage, typename TMaskImage>
@@ -471,85 +752,66 @@ void ResoluteImageFilter<TInputImage, TMaskImage>::MakePatientVolumeMask(){
   //MRAC after region growing = 1
   //snUTE > 1000 = 1
   //Add both masks and binarize.
-  const int RADIUS = 11;
+  const int RADIUS = GetClosingRadius();
 
-  typename TInputImage::ConstPointer mrac = this->GetMRACImage();
+  typename TInputImage::ConstPointer mrac = _mrac;
 
-  typedef itk::BinaryThresholdImageFilter <TInputImage, InternalMaskImageType> BinThresholdImageFilterType;
-  typename BinThresholdImageFilterType::Pointer binFilter = BinThresholdImageFilterType::New();
-  typename BinThresholdImageFilterType::Pointer binFilter2 = BinThresholdImageFilterType::New();
+  const typename TInputImage::RegionType region = mrac->GetLargestPossibleRegion();
+  const std::size_t size[3] = { region.GetSize()[0], region.GetSize()[1], region.GetSize()[2] };
+  const std::size_t nVox = region.GetNumberOfPixels();
 
-  binFilter->SetInput( mrac );
-  binFilter->SetLowerThreshold( 1 );
-  binFilter->SetInsideValue( 1 );
+  const PixelType maxPx = itk::NumericTraits<PixelType>::max();
+
+  //MRAC >= 1, closed with a ball of RADIUS via distance transforms. The
+  //closing runs one z-slab at a time, straight into the patient volume.
+  std::vector<unsigned char> mracMask(nVox);
+  const PixelType *mracBuf = mrac->GetBufferPointer();
+  for (std::size_t i = 0; i < nVox; ++i)
+    mracMask[i] = (mracBuf[i] >= 1 && mracBuf[i] <= maxPx);
+
+  _patVolMask = InternalMaskImageType::New();
+  _patVolMask->CopyInformation(mrac);
+  _patVolMask->SetRegions(region);
+  _patVolMask->Allocate();
 
-  typedef itk::BinaryBallStructuringElement<InternalMaskImageType::PixelType, InternalMaskImageType::ImageDimension>
-              StructuringElementType;
-  StructuringElementType structuringElement;
-  structuringElement.SetRadius(RADIUS);
-  structuringElement.CreateStructuringElement();
-  typedef itk::BinaryMorphologicalClosingImageFilter <InternalMaskImageType, InternalMaskImageType, StructuringElementType>
-          BinaryMorphologicalClosingImageFilterType;
-  BinaryMorphologicalClosingImageFilterType::Pointer closingFilter
-          = BinaryMorphologicalClosingImageFilterType::New();
-  closingFilter->SetInput(binFilter->GetOutput());
-  closingFilter->SetForegroundValue(1);
-  closingFilter->SetKernel(structuringElement);
-  closingFilter->Update();
+  unsigned char *patVolBuf = _patVolMask->GetBufferPointer();
+  BinaryClosingBallInSlabs(mracMask.data(), patVolBuf, size, RADIUS, GetSlabBudget());
+  mracMask = std::vector<unsigned char>();
 
   /*
-  typedef itk::BinaryFillholeImageFilter< CompImageType > FillHoleFilterType;
-  typename FillHoleFilterType::Pointer fillFilter = FillHoleFilterType::New();
-  fillFilter->SetInput(binFilter->GetOutput());
-  fillFilter->SetForegroundValue( 0 );
-  fillFilter->UpdateLargestPossibleRegion();
-  fillFilter->Update();
+  //Fill holes (FillHoles in MaskMorphology.hpp).
+  FillHoles(patVolBuf, size);
   */
 
   //Takes summed UTE images and creates binary mask of all voxels > 1000 (soft-tissue).
-  binFilter2->SetInput( _sumUTE );
-  binFilter2->SetLowerThreshold( 1000 );
-  binFilter2->SetInsideValue( 1 );
+  const PixelType *sumBuf = _sumUTE->GetBufferPointer();
 
-  typedef itk::AddImageFilter<InternalMaskImageType,InternalMaskImageType> AddFilterType;
-  typename AddFilterType::Pointer addFilter = AddFilterType::New();
+  ParallelFor(0, nVox, [&](std::size_t first, std::size_t last){
+    for (std::size_t i = first; i < last; ++i)
+      patVolBuf[i] = patVolBuf[i] + (sumBuf[i] >= 1000 && sumBuf[i] <= maxPx);
+  });
 
-  addFilter->SetInput1(closingFilter->GetOutput());
-  addFilter->SetInput2(binFilter2->GetOutput());
-  addFilter->Update();
+  //The labels are only written for review.
+  if (!_jsonParams.value("writeIntermediates", true))
+    return;
 
-  typedef itk::ConnectedComponentImageFilter <InternalMaskImageType, InternalMaskImageType >
-    ConnectedComponentImageFilterType;
- 
-  ConnectedComponentImageFilterType::Pointer connected =
-    ConnectedComponentImageFilterType::New ();
-  connected->SetInput(addFilter->GetOutput());
-  connected->Update();
+  std::vector<uint32_t> labels;
+  const unsigned long nObjects = LabelConnectedComponents(patVolBuf, size, labels);
  
-  LOG(INFO) << "Number of objects: " << connected->GetObjectCount() << std::endl;
+  LOG(INFO) << "Number of objects: " << nObjects << std::endl;
 
-  typedef itk::ImageFileWriter<InternalMaskImageType> WriterType;
-  typename WriterType::Pointer writer = WriterType::New();
+  typename InternalMaskImageType::Pointer connected = InternalMaskImageType::New();
+  connected->CopyInformation(mrac);
+  connected->SetRegions(region);
+  connected->Allocate();
 
-  boost::filesystem::path outFileName = _dstDir;
-  outFileName /= "patient_vol" + _fileExt;
-  writer->SetFileName(outFileName.string());
-  writer->SetInput(connected->GetOutput());
+  LOG_IF(WARNING, nObjects > 255) << "Object labels above 255 are saturated in the written mask.";
 
-  try {
-    writer->Update();
-  } catch (itk::ExceptionObject &ex){
-    LOG(ERROR) << "Could not write patient volume mask!";
-    throw(ex);    
-  }
-  
-  typedef itk::ImageDuplicator<InternalMaskImageType> DuplicatorType;
-  typename DuplicatorType::Pointer duplicator = DuplicatorType::New();
-  duplicator->SetInputImage(addFilter->GetOutput());
-  duplicator->Update();
-  _patVolMask = duplicator->GetOutput();
-  
+  unsigned char *connectedBuf = connected->GetBufferPointer();
+  for (std::size_t i = 0; i < nVox; ++i)
+    connectedBuf[i] = static_cast<unsigned char>(std::min<uint32_t>(labels[i], 255));
 
+  WriteIntermediate<InternalMaskImageType>(connected, "patient_vol" + _fileExt, "patient volume mask");
 
 }
 
@@ -558,122 +820,327 @@ void ResoluteImageFilter<TInputImage, TMaskImage>::MakeR2s(){
 
   float dUTE = (2.46 - 0.07)/1000.0;
 
-  typename TInputImage::ConstPointer ute1 = this->GetUTEImage1();
-  typename TInputImage::ConstPointer ute2 = this->GetUTEImage2();
+  const RegionType region = _ute1->GetLargestPossibleRegion();
+  const std::size_t nx = region.GetSize()[0];
+  const std::size_t ny = region.GetSize()[1];
+  const std::size_t nz = region.GetSize()[2];
+  const std::size_t plane = nx * ny;
+
+  //In half precision, finished slabs go straight to _R2sHalf and no float
+  //R2* volume is ever held.
+  if (_bHalfPrecision){
+    _R2sHalf = HalfImageType::New();
+    _R2sHalf->CopyInformation(_ute1);
+    _R2sHalf->SetRegions(region);
+    _R2sHalf->Allocate();
+  } else
+    _R2s = AllocateImage<TInputImage>(_ute1);
+
+  const PixelType *ute1Buf = _ute1->GetBufferPointer();
+  const PixelType *ute2Buf = _ute2->GetBufferPointer();
+  const PixelType *normUTE2Buf = _normUTE2->GetBufferPointer();
+  const unsigned char *patVolBuf = _patVolMask->GetBufferPointer();
 
-  typedef itk::LogImageFilter<TInputImage,TInputImage> LogFilterType;
-  //typedef itk::ImageDuplicator<InternalMaskImageType> DuplicatorType;
+  const float R2S_THRESHOLD = 10000;
 
-  typename LogFilterType::Pointer l1 = LogFilterType::New();
-  typename LogFilterType::Pointer l2 = LogFilterType::New();
+  //R2* is made one z-slab at a time in a buffer with a plane of halo on
+  //each side, for the 3x3x3 neighbourhood of the +inf fix. The fix works
+  //in place in raster order, so slabs are done in z order and the plane
+  //before each slab is carried over, already fixed, from the one before.
+  const std::vector<Slab> slabs = MakeSlabs(nz, plane * sizeof(PixelType), GetSlabBudget(), 1);
+
+  std::vector<PixelType> work;
+  std::vector<PixelType> carry;
+
+  for (const Slab &slab : slabs){
+
+    //work holds planes [haloFirst, haloLast); voxel i is at i - base.
+    const std::size_t base = slab.haloFirst * plane;
+    work.resize((slab.haloLast - slab.haloFirst) * plane);
+    PixelType *workBuf = work.data();
+
+    if (slab.haloFirst < slab.first)
+      std::copy(carry.begin(), carry.end(), workBuf);
+
+    //R2* = (log(UTE1) - log(UTE2)) / dTE inside the patient volume, with
+    //the same arithmetic as the Log/Subtract/Divide/Mask filters it
+    //replaces.
+    ParallelFor(slab.first * plane, slab.haloLast * plane, [&](std::size_t first, std::size_t last){
+      for (std::size_t i = first; i < last; ++i){
+        const PixelType l1 = static_cast<PixelType>( std::log( static_cast<double>(ute1Buf[i]) ) );
+        const PixelType l2 = static_cast<PixelType>( std::log( static_cast<double>(ute2Buf[i]) ) );
+        const PixelType diff = static_cast<PixelType>(l1 - l2);
+        workBuf[i - base] = (patVolBuf[i] != 0) ? static_cast<PixelType>(diff / dUTE) : 0;
+      }
+    });
+
+    //Make any +inf voxels equal to average of neighbourhood (that are not
+    //infs). As with the ITK neighbourhood iterator this replaces, edges
+    //repeat the border voxel and the (-1,-1,-1) neighbour is skipped.
+    for (std::size_t z = slab.first; z < slab.last; ++z){
+      for (std::size_t y = 0; y < ny; ++y){
+        for (std::size_t x = 0; x < nx; ++x){
+          const std::size_t i = (z * ny + y) * nx + x;
+
+          if (normUTE2Buf[i] > 1200)
+            workBuf[i - base] = 0;
+          else {
+            if (workBuf[i - base] > R2S_THRESHOLD){
+              float accum = 0.0;
+              int nV = 0;
+
+              for (int n = 1; n < 27; ++n){
+                const std::size_t zn = std::min<long>(nz - 1, std::max<long>(0, long(z) + n / 9 - 1));
+                const std::size_t yn = std::min<long>(ny - 1, std::max<long>(0, long(y) + (n / 3) % 3 - 1));
+                const std::size_t xn = std::min<long>(nx - 1, std::max<long>(0, long(x) + n % 3 - 1));
+
+                const PixelType v = workBuf[(zn * ny + yn) * nx + xn - base];
+                if (v <= R2S_THRESHOLD){
+                  accum += v;
+                  nV++;
+                }
+              }
+              workBuf[i - base] = accum/nV;
+            }
+          }
+        }
+      }
+    }
 
-  l1->SetInput(ute1);
-  l2->SetInput(ute2);
+    carry.assign(workBuf + ((slab.last - 1) * plane - base), workBuf + (slab.last * plane - base));
+
+    if (_bHalfPrecision){
+      uint16_t *r2sHalfBuf = _R2sHalf->GetBufferPointer();
+      ParallelFor(slab.first * plane, slab.last * plane, [&](std::size_t first, std::size_t last){
+        for (std::size_t i = first; i < last; ++i)
+          r2sHalfBuf[i] = FloatToHalf(static_cast<float>(workBuf[i - base]));
+      });
+    } else
+      std::copy(workBuf + (slab.first * plane - base), workBuf + (slab.last * plane - base),
+        _R2s->GetBufferPointer() + slab.first * plane);
+  }
 
-  typedef itk::SubtractImageFilter<TInputImage,TInputImage> SubtractFilterType;
-  typename SubtractFilterType::Pointer subFilter = SubtractFilterType::New();
+  if (!_bHalfPrecision)
+    WriteIntermediate<TInputImage>(_R2s, "R2s" + _fileExt, "R2* image");
+  else if (_jsonParams.value("writeIntermediates", true))
+    WriteIntermediate<TInputImage>(ExpandFromHalf<TInputImage>(_R2sHalf, region).GetPointer(), "R2s" + _fileExt, "R2* image");
 
-  subFilter->SetInput1(l1->GetOutput());
-  subFilter->SetInput2(l2->GetOutput());
+}
 
-  typedef itk::DivideImageFilter<TInputImage,TInputImage, TInputImage> DivideFilterType;
-  typename DivideFilterType::Pointer divideFilter = DivideFilterType::New();
+template< typename TInputImage, typename TMaskImage>
+void ResoluteImageFilter<TInputImage, TMaskImage>::PrepareRegistrationInputs(){
 
-  divideFilter->SetInput(subFilter->GetOutput());
-  divideFilter->SetConstant(dUTE);
+  _regFloatFileName = _dstDir / "ute2.nii.gz";
+  _regMaskFileName.clear();
 
-  typedef itk::MaskImageFilter< TInputImage, InternalMaskImageType, TInputImage > MaskFilterType;
-  typename MaskFilterType::Pointer maskFilter = MaskFilterType::New();
-  maskFilter->SetInput(divideFilter->GetOutput());
-  maskFilter->SetOutsideValue( 0 ); 
-  maskFilter->SetMaskImage( _patVolMask );
+  if (!_jsonParams.value("regPreprocess", false))
+    return;
 
-  try {
-    maskFilter->Update();
-  } catch (itk::ExceptionObject &ex){
-    LOG(ERROR) << "Could not calculate R2* image!";
-    throw(ex);    
-  }
-  
-  typedef itk::ImageDuplicator<TInputImage> DuplicatorType;
-  typename DuplicatorType::Pointer duplicator = DuplicatorType::New();
-  duplicator->SetInputImage(maskFilter->GetOutput());
-  duplicator->Update();
-  _R2s = duplicator->GetOutput();
+  mon::ScopedTimer timer("PrepareRegistrationInputs", "registration");
 
-  //Make any +inf voxels equal to average of neighbourhood (that are not infs).
-  itk::ImageRegionIterator<TInputImage> r2sIt(_R2s,_R2s->GetLargestPossibleRegion());
-  typedef itk::NeighborhoodIterator<TInputImage> NeighborhoodIteratorType;
+  typename TInputImage::Pointer ute2;
+  LoadImageFromFile(_regFloatFileName, ute2);
 
-  itk::ImageRegionIterator<TInputImage> ute2It(_normUTE2,_normUTE2->GetLargestPossibleRegion());
+  //Same grid as the patient volume. Air and neck outside it only add
+  //noise to the metric.
+  const RegionType region = ute2->GetLargestPossibleRegion();
+  const SizeType size = region.GetSize();
+  PixelType *buf = ute2->GetBufferPointer();
+  const unsigned char *patVol = _patVolMask->GetBufferPointer();
 
+  long lo[3] = { static_cast<long>(size[0]), static_cast<long>(size[1]), static_cast<long>(size[2]) };
+  long hi[3] = { -1, -1, -1 };
 
-  //3x3x3 neighbourhood
-  typename NeighborhoodIteratorType::RadiusType radius;
-  for (unsigned int i = 0; i < TInputImage::ImageDimension; ++i) 
-    radius[i] = 1;
-  // Initializes the iterators on the input & output image regions
-  NeighborhoodIteratorType it(radius, _R2s, 
-                          _R2s->GetLargestPossibleRegion());
+  std::size_t i = 0;
+  for (long z = 0; z < static_cast<long>(size[2]); ++z)
+    for (long y = 0; y < static_cast<long>(size[1]); ++y)
+      for (long x = 0; x < static_cast<long>(size[0]); ++x, ++i){
+        if (patVol[i] == 0){
+          buf[i] = 0;
+          continue;
+        }
+        const long idx[3] = { x, y, z };
+        for (unsigned int d = 0; d < 3; ++d){
+          lo[d] = std::min(lo[d], idx[d]);
+          hi[d] = std::max(hi[d], idx[d]);
+        }
+      }
 
-  const typename TInputImage::PixelType maxPX = itk::NumericTraits< typename TInputImage::PixelType >::max();
+  if (hi[0] < 0){
+    LOG(WARNING) << "Empty patient volume. Registering the unprocessed UTE2.";
+    return;
+  }
 
-  const float R2S_THRESHOLD = 10000;
+  //Crop to the patient volume, with a margin for the registration's
+  //smoothing pyramid.
+  const double REG_CROP_MARGIN_MM = 10.0;
+  const typename TInputImage::SpacingType spacing = ute2->GetSpacing();
+
+  RegionType headRegion;
+  for (unsigned int d = 0; d < 3; ++d){
+    const long margin = static_cast<long>(std::ceil(REG_CROP_MARGIN_MM / spacing[d]));
+    const long first = std::max(0L, lo[d] - margin);
+    const long last = std::min(static_cast<long>(size[d]) - 1, hi[d] + margin);
+    headRegion.SetIndex(d, region.GetIndex()[d] + first);
+    headRegion.SetSize(d, last - first + 1);
+  }
 
-  for (it.Begin(); ! it.IsAtEnd(); ++it, ++r2sIt, ++ute2It )
-  {
+  typename TInputImage::Pointer regImage = CropImage(ute2, &headRegion);
+  ute2 = nullptr;
+
+  //Downsample to the template resolution; never upsample.
+  const typename TInputImage::SpacingType tplSpacing =
+    _templateImageController->template GetImage<TInputImage>(tc::ETemplateImages::T1)->GetSpacing();
+
+  typename TInputImage::SpacingType regSpacing = spacing;
+  SizeType regSize = headRegion.GetSize();
+  typename TInputImage::PointType regOrigin = regImage->GetOrigin();
+  double fwhm = 0;
+
+  for (unsigned int d = 0; d < 3; ++d){
+    if (tplSpacing[d] <= spacing[d])
+      continue;
+    regSpacing[d] = tplSpacing[d];
+    regSize[d] = std::max<std::size_t>(1, static_cast<std::size_t>(std::ceil(regSize[d] * spacing[d] / regSpacing[d])));
+    //Anti-aliasing: the FWHM that takes the native resolution to the new one.
+    fwhm = std::max(fwhm, std::sqrt(regSpacing[d] * regSpacing[d] - spacing[d] * spacing[d]));
+  }
 
-    if (ute2It.Get() > 1200 )
-      r2sIt.Set(0);
-    else {
-      if (r2sIt.Get() > R2S_THRESHOLD){
-        float accum = 0.0;
-        int nV = 0;
-
-        for (int i = 1; i < it.Size(); ++i){
-          if (it.GetPixel(i) <= R2S_THRESHOLD){
-            accum += it.GetPixel(i);
-            nV++;
-          }
-        }
-        r2sIt.Set(accum/nV);
-      }
+  if (fwhm > 0){
+    //Keeps the first voxel edge where it was.
+    typename TInputImage::SpacingType shift;
+    for (unsigned int d = 0; d < 3; ++d)
+      shift[d] = 0.5 * (regSpacing[d] - spacing[d]);
+    regOrigin += regImage->GetDirection() * shift;
+
+    typedef itk::ResampleImageFilter<TInputImage, TInputImage, double> ResampleFilterType;
+    typename ResampleFilterType::Pointer resampler = ResampleFilterType::New();
+    resampler->SetInput(SmoothImage<TInputImage>(regImage.GetPointer(), fwhm));
+    resampler->SetOutputSpacing(regSpacing);
+    resampler->SetOutputOrigin(regOrigin);
+    resampler->SetOutputDirection(regImage->GetDirection());
+    resampler->SetSize(regSize);
+    resampler->SetDefaultPixelValue(0);
+
+    try {
+      resampler->Update();
+    } catch (itk::ExceptionObject &ex){
+      LOG(ERROR) << "Could not downsample UTE2 for registration!";
+      throw(ex);
     }
+
+    regImage = resampler->GetOutput();
+    regImage->DisconnectPipeline();
   }
 
+  LOG(INFO) << "Registration image: " << regSize << " voxels of " << regSpacing << " mm ("
+            << (100.0 * regImage->GetLargestPossibleRegion().GetNumberOfPixels()) / region.GetNumberOfPixels()
+            << "% of UTE2).";
+
+  _regFloatFileName = _dstDir / "ute2_reg.nii.gz";
+
   typedef itk::ImageFileWriter<TInputImage> WriterType;
   typename WriterType::Pointer writer = WriterType::New();
+  writer->SetFileName(_regFloatFileName.string());
+  writer->SetInput(regImage);
 
-  boost::filesystem::path outFileName = _dstDir;
-  outFileName /= "R2s" + _fileExt;
-  writer->SetFileName(outFileName.string());
-  writer->SetInput(_R2s);
+  try {
+    writer->Update();
+  } catch (itk::ExceptionObject &ex){
+    LOG(ERROR) << "Could not write " << _regFloatFileName;
+    throw(ex);
+  }
+
+  _regMaskFileName = _dstDir / "template_mask.nii.gz";
+  WriteTemplateMask(_regMaskFileName);
+
+}
+
+template< typename TInputImage, typename TMaskImage>
+void ResoluteImageFilter<TInputImage, TMaskImage>::WriteTemplateMask(const boost::filesystem::path &dst){
+
+  //Head foreground of the T1 template: above 10% of its 99th percentile,
+  //closed and filled as the patient volume is.
+  typename TInputImage::ConstPointer t1 =
+    _templateImageController->template GetImage<TInputImage>(tc::ETemplateImages::T1);
+
+  const RegionType region = t1->GetLargestPossibleRegion();
+  const std::size_t size[3] = { region.GetSize()[0], region.GetSize()[1], region.GetSize()[2] };
+  const std::size_t n = region.GetNumberOfPixels();
+  const PixelType *t1Buf = t1->GetBufferPointer();
+  const PixelType threshold = GetForegroundThreshold(t1Buf, n, 0.1);
+
+  typename InternalMaskImageType::Pointer mask = InternalMaskImageType::New();
+  mask->CopyInformation(t1);
+  mask->SetRegions(region);
+  mask->Allocate();
+
+  unsigned char *maskBuf = mask->GetBufferPointer();
+  for (std::size_t i = 0; i < n; ++i)
+    maskBuf[i] = (t1Buf[i] > threshold) ? 1 : 0;
+
+  BinaryClosingBall(maskBuf, size, PATIENT_VOLUME_CLOSING_RADIUS);
+  FillHoles(maskBuf, size);
+
+  typedef itk::ImageFileWriter<InternalMaskImageType> WriterType;
+  typename WriterType::Pointer writer = WriterType::New();
+  writer->SetFileName(dst.string());
+  writer->SetInput(mask);
 
   try {
     writer->Update();
   } catch (itk::ExceptionObject &ex){
-    LOG(ERROR) << "Could not write R2* image!";
-    throw(ex);    
+    LOG(ERROR) << "Could not write " << dst;
+    throw(ex);
   }
-  
+
 }
 
 template< typename TInputImage, typename TMaskImage>
-void ResoluteImageFilter<TInputImage, TMaskImage>::PerformRegistration(){
+std::string ResoluteImageFilter<TInputImage, TMaskImage>::GetRegistrationArgs(const std::string &key){
+
+  const nlohmann::json args = _jsonParams.value(key, nlohmann::json());
+  if (args.is_string() && !args.get<std::string>().empty())
+    return args.get<std::string>();
+
+  try {
+    const std::unique_ptr<reg::RegistrationBackend<TInputImage>> backend =
+      reg::CreateRegistrationBackend<TInputImage>(_jsonParams.value("regName", std::string("ANTS")));
+    return (key == "regAffineArgs") ? backend->GetDefaultAffineArgs() : backend->GetDefaultArgs();
+  } catch (bool) {
+    itk::ExceptionObject ex;
+    throw(ex);
+  }
 
-  typedef reg::ANTsReg<TInputImage> ANTsRegistrationType;
-  std::unique_ptr<ANTsRegistrationType>ANTsRegistration(new ANTsRegistrationType);
+}
+
+template< typename TInputImage, typename TMaskImage>
+void ResoluteImageFilter<TInputImage, TMaskImage>::PerformRegistration(const std::string &args,
+  const std::string &prefix){
 
   try {
-    ANTsRegistration->SetParams(_jsonParams["regArgs"]);
-    ANTsRegistration->SetOutputDirectory( _dstDir );
-    ANTsRegistration->SetOutputPrefix("ANTs-");
-    ANTsRegistration->SetReferenceFileName(_templateImageController.GetFilePath(tc::ETemplateImages::T1));
-
-    boost::filesystem::path floatFileName = _dstDir;
-    floatFileName /= "ute2.nii.gz";
-    ANTsRegistration->SetFloatingFileName(floatFileName);    
-    ANTsRegistration->Update();
+    std::unique_ptr<reg::RegistrationBackend<TInputImage>> backend =
+      reg::CreateRegistrationBackend<TInputImage>(_jsonParams.value("regName", std::string("ANTS")));
+
+    if (!_regMaskFileName.empty()){
+      backend->SetParams(reg::AddMaskArgument(args));
+      backend->SetMaskFileName(_regMaskFileName);
+    }
+    else
+      backend->SetParams(args);
+
+    backend->SetOutputDirectory( _dstDir );
+    backend->SetOutputPrefix(prefix);
+    backend->SetReferenceFileName(_templateImageController->GetFilePath(tc::ETemplateImages::T1));
+    backend->SetFloatingFileName(_regFloatFileName);
+
+    const std::string cacheDir = _jsonParams.value("regCacheDir", std::string());
+    if (!cacheDir.empty()){
+      const uintmax_t cacheBytes = static_cast<uintmax_t>(_jsonParams.value("regCacheMB", 10240.0) * 1024 * 1024);
+      backend->SetCache(std::make_shared<reg::RegistrationCache>(cacheDir, cacheBytes));
+    }
+
+    backend->Update();
   } catch (bool) {
     LOG(ERROR) << "Error during registration!";
     LOG(ERROR) << "Aborting!";
@@ -684,39 +1151,213 @@ void ResoluteImageFilter<TInputImage, TMaskImage>::PerformRegistration(){
 }
 
 template< typename TInputImage, typename TMaskImage>
-void ResoluteImageFilter<TInputImage, TMaskImage>::InvertMasks(
-  const boost::filesystem::path &src, const boost::filesystem::path &dst,
-  const std::string &interp){
+void ResoluteImageFilter<TInputImage, TMaskImage>::PerformTieredRegistration(){
+
+  const std::string affineArgs = GetRegistrationArgs("regAffineArgs");
+  const double minCC = _jsonParams.value("regTierMinCC", 0.4);
+  const double minBrainOverlap = _jsonParams.value("regTierMinBrainOverlap", 0.9);
+
+  const std::string affinePrefix = "ANTs-affine-";
+
+  //Results of an earlier run in this folder must not be mixed in.
+  const char *const outputs[] = { "Affine.txt", "Warp.nii.gz", "InverseWarp.nii.gz" };
+  for (const char *o : outputs){
+    boost::system::error_code ec;
+    boost::filesystem::remove(_dstDir / ("ANTs-" + std::string(o)), ec);
+    boost::filesystem::remove(_dstDir / (affinePrefix + o), ec);
+  }
+
+  LOG(INFO) << "Registering UTE to Atlas (affine)";
+  PerformRegistration(affineArgs, affinePrefix);
+
+  LoadInverseTransform(affinePrefix);
+  const RegistrationQuality q = AssessRegistration();
+  _inverseTransform = nullptr;
+  _warpReference = nullptr;
+
+  const bool bAccepted = (q.cc >= minCC) && (q.brainOverlap >= minBrainOverlap);
+
+  LOG(INFO) << "Affine registration: CC = " << q.cc << " (min " << minCC << "), brain overlap = "
+            << q.brainOverlap << " (min " << minBrainOverlap << "). "
+            << (bAccepted ? "Accepted." : "Escalating to deformable registration.");
+
+  if (bAccepted){
+    boost::system::error_code ec;
+    boost::filesystem::rename(_dstDir / (affinePrefix + "Affine.txt"), _dstDir / "ANTs-Affine.txt", ec);
+    if (ec){
+      LOG(ERROR) << "Could not rename the affine transform to ANTs-Affine.txt: " << ec.message();
+      throw false;
+    }
+  }
+  else {
+    LOG(INFO) << "Registering UTE to Atlas (deformable)";
+    PerformRegistration(GetRegistrationArgs("regArgs"), "ANTs-");
+  }
+
+  for (const char *o : outputs){
+    boost::system::error_code ec;
+    boost::filesystem::remove(_dstDir / (affinePrefix + o), ec);
+  }
+
+  nlohmann::json report = {
+    {"tier", bAccepted ? "affine" : "deformable"},
+    {"affineCC", q.cc},
+    {"affineBrainOverlap", q.brainOverlap},
+    {"minCC", minCC},
+    {"minBrainOverlap", minBrainOverlap}
+  };
+
+  std::ofstream ofs((_dstDir / "registration_quality.json").string());
+  ofs << report.dump(2) << std::endl;
+  LOG_IF(WARNING, !ofs.good()) << "Could not write registration_quality.json";
+
+}
+
+template< typename TInputImage, typename TMaskImage>
+void ResoluteImageFilter<TInputImage, TMaskImage>::LoadInverseTransform(const std::string &prefix){
 
+  //Equivalent to antsApplyTransforms -t [ANTs-Affine.txt,1] ANTs-InverseWarp.nii.gz,
+  //whichever backend wrote them. Without a warp (affine-only registration)
+  //only the inverse affine is applied.
   boost::filesystem::path targetFileName = _dstDir;
   targetFileName /= "ute2.nii.gz";
 
-  boost::filesystem::path nrrTransform = _dstDir;
-  nrrTransform /= "ANTs-InverseWarp.nii.gz";  
+  try {
+    _inverseTransform = reg::LoadTransforms(_dstDir / prefix).GetInverse();
+    LoadImageFromFile(targetFileName, _warpReference);
+  } catch (itk::ExceptionObject &ex){
+    LOG(ERROR) << "Could not load registration transforms from " << _dstDir;
+    throw(ex);
+  }
+
+}
+
+template< typename TInputImage, typename TMaskImage>
+typename TInputImage::Pointer ResoluteImageFilter<TInputImage, TMaskImage>::ResampleTemplate(
+  const tc::ETemplateImages e, const std::string &interp){
+
+  typedef itk::ResampleImageFilter<TInputImage, TInputImage, double> ResampleFilterType;
+  typename ResampleFilterType::Pointer resampler = ResampleFilterType::New();
+
+  if (interp == "NearestNeighbor"){
+    typedef itk::NearestNeighborInterpolateImageFunction<TInputImage, double> InterpolatorType;
+    resampler->SetInterpolator(InterpolatorType::New());
+  }
+  else {
+    typedef itk::LinearInterpolateImageFunction<TInputImage, double> InterpolatorType;
+    resampler->SetInterpolator(InterpolatorType::New());
+  }
+
+  //The cached template is shared by every study computed at once, and the
+  //resampler sets the requested region of its input. Each call gets its
+  //own image over the same pixels, so the studies do not race on it.
+  typename TInputImage::ConstPointer cached = _templateImageController->template GetImage<TInputImage>(e);
+  typename TInputImage::Pointer input = TInputImage::New();
+  input->CopyInformation(cached);
+  input->SetBufferedRegion(cached->GetBufferedRegion());
+  input->SetRequestedRegion(cached->GetBufferedRegion());
+  input->SetPixelContainer(const_cast<TInputImage *>(cached.GetPointer())->GetPixelContainer());
+  input->SetMetaDataDictionary(cached->GetMetaDataDictionary());
+
+  resampler->SetInput(input);
+  resampler->SetTransform(_inverseTransform);
+  resampler->SetReferenceImage(_warpReference);
+  resampler->UseReferenceImageOn();
+  resampler->SetDefaultPixelValue(0);
+  resampler->Update();
+
+  return resampler->GetOutput();
+
+}
 
-  boost::filesystem::path affTransform = _dstDir;
-  affTransform /= "ANTs-Affine.txt";  
+template< typename TInputImage, typename TMaskImage>
+void ResoluteImageFilter<TInputImage, TMaskImage>::InvertMasks(
+  const tc::ETemplateImages e, const std::string &interp){
 
-  std::stringstream ss;
+  //Resamples the cached template into UTE2 space in-process, rather than
+  //re-reading it and the transforms for each file.
+  boost::filesystem::path dst = _dstDir;
+  dst /= _templateImageController->GetFileName(e);
 
-  ss << "--verbose 0 ";
-  ss << "--default-value 0 ";
-  ss << "--interpolation " << interp << " ";
-  ss << "--reference-image " << targetFileName.string() << " ";
-  ss << "--transform [" << affTransform.string() << ",1] " << nrrTransform.string() << " ";
+  mon::ScopedTimer timer("InvertMasks: " + dst.filename().string(), "warp");
 
-  ss << "--input " << src.string() << " ";
-  ss << "--output " << dst.string();
+  LOG(INFO) << "Inverting " << dst.filename() << " (" << interp << ")";
 
-  LOG(INFO) << "Mask inversion parameters:";
-  LOG(INFO) << "";
-  LOG(INFO) << ss.str();
-  LOG(INFO) << "";  
+  typedef itk::ImageFileWriter<TInputImage> WriterType;
+  typename WriterType::Pointer writer = WriterType::New();
+  writer->SetFileName(dst.string());
+
+  typename TInputImage::Pointer warped;
 
-  std::vector<std::string> invertArgs;
-  boost::split_regex(invertArgs, ss.str(), boost::regex( " " ) ) ;
+  try {
+    warped = ResampleTemplate(e, interp);
+    writer->SetInput(warped);
+    writer->Update();
+  } catch (itk::ExceptionObject &ex){
+    LOG(ERROR) << "Could not invert " << dst.filename();
+    throw(ex);
+  }
 
-  ants::antsApplyTransforms( invertArgs, &std::cout);
+  //Kept in 8 bits for the decision rules, so they need not read the file
+  //back.
+  StoreWarpedTemplate(e, warped);
+
+}
+
+template< typename TInputImage, typename TMaskImage>
+typename ResoluteImageFilter<TInputImage, TMaskImage>::RegistrationQuality
+ResoluteImageFilter<TInputImage, TMaskImage>::AssessRegistration(){
+
+  mon::ScopedTimer timer("AssessRegistration", "registration");
+
+  typename TInputImage::Pointer t1;
+  typename TInputImage::Pointer brain;
+
+  try {
+    t1 = ResampleTemplate(tc::ETemplateImages::T1, "Linear");
+    brain = ResampleTemplate(tc::ETemplateImages::Brain, "NearestNeighbor");
+  } catch (itk::ExceptionObject &ex){
+    LOG(ERROR) << "Could not resample templates to assess registration";
+    throw(ex);
+  }
+
+  //All on the cropped UTE grid.
+  const std::size_t n = _warpReference->GetLargestPossibleRegion().GetNumberOfPixels();
+  const typename TInputImage::PixelType *ute = _warpReference->GetBufferPointer();
+  const typename TInputImage::PixelType *tpl = t1->GetBufferPointer();
+  const typename TInputImage::PixelType *br = brain->GetBufferPointer();
+  const unsigned char *patVol = _patVolMask->GetBufferPointer();
+  const unsigned char *air = _airMask->GetBufferPointer();
+
+  double sx = 0, sy = 0, sxx = 0, syy = 0, sxy = 0, count = 0;
+  double brainVoxels = 0, brainOnTissue = 0;
+
+  for (std::size_t i = 0; i < n; ++i){
+    if (patVol[i] == 0)
+      continue;
+
+    const double x = tpl[i];
+    const double y = ute[i];
+    sx += x; sy += y;
+    sxx += x * x; syy += y * y; sxy += x * y;
+    count++;
+
+    if (br[i] > 0.5){
+      brainVoxels++;
+      const float r2s = _bHalfPrecision ? HalfToFloat(_R2sHalf->GetBufferPointer()[i])
+                                        : static_cast<float>(_R2s->GetBufferPointer()[i]);
+      if (air[i] == 0 && r2s <= 100.0f)
+        brainOnTissue++;
+    }
+  }
+
+  RegistrationQuality q;
+  const double varX = count * sxx - sx * sx;
+  const double varY = count * syy - sy * sy;
+  q.cc = (varX > 0 && varY > 0) ? (count * sxy - sx * sy) / std::sqrt(varX * varY) : 0.0;
+  q.brainOverlap = (brainVoxels > 0) ? brainOnTissue / brainVoxels : 0.0;
+
+  return q;
 
 }
 
@@ -738,208 +1379,368 @@ void ResoluteImageFilter<TInputImage, TMaskImage>::LoadImageFromFile(
     dst = duplicator->GetOutput();
   } catch (itk::ExceptionObject &ex){
     LOG(ERROR) << "Could not read " << src;
-    throw(ex);    
+    throw(ex);
   }
 
 }
 
 template< typename TInputImage, typename TMaskImage>
-void ResoluteImageFilter<TInputImage, TMaskImage>::ApplyAlgorithm(){
+std::size_t ResoluteImageFilter<TInputImage, TMaskImage>::GetSlabBudget() const {
+
+  return static_cast<std::size_t>(_jsonParams.value("slabMemoryMB", 0.0) * 1024 * 1024);
 
-  boost::filesystem::path imgPath = _dstDir;
-  //Load GM
-  imgPath /= _templateImageController.GetFileName(tc::ETemplateImages::GM);
-  typename TInputImage::Pointer gm = TInputImage::New();
-  LoadImageFromFile(imgPath, gm);
+}
 
-  //Load WM
-  imgPath = _dstDir;
-  imgPath /= _templateImageController.GetFileName(tc::ETemplateImages::WM);
-  typename TInputImage::Pointer wm = TInputImage::New();
-  LoadImageFromFile(imgPath, wm);
+template< typename TInputImage, typename TMaskImage>
+ESmoothingBackend ResoluteImageFilter<TInputImage, TMaskImage>::GetSmoothingBackend() const {
 
-  //Load CSF
-  imgPath = _dstDir;
-  imgPath /= _templateImageController.GetFileName(tc::ETemplateImages::CSF);
-  typename TInputImage::Pointer csf = TInputImage::New();
-  LoadImageFromFile(imgPath, csf);
+  const ESmoothingBackend backend = ns::GetSmoothingBackend(_jsonParams.value("smoothingBackend", std::string("discrete")));
 
-  //(GM+WM)
-  typedef typename itk::AddImageFilter<TInputImage,TInputImage> AddFilterType;
-  typename AddFilterType::Pointer addFilter = AddFilterType::New();
+  if (backend == ESmoothingBackend::Recursive && GetSlabBudget() > 0){
+    DLOG(INFO) << "slabMemoryMB is set: smoothing with the discrete backend.";
+    return ESmoothingBackend::Discrete;
+  }
 
-  addFilter->SetInput1(gm);
-  addFilter->SetInput2(wm);
+  return backend;
+}
 
-  try {
-    addFilter->Update();
-  } catch (itk::ExceptionObject &ex){
-    LOG(ERROR) << "Could not write RESOLUTE image!";
-    throw(ex);    
+template< typename TInputImage, typename TMaskImage>
+unsigned int ResoluteImageFilter<TInputImage, TMaskImage>::GetInputShrinkFactor() const {
+
+  return std::max(1u, _jsonParams.value("inputShrinkFactor", 1u));
+
+}
+
+template< typename TInputImage, typename TMaskImage>
+int ResoluteImageFilter<TInputImage, TMaskImage>::GetClosingRadius() const {
+
+  const unsigned int factor = GetInputShrinkFactor();
+  return std::max(1, static_cast<int>(std::lround(static_cast<double>(PATIENT_VOLUME_CLOSING_RADIUS) / factor)));
+
+}
+
+template< typename TInputImage, typename TMaskImage>
+unsigned char ResoluteImageFilter<TInputImage, TMaskImage>::ToMaskValue(PixelType v){
+
+  //Anything but 0 and 1 maps to 2, so that it still fails both the == 0
+  //and == 1 tests, as it did in float.
+  return static_cast<unsigned char>( (v == 0) ? 0 : ((v == 1) ? 1 : 2) );
+
+}
+
+template< typename TInputImage, typename TMaskImage>
+unsigned char ResoluteImageFilter<TInputImage, TMaskImage>::ToBrainTissue(PixelType gm, PixelType wm){
+
+  //Rounded to the nearest step, but kept on the same side of one half as
+  //the float sum, so 2 * value > PROBABILITY_ONE gives the same answer as
+  //GM + WM > 0.5 for any pair, including sums within a step of 0.5.
+  const PixelType sum = gm + wm;
+  const double p = std::min(1.0, std::max(0.0, static_cast<double>(sum)));
+  const int q = static_cast<int>( std::floor(p * PROBABILITY_ONE + 0.5) );
+
+  if (sum > 0.5)
+    return static_cast<unsigned char>( std::max(q, PROBABILITY_ONE / 2 + 1) );
+
+  return static_cast<unsigned char>( std::min(q, PROBABILITY_ONE / 2) );
+
+}
+
+template< typename TInputImage, typename TMaskImage>
+typename ResoluteImageFilter<TInputImage, TMaskImage>::InternalMaskImageType::Pointer
+ResoluteImageFilter<TInputImage, TMaskImage>::ConvertTemplate(const TInputImage *img){
+
+  typename InternalMaskImageType::Pointer dst = InternalMaskImageType::New();
+  dst->CopyInformation(img);
+  dst->SetRegions(img->GetLargestPossibleRegion());
+  dst->Allocate();
+
+  const PixelType *in = img->GetBufferPointer();
+  unsigned char *out = dst->GetBufferPointer();
+
+  ParallelFor(0, img->GetLargestPossibleRegion().GetNumberOfPixels(), [&](std::size_t first, std::size_t last){
+    for (std::size_t i = first; i < last; ++i)
+      out[i] = ToMaskValue(in[i]);
+  });
+
+  return dst;
+
+}
+
+template< typename TInputImage, typename TMaskImage>
+typename ResoluteImageFilter<TInputImage, TMaskImage>::ProbabilityImageType::Pointer
+ResoluteImageFilter<TInputImage, TMaskImage>::MakeBrainTissue(const TInputImage *gm, const TInputImage *wm){
+
+  typename ProbabilityImageType::Pointer dst = ProbabilityImageType::New();
+  dst->CopyInformation(gm);
+  dst->SetRegions(gm->GetLargestPossibleRegion());
+  dst->Allocate();
+
+  const PixelType *gmBuf = gm->GetBufferPointer();
+  const PixelType *wmBuf = wm->GetBufferPointer();
+  unsigned char *out = dst->GetBufferPointer();
+
+  ParallelFor(0, gm->GetLargestPossibleRegion().GetNumberOfPixels(), [&](std::size_t first, std::size_t last){
+    for (std::size_t i = first; i < last; ++i)
+      out[i] = ToBrainTissue(gmBuf[i], wmBuf[i]);
+  });
+
+  return dst;
+
+}
+
+template< typename TInputImage, typename TMaskImage>
+void ResoluteImageFilter<TInputImage, TMaskImage>::StoreWarpedTemplate(const tc::ETemplateImages e,
+  const TInputImage *img){
+
+  if (e == tc::ETemplateImages::CSF)
+    return;
+
+  if (e != tc::ETemplateImages::GM && e != tc::ETemplateImages::WM){
+    _warpedTemplates[e] = ConvertTemplate(img);
+    return;
   }
 
-  /*
-  //(GM+WM) * MU = brain;
-  typedef typename itk::MultiplyImageFilter<TInputImage,TInputImage> MultiplyFilterType;
-  typename MultiplyFilterType::Pointer mult = MultiplyFilterType::New();
-  mult->SetInput1(addFilter->GetOutput());
-  mult->SetConstant(BRAIN_MU);
-
-  //CSF * MU;
-  typename MultiplyFilterType::Pointer mult2 = MultiplyFilterType::New();
-  mult2->SetInput1(csf);
-  mult2->SetConstant(CSF_MU);
-
-  //brain + CSF
-  typename AddFilterType::Pointer addFilter2 = AddFilterType::New();
-  addFilter2->SetInput1(mult->GetOutput());
-  addFilter2->SetInput2(mult2->GetOutput());
+  _warpedTissue[e] = img;
+
+  auto gm = _warpedTissue.find(tc::ETemplateImages::GM);
+  auto wm = _warpedTissue.find(tc::ETemplateImages::WM);
+  if (gm == _warpedTissue.end() || wm == _warpedTissue.end())
+    return;
+
+  _brainTissue = MakeBrainTissue(gm->second, wm->second);
+  _warpedTissue.clear();
+
+}
+
+template< typename TInputImage, typename TMaskImage>
+void ResoluteImageFilter<TInputImage, TMaskImage>::ReadWarpedTemplate(const tc::ETemplateImages e){
+
+  //The warp stage was resumed: read its output, once per run. The float
+  //copy is dropped as soon as it is converted.
+  boost::filesystem::path src = _dstDir;
+  src /= _templateImageController->GetFileName(e);
+
+  typedef itk::ImageFileReader<TInputImage> ReaderType;
+  typename ReaderType::Pointer reader = ReaderType::New();
+  reader->SetFileName(src.string());
 
   try {
-    addFilter2->Update();
+    reader->Update();
   } catch (itk::ExceptionObject &ex){
-    LOG(ERROR) << "Could not write RESOLUTE image!";
-    throw(ex);    
-  }*/
+    LOG(ERROR) << "Could not read " << src;
+    throw(ex);
+  }
+
+  StoreWarpedTemplate(e, reader->GetOutput());
+
+}
+
+template< typename TInputImage, typename TMaskImage>
+typename ResoluteImageFilter<TInputImage, TMaskImage>::InternalMaskImageType::Pointer
+ResoluteImageFilter<TInputImage, TMaskImage>::GetWarpedTemplate(const tc::ETemplateImages e){
+
+  if (_warpedTemplates.find(e) == _warpedTemplates.end())
+    ReadWarpedTemplate(e);
+
+  return _warpedTemplates[e];
+
+}
+
+template< typename TInputImage, typename TMaskImage>
+typename ResoluteImageFilter<TInputImage, TMaskImage>::ProbabilityImageType::Pointer
+ResoluteImageFilter<TInputImage, TMaskImage>::GetBrainTissue(){
 
-  typename TInputImage::Pointer brain = addFilter->GetOutput();
+  if (!_brainTissue){
+    for (auto e : { tc::ETemplateImages::GM, tc::ETemplateImages::WM }){
+      if (_warpedTissue.find(e) == _warpedTissue.end())
+        ReadWarpedTemplate(e);
+    }
+  }
 
-  //Smooth the R2* by FWHM.
-  const float variance = pow(FWHM / (2.0 * sqrt(2.0 * log(2.0))),2.0);
+  return _brainTissue;
 
-  typedef itk::DiscreteGaussianImageFilter<TInputImage, TInputImage> GaussFilterType;
-  typename GaussFilterType::Pointer blurFilter = GaussFilterType::New();
-  blurFilter->SetInput(_R2s);
-  blurFilter->SetVariance( variance );
-  blurFilter->Update();
+}
 
-  typename TInputImage::Pointer G = blurFilter->GetOutput();
+template< typename TInputImage, typename TMaskImage>
+void ResoluteImageFilter<TInputImage, TMaskImage>::ApplyAlgorithm(){
+
+  const ESmoothingBackend backend = GetSmoothingBackend();
+  const unsigned int smoothThreads = std::max(1u, itk::MultiThreader::GetGlobalDefaultNumberOfThreads() / 2);
+  const float smoothFWHM = 5.0;
 
-  typename TInputImage::Pointer outputImage = TInputImage::New();
+  typedef typename TInputImage::Pointer ImagePointer;
+
+  //The RESOLUTE map is returned as the filter output. The files, and the
+  //smoothed copies only written for review, are optional.
+  const bool bWriteImages = _jsonParams.value("writeIntermediates", true);
+
+  //The smoothed MRAC is independent, so it runs alongside the decision
+  //rules, on half of the threads.
+  typename TInputImage::ConstPointer mrac = _mrac;
+  const std::size_t slabBudget = GetSlabBudget();
+  std::future<ImagePointer> sMRACJob;
+  if (bWriteImages){
+    sMRACJob = std::async(std::launch::async, [&](){
+      return SmoothImageInSlabs<TInputImage>(mrac.GetPointer(), smoothFWHM, slabBudget, backend, smoothThreads);
+    });
+  }
 
-  typedef itk::ImageDuplicator<TInputImage> DuplicatorType;
-  typename DuplicatorType::Pointer duplicator = DuplicatorType::New();
-  duplicator->SetInputImage(GetUTEImage2());
-  duplicator->Update();
-  outputImage = duplicator->GetOutput();
+  typename TInputImage::Pointer outputImage = AllocateImage<TInputImage>(_mrac);
   outputImage->FillBuffer(0);
 
-  //Load brain_mask
-  imgPath = _dstDir;
-  imgPath /= _templateImageController.GetFileName(tc::ETemplateImages::Brain);
-  typename TInputImage::Pointer brain_mask = TInputImage::New();
-  LoadImageFromFile(imgPath, brain_mask);
-
-  //Load frontal sinus
-  imgPath = _dstDir;
-  imgPath /= _templateImageController.GetFileName(tc::ETemplateImages::Frontal);
-  typename TInputImage::Pointer frontal = TInputImage::New();
-  LoadImageFromFile(imgPath, frontal);
-
-  //Load skull base
-  imgPath = _dstDir;
-  imgPath /= _templateImageController.GetFileName(tc::ETemplateImages::Skull);
-  typename TInputImage::Pointer skull_base = TInputImage::New();
-  LoadImageFromFile(imgPath, skull_base);
-
-  //Load mastoid
-  imgPath = _dstDir;
-  imgPath /= _templateImageController.GetFileName(tc::ETemplateImages::Mastoid);
-  typename TInputImage::Pointer mastoid = TInputImage::New();
-  LoadImageFromFile(imgPath, mastoid);
-
-  //Load nasal
-  imgPath = _dstDir;
-  imgPath /= _templateImageController.GetFileName(tc::ETemplateImages::Nasal);
-  typename TInputImage::Pointer nasal = TInputImage::New();
-  LoadImageFromFile(imgPath, nasal);
-
-
-  itk::ImageRegionConstIterator<TInputImage> brainMaskIt(brain_mask,brain_mask->GetLargestPossibleRegion());
-  itk::ImageRegionConstIterator<TInputImage> brainIt(brain,brain->GetLargestPossibleRegion());
-  itk::ImageRegionConstIterator<TInputImage> csfIt(csf,csf->GetLargestPossibleRegion());
-
-  itk::ImageRegionConstIterator<InternalMaskImageType> airIt(_airMask,_airMask->GetLargestPossibleRegion());
-  itk::ImageRegionConstIterator<TInputImage> frontalIt(frontal,frontal->GetLargestPossibleRegion());
-  itk::ImageRegionConstIterator<TInputImage> r2sIt(_R2s,_R2s->GetLargestPossibleRegion());
-  itk::ImageRegionConstIterator<TInputImage> skBaseIt(skull_base,skull_base->GetLargestPossibleRegion());
-  itk::ImageRegionConstIterator<TInputImage> mastIt(mastoid,mastoid->GetLargestPossibleRegion());
-  itk::ImageRegionConstIterator<InternalMaskImageType> patVolIt(_patVolMask,_patVolMask->GetLargestPossibleRegion());
-  itk::ImageRegionConstIterator<TInputImage> nasalIt(nasal,nasal->GetLargestPossibleRegion());
-  itk::ImageRegionConstIterator<TInputImage> sumIt(_sumUTE,_sumUTE->GetLargestPossibleRegion());
-  itk::ImageRegionConstIterator<TInputImage> gIt(G,G->GetLargestPossibleRegion());
-
-  itk::ImageRegionIterator<TInputImage> outIt(outputImage,outputImage->GetLargestPossibleRegion());
-
-  while(!brainMaskIt.IsAtEnd())
-    {     
-      //If is brain
-      if (brainMaskIt.Get() == 1){
-        //outIt.Set(brainIt.Get());
-        if (brainIt.Get() > 0.5 ) //If > 50% brain
-          outIt.Set(BRAIN_MU);
-        else
-          outIt.Set(CSF_MU);
-      }
-      else { //Check if air
-        if (airIt.Get() == 1){
-          //If in Frontal sinus
-          if (frontalIt.Get() == 1){
-            outIt.Set(FRONTAL_SINUS_MU);
-          } else {
-            //Check mix
-            if (gIt.Get() > 300)
-              outIt.Set(AIR_TISSUE_MIX_MU);
-            else
-              outIt.Set(FRONTAL_SINUS_MU);
-          }
+  //Tissue maps are held as 8-bit fixed point (255 = 1.0). CSF is not
+  //needed by the decision rules below, so it is not loaded.
+  const tc::ETemplateImages templates[] = {
+    tc::ETemplateImages::GM, tc::ETemplateImages::WM, tc::ETemplateImages::Brain,
+    tc::ETemplateImages::Frontal, tc::ETemplateImages::Skull, tc::ETemplateImages::Mastoid,
+    tc::ETemplateImages::Nasal
+  };
+
+  {
+    mon::ScopedTimer timer("Load templates");
+    for (auto e : templates)
+      GetWarpedTemplate(e);
+  }
+
+  //The smoothed R2* and the decision rules run one z-slab at a time. Each
+  //slab of R2* is smoothed with enough halo planes to match smoothing the
+  //whole volume, so no full smoothed R2* is held. Per plane, the slab
+  //holds the R2* halo copy, the filter output and working image and, in
+  //half precision, the expanded snUTE.
+  const RegionType fullRegion = _mrac->GetLargestPossibleRegion();
+  const std::size_t planeVoxels = fullRegion.GetSize()[0] * fullRegion.GetSize()[1];
+  const std::size_t bytesPerPlane = planeVoxels * 4 * sizeof(PixelType);
+  const std::size_t halo = GetSmoothingHaloPlanes(FWHM, _mrac->GetSpacing()[2]);
+
+  const std::vector<Slab> slabs = MakeSlabs(fullRegion.GetSize()[2], bytesPerPlane, slabBudget, halo);
+
+  LOG(INFO) << "Applying decision rules in " << slabs.size() << " slab(s).";
+
+  for (const Slab &slab : slabs){
+
+    RegionType slabRegion = fullRegion;
+    slabRegion.SetIndex(2, fullRegion.GetIndex()[2] + slab.first);
+    slabRegion.SetSize(2, slab.last - slab.first);
+
+    std::unique_ptr<mon::ScopedTimer> timer(new mon::ScopedTimer("Smooth R2*"));
 
-        } else { // Check R2* > 100
-          float r2sVal = r2sIt.Get();
-          if (r2sVal > 100){
-            //Check skull base
-            if (skBaseIt.Get() == 0){ //If not skull base
-              outIt.Set( GetMU(r2sVal) ); // f(R2*)
+    //Half precision inputs are expanded to float for this slab only.
+    typename TInputImage::ConstPointer r2s = _R2s;
+    typename TInputImage::ConstPointer sum = _sumUTE;
+    if (_bHalfPrecision){
+      RegionType haloRegion = fullRegion;
+      haloRegion.SetIndex(2, fullRegion.GetIndex()[2] + slab.haloFirst);
+      haloRegion.SetSize(2, slab.haloLast - slab.haloFirst);
+
+      r2s = ExpandFromHalf<TInputImage>(_R2sHalf, haloRegion);
+      sum = ExpandFromHalf<TInputImage>(_sumUTEHalf, slabRegion);
+    }
+
+    //Smooth the R2* by FWHM.
+    typename TInputImage::ConstPointer g = SmoothSlab<TInputImage>(r2s.GetPointer(), FWHM, slabRegion, backend);
+
+    timer.reset();
+    timer.reset(new mon::ScopedTimer("Decision rules"));
+
+    const typename ProbabilityImageType::Pointer brain_tissue = GetBrainTissue();
+    const typename InternalMaskImageType::Pointer brain_mask = GetWarpedTemplate(tc::ETemplateImages::Brain);
+    const typename InternalMaskImageType::Pointer frontal = GetWarpedTemplate(tc::ETemplateImages::Frontal);
+    const typename InternalMaskImageType::Pointer skull_base = GetWarpedTemplate(tc::ETemplateImages::Skull);
+    const typename InternalMaskImageType::Pointer mastoid = GetWarpedTemplate(tc::ETemplateImages::Mastoid);
+    const typename InternalMaskImageType::Pointer nasal = GetWarpedTemplate(tc::ETemplateImages::Nasal);
+
+    itk::ImageRegionConstIterator<InternalMaskImageType> brainMaskIt(brain_mask,slabRegion);
+    itk::ImageRegionConstIterator<ProbabilityImageType> tissueIt(brain_tissue,slabRegion);
+
+    itk::ImageRegionConstIterator<InternalMaskImageType> airIt(_airMask,slabRegion);
+    itk::ImageRegionConstIterator<InternalMaskImageType> frontalIt(frontal,slabRegion);
+    itk::ImageRegionConstIterator<TInputImage> r2sIt(r2s,slabRegion);
+    itk::ImageRegionConstIterator<InternalMaskImageType> skBaseIt(skull_base,slabRegion);
+    itk::ImageRegionConstIterator<InternalMaskImageType> mastIt(mastoid,slabRegion);
+    itk::ImageRegionConstIterator<InternalMaskImageType> patVolIt(_patVolMask,slabRegion);
+    itk::ImageRegionConstIterator<InternalMaskImageType> nasalIt(nasal,slabRegion);
+    itk::ImageRegionConstIterator<TInputImage> sumIt(sum,slabRegion);
+    itk::ImageRegionConstIterator<TInputImage> gIt(g,slabRegion);
+
+    itk::ImageRegionIterator<TInputImage> outIt(outputImage,slabRegion);
+
+    while(!brainMaskIt.IsAtEnd())
+      {     
+        //If is brain
+        if (brainMaskIt.Get() == 1){
+          //GM + WM > 0.5, in fixed point.
+          if (2 * tissueIt.Get() > PROBABILITY_ONE ) //If > 50% brain
+            outIt.Set(BRAIN_MU);
+          else
+            outIt.Set(CSF_MU);
+        }
+        else { //Check if air
+          if (airIt.Get() == 1){
+            //If in Frontal sinus
+            if (frontalIt.Get() == 1){
+              outIt.Set(FRONTAL_SINUS_MU);
             } else {
-              if (mastIt.Get() == 1){ //If in mastoid space
-                outIt.Set( MASTOID_MU );
-              } else { // Check R2* > 300
-                if (r2sVal > 300)
-                  outIt.Set( GetMU(r2sVal) );
-                else
-                  outIt.Set(R2S_LESS_300_MU);
-              }
+              //Check mix
+              if (gIt.Get() > 300)
+                outIt.Set(AIR_TISSUE_MIX_MU);
+              else
+                outIt.Set(FRONTAL_SINUS_MU);
             }
 
-          } else {
-            if (patVolIt.Get() == 0){//If outside patient volume
-              outIt.Set( OUTSIDE_MU );
-            } else {//If inside patient volume
-              if (nasalIt.Get() == 0){
-                outIt.Set( NASAL_OUTSIDE_MU );
+          } else { // Check R2* > 100
+            float r2sVal = r2sIt.Get();
+            if (r2sVal > 100){
+              //Check skull base
+              if (skBaseIt.Get() == 0){ //If not skull base
+                outIt.Set( GetMU(r2sVal) ); // f(R2*)
+              } else {
+                if (mastIt.Get() == 1){ //If in mastoid space
+                  outIt.Set( MASTOID_MU );
+                } else { // Check R2* > 300
+                  if (r2sVal > 300)
+                    outIt.Set( GetMU(r2sVal) );
+                  else
+                    outIt.Set(R2S_LESS_300_MU);
+                }
               }
-              else { // If inside nasal septa
-                float snUTEVal = sumIt.Get();
-                if (snUTEVal > 1600)
-                  outIt.Set( SN_OVER_1600_MU );
-                else if (snUTEVal > 800)
-                  outIt.Set( SN_800_1600_MU );
-                  else //snUTEVal <= 800 
-                    outIt.Set( SN_BELOW_800_MU );
+
+            } else {
+              if (patVolIt.Get() == 0){//If outside patient volume
+                outIt.Set( OUTSIDE_MU );
+              } else {//If inside patient volume
+                if (nasalIt.Get() == 0){
+                  outIt.Set( NASAL_OUTSIDE_MU );
+                }
+                else { // If inside nasal septa
+                  float snUTEVal = sumIt.Get();
+                  if (snUTEVal > 1600)
+                    outIt.Set( SN_OVER_1600_MU );
+                  else if (snUTEVal > 800)
+                    outIt.Set( SN_800_1600_MU );
+                    else //snUTEVal <= 800 
+                      outIt.Set( SN_BELOW_800_MU );
+                }
               }
             }
           }
         }
+
+        ++brainMaskIt; ++tissueIt; ++airIt;
+        ++frontalIt; ++r2sIt; ++skBaseIt;
+        ++mastIt; ++patVolIt; ++nasalIt;
+        ++sumIt; ++gIt;
+        ++outIt;
       }
+  }
 
-      ++brainMaskIt; ++brainIt; ++airIt;
-      ++frontalIt; ++r2sIt; ++skBaseIt;
-      ++mastIt; ++patVolIt; ++nasalIt;
-      ++sumIt; ++gIt; ++csfIt;
-      ++outIt;
-    }
+  _warpedTemplates.clear();
+  _brainTissue = nullptr;
 
+  //Final images are pasted back into the full field of view.
+  _resolute = UncropImage(outputImage);
 
+  if (!bWriteImages)
+    return;
 
   typedef itk::ImageFileWriter<TInputImage> WriterType;
   typename WriterType::Pointer writer = WriterType::New();
@@ -947,7 +1748,7 @@ void ResoluteImageFilter<TInputImage, TMaskImage>::ApplyAlgorithm(){
   boost::filesystem::path outFileName = _dstDir;
   outFileName /= "RESOLUTE" + _fileExt;
   writer->SetFileName(outFileName.string());
-  writer->SetInput(outputImage);
+  writer->SetInput(_resolute);
 
   try {
     writer->Update();
@@ -956,21 +1757,12 @@ void ResoluteImageFilter<TInputImage, TMaskImage>::ApplyAlgorithm(){
     throw(ex);    
   }
 
-  duplicator->SetInputImage(outputImage);
-  duplicator->Update();
-  _resolute = duplicator->GetOutput();
-
-  const float smoothFWHM = 5.0;
-  const float v2 = pow( smoothFWHM / (2.0 * sqrt(2.0 * log(2.0))),2.0);
-
-  blurFilter->SetInput( _resolute );
-  blurFilter->SetVariance( v2 );
-  blurFilter->Update();
+  mon::ScopedStage stage("smoothing");
 
   outFileName = _dstDir;
   outFileName /= "sRESOLUTE" + _fileExt;
   writer->SetFileName(outFileName.string());
-  writer->SetInput(blurFilter->GetOutput());
+  writer->SetInput(UncropImage(SmoothImageInSlabs<TInputImage>(outputImage.GetPointer(), smoothFWHM, slabBudget, backend)));
 
   try {
     writer->Update();
@@ -979,14 +1771,10 @@ void ResoluteImageFilter<TInputImage, TMaskImage>::ApplyAlgorithm(){
     throw(ex);    
   }
 
-  blurFilter->SetInput( this->GetMRACImage() );
-  blurFilter->SetVariance( v2 );
-  blurFilter->Update();
-
   outFileName = _dstDir;
   outFileName /= "sMRAC" + _fileExt;
   writer->SetFileName(outFileName.string());
-  writer->SetInput(blurFilter->GetOutput());
+  writer->SetInput(UncropImage(sMRACJob.get()));
 
   try {
     writer->Update();
@@ -1002,144 +1790,52 @@ void ResoluteImageFilter<TInputImage, TMaskImage>::GetKMeansMask(const HistoImag
 
   LOG(INFO) << "Starting k-means";
 
-  const unsigned int NUMOFCLASSES=2;
   _coords.x = 0;
   _coords.y = 0;
 
-  typedef itk::Statistics::JointDomainImageToListSampleAdaptor< HistoImageType >   AdaptorType;
-  typename AdaptorType::Pointer adaptor = AdaptorType::New();
-  adaptor->SetImage( h );
-
-  typedef typename AdaptorType::MeasurementVectorType  MeasurementVectorType;
-
-  // Create the K-d tree structure
-  typedef itk::Statistics::WeightedCentroidKdTreeGenerator< AdaptorType > TreeGeneratorType;
-
-  typename TreeGeneratorType::Pointer treeGenerator = TreeGeneratorType::New();
-
-  treeGenerator->SetSample( adaptor );
-  treeGenerator->SetBucketSize( 16 );
-  treeGenerator->Update();
-
-  DLOG(INFO) << "Generated K-d tree";
+  const typename HistoImageType::SizeType size = h->GetLargestPossibleRegion().GetSize();
+  const typename HistoImageType::PointType origin = h->GetOrigin();
+  const typename HistoImageType::SpacingType spacing = h->GetSpacing();
+
+  //Clusters in the joint (x, y, count) domain, using bin centres as coordinates.
+  HistogramKMeans kmeans;
+  kmeans.SetHistogram(h->GetBufferPointer(), size[0], size[1]);
+  kmeans.SetOrigin(origin[0], origin[1]);
+  kmeans.SetSpacing(spacing[0], spacing[1]);
+  kmeans.SetMaximumIterations(500);
+  kmeans.SetTolerance(_jsonParams.value("kmeansTolerance", 1e-6));
+
+  //Legacy seeds reproduce the previous ITK estimator exactly. Data-driven
+  //seeds are optional, as they can settle in a neighbouring local minimum.
+  if (_jsonParams.value("kmeansInit", std::string("legacy")) != "data"){
+    //The seed count is of voxels per bin, which shrinking divides by
+    //factor^3.
+    const double factor = GetInputShrinkFactor();
+    HistogramKMeans::Centroid softTissue = {100, 100, 1000 / (factor * factor * factor)};
+    HistogramKMeans::Centroid background = {100, 100, 0};
+    kmeans.SetInitialCentroids(softTissue, background);
+  }
 
-  typedef typename TreeGeneratorType::KdTreeType TreeType;
-  typedef itk::Statistics::KdTreeBasedKmeansEstimator<TreeType> EstimatorType;
+  kmeans.Compute();
 
-  typename EstimatorType::Pointer estimator = EstimatorType::New();
-  typename EstimatorType::ParametersType initialMeans( NUMOFCLASSES*3 );
-  
-  initialMeans[0] = 100;
-  initialMeans[1] = 100;
-  initialMeans[2] = 1000;
-  initialMeans[3] = 100;
-  initialMeans[4] = 100;
-  initialMeans[5] = 0;
-  /*initialMeans[6] = 100;
-  initialMeans[7] = 100;
-  initialMeans[8] = 0; */
-
-  estimator->SetParameters( initialMeans );
-  estimator->SetKdTree( treeGenerator->GetOutput() );
-  estimator->SetMaximumIteration( 500 );
-  estimator->SetCentroidPositionChangesThreshold(0);
-  estimator->StartOptimization();
-
-  LOG(INFO) << "k-means estimation complete.";
-
-  typename EstimatorType::ParametersType estimatedMeans = estimator->GetParameters();
-  //LOG(INFO) << "Estimated means: " << estimatedMeans;
-  //typename EstimatorType::ParametersType estimatedCentroids;
-
-  LOG(INFO) << "Centre of soft-tissue cluster = (" << (int)estimatedMeans[0]-1 << "," << (int)estimatedMeans[1]-1 << ")";
-  _coords.x = (int)estimatedMeans[0]-1;
-  _coords.y = (int)estimatedMeans[1]-1;
-
-  //Test histo start
-  typedef itk::Statistics::DistanceToCentroidMembershipFunction< MeasurementVectorType > MembershipFunctionType;
-  typedef MembershipFunctionType::Pointer MembershipFunctionPointer;
-  typedef itk::Statistics::MinimumDecisionRule DecisionRuleType;
-  typename DecisionRuleType::Pointer decisionRule = DecisionRuleType::New();
-
-  typedef itk::Statistics::SampleClassifierFilter< AdaptorType > ClassifierType;
-  ClassifierType::Pointer classifier = ClassifierType::New();
- 
-  classifier->SetDecisionRule(decisionRule);
-  classifier->SetInput( adaptor );
-  classifier->SetNumberOfClasses( NUMOFCLASSES );
- 
-  typedef ClassifierType::ClassLabelVectorObjectType               ClassLabelVectorObjectType;
-  typedef ClassifierType::ClassLabelVectorType                     ClassLabelVectorType;
-  typedef ClassifierType::MembershipFunctionVectorObjectType       MembershipFunctionVectorObjectType;
-  typedef ClassifierType::MembershipFunctionVectorType             MembershipFunctionVectorType;
- 
-  ClassLabelVectorObjectType::Pointer  classLabelsObject = ClassLabelVectorObjectType::New();
-  classifier->SetClassLabels( classLabelsObject );
- 
-  ClassLabelVectorType &  classLabelsVector = classLabelsObject->Get();
-  classLabelsVector.push_back( 1 );
-  classLabelsVector.push_back( 0 );
-  //classLabelsVector.push_back( 300 );
-
-  MembershipFunctionVectorObjectType::Pointer membershipFunctionsObject =
-    MembershipFunctionVectorObjectType::New();
-  classifier->SetMembershipFunctions( membershipFunctionsObject );
- 
-  MembershipFunctionVectorType &  membershipFunctionsVector = membershipFunctionsObject->Get();
- 
-  MembershipFunctionType::CentroidType origin( adaptor->GetMeasurementVectorSize() );
-  int index = 0;
-  for ( unsigned int i = 0 ; i < NUMOFCLASSES ; i++ )
-    {
-    MembershipFunctionPointer membershipFunction = MembershipFunctionType::New();
-    for ( unsigned int j = 0 ; j < adaptor->GetMeasurementVectorSize(); j++ )
-      {
-      origin[j] = estimatedMeans[index++];
-      }
-    membershipFunction->SetCentroid( origin );
-    membershipFunctionsVector.push_back( membershipFunction.GetPointer() );
-    }
- 
-  classifier->Update();
-
-  // Prepare the output image
-  //HistoImageType::Pointer outputImage = HistoImageType::New();
-  //outputImage->SetRegions(h->GetLargestPossibleRegion());
-  //outputImage->Allocate();
-  typedef itk::ImageDuplicator<HistoImageType> DuplicatorType;
-  typename DuplicatorType::Pointer duplicator = DuplicatorType::New();
-  duplicator->SetInputImage(h);
-  duplicator->Update();
-  outputImage = duplicator->GetOutput();
-  outputImage->FillBuffer(0);
- 
-  const ClassifierType::MembershipSampleType* membershipSample = classifier->GetOutput();
-  ClassifierType::MembershipSampleType::ConstIterator iter = membershipSample->Begin();
+  LOG(INFO) << "k-means estimation complete (" << kmeans.GetNumberOfNonZeroBins() << " non-zero bins, "
+            << kmeans.GetNumberOfIterations() << " iterations).";
 
-  // Setup the output image iterator - this is automatically synchronized with the membership iterator since the sample is an adaptor
-  itk::ImageRegionIteratorWithIndex<HistoImageType> outputIterator(outputImage,outputImage->GetLargestPossibleRegion());
-  outputIterator.GoToBegin();
+  const HistogramKMeans::Centroid &centre = kmeans.GetCentroid(0);
 
-  while ( iter != membershipSample->End() )
-  {
-    //DLOG(INFO) << "measurement vector = " << iter.GetMeasurementVector()
-    //          << "class label = " << iter.GetClassLabel();
+  LOG(INFO) << "Centre of soft-tissue cluster = (" << (int)centre.x-1 << "," << (int)centre.y-1 << ")";
+  _coords.x = (int)centre.x-1;
+  _coords.y = (int)centre.y-1;
 
-    int classLabel = iter.GetClassLabel();
-    outputIterator.Set(classLabel);
-    ++iter;
-    ++outputIterator;
-  }
+  //Label image: 1 = soft-tissue cluster, 0 = background.
+  outputImage = HistoImageType::New();
+  outputImage->CopyInformation(h);
+  outputImage->SetRegions(h->GetLargestPossibleRegion());
+  outputImage->Allocate();
 
-  typedef itk::ImageFileWriter< HistoImageType  > HistoWriterType;
-  HistoWriterType::Pointer outputWriter = HistoWriterType::New();
+  kmeans.Classify(outputImage->GetBufferPointer());
 
-  boost::filesystem::path outFileName = _dstDir;
-  outFileName /= "k-means.mhd";
-  outputWriter->SetFileName(outFileName.string());
-  outputWriter->SetInput(outputImage);
-  outputWriter->Update();
-  //Test histo end
+  WriteIntermediate<HistoImageType>(outputImage, "k-means.mhd", "k-means labels");
 
 }
 
@@ -1207,44 +1903,42 @@ void ResoluteImageFilter<TInputImage, TMaskImage>::NormaliseUTE(){
     LOG(INFO) <<  "\tUTE2 * " <<  scaleFact2;
   }
 
-  typename TInputImage::ConstPointer ute1 = this->GetUTEImage1();
+  //Scaled UTEs and their sum in one pass, with the same arithmetic as
+  //itk::MultiplyImageFilter and itk::AddImageFilter.
+  _normUTE1 = AllocateImage<TInputImage>(_ute1);
+  _normUTE2 = AllocateImage<TInputImage>(_ute1);
+  _sumUTE = AllocateImage<TInputImage>(_ute1);
+
+  const PixelType *ute1Buf = _ute1->GetBufferPointer();
+  const PixelType *ute2Buf = _ute2->GetBufferPointer();
+  PixelType *norm1Buf = _normUTE1->GetBufferPointer();
+  PixelType *norm2Buf = _normUTE2->GetBufferPointer();
+  PixelType *sumBuf = _sumUTE->GetBufferPointer();
+
+  ParallelFor(0, _ute1->GetLargestPossibleRegion().GetNumberOfPixels(), [&](std::size_t first, std::size_t last){
+    for (std::size_t i = first; i < last; ++i){
+      norm1Buf[i] = static_cast<PixelType>(ute1Buf[i] * scaleFact1);
+      norm2Buf[i] = static_cast<PixelType>(ute2Buf[i] * scaleFact2);
+      sumBuf[i] = static_cast<PixelType>(norm1Buf[i] + norm2Buf[i]);
+    }
+  });
+
+  WriteIntermediate<TInputImage>(_normUTE1, "ute1.nii.gz", "UTE1");
+  WriteIntermediate<TInputImage>(_sumUTE, "snUTE" + _fileExt, "snUTE");
 
-  typedef typename itk::MultiplyImageFilter<TInputImage,TInputImage> MultiplyType;
-  typename MultiplyType::Pointer mult = MultiplyType::New();
-  mult->SetInput1(ute1);
-  mult->SetConstant(scaleFact1);
+}
+
+template< typename TInputImage, typename TMaskImage>
+void ResoluteImageFilter<TInputImage, TMaskImage>::WriteRegistrationTarget(){
 
+  //Always written: it is the registration's floating image.
   typedef itk::ImageFileWriter<TInputImage> WriterType;
   typename WriterType::Pointer writer = WriterType::New();
 
   boost::filesystem::path outFileName = _dstDir;
-  outFileName /= "ute1.nii.gz";
-  writer->SetFileName(outFileName.string());
-  writer->SetInput(mult->GetOutput());
-
-  try {
-    writer->Update();
-  } catch (itk::ExceptionObject &ex){
-    LOG(ERROR) << "Could not write UTE1!";
-    throw(ex);    
-  }
-
-  typedef itk::ImageDuplicator<TInputImage> DuplicatorType;
-  typename DuplicatorType::Pointer duplicator = DuplicatorType::New();
-  duplicator->SetInputImage(mult->GetOutput());
-  duplicator->Update();
-
-  _normUTE1 = duplicator->GetOutput();
-
-  typename TInputImage::ConstPointer ute2 = this->GetUTEImage2();
-
-  mult->SetInput1(ute2);
-  mult->SetConstant(scaleFact2);
-
-  outFileName = _dstDir;
   outFileName /= "ute2.nii.gz";
   writer->SetFileName(outFileName.string());
-  writer->SetInput(mult->GetOutput());
+  writer->SetInput(_normUTE2);
 
   try {
     writer->Update();
@@ -1253,34 +1947,54 @@ void ResoluteImageFilter<TInputImage, TMaskImage>::NormaliseUTE(){
     throw(ex);    
   }
 
-  duplicator->SetInputImage(mult->GetOutput());
-  duplicator->Update();
+}
 
-  _normUTE2 = duplicator->GetOutput();
+template< typename TInputImage, typename TMaskImage>
+std::string ResoluteImageFilter<TInputImage, TMaskImage>::GetInputFingerprint(){
+
+  ck::Hasher h;
+  h.Add(std::string(VERSION_NO));
+  h.AddImage(this->GetMRACImage().GetPointer());
+  h.AddImage(this->GetUTEImage1().GetPointer());
+  h.AddImage(this->GetUTEImage2().GetPointer());
+
+  h.AddValue<double>(_jsonParams.value("kmeansTolerance", 1e-6));
+  h.Add(_jsonParams.value("kmeansInit", std::string("legacy")));
+  if (GetInputShrinkFactor() != 1)
+    h.AddValue<unsigned int>(GetInputShrinkFactor());
+  h.AddValue<bool>(_jsonParams.value("cropToHead", true));
+  h.AddValue<double>(_jsonParams.value("headCropMargin", 30.0));
+  h.Add(_fileExt);
+
+  return h.GetHex();
+}
 
-  typedef itk::AddImageFilter<TInputImage,TInputImage> AddFilterType;
-  typename AddFilterType::Pointer addFilter = AddFilterType::New();
+template< typename TInputImage, typename TMaskImage>
+bool ResoluteImageFilter<TInputImage, TMaskImage>::ResumeStage(const std::string &stage, const std::string &fingerprint){
 
-  addFilter->SetInput1(_normUTE1);
-  addFilter->SetInput2(_normUTE2);
-  addFilter->Update();
+  if (!_checkpoints || fingerprint.empty())
+    return false;
 
-  duplicator->SetInputImage(addFilter->GetOutput());
-  duplicator->Update();
+  if (_bResuming && _checkpoints->IsValid(stage, fingerprint)){
+    LOG(INFO) << "Resuming: " << stage << " is unchanged, reusing its outputs.";
+    mon::MetricsRegistry::GetInstance().Increment("resolute_checkpoint_requests_total", 1.0,
+      { { "stage", stage }, { "result", "reused" } });
+    return true;
+  }
 
-  _sumUTE = duplicator->GetOutput();
+  mon::MetricsRegistry::GetInstance().Increment("resolute_checkpoint_requests_total", 1.0,
+    { { "stage", stage }, { "result", "run" } });
+  _bResuming = false;
+  _checkpoints->Invalidate(stage);
+  return false;
+}
 
-  outFileName = _dstDir;
-  outFileName /= "snUTE" + _fileExt;
-  writer->SetFileName(outFileName.string());
-  writer->SetInput(_sumUTE);
+template< typename TInputImage, typename TMaskImage>
+void ResoluteImageFilter<TInputImage, TMaskImage>::CommitStage(const std::string &stage,
+  const std::string &fingerprint, const std::vector<boost::filesystem::path> &outputs){
 
-  try {
-    writer->Update();
-  } catch (itk::ExceptionObject &ex){
-    LOG(ERROR) << "Could not write snUTE!";
-    throw(ex);    
-  }  
+  if (_checkpoints && !fingerprint.empty())
+    _checkpoints->Commit(stage, fingerprint, outputs);
 
 }
 
@@ -1296,77 +2010,205 @@ void ResoluteImageFilter<TInputImage, TMaskImage>::GenerateData()
   output->SetRegions(mrac->GetLargestPossibleRegion());
   output->Allocate();
 
-  LOG(INFO) << "Initialised input images.";
-  CalculateHistogram();
-  LOG(INFO) << "Calculated histogram.";
+  const tc::ETemplateImages masks[] = {
+    tc::ETemplateImages::Mastoid,
+    tc::ETemplateImages::Frontal,
+    tc::ETemplateImages::Nasal,
+    tc::ETemplateImages::Skull,
+    tc::ETemplateImages::Brain
+  };
 
-  LOG(INFO) << "Finding centroid";
-  FindClusterCoords();
-  LOG(INFO) << "Centroid found at...";
+  const tc::ETemplateImages tissues[] = {
+    tc::ETemplateImages::GM,
+    tc::ETemplateImages::WM,
+    tc::ETemplateImages::CSF
+  };
 
-  LOG(INFO) << "Normalising UTE";
-  NormaliseUTE();
-  LOG(INFO) << "Normalisation complete.";
+  //The stages up to R2* take seconds and always run. Registration and
+  //the stages after it are skipped on a rerun if nothing they depend on
+  //has changed. Each fingerprint includes the one before it.
+  _checkpoints.reset();
+  _bResuming = true;
+  _warpedTemplates.clear();
+  _warpedTissue.clear();
+  _brainTissue = nullptr;
+
+  const std::string precision = _jsonParams.value("intermediatePrecision", std::string("float"));
+  LOG_IF(WARNING, precision != "float" && precision != "half")
+    << "Unknown intermediate precision '" << precision << "'. Using float.";
+  _bHalfPrecision = (precision == "half");
+
+  std::string registrationKey, warpsKey, algorithmKey;
+
+  if (_jsonParams.value("checkpoint", true)){
+    mon::ScopedTimer timer("Fingerprint inputs");
+    _checkpoints.reset(new ck::CheckpointStore(_dstDir));
+
+    ck::Hasher registration;
+    registration.Add(GetInputFingerprint());
+    registration.Add(nlohmann::json(GetRegistrationArgs("regArgs")).dump());
+    const std::string regName = _jsonParams.value("regName", std::string("ANTS"));
+    if (regName != "ANTS")
+      registration.Add(regName);
+    registration.AddValue<bool>(_jsonParams.value("regPreprocess", false));
+    if (_jsonParams.value("regTiered", false)){
+      registration.Add(GetRegistrationArgs("regAffineArgs"));
+      registration.AddValue<double>(_jsonParams.value("regTierMinCC", 0.4));
+      registration.AddValue<double>(_jsonParams.value("regTierMinBrainOverlap", 0.9));
+    }
+    registration.Add(_templateImageController->GetFingerprint());
+    registrationKey = registration.GetHex();
+
+    ck::Hasher warps;
+    warps.Add(registrationKey);
+    for (auto e : masks)
+      warps.Add(_templateImageController->GetFileName(e));
+    for (auto e : tissues)
+      warps.Add(_templateImageController->GetFileName(e));
+    warpsKey = warps.GetHex();
+
+    //Resuming the last stage reloads RESOLUTE from disk, so it is only
+    //checkpointed when that file is written.
+    if (_jsonParams.value("writeIntermediates", true)){
+      ck::Hasher algorithm;
+      algorithm.Add(warpsKey);
+      algorithm.AddValue<int>(static_cast<int>(GetSmoothingBackend()));
+      algorithm.AddValue<bool>(_bHalfPrecision);
+      algorithmKey = algorithm.GetHex();
+    }
+  }
 
-  LOG(INFO) << "Calculating air mask";
-  MakeAirMask();
-  LOG(INFO) << "Air mask calculation complete.";
+  {
+    mon::ScopedStage stage("histogram");
+    LOG(INFO) << "Initialised input images.";
+    CalculateHistogram();
+    LOG(INFO) << "Calculated histogram.";
+  }
 
-  LOG(INFO) << "Calculating patient volume";
-  MakePatientVolumeMask();
-  LOG(INFO) << "Patient volume calculation complete.";
+  {
+    mon::ScopedStage stage("k-means");
+    LOG(INFO) << "Finding centroid";
+    FindClusterCoords();
+    LOG(INFO) << "Centroid found at...";
+  }
 
-  LOG(INFO) << "Calculating R2*";
-  MakeR2s();
-  LOG(INFO) << "R2* calculation complete.";
+  {
+    mon::ScopedStage stage("crop");
+    LOG(INFO) << "Cropping to head";
+    CropToHead();
+    LOG(INFO) << "Cropping complete.";
+  }
 
-  LOG(INFO) << "Registering UTE to Atlas";
-  PerformRegistration();
-  LOG(INFO) << "Registration complete.";
+  {
+    mon::ScopedStage stage("normalise");
+    LOG(INFO) << "Normalising UTE";
+    NormaliseUTE();
+    WriteRegistrationTarget();
+    LOG(INFO) << "Normalisation complete.";
+  }
 
-  LOG(INFO) << "Inverting masks";
+  {
+    mon::ScopedStage stage("masks");
+    LOG(INFO) << "Calculating air mask";
+    MakeAirMask();
+    LOG(INFO) << "Air mask calculation complete.";
+
+    LOG(INFO) << "Calculating patient volume";
+    MakePatientVolumeMask();
+    LOG(INFO) << "Patient volume calculation complete.";
+  }
 
-  boost::filesystem::path t1TemplateDir = _templateImageController.GetFilePath(tc::ETemplateImages::T1);
-  t1TemplateDir = t1TemplateDir.parent_path();
+  {
+    mon::ScopedStage stage("R2*");
+    LOG(INFO) << "Calculating R2*";
+    MakeR2s();
+    LOG(INFO) << "R2* calculation complete.";
+
+    //The UTEs are only needed up to R2*. ute2.nii.gz on disk is the
+    //registration target.
+    _normUTE1 = nullptr;
+    _normUTE2 = nullptr;
+    _ute1 = nullptr;
+    _ute2 = nullptr;
+
+    //The rest only reads it, so half precision is enough from here.
+    if (_bHalfPrecision){
+      LOG(INFO) << "Storing snUTE in half precision.";
+      _sumUTEHalf = CompressToHalf<TInputImage>(_sumUTE);
+      _sumUTE = nullptr;
+    }
+  }
 
-  std::vector<std::string> masks = {
-    _templateImageController.GetFileName(tc::ETemplateImages::Mastoid), 
-    _templateImageController.GetFileName(tc::ETemplateImages::Frontal),
-    _templateImageController.GetFileName(tc::ETemplateImages::Nasal),
-    _templateImageController.GetFileName(tc::ETemplateImages::Skull),
-    _templateImageController.GetFileName(tc::ETemplateImages::Brain),
-  };
+  {
+    mon::ScopedStage stage("registration");
+
+    if (!ResumeStage("registration", registrationKey)){
+      PrepareRegistrationInputs();
+
+      if (_jsonParams.value("regTiered", false))
+        PerformTieredRegistration();
+      else {
+        LOG(INFO) << "Registering UTE to Atlas";
+        PerformRegistration(GetRegistrationArgs("regArgs"), "ANTs-");
+      }
+      LOG(INFO) << "Registration complete.";
 
-  for (auto m : masks){
-    boost::filesystem::path srcPath = t1TemplateDir;
-    srcPath /= m;
+      //Affine-only registrations have no warp.
+      std::vector<boost::filesystem::path> outputs = { _dstDir / "ANTs-Affine.txt" };
+      if (boost::filesystem::exists(_dstDir / "ANTs-InverseWarp.nii.gz"))
+        outputs.push_back(_dstDir / "ANTs-InverseWarp.nii.gz");
 
-    boost::filesystem::path dstPath = _dstDir;
-    dstPath /= m;
-    InvertMasks(srcPath, dstPath, "NearestNeighbor");
+      CommitStage("registration", registrationKey, outputs);
+    }
   }
 
-  std::vector<std::string> tissues = {
-    _templateImageController.GetFileName(tc::ETemplateImages::GM),
-    _templateImageController.GetFileName(tc::ETemplateImages::WM),
-    _templateImageController.GetFileName(tc::ETemplateImages::CSF),
-  }; 
+  {
+    mon::ScopedStage stage("warps");
+
+    if (!ResumeStage("warps", warpsKey)){
+      LOG(INFO) << "Inverting masks";
 
-  for (auto t : tissues){
-    boost::filesystem::path srcPath = t1TemplateDir;
-    srcPath /= t;
+      LoadInverseTransform();
 
-    boost::filesystem::path dstPath = _dstDir;
-    dstPath /= t;
-    InvertMasks(srcPath, dstPath, "Linear");
-  }   
+      std::vector<boost::filesystem::path> outputs;
 
-  LOG(INFO) << "Inversion complete.";
+      for (auto m : masks){
+        InvertMasks(m, "NearestNeighbor");
+        outputs.push_back(_dstDir / _templateImageController->GetFileName(m));
+      }
+
+      for (auto t : tissues){
+        InvertMasks(t, "Linear");
+        outputs.push_back(_dstDir / _templateImageController->GetFileName(t));
+      }
 
-  //Apply masking 2.4.5
-  LOG(INFO) << "Applying RESOLUTE algorithm...";
-  ApplyAlgorithm();
-  LOG(INFO) << "RESOLUTE complete.";
+      _inverseTransform = nullptr;
+      _warpReference = nullptr;
+
+      LOG(INFO) << "Inversion complete.";
+
+      CommitStage("warps", warpsKey, outputs);
+    }
+  }
+
+  {
+    mon::ScopedStage stage("ApplyAlgorithm");
+
+    const boost::filesystem::path resolutePath = _dstDir / ("RESOLUTE" + _fileExt);
+
+    if (ResumeStage("ApplyAlgorithm", algorithmKey)){
+      LoadImageFromFile(resolutePath, _resolute);
+    }
+    else {
+      //Apply masking 2.4.5
+      LOG(INFO) << "Applying RESOLUTE algorithm...";
+      ApplyAlgorithm();
+      LOG(INFO) << "RESOLUTE complete.";
+
+      CommitStage("ApplyAlgorithm", algorithmKey,
+        { resolutePath, _dstDir / ("sRESOLUTE" + _fileExt), _dstDir / ("sMRAC" + _fileExt) });
+    }
+  }
 
   this->GraftOutput(_resolute);
 
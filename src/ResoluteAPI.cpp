@@ -0,0 +1,430 @@
+/*
+   ResoluteAPI.cpp
+
+   Author:      Benjamin A. Thomas
+
+   Copyright 2018 Institute of Nuclear Medicine, University College London.
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+
+   libresolute: the C++ and C interfaces.
+ */
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstring>
+#include <map>
+#include <mutex>
+
+#include <boost/filesystem.hpp>
+#include <boost/algorithm/string/replace.hpp>
+#include <glog/logging.h>
+#include <nlohmann/json.hpp>
+
+#include <itkImportImageFilter.h>
+
+#include "EnvironmentInfo.h"
+#include "ParamSkeleton.hpp"
+#include "Resolute.hpp"
+#include "MemoryMonitor.hpp"
+
+#include "ResoluteAPI.hpp"
+#include "resolute.h"
+
+namespace fs = boost::filesystem;
+using json = nlohmann::json;
+
+typedef itk::Image<float,3> ImageType;
+
+namespace resolute {
+
+//Wraps the caller's buffer without copying it.
+static ImageType::Pointer ImportVolume(const VolumeView &v, const std::string &name){
+
+  if (v.data == nullptr)
+    throw Error(name + " has no data");
+
+  typedef itk::ImportImageFilter<float, 3> ImportFilterType;
+  ImportFilterType::Pointer importer = ImportFilterType::New();
+
+  ImportFilterType::IndexType start;
+  start.Fill(0);
+  ImportFilterType::SizeType size;
+  ImportFilterType::SpacingType spacing;
+  ImportFilterType::OriginType origin;
+  ImportFilterType::DirectionType direction;
+
+  for (unsigned int d = 0; d < 3; ++d){
+    if (v.geometry.size[d] == 0 || !(v.geometry.spacing[d] > 0))
+      throw Error(name + " has an invalid size or spacing");
+
+    size[d] = v.geometry.size[d];
+    spacing[d] = v.geometry.spacing[d];
+    origin[d] = v.geometry.origin[d];
+    for (unsigned int e = 0; e < 3; ++e)
+      direction[d][e] = v.geometry.direction[3 * d + e];
+  }
+
+  ImportFilterType::RegionType region(start, size);
+  importer->SetRegion(region);
+  importer->SetSpacing(spacing);
+  importer->SetOrigin(origin);
+  importer->SetDirection(direction);
+  importer->SetImportPointer(const_cast<float *>(v.data), region.GetNumberOfPixels(), false);
+
+  try {
+    importer->Update();
+  } catch (itk::ExceptionObject &ex){
+    throw Error("Could not import " + name + ": " + ex.GetDescription());
+  }
+
+  ImageType::Pointer img = importer->GetOutput();
+  img->DisconnectPipeline();
+  return img;
+}
+
+static ImageType::Pointer CopyVolume(const VolumeView &v, const std::string &name){
+
+  ImageType::Pointer view = ImportVolume(v, name);
+
+  ImageType::Pointer img = ImageType::New();
+  img->CopyInformation(view);
+  img->SetRegions(view->GetLargestPossibleRegion());
+  img->Allocate();
+  std::copy(v.data, v.data + view->GetLargestPossibleRegion().GetNumberOfPixels(), img->GetBufferPointer());
+  return img;
+}
+
+static Geometry GetGeometry(const ImageType *img){
+
+  Geometry g;
+  for (unsigned int d = 0; d < 3; ++d){
+    g.size[d] = img->GetLargestPossibleRegion().GetSize()[d];
+    g.spacing[d] = img->GetSpacing()[d];
+    g.origin[d] = img->GetOrigin()[d];
+    for (unsigned int e = 0; e < 3; ++e)
+      g.direction[3 * d + e] = img->GetDirection()[d][e];
+  }
+  return g;
+}
+
+static bool SameGeometry(const Geometry &a, const Geometry &b){
+
+  const double tolerance = 1e-4;
+  for (unsigned int d = 0; d < 3; ++d){
+    if (a.size[d] != b.size[d] ||
+        std::abs(a.spacing[d] - b.spacing[d]) > tolerance ||
+        std::abs(a.origin[d] - b.origin[d]) > tolerance)
+      return false;
+  }
+  for (unsigned int i = 0; i < 9; ++i){
+    if (std::abs(a.direction[i] - b.direction[i]) > tolerance)
+      return false;
+  }
+  return true;
+}
+
+//Removed with everything in it on destruction, unless kept.
+struct ScratchFolder {
+
+  ScratchFolder(const std::string &parent, const std::string &pattern, bool keep) : _bKeep(keep) {
+    const fs::path root = parent.empty() ? fs::temp_directory_path() : fs::path(parent);
+    try {
+      path = root / fs::unique_path(pattern);
+      fs::create_directories(path);
+    } catch (const fs::filesystem_error &e){
+      throw Error("Cannot create a scratch folder in " + root.string());
+    }
+  };
+
+  ~ScratchFolder(){
+    if (_bKeep)
+      return;
+    boost::system::error_code ec;
+    fs::remove_all(path, ec);
+    LOG_IF(WARNING, ec) << "Could not remove " << path << ": " << ec.message();
+  };
+
+  fs::path path;
+
+private:
+
+  bool _bKeep;
+
+  ScratchFolder(const ScratchFolder &); //purposely not implemented
+  void operator=(const ScratchFolder &);  //purposely not implemented
+
+};
+
+struct Processor::Impl {
+  std::shared_ptr<tc::TemplateController> templates;
+  std::unique_ptr<ScratchFolder> templateFolder;
+  std::mutex mutex;
+};
+
+Processor::Processor(const Templates &t) : _impl(new Impl) {
+
+  _impl->templates = std::make_shared<tc::TemplateController>();
+
+  const tc::ETemplateImages warmTemplates[] = {
+    tc::ETemplateImages::GM, tc::ETemplateImages::WM, tc::ETemplateImages::CSF,
+    tc::ETemplateImages::Brain, tc::ETemplateImages::Frontal, tc::ETemplateImages::Mastoid,
+    tc::ETemplateImages::Nasal, tc::ETemplateImages::Skull
+  };
+
+  try {
+    if (!t.path.empty()){
+      _impl->templates->SetPath(t.path);
+      for (auto e : warmTemplates)
+        _impl->templates->GetImage<ImageType>(e);
+    }
+    else {
+      std::map<tc::ETemplateImages, ImageType::ConstPointer> images;
+      images[tc::ETemplateImages::GM] = CopyVolume(t.gm, "GM template").GetPointer();
+      images[tc::ETemplateImages::WM] = CopyVolume(t.wm, "WM template").GetPointer();
+      images[tc::ETemplateImages::CSF] = CopyVolume(t.csf, "CSF template").GetPointer();
+      images[tc::ETemplateImages::Brain] = CopyVolume(t.brain, "brain mask").GetPointer();
+      images[tc::ETemplateImages::Frontal] = CopyVolume(t.frontal, "frontal sinus template").GetPointer();
+      images[tc::ETemplateImages::Mastoid] = CopyVolume(t.mastoid, "mastoid template").GetPointer();
+      images[tc::ETemplateImages::Nasal] = CopyVolume(t.nasal, "nasal template").GetPointer();
+      images[tc::ETemplateImages::Skull] = CopyVolume(t.skull, "skull base template").GetPointer();
+      images[tc::ETemplateImages::T1] = CopyVolume(t.t1, "registration template").GetPointer();
+
+      _impl->templateFolder.reset(new ScratchFolder("", "resolute-templates-%%%%-%%%%-%%%%", false));
+      _impl->templates->SetImages<ImageType>(images, _impl->templateFolder->path);
+    }
+  } catch (const Error &){
+    throw;
+  } catch (...) {
+    throw Error("Failed to load templates");
+  }
+
+}
+
+Processor::~Processor(){}
+
+Result Processor::Compute(const VolumeView &mrac, const VolumeView &ute1, const VolumeView &ute2,
+  const Parameters &params){
+
+  std::lock_guard<std::mutex> lock(_impl->mutex);
+
+  const std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+  if (!SameGeometry(mrac.geometry, ute1.geometry) || !SameGeometry(mrac.geometry, ute2.geometry))
+    throw Error("MRAC, UTE1 and UTE2 must share one grid");
+
+  ImageType::Pointer mracImage = ImportVolume(mrac, "MRAC");
+  ImageType::Pointer ute1Image = ImportVolume(ute1, "UTE1");
+  ImageType::Pointer ute2Image = ImportVolume(ute2, "UTE2");
+
+  json paramFile = json::object();
+  if (!params.extraJSON.empty()){
+    try {
+      paramFile = json::parse(params.extraJSON);
+    } catch (json::exception &e){
+      throw Error(std::string("Invalid extraJSON: ") + e.what());
+    }
+    if (!paramFile.is_object())
+      throw Error("extraJSON must be a JSON object");
+  }
+
+  //Without regArgs, the default of the backend is used.
+  if (!params.regName.empty())
+    paramFile["regName"] = params.regName;
+  if (!params.regArgs.empty())
+    paramFile["regArgs"] = params.regArgs;
+  paramFile["regTemplatePath"] = _impl->templates->GetManifestPath().string();
+  paramFile["writeIntermediates"] = params.writeIntermediates;
+
+  //A scratch folder is new every call, so there is nothing to resume.
+  paramFile["checkpoint"] = false;
+
+  ScratchFolder scratch(params.scratchDir, "resolute-%%%%-%%%%-%%%%", params.keepScratch);
+
+  typedef ns::ResoluteImageFilter<ImageType,ImageType> ResoluteFilterType;
+  ResoluteFilterType::Pointer resoluteFilter = ResoluteFilterType::New();
+  resoluteFilter->SetTemplateController(_impl->templates);
+
+  try {
+    resoluteFilter->SetJSONParams(paramFile);
+  } catch (...){
+    throw Error("Invalid parameters");
+  }
+
+  resoluteFilter->SetOutputDirectory(scratch.path);
+  resoluteFilter->SetMRACImage(mracImage);
+  resoluteFilter->SetUTEImage1(ute1Image);
+  resoluteFilter->SetUTEImage2(ute2Image);
+  resoluteFilter->SetMaskImage(ute2Image);
+
+  try {
+    resoluteFilter->Update();
+  } catch (itk::ExceptionObject &e) {
+    LOG(ERROR) << e;
+    throw Error(std::string("RESOLUTE failed: ") + e.GetDescription());
+  } catch (...) {
+    throw Error("RESOLUTE failed");
+  }
+
+  const ImageType *output = resoluteFilter->GetOutput();
+
+  Result result;
+  result.muMap.geometry = GetGeometry(output);
+  result.muMap.data.assign(output->GetBufferPointer(),
+    output->GetBufferPointer() + output->GetLargestPossibleRegion().GetNumberOfPixels());
+
+  result.metrics.wallSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+  result.metrics.peakResidentMB = mon::detail::ReadProcStatusBytes("VmHWM") / (1024.0 * 1024.0);
+  result.metrics.softTissueUTE1 = resoluteFilter->GetSoftTissuePeakUTE1();
+  result.metrics.softTissueUTE2 = resoluteFilter->GetSoftTissuePeakUTE2();
+  result.metrics.croppedToHead = resoluteFilter->IsCroppedToHead();
+
+  return result;
+}
+
+std::string GetVersion(){
+  return VERSION_NO;
+}
+
+}// namespace resolute
+
+//C interface. Exceptions stop here, and become a status and a message.
+
+struct resolute_processor {
+  std::unique_ptr<resolute::Processor> processor;
+};
+
+static thread_local std::string lastError;
+
+static resolute_status SetError(resolute_status status, const std::string &msg){
+  lastError = msg;
+  LOG(ERROR) << msg;
+  return status;
+}
+
+static resolute::VolumeView ToVolumeView(const resolute_volume &v){
+
+  resolute::VolumeView view;
+  std::memcpy(view.geometry.size, v.geometry.size, sizeof(view.geometry.size));
+  std::memcpy(view.geometry.spacing, v.geometry.spacing, sizeof(view.geometry.spacing));
+  std::memcpy(view.geometry.origin, v.geometry.origin, sizeof(view.geometry.origin));
+  std::memcpy(view.geometry.direction, v.geometry.direction, sizeof(view.geometry.direction));
+  view.data = v.data;
+  return view;
+}
+
+static std::string ToString(const char *s){
+  return (s == NULL) ? std::string() : std::string(s);
+}
+
+void resolute_params_init(resolute_params *params){
+
+  if (params == NULL)
+    return;
+
+  const resolute::Parameters defaults;
+  params->reg_name = NULL;
+  params->reg_args = NULL;
+  params->scratch_dir = NULL;
+  params->keep_scratch = defaults.keepScratch;
+  params->write_intermediates = defaults.writeIntermediates;
+  params->extra_json = NULL;
+
+}
+
+resolute_status resolute_processor_create(const resolute_templates *templates, resolute_processor **processor){
+
+  if (templates == NULL || processor == NULL)
+    return SetError(RESOLUTE_INVALID_ARGUMENT, "resolute_processor_create: NULL argument");
+
+  *processor = NULL;
+
+  resolute::Templates t;
+  t.path = ToString(templates->path);
+  t.gm = ToVolumeView(templates->gm);
+  t.wm = ToVolumeView(templates->wm);
+  t.csf = ToVolumeView(templates->csf);
+  t.brain = ToVolumeView(templates->brain);
+  t.frontal = ToVolumeView(templates->frontal);
+  t.mastoid = ToVolumeView(templates->mastoid);
+  t.nasal = ToVolumeView(templates->nasal);
+  t.skull = ToVolumeView(templates->skull);
+  t.t1 = ToVolumeView(templates->t1);
+
+  try {
+    std::unique_ptr<resolute_processor> p(new resolute_processor);
+    p->processor.reset(new resolute::Processor(t));
+    *processor = p.release();
+  } catch (const std::exception &e){
+    return SetError(RESOLUTE_FAILED, e.what());
+  } catch (...) {
+    return SetError(RESOLUTE_FAILED, "resolute_processor_create: unknown error");
+  }
+
+  return RESOLUTE_OK;
+}
+
+void resolute_processor_destroy(resolute_processor *processor){
+  delete processor;
+}
+
+resolute_status resolute_compute(resolute_processor *processor,
+  const resolute_volume *mrac, const resolute_volume *ute1, const resolute_volume *ute2,
+  const resolute_params *params, float *mu_map, size_t mu_map_length, resolute_metrics *metrics){
+
+  if (processor == NULL || mrac == NULL || ute1 == NULL || ute2 == NULL || mu_map == NULL)
+    return SetError(RESOLUTE_INVALID_ARGUMENT, "resolute_compute: NULL argument");
+
+  const size_t nVoxels = static_cast<size_t>(mrac->geometry.size[0]) * mrac->geometry.size[1] * mrac->geometry.size[2];
+  if (mu_map_length < nVoxels)
+    return SetError(RESOLUTE_INVALID_ARGUMENT, "resolute_compute: mu_map is smaller than the MRAC volume");
+
+  resolute::Parameters p;
+  if (params != NULL){
+    p.regName = ToString(params->reg_name);
+    p.regArgs = ToString(params->reg_args);
+    p.scratchDir = ToString(params->scratch_dir);
+    p.keepScratch = params->keep_scratch != 0;
+    p.writeIntermediates = params->write_intermediates != 0;
+    p.extraJSON = ToString(params->extra_json);
+  }
+
+  try {
+    const resolute::Result result = processor->processor->Compute(
+      ToVolumeView(*mrac), ToVolumeView(*ute1), ToVolumeView(*ute2), p);
+
+    std::copy(result.muMap.data.begin(), result.muMap.data.end(), mu_map);
+
+    if (metrics != NULL){
+      metrics->wall_seconds = result.metrics.wallSeconds;
+      metrics->peak_resident_mb = result.metrics.peakResidentMB;
+      metrics->soft_tissue_ute1 = result.metrics.softTissueUTE1;
+      metrics->soft_tissue_ute2 = result.metrics.softTissueUTE2;
+      metrics->cropped_to_head = result.metrics.croppedToHead;
+    }
+  } catch (const std::exception &e){
+    return SetError(RESOLUTE_FAILED, e.what());
+  } catch (...) {
+    return SetError(RESOLUTE_FAILED, "resolute_compute: unknown error");
+  }
+
+  return RESOLUTE_OK;
+}
+
+const char *resolute_last_error(void){
+  return lastError.c_str();
+}
+
+const char *resolute_version(void){
+  return VERSION_NO;
+}
@@ -0,0 +1,138 @@
+/*
+   ResoluteAPI.hpp
+
+   Author:      Benjamin A. Thomas
+
+   Copyright 2018 Institute of Nuclear Medicine, University College London.
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+
+ */
+
+#pragma once
+
+#ifndef _RESOLUTEAPI_HPP_
+#define _RESOLUTEAPI_HPP_
+
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+/*
+  Embeddable RESOLUTE (libresolute). Takes the MRAC, UTE and template
+  volumes from memory, and returns the mu-map and some metrics. Only the
+  standard library appears here, so that callers need neither ITK nor
+  glog headers, and this interface stays stable as the internals change.
+
+  Registration still goes through a scratch folder, as ANTs is run through
+  its command line. Put it on tmpfs (e.g. /dev/shm) to keep it off disk.
+*/
+
+namespace resolute {
+
+//Thrown by every call on failure.
+class Error : public std::runtime_error {
+public:
+  explicit Error(const std::string &what) : std::runtime_error(what) {};
+};
+
+//Voxel grid, as in ITK: physical = origin + direction * (spacing * index).
+struct Geometry {
+  unsigned int size[3];
+  double spacing[3];   //mm
+  double origin[3];    //mm
+  double direction[9]; //Row-major direction cosines.
+};
+
+//A float volume owned by the caller, x fastest. It must stay valid for
+//the duration of the call it is passed to.
+struct VolumeView {
+  Geometry geometry;
+  const float *data;
+};
+
+struct Volume {
+  Geometry geometry;
+  std::vector<float> data;
+};
+
+//Either a manifest, a folder holding manifest.json, or a compiled bundle;
+//or, if path is empty, every volume in memory. Volumes are in template
+//space, and are copied when the Processor is created.
+struct Templates {
+  std::string path;
+  VolumeView gm, wm, csf, brain, frontal, mastoid, nasal, skull, t1;
+};
+
+struct Parameters {
+  //Registration backend and its arguments, as regName and regArgs in the
+  //configuration file. Empty uses ANTS, and the default of the backend.
+  std::string regName;
+  std::string regArgs;
+
+  //Parent of the per-call scratch folder. Empty uses the system temporary
+  //folder. The scratch folder is removed afterwards unless keepScratch.
+  std::string scratchDir;
+  bool keepScratch = false;
+
+  //Also write the diagnostic images of the command line tool to the
+  //scratch folder.
+  bool writeIntermediates = false;
+
+  //Further optional configuration keys, as a JSON object (see README).
+  std::string extraJSON;
+};
+
+struct Metrics {
+  double wallSeconds = 0;
+  //High-water mark of the whole process, not just this call.
+  double peakResidentMB = 0;
+  //Soft-tissue peak of the UTE joint histogram.
+  unsigned int softTissueUTE1 = 0;
+  unsigned int softTissueUTE2 = 0;
+  bool croppedToHead = false;
+};
+
+struct Result {
+  Volume muMap; //cm-1, on the MRAC grid.
+  Metrics metrics;
+};
+
+//Holds the templates, so that they are loaded once for many studies.
+//Calls on one Processor are serialised; use several for concurrency.
+class Processor {
+
+public:
+
+  explicit Processor(const Templates &templates);
+  ~Processor();
+
+  //MRAC, UTE1 (TE 0.07 ms) and UTE2 (TE 2.46 ms), on the same grid.
+  Result Compute(const VolumeView &mrac, const VolumeView &ute1, const VolumeView &ute2,
+    const Parameters &params = Parameters());
+
+private:
+
+  struct Impl;
+  std::unique_ptr<Impl> _impl;
+
+  Processor(const Processor &); //purposely not implemented
+  void operator=(const Processor &);  //purposely not implemented
+
+};
+
+std::string GetVersion();
+
+}// namespace resolute
+
+#endif
@@ -0,0 +1,161 @@
+/*
+   SeriesProgress.hpp
+
+   Author:      Benjamin A. Thomas
+
+   Copyright 2018 Institute of Nuclear Medicine, University College London.
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+
+ */
+
+#pragma once
+
+#ifndef _SERIESPROGRESS_HPP_
+#define _SERIESPROGRESS_HPP_
+
+#include <boost/filesystem.hpp>
+#include <glog/logging.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <string>
+#include <vector>
+
+/*
+  Instances received by the storage SCP, and the state of each series
+  while it arrives. Kept apart from StoreSCP.hpp so that it does not need
+  DCMTK.
+*/
+
+namespace dcm {
+
+struct ReceivedInstance {
+  boost::filesystem::path filePath;
+  std::string studyUID;
+  std::string seriesUID;
+  //Images in Acquisition (0020,1002). Only a hint: it counts the images
+  //of the acquisition, which need not all belong to this series.
+  unsigned int imagesInAcquisition;
+  //Image Orientation (Patient), and the position of the slice along its
+  //normal, when the instance has both.
+  bool hasGeometry;
+  double orientation[6];
+  double slicePosition;
+};
+
+class SeriesProgress {
+
+public:
+
+  typedef std::chrono::steady_clock ClockType;
+
+  //Adds an instance of the series, received at time now.
+  void Add(const ReceivedInstance &r, ClockType::time_point now);
+
+  //True if the slices form one stack with no gaps or repeats. Series
+  //without per-slice geometry (e.g. multi-frame) are not checked.
+  bool IsEvenlySpaced() const;
+
+  //A series is complete once nothing has arrived for the quiescence
+  //window and it has at least the Images in Acquisition, or once nothing
+  //has arrived for the timeout. The image count is only a hint, so the
+  //slices must also form an evenly spaced stack.
+  bool IsComplete(ClockType::time_point now, ClockType::duration quiescence, ClockType::duration timeout);
+
+  unsigned int GetReceived() const { return _received; };
+
+protected:
+
+  std::string _seriesUID;
+  unsigned int _received = 0, _expected = 0;
+  ClockType::time_point _lastReceived;
+
+  //Slice positions along the normal. Only checked while every instance
+  //has its geometry, and they must all share one orientation.
+  bool _hasGeometry = true, _sameOrientation = true, _warned = false;
+  double _orientation[6] = { 0 };
+  std::vector<double> _positions;
+
+};
+
+inline void SeriesProgress::Add(const ReceivedInstance &r, ClockType::time_point now){
+
+  if (!r.hasGeometry)
+    _hasGeometry = false;
+  else if (_received == 0)
+    std::copy(r.orientation, r.orientation + 6, _orientation);
+  else {
+    for (int i = 0; i < 6; ++i)
+      if (std::fabs(r.orientation[i] - _orientation[i]) > 1e-4)
+        _sameOrientation = false;
+  }
+
+  _seriesUID = r.seriesUID;
+  _positions.push_back(r.slicePosition);
+  _received++;
+  _expected = std::max(_expected, r.imagesInAcquisition);
+  _lastReceived = now;
+
+}
+
+inline bool SeriesProgress::IsEvenlySpaced() const {
+
+  if (!_hasGeometry || _positions.size() < 2)
+    return true;
+
+  if (!_sameOrientation)
+    return false;
+
+  std::vector<double> p = _positions;
+  std::sort(p.begin(), p.end());
+
+  const double step = (p.back() - p.front()) / (p.size() - 1);
+  if (step <= 0.0)
+    return false;
+
+  for (std::size_t i = 1; i < p.size(); ++i)
+    if (std::fabs(p[i] - p[i-1] - step) > 0.1 * step)
+      return false;
+
+  return true;
+
+}
+
+inline bool SeriesProgress::IsComplete(ClockType::time_point now, ClockType::duration quiescence,
+  ClockType::duration timeout){
+
+  if (_received == 0)
+    return false;
+
+  const ClockType::duration idle = now - _lastReceived;
+
+  if (idle < quiescence)
+    return false;
+
+  if (!(_expected > 0 && _received >= _expected) && idle < timeout)
+    return false;
+
+  if (IsEvenlySpaced())
+    return true;
+
+  LOG_IF(WARNING, !_warned) << "Series " << _seriesUID << " has " << _received
+                            << " images with missing or repeated slices, waiting for more.";
+  _warned = true;
+  return false;
+
+}
+
+}// namespace dcm
+
+#endif
@@ -0,0 +1,73 @@
+/*
+   SlabScheduler.hpp
+
+   Author:      Benjamin A. Thomas
+
+   Copyright 2018 Institute of Nuclear Medicine, University College London.
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+
+ */
+
+#pragma once
+
+#ifndef _SLABSCHEDULER_HPP_
+#define _SLABSCHEDULER_HPP_
+
+#include <algorithm>
+#include <cstddef>
+#include <vector>
+
+namespace ns {
+
+//A run of z-planes. [first, last) are the planes a slab produces,
+//[haloFirst, haloLast) the planes it has to read to do so.
+struct Slab {
+  std::size_t first, last;
+  std::size_t haloFirst, haloLast;
+};
+
+//Splits nz planes into slabs whose planes, including halo planes on each
+//side for neighbourhood operations, fit in budgetBytes. A budget of 0
+//gives a single slab. Slabs are never thinner than one plane, whatever
+//the budget.
+inline std::vector<Slab> MakeSlabs(std::size_t nz, std::size_t bytesPerPlane,
+  std::size_t budgetBytes, std::size_t halo = 0){
+
+  std::vector<Slab> slabs;
+
+  if (nz == 0)
+    return slabs;
+
+  std::size_t planesPerSlab = nz;
+
+  if (budgetBytes > 0 && bytesPerPlane > 0){
+    const std::size_t fit = budgetBytes / bytesPerPlane;
+    planesPerSlab = (fit > 2 * halo) ? fit - 2 * halo : 1;
+    planesPerSlab = std::min(planesPerSlab, nz);
+  }
+
+  for (std::size_t first = 0; first < nz; first += planesPerSlab){
+    Slab s;
+    s.first = first;
+    s.last = std::min(first + planesPerSlab, nz);
+    s.haloFirst = (s.first > halo) ? s.first - halo : 0;
+    s.haloLast = std::min(s.last + halo, nz);
+    slabs.push_back(s);
+  }
+
+  return slabs;
+}
+
+}// namespace ns
+
+#endif
@@ -0,0 +1,329 @@
+/*
+   StageTimer.hpp
+
+   Author:      Benjamin A. Thomas
+
+   Copyright 2018 Institute of Nuclear Medicine, University College London.
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+
+ */
+
+#pragma once
+
+#ifndef _STAGETIMER_HPP_
+#define _STAGETIMER_HPP_
+
+#include <glog/logging.h>
+#include <nlohmann/json.hpp>
+#include <boost/filesystem.hpp>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <fstream>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <time.h>
+#include <unistd.h>
+
+#include "MemoryMonitor.hpp"
+
+/*
+  Scoped wall/CPU timers. Every timed scope becomes one event. The events
+  can be written as a per-stage JSON summary, or as a Chrome trace
+  (chrome://tracing, Perfetto) with one lane per thread.
+*/
+
+namespace mon {
+
+namespace detail {
+
+//CPU time of the whole process (all threads), in microseconds.
+inline int64_t GetProcessCPUMicroseconds(){
+
+  timespec ts;
+  if (clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts) != 0)
+    return 0;
+  return static_cast<int64_t>(ts.tv_sec) * 1000000 + ts.tv_nsec / 1000;
+}
+
+//Bytes read and written by the whole process, page cache included.
+inline int64_t GetProcessReadBytes(){
+  return static_cast<int64_t>(ReadProcValue("/proc/self/io", "rchar"));
+}
+
+inline int64_t GetProcessWrittenBytes(){
+  return static_cast<int64_t>(ReadProcValue("/proc/self/io", "wchar"));
+}
+
+}// namespace detail
+
+class TimingRecorder {
+
+public:
+
+  struct Event {
+    std::string name;
+    std::string category;
+    std::size_t tid;
+    int64_t startUs, wallUs, cpuUs;
+    int64_t readBytes, writtenBytes;
+    unsigned int threads;
+  };
+
+  static TimingRecorder &GetInstance(){
+    static TimingRecorder instance;
+    return instance;
+  };
+
+  //Microseconds since the recorder was created.
+  int64_t Now() const {
+    return std::chrono::duration_cast<std::chrono::microseconds>(
+      std::chrono::steady_clock::now() - _epoch).count();
+  };
+
+  void AddEvent(const Event &e);
+
+  //Drops all events and restarts the clock, e.g. between studies.
+  void Clear();
+
+  //Total wall time since the recorder was created, in seconds.
+  double GetElapsedSeconds() const { return Now() / 1e6; };
+
+  nlohmann::json GetSummary() const;
+  nlohmann::json GetChromeTrace() const;
+
+  void WriteSummary(const boost::filesystem::path &dst) const;
+  void WriteChromeTrace(const boost::filesystem::path &dst) const;
+
+protected:
+
+  TimingRecorder() : _epoch(std::chrono::steady_clock::now()) {};
+
+  std::chrono::steady_clock::time_point _epoch;
+
+  mutable std::mutex _mutex;
+  std::vector<Event> _events;
+
+};
+
+inline void TimingRecorder::AddEvent(const Event &e){
+
+  std::lock_guard<std::mutex> lock(_mutex);
+  _events.push_back(e);
+
+}
+
+inline void TimingRecorder::Clear(){
+
+  std::lock_guard<std::mutex> lock(_mutex);
+  _events.clear();
+  _epoch = std::chrono::steady_clock::now();
+
+}
+
+inline nlohmann::json TimingRecorder::GetSummary() const {
+
+  std::lock_guard<std::mutex> lock(_mutex);
+
+  //Events in completion order, plus totals per name for repeated steps.
+  nlohmann::json events = nlohmann::json::array();
+
+  struct Totals {
+    std::string category;
+    unsigned int count;
+    int64_t wallUs, cpuUs;
+    int64_t readBytes, writtenBytes;
+    unsigned int maxThreads;
+  };
+
+  std::vector<std::string> order;
+  std::map<std::string, Totals> totals;
+
+  for (const Event &e : _events){
+    events.push_back({
+      {"name", e.name},
+      {"category", e.category},
+      {"startSeconds", e.startUs / 1e6},
+      {"wallSeconds", e.wallUs / 1e6},
+      {"cpuSeconds", e.cpuUs / 1e6},
+      {"readBytes", e.readBytes},
+      {"writtenBytes", e.writtenBytes},
+      {"threads", e.threads}
+    });
+
+    if (totals.find(e.name) == totals.end()){
+      order.push_back(e.name);
+      totals[e.name] = {e.category, 0, 0, 0, 0, 0, 0};
+    }
+
+    Totals &t = totals[e.name];
+    t.count++;
+    t.wallUs += e.wallUs;
+    t.cpuUs += e.cpuUs;
+    t.readBytes += e.readBytes;
+    t.writtenBytes += e.writtenBytes;
+    t.maxThreads = std::max(t.maxThreads, e.threads);
+  }
+
+  nlohmann::json stages = nlohmann::json::array();
+  for (const std::string &name : order){
+    const Totals &t = totals.at(name);
+    stages.push_back({
+      {"name", name},
+      {"category", t.category},
+      {"count", t.count},
+      {"wallSeconds", t.wallUs / 1e6},
+      {"cpuSeconds", t.cpuUs / 1e6},
+      {"readBytes", t.readBytes},
+      {"writtenBytes", t.writtenBytes},
+      {"maxThreads", t.maxThreads}
+    });
+  }
+
+  nlohmann::json summary;
+  summary["totalWallSeconds"] = GetElapsedSeconds();
+  summary["stages"] = stages;
+  summary["events"] = events;
+
+  return summary;
+}
+
+inline nlohmann::json TimingRecorder::GetChromeTrace() const {
+
+  std::lock_guard<std::mutex> lock(_mutex);
+
+  const int pid = static_cast<int>(getpid());
+  nlohmann::json traceEvents = nlohmann::json::array();
+
+  for (const Event &e : _events){
+    traceEvents.push_back({
+      {"name", e.name},
+      {"cat", e.category},
+      {"ph", "X"},
+      {"ts", e.startUs},
+      {"dur", e.wallUs},
+      {"pid", pid},
+      {"tid", e.tid},
+      {"args", {
+        {"cpu_ms", e.cpuUs / 1e3},
+        {"threads", e.threads}
+      }}
+    });
+  }
+
+  nlohmann::json trace;
+  trace["traceEvents"] = traceEvents;
+  trace["displayTimeUnit"] = "ms";
+
+  return trace;
+}
+
+inline void TimingRecorder::WriteSummary(const boost::filesystem::path &dst) const {
+
+  std::ofstream ofs(dst.string());
+  ofs << GetSummary().dump(2) << std::endl;
+
+  if (!ofs.good())
+    LOG(WARNING) << "Could not write timing summary to " << dst;
+  else
+    LOG(INFO) << "Timing summary written to " << dst;
+
+}
+
+inline void TimingRecorder::WriteChromeTrace(const boost::filesystem::path &dst) const {
+
+  std::ofstream ofs(dst.string());
+  ofs << GetChromeTrace().dump() << std::endl;
+
+  if (!ofs.good())
+    LOG(WARNING) << "Could not write trace to " << dst;
+  else
+    LOG(INFO) << "Trace written to " << dst;
+
+}
+
+//Times the enclosing scope. CPU time and bytes read and written are for
+//the whole process, so for a stage that runs worker threads they are the
+//work done by all of them. The thread count is the process's when the
+//scope closes.
+class ScopedTimer {
+
+public:
+
+  explicit ScopedTimer(const std::string &name, const std::string &category = "step")
+    : _name(name), _category(category) {
+    TimingRecorder &rec = TimingRecorder::GetInstance();
+    _startUs = rec.Now();
+    _startCPUUs = detail::GetProcessCPUMicroseconds();
+    _startReadBytes = detail::GetProcessReadBytes();
+    _startWrittenBytes = detail::GetProcessWrittenBytes();
+  };
+
+  ~ScopedTimer(){
+    TimingRecorder &rec = TimingRecorder::GetInstance();
+
+    TimingRecorder::Event e;
+    e.name = _name;
+    e.category = _category;
+    e.tid = std::hash<std::thread::id>()(std::this_thread::get_id());
+    e.startUs = _startUs;
+    e.wallUs = rec.Now() - _startUs;
+    e.cpuUs = detail::GetProcessCPUMicroseconds() - _startCPUUs;
+    e.readBytes = detail::GetProcessReadBytes() - _startReadBytes;
+    e.writtenBytes = detail::GetProcessWrittenBytes() - _startWrittenBytes;
+    e.threads = static_cast<unsigned int>(detail::ReadProcStatusValue("Threads"));
+
+    rec.AddEvent(e);
+
+    DLOG(INFO) << "[timing] " << _name << ": " << e.wallUs / 1e6 << " s wall, "
+               << e.cpuUs / 1e6 << " s CPU";
+  };
+
+private:
+
+  std::string _name;
+  std::string _category;
+  int64_t _startUs;
+  int64_t _startCPUUs;
+  int64_t _startReadBytes, _startWrittenBytes;
+
+  ScopedTimer(const ScopedTimer &); //purposely not implemented
+  void operator=(const ScopedTimer &);  //purposely not implemented
+
+};
+
+//A pipeline stage: timed and recorded by the memory monitor.
+class ScopedStage {
+
+public:
+  explicit ScopedStage(const std::string &name) : _memory(name), _timer(name, "stage") {};
+
+private:
+  //Destroyed in reverse order, so the timer closes first.
+  ScopedMemoryStage _memory;
+  ScopedTimer _timer;
+
+  ScopedStage(const ScopedStage &); //purposely not implemented
+  void operator=(const ScopedStage &);  //purposely not implemented
+
+};
+
+}// namespace mon
+
+#endif
@@ -0,0 +1,164 @@
+/*
+   StoreSCP.hpp
+
+   Author:      Benjamin A. Thomas
+
+   Copyright 2018 Institute of Nuclear Medicine, University College London.
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+
+ */
+
+#pragma once
+
+#ifndef _STORESCP_HPP_
+#define _STORESCP_HPP_
+
+#include <boost/filesystem.hpp>
+#include <glog/logging.h>
+
+#include <functional>
+#include <string>
+
+#include <dcmtk/config/osconfig.h>
+#include <dcmtk/dcmnet/dstorscp.h>
+#include <dcmtk/dcmdata/dcuid.h>
+#include <dcmtk/dcmdata/dcdeftag.h>
+
+#include "SeriesProgress.hpp"
+
+/*
+  Embedded DICOM Storage SCP (DCMTK). Received instances are written to
+  the storage directory, then passed to a callback together with their
+  series, the Images in Acquisition given by the sender (0 if absent) and
+  the slice geometry.
+*/
+
+namespace dcm {
+
+class StoreSCP : public DcmStorageSCP {
+
+public:
+
+  typedef std::function<void(const ReceivedInstance &)> CallbackType;
+
+  StoreSCP(const std::string &aeTitle, unsigned short port, const boost::filesystem::path &storeDir);
+
+  void SetCallback(const CallbackType &cb){ _callback = cb; };
+
+  //Blocks, serving one association at a time.
+  void Listen();
+
+protected:
+
+  virtual void notifyInstanceStored(const OFString &filename, const OFString &sopClassUID,
+    const OFString &sopInstanceUID, DcmDataset *dataset = NULL) const override;
+
+  CallbackType _callback;
+
+  StoreSCP(const StoreSCP &); //purposely not implemented
+  void operator=(const StoreSCP &);  //purposely not implemented
+
+};
+
+inline StoreSCP::StoreSCP(const std::string &aeTitle, unsigned short port, const boost::filesystem::path &storeDir){
+
+  try {
+    boost::filesystem::create_directories(storeDir);
+  } catch (const boost::filesystem::filesystem_error &e){
+    LOG(ERROR) << "Cannot create storage folder : " << storeDir;
+    throw false;
+  }
+
+  if (setOutputDirectory(storeDir.string().c_str()).bad()){
+    LOG(ERROR) << "Cannot store received files in " << storeDir;
+    throw false;
+  }
+
+  setDirectoryGenerationMode(DGM_NoSubdirectory);
+  setFilenameGenerationMode(FGM_SOPInstanceUID);
+  setFilenameExtension(".dcm");
+
+  getConfig().setAETitle(aeTitle.c_str());
+  getConfig().setPort(port);
+
+  OFList<OFString> transferSyntaxes;
+  transferSyntaxes.push_back(UID_LittleEndianExplicitTransferSyntax);
+  transferSyntaxes.push_back(UID_BigEndianExplicitTransferSyntax);
+  transferSyntaxes.push_back(UID_LittleEndianImplicitTransferSyntax);
+
+  //C-ECHO, so that the scanner can test the node, and every storage class.
+  getConfig().addPresentationContext(UID_VerificationSOPClass, transferSyntaxes);
+  for (int i = 0; i < numberOfDcmAllStorageSOPClassUIDs; ++i)
+    getConfig().addPresentationContext(dcmAllStorageSOPClassUIDs[i], transferSyntaxes);
+
+}
+
+inline void StoreSCP::Listen(){
+
+  LOG(INFO) << "Storage SCP " << getConfig().getAETitle() << " listening on port " << getConfig().getPort();
+
+  OFCondition status = listen();
+  if (status.bad()){
+    LOG(ERROR) << "Storage SCP stopped: " << status.text();
+    throw false;
+  }
+
+}
+
+inline void StoreSCP::notifyInstanceStored(const OFString &filename, const OFString &sopClassUID,
+  const OFString &sopInstanceUID, DcmDataset *dataset) const {
+
+  DLOG(INFO) << "Received " << sopInstanceUID << " -> " << filename;
+
+  if (!_callback)
+    return;
+
+  ReceivedInstance r;
+  r.filePath = filename.c_str();
+  r.imagesInAcquisition = 0;
+  r.hasGeometry = false;
+  r.slicePosition = 0.0;
+
+  if (dataset != NULL){
+    OFString uid;
+    if (dataset->findAndGetOFString(DCM_StudyInstanceUID, uid).good())
+      r.studyUID = uid.c_str();
+    if (dataset->findAndGetOFString(DCM_SeriesInstanceUID, uid).good())
+      r.seriesUID = uid.c_str();
+
+    Sint32 n = 0;
+    if (dataset->findAndGetSint32(DCM_ImagesInAcquisition, n).good() && n > 0)
+      r.imagesInAcquisition = static_cast<unsigned int>(n);
+
+    double pos[3];
+    bool found = true;
+    for (unsigned long i = 0; i < 6 && found; ++i)
+      found = dataset->findAndGetFloat64(DCM_ImageOrientationPatient, r.orientation[i], i).good();
+    for (unsigned long i = 0; i < 3 && found; ++i)
+      found = dataset->findAndGetFloat64(DCM_ImagePositionPatient, pos[i], i).good();
+
+    if (found){
+      const double *o = r.orientation;
+      const double normal[3] = { o[1]*o[5] - o[2]*o[4], o[2]*o[3] - o[0]*o[5], o[0]*o[4] - o[1]*o[3] };
+      r.slicePosition = pos[0]*normal[0] + pos[1]*normal[1] + pos[2]*normal[2];
+      r.hasGeometry = true;
+    }
+  }
+
+  _callback(r);
+
+}
+
+}// namespace dcm
+
+#endif
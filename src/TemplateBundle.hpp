@@ -0,0 +1,501 @@
+/*
+   TemplateBundle.hpp
+
+   Author:      Benjamin A. Thomas
+
+   Copyright 2018 Institute of Nuclear Medicine, University College London.
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+
+ */
+
+#pragma once
+
+#ifndef _TEMPLATEBUNDLE_HPP_
+#define _TEMPLATEBUNDLE_HPP_
+
+#include <boost/filesystem.hpp>
+#include <glog/logging.h>
+#include <nlohmann/json.hpp>
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <map>
+#include <memory>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <itkImage.h>
+#include <itkImageFileWriter.h>
+#include <itkImportImageContainer.h>
+
+#include "Checkpoint.hpp"
+
+/*
+  Compiled template bundle: every template volume in one uncompressed file,
+  read through mmap. Layout:
+
+    [ "RESOLTPL" | version | header offset | header length ]  32 bytes
+    [ volume data, each starting on a 4 KiB boundary ]
+    [ JSON header: the template manifest, and per volume its storage
+      type, geometry, offset and content hash ]
+
+  Each volume is stored in the smallest type that holds it exactly (binary
+  masks as bytes). Float volumes read as float images are not copied: the
+  image buffer points into the mapping, which the page cache shares
+  between processes. Such images keep the mapping open, so they stay
+  valid after the bundle is released. Bundles are written to a temporary
+  file and renamed into place, so a rewrite never changes a file that
+  another process has mapped.
+*/
+
+namespace tc {
+
+namespace detail {
+
+//An open, mapped bundle file. Shared by the bundle and every image that
+//points into it.
+struct BundleMapping {
+  int fd = -1;
+  void *base = MAP_FAILED;
+  std::size_t length = 0;
+
+  ~BundleMapping(){
+    if (base != MAP_FAILED)
+      munmap(base, length);
+    if (fd >= 0)
+      close(fd);
+  };
+};
+
+//Pixel container over a mapped volume, which keeps the mapping open for
+//as long as any image uses it.
+template< typename TElement >
+class MappedPixelContainer : public itk::ImportImageContainer<itk::SizeValueType, TElement> {
+
+public:
+  typedef MappedPixelContainer Self;
+  typedef itk::ImportImageContainer<itk::SizeValueType, TElement> Superclass;
+  typedef itk::SmartPointer< Self > Pointer;
+
+  itkNewMacro(Self);
+  itkTypeMacro(MappedPixelContainer, ImportImageContainer);
+
+  void SetMapping(const std::shared_ptr<const BundleMapping> &m){ _mapping = m; };
+
+protected:
+  MappedPixelContainer(){};
+
+  std::shared_ptr<const BundleMapping> _mapping;
+
+private:
+  MappedPixelContainer(const Self &); //purposely not implemented
+  void operator=(const Self &);  //purposely not implemented
+
+};
+
+}// namespace detail
+
+class TemplateBundle {
+
+public:
+
+  static const uint64_t VERSION = 1;
+  static const std::size_t ALIGNMENT = 4096;
+
+  //True if p starts with the bundle signature.
+  static bool IsBundle(const boost::filesystem::path &p);
+
+  //True if any process has the bundle at p mapped, directly or through
+  //an image read from it.
+  static bool IsInUse(const boost::filesystem::path &p);
+
+  //Maps the bundle. Throws false if it cannot be read.
+  explicit TemplateBundle(const boost::filesystem::path &p);
+
+  const nlohmann::json &GetManifest() const { return _header["manifest"]; };
+  bool HasVolume(const std::string &key) const;
+
+  template< typename TImage >
+  typename TImage::ConstPointer GetImage(const std::string &key) const;
+
+  //Uncompressed NIfTI copy of the registration template, written next to
+  //the bundle, since ANTs reads its reference from a file.
+  boost::filesystem::path GetRegistrationTemplatePath() const;
+
+  //Changes whenever any volume or the manifest changes.
+  std::string GetFingerprint() const { return _fingerprint; };
+
+  //Writes volumes (manifest key -> image) and the manifest to dst.
+  //registrationKey names the volume also written as the NIfTI copy. If
+  //compact is false, every volume is stored as float, so that none needs
+  //a private copy when read as a float image.
+  template< typename TImage >
+  static void Write(const boost::filesystem::path &dst, const nlohmann::json &manifest,
+    const std::map<std::string, typename TImage::ConstPointer> &volumes, const std::string &registrationKey,
+    bool compact = true);
+
+protected:
+
+  template< typename TPixel >
+  static std::string GetStorageType(const TPixel *buf, std::size_t n);
+
+  template< typename TStored, typename TImage >
+  static void CopyPixels(const void *src, typename TImage::PixelType *dst, std::size_t n);
+
+  template< typename TStored, typename TPixel >
+  static void WritePixels(std::ofstream &ofs, const TPixel *buf, std::size_t n, ck::Hasher &h);
+
+  static std::size_t Align(std::size_t n){ return (n + ALIGNMENT - 1) / ALIGNMENT * ALIGNMENT; };
+
+  boost::filesystem::path _path;
+  std::shared_ptr<detail::BundleMapping> _mapping;
+
+  nlohmann::json _header;
+  std::string _fingerprint;
+
+  TemplateBundle(const TemplateBundle &); //purposely not implemented
+  void operator=(const TemplateBundle &);  //purposely not implemented
+
+};
+
+namespace detail {
+
+const char BUNDLE_MAGIC[8] = { 'R', 'E', 'S', 'O', 'L', 'T', 'P', 'L' };
+
+struct BundlePreamble {
+  char magic[8];
+  uint64_t version;
+  uint64_t headerOffset;
+  uint64_t headerLength;
+};
+
+}// namespace detail
+
+inline bool TemplateBundle::IsBundle(const boost::filesystem::path &p){
+
+  if (!boost::filesystem::is_regular_file(p))
+    return false;
+
+  std::ifstream ifs(p.string(), std::ios::binary);
+  char magic[8] = {0};
+  ifs.read(magic, sizeof(magic));
+
+  return ifs.good() && std::memcmp(magic, detail::BUNDLE_MAGIC, sizeof(magic)) == 0;
+}
+
+inline bool TemplateBundle::IsInUse(const boost::filesystem::path &p){
+
+  const int fd = open(p.string().c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0)
+    return false;
+
+  const bool inUse = (flock(fd, LOCK_EX | LOCK_NB) != 0);
+  close(fd);
+
+  return inUse;
+}
+
+inline TemplateBundle::TemplateBundle(const boost::filesystem::path &p)
+  : _path(p), _mapping(std::make_shared<detail::BundleMapping>()) {
+
+  detail::BundleMapping &m = *_mapping;
+  m.fd = open(p.string().c_str(), O_RDONLY | O_CLOEXEC);
+
+  struct stat st;
+  if (m.fd < 0 || fstat(m.fd, &st) != 0 || static_cast<std::size_t>(st.st_size) < sizeof(detail::BundlePreamble)){
+    LOG(ERROR) << "Unable to open template bundle " << p;
+    throw false;
+  }
+
+  //Held until the mapping is released, for IsInUse().
+  flock(m.fd, LOCK_SH);
+
+  m.length = static_cast<std::size_t>(st.st_size);
+  m.base = mmap(nullptr, m.length, PROT_READ, MAP_SHARED, m.fd, 0);
+
+  if (m.base == MAP_FAILED){
+    LOG(ERROR) << "Unable to map template bundle " << p;
+    throw false;
+  }
+
+  const detail::BundlePreamble *pre = static_cast<const detail::BundlePreamble *>(m.base);
+
+  if (std::memcmp(pre->magic, detail::BUNDLE_MAGIC, sizeof(pre->magic)) != 0 || pre->version != VERSION ||
+      pre->headerOffset + pre->headerLength > m.length){
+    LOG(ERROR) << p << " is not a version " << VERSION << " template bundle.";
+    throw false;
+  }
+
+  const char *header = static_cast<const char *>(m.base) + pre->headerOffset;
+
+  try {
+    _header = nlohmann::json::parse(std::string(header, pre->headerLength));
+  } catch (...) {
+    LOG(ERROR) << "Unable to parse template bundle header in " << p;
+    throw false;
+  }
+
+  _fingerprint = ck::Hasher().Add(header, pre->headerLength).GetHex();
+
+  LOG(INFO) << "Mapped template bundle " << p << " (" << _header["volumes"].size() << " volumes, "
+            << m.length / (1024 * 1024) << " MB)";
+
+}
+
+inline bool TemplateBundle::HasVolume(const std::string &key) const {
+
+  return _header["volumes"].find(key) != _header["volumes"].end();
+}
+
+inline boost::filesystem::path TemplateBundle::GetRegistrationTemplatePath() const {
+
+  return _path.parent_path() / _header["registrationTemplate"].get<std::string>();
+}
+
+template< typename TPixel >
+std::string TemplateBundle::GetStorageType(const TPixel *buf, std::size_t n){
+
+  bool integral = true;
+  double lo = 0, hi = 0;
+
+  for (std::size_t i = 0; i < n && integral; ++i){
+    const double v = static_cast<double>(buf[i]);
+    integral = (std::floor(v) == v);
+    lo = std::min(lo, v);
+    hi = std::max(hi, v);
+  }
+
+  if (integral && lo >= 0 && hi <= 255)
+    return "uint8";
+  if (integral && lo >= -32768 && hi <= 32767)
+    return "int16";
+  return "float32";
+}
+
+template< typename TStored, typename TImage >
+void TemplateBundle::CopyPixels(const void *src, typename TImage::PixelType *dst, std::size_t n){
+
+  const TStored *s = static_cast<const TStored *>(src);
+  for (std::size_t i = 0; i < n; ++i)
+    dst[i] = static_cast<typename TImage::PixelType>(s[i]);
+
+}
+
+template< typename TStored, typename TPixel >
+void TemplateBundle::WritePixels(std::ofstream &ofs, const TPixel *buf, std::size_t n, ck::Hasher &h){
+
+  std::vector<TStored> out(n);
+  for (std::size_t i = 0; i < n; ++i)
+    out[i] = static_cast<TStored>(buf[i]);
+
+  h.Add(out.data(), n * sizeof(TStored));
+  ofs.write(reinterpret_cast<const char *>(out.data()), n * sizeof(TStored));
+
+}
+
+template< typename TImage >
+typename TImage::ConstPointer TemplateBundle::GetImage(const std::string &key) const {
+
+  if (!HasVolume(key)){
+    LOG(ERROR) << "Template bundle " << _path << " has no volume " << key;
+    throw false;
+  }
+
+  const nlohmann::json &v = _header["volumes"][key];
+  const unsigned int D = TImage::ImageDimension;
+
+  typename TImage::RegionType region;
+  typename TImage::SpacingType spacing;
+  typename TImage::PointType origin;
+  typename TImage::DirectionType direction;
+
+  for (unsigned int d = 0; d < D; ++d){
+    region.SetIndex(d, 0);
+    region.SetSize(d, v["size"][d].get<std::size_t>());
+    spacing[d] = v["spacing"][d].get<double>();
+    origin[d] = v["origin"][d].get<double>();
+    for (unsigned int e = 0; e < D; ++e)
+      direction[d][e] = v["direction"][d * D + e].get<double>();
+  }
+
+  typename TImage::Pointer img = TImage::New();
+  img->SetRegions(region);
+  img->SetSpacing(spacing);
+  img->SetOrigin(origin);
+  img->SetDirection(direction);
+
+  const std::size_t n = region.GetNumberOfPixels();
+  const std::string type = v["type"].get<std::string>();
+  const void *data = static_cast<const char *>(_mapping->base) + v["offset"].get<std::size_t>();
+
+  typedef typename TImage::PixelType PixelType;
+
+  if (type == "float32" && std::is_same<PixelType, float>::value){
+    //Read-only mapping: the image must not be written to.
+    typename detail::MappedPixelContainer<PixelType>::Pointer container = detail::MappedPixelContainer<PixelType>::New();
+    container->SetImportPointer(const_cast<PixelType *>(static_cast<const PixelType *>(data)), n, false);
+    container->SetMapping(_mapping);
+    img->SetPixelContainer(container);
+    return img.GetPointer();
+  }
+
+  img->Allocate();
+
+  if (type == "uint8")
+    CopyPixels<uint8_t, TImage>(data, img->GetBufferPointer(), n);
+  else if (type == "int16")
+    CopyPixels<int16_t, TImage>(data, img->GetBufferPointer(), n);
+  else
+    CopyPixels<float, TImage>(data, img->GetBufferPointer(), n);
+
+  return img.GetPointer();
+}
+
+template< typename TImage >
+void TemplateBundle::Write(const boost::filesystem::path &dst, const nlohmann::json &manifest,
+  const std::map<std::string, typename TImage::ConstPointer> &volumes, const std::string &registrationKey,
+  bool compact){
+
+  const unsigned int D = TImage::ImageDimension;
+
+  //Written beside dst and renamed over it once complete, so that processes
+  //mapping the old file keep reading it unchanged.
+  const boost::filesystem::path tmp = dst.parent_path() /
+    boost::filesystem::unique_path("." + dst.filename().string() + ".tmp-%%%%-%%%%");
+
+  std::ofstream ofs(tmp.string(), std::ios::binary | std::ios::trunc);
+  if (!ofs.good()){
+    LOG(ERROR) << "Unable to write template bundle " << dst;
+    throw false;
+  }
+
+  //Filled in once the header offset is known.
+  detail::BundlePreamble pre;
+  std::memset(&pre, 0, sizeof(pre));
+  ofs.write(reinterpret_cast<const char *>(&pre), sizeof(pre));
+
+  nlohmann::json header;
+  header["manifest"] = manifest;
+  header["volumes"] = nlohmann::json::object();
+
+  const std::vector<char> padding(ALIGNMENT, 0);
+
+  for (const auto &kv : volumes){
+    const TImage *img = kv.second.GetPointer();
+    const std::size_t n = img->GetLargestPossibleRegion().GetNumberOfPixels();
+    const typename TImage::PixelType *buf = img->GetBufferPointer();
+
+    const std::size_t offset = Align(static_cast<std::size_t>(ofs.tellp()));
+    ofs.write(padding.data(), offset - static_cast<std::size_t>(ofs.tellp()));
+
+    const std::string type = compact ? GetStorageType(buf, n) : std::string("float32");
+    ck::Hasher h;
+
+    if (type == "uint8")
+      WritePixels<uint8_t>(ofs, buf, n, h);
+    else if (type == "int16")
+      WritePixels<int16_t>(ofs, buf, n, h);
+    else
+      WritePixels<float>(ofs, buf, n, h);
+
+    nlohmann::json v;
+    v["type"] = type;
+    v["offset"] = offset;
+    for (unsigned int d = 0; d < D; ++d){
+      v["size"].push_back(img->GetLargestPossibleRegion().GetSize()[d]);
+      v["spacing"].push_back(img->GetSpacing()[d]);
+      v["origin"].push_back(img->GetOrigin()[d]);
+      for (unsigned int e = 0; e < D; ++e)
+        v["direction"].push_back(img->GetDirection()[d][e]);
+    }
+    v["hash"] = h.GetHex();
+
+    header["volumes"][kv.first] = v;
+
+    LOG(INFO) << "Bundled " << kv.first << " as " << type;
+  }
+
+  //The NIfTI copy that ANTs reads, uncompressed.
+  boost::filesystem::path registrationTemplate = dst.filename();
+  registrationTemplate.replace_extension("");
+  registrationTemplate += "-" + registrationKey + ".nii";
+  header["registrationTemplate"] = registrationTemplate.string();
+
+  //Also renamed into place, as ANTs may be reading the old copy.
+  const boost::filesystem::path registrationTmp = dst.parent_path() /
+    boost::filesystem::unique_path(".tmp-%%%%-%%%%-" + registrationTemplate.string());
+
+  typedef itk::ImageFileWriter<TImage> WriterType;
+  typename WriterType::Pointer writer = WriterType::New();
+  writer->SetFileName(registrationTmp.string());
+  writer->SetInput(volumes.at(registrationKey));
+
+  boost::system::error_code ec;
+
+  try {
+    writer->Update();
+  } catch (itk::ExceptionObject &ex){
+    LOG(ERROR) << "Unable to write registration template " << registrationTemplate;
+    ofs.close();
+    boost::filesystem::remove(tmp, ec);
+    boost::filesystem::remove(registrationTmp, ec);
+    throw(ex);
+  }
+
+  const std::string text = header.dump();
+
+  std::memcpy(pre.magic, detail::BUNDLE_MAGIC, sizeof(pre.magic));
+  pre.version = VERSION;
+  pre.headerOffset = static_cast<uint64_t>(ofs.tellp());
+  pre.headerLength = text.size();
+
+  ofs.write(text.data(), text.size());
+  ofs.seekp(0);
+  ofs.write(reinterpret_cast<const char *>(&pre), sizeof(pre));
+  ofs.close();
+
+  if (!ofs.good()){
+    LOG(ERROR) << "Unable to write template bundle " << dst;
+    boost::filesystem::remove(tmp, ec);
+    boost::filesystem::remove(registrationTmp, ec);
+    throw false;
+  }
+
+  boost::filesystem::rename(registrationTmp, dst.parent_path() / registrationTemplate, ec);
+  if (!ec)
+    boost::filesystem::rename(tmp, dst, ec);
+
+  if (ec){
+    LOG(ERROR) << "Unable to write template bundle " << dst << ": " << ec.message();
+    boost::filesystem::remove(tmp, ec);
+    boost::filesystem::remove(registrationTmp, ec);
+    throw false;
+  }
+
+  LOG(INFO) << "Template bundle written to " << dst;
+
+}
+
+}// namespace tc
+
+#endif
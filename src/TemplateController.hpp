@@ -28,9 +28,18 @@
 #include <boost/algorithm/string/regex.hpp>
 
 #include <fstream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <vector>
 #include <glog/logging.h>
 #include <nlohmann/json.hpp>
 
+#include <itkImageFileReader.h>
+#include <itkImageFileWriter.h>
+
+#include "TemplateBundle.hpp"
+
 namespace tc {
 
 enum class ETemplateImages {
@@ -42,18 +51,59 @@ class TemplateController {
 public:
 
   TemplateController(){};
+
+  //A manifest, a folder holding manifest.json, or a compiled bundle.
   void SetPath(const boost::filesystem::path &pth);
   boost::filesystem::path GetFilePath(const ETemplateImages e);
   std::string GetFileName(const ETemplateImages e);
+  boost::filesystem::path GetManifestPath() const { return _manifestPath; };
+
+  //Changes whenever the manifest or any template changes.
+  std::string GetFingerprint();
+
+  //Writes every template to one bundle file, for fast loading.
+  template< typename TImage >
+  void CompileBundle(const boost::filesystem::path &dst);
+
+  //Share templates between processes through dir (e.g. /dev/shm). The
+  //first process to load a manifest publishes its templates there as a
+  //bundle, and later processes map it read-only. Call before SetPath.
+  void SetSharedStore(const boost::filesystem::path &dir){ _sharedStoreDir = dir; };
+
+  //Templates supplied in memory, e.g. by the library API. Every template
+  //is required. Only the registration template and a manifest are written
+  //to dir, as ANTs reads its reference image from disk.
+  template< typename TImage >
+  void SetImages(const std::map<ETemplateImages, typename TImage::ConstPointer> &images,
+    const boost::filesystem::path &dir);
+
+  //Template volume, read on first use and kept for the controller's
+  //lifetime. A controller shared between filters keeps its templates warm.
+  template< typename TImage >
+  typename TImage::ConstPointer GetImage(const ETemplateImages e);
 
 protected:
 
+  boost::filesystem::path _manifestPath;
   boost::filesystem::path _rootDir;
   nlohmann::json _jsonManifest;
+  std::shared_ptr<TemplateBundle> _bundle;
+  std::string _inMemoryFingerprint;
+
+  static std::string GetManifestKey(const ETemplateImages e);
+
+  typedef itk::Image<float, 3> SharedImageType;
+
+  boost::filesystem::path _sharedStoreDir;
+  std::string GetSharedStoreKey();
+  void AttachSharedStore();
+
+  std::mutex _cacheMutex;
+  std::map<ETemplateImages, itk::DataObject::ConstPointer> _imageCache;
 
 };
 
-void TemplateController::SetPath(const boost::filesystem::path &pth){
+inline void TemplateController::SetPath(const boost::filesystem::path &pth){
 
   boost::filesystem::path tempPath;
 
@@ -67,19 +117,139 @@ void TemplateController::SetPath(const boost::filesystem::path &pth){
     }
   }
 
-  LOG(INFO) << "Reading manifest from: " << tempPath;
-  
+  //Already loaded: keep the manifest and any cached volumes.
+  if (!_manifestPath.empty() && tempPath == _manifestPath)
+    return;
+
+  if (TemplateBundle::IsBundle(tempPath)){
+    _bundle = std::make_shared<TemplateBundle>(tempPath);
+    _jsonManifest = _bundle->GetManifest();
+  }
+  else {
+    LOG(INFO) << "Reading manifest from: " << tempPath;
+
+    try {
+      std::ifstream ifs(tempPath.c_str());
+      _jsonManifest = nlohmann::json::parse(ifs);
+    } catch (...) {
+      LOG(ERROR) << "Unable to read manifest!";
+      throw false;
+    }
+    _bundle = nullptr;
+  }
+
+  _rootDir = pth.parent_path();
+  _manifestPath = tempPath;
+  _inMemoryFingerprint.clear();
+
+  {
+    std::lock_guard<std::mutex> lock(_cacheMutex);
+    _imageCache.clear();
+  }
+
+  if (!_bundle && !_sharedStoreDir.empty())
+    AttachSharedStore();
+
+}
+
+//Identifies a version of the templates without reading them: the manifest,
+//and the name, size and modification time of each template file.
+inline std::string TemplateController::GetSharedStoreKey(){
+
+  ck::Hasher h;
+  h.Add(ck::HashFile(_manifestPath));
+
+  const ETemplateImages all[] = {
+    ETemplateImages::GM, ETemplateImages::WM, ETemplateImages::CSF,
+    ETemplateImages::Brain, ETemplateImages::Frontal, ETemplateImages::Mastoid,
+    ETemplateImages::Nasal, ETemplateImages::Skull, ETemplateImages::T1
+  };
+
+  for (auto e : all){
+    const boost::filesystem::path p = boost::filesystem::canonical(GetFilePath(e));
+    h.Add(p.string());
+    h.AddValue<uintmax_t>(boost::filesystem::file_size(p));
+    h.AddValue<int64_t>(boost::filesystem::last_write_time(p));
+  }
+
+  return h.GetHex();
+}
+
+inline void TemplateController::AttachSharedStore(){
+
+  const std::string prefix = "resolute-templates-";
+
   try {
-    std::ifstream ifs(tempPath.c_str());
-    _jsonManifest = nlohmann::json::parse(ifs);
+    const std::string key = GetSharedStoreKey();
+    const boost::filesystem::path bundlePath = _sharedStoreDir / (prefix + key + ".rtb");
+
+    //One process publishes while the others wait, then all map the result.
+    //A bundle only gets its signature once it is complete.
+    ck::FileLock lock(_sharedStoreDir / (prefix + "lock"));
+    if (!lock.IsLocked()){
+      LOG(ERROR) << "Could not lock the shared template store " << _sharedStoreDir;
+      throw false;
+    }
+
+    if (!TemplateBundle::IsBundle(bundlePath)){
+      LOG(INFO) << "Publishing templates to " << bundlePath;
+
+      const ETemplateImages all[] = {
+        ETemplateImages::GM, ETemplateImages::WM, ETemplateImages::CSF,
+        ETemplateImages::Brain, ETemplateImages::Frontal, ETemplateImages::Mastoid,
+        ETemplateImages::Nasal, ETemplateImages::Skull, ETemplateImages::T1
+      };
+
+      std::map<std::string, SharedImageType::ConstPointer> volumes;
+      for (auto e : all)
+        volumes[GetManifestKey(e)] = GetImage<SharedImageType>(e);
+
+      TemplateBundle::Write<SharedImageType>(bundlePath, _jsonManifest, volumes, GetManifestKey(ETemplateImages::T1), false);
+
+      volumes.clear();
+      std::lock_guard<std::mutex> cacheLock(_cacheMutex);
+      _imageCache.clear();
+
+      //Older versions, with their registration templates, once no process
+      //has them mapped. Those still in use are removed by a later publish.
+      std::vector<std::string> unused;
+      for (boost::filesystem::directory_iterator it(_sharedStoreDir), end; it != end; ++it){
+        const boost::filesystem::path &p = it->path();
+        const std::string name = p.filename().string();
+        if (name.compare(0, prefix.size(), prefix) != 0 || p.extension() != ".rtb" ||
+            name.find(key) != std::string::npos)
+          continue;
+
+        if (TemplateBundle::IsInUse(p))
+          LOG(INFO) << "Keeping old shared templates " << p << ", still in use.";
+        else
+          unused.push_back(p.stem().string());
+      }
+
+      for (const std::string &stem : unused){
+        for (boost::filesystem::directory_iterator it(_sharedStoreDir), end; it != end; ++it){
+          if (it->path().filename().string().compare(0, stem.size(), stem) == 0){
+            LOG(INFO) << "Removing old shared templates " << it->path();
+            boost::filesystem::remove(it->path());
+          }
+        }
+      }
+    }
+
+    _bundle = std::make_shared<TemplateBundle>(bundlePath);
   } catch (...) {
-    LOG(ERROR) << "Unable to read manifest!";
-    throw false;
+    LOG(WARNING) << "Shared template store in " << _sharedStoreDir << " is unavailable, loading templates privately.";
+    _bundle = nullptr;
+    std::lock_guard<std::mutex> cacheLock(_cacheMutex);
+    _imageCache.clear();
   }
-  _rootDir = pth.parent_path();
 
 }
-boost::filesystem::path TemplateController::GetFilePath(const ETemplateImages e){
+inline boost::filesystem::path TemplateController::GetFilePath(const ETemplateImages e){
+
+  //Only the registration template exists as a file next to a bundle.
+  if (_bundle && e == ETemplateImages::T1)
+    return _bundle->GetRegistrationTemplatePath();
 
   boost::filesystem::path outDir = _rootDir;
   outDir /= GetFileName(e);
@@ -87,24 +257,178 @@ boost::filesystem::path TemplateController::GetFilePath(const ETemplateImages e)
 
 }
 
-std::string TemplateController::GetFileName(const ETemplateImages e){
+inline std::string TemplateController::GetManifestKey(const ETemplateImages e){
 
   switch (e){
-    case ETemplateImages::GM: return _jsonManifest["GMReg"].template get<std::string>() ; break;
-    case ETemplateImages::WM: return _jsonManifest["WMReg"].template get<std::string>(); break;
-    case ETemplateImages::CSF: return _jsonManifest["CSFReg"].template get<std::string>(); break; 
-    case ETemplateImages::Brain: return _jsonManifest["brainMask"].template get<std::string>(); break;
-    case ETemplateImages::Frontal: return _jsonManifest["frontalReg"].template get<std::string>(); break;
-    case ETemplateImages::Mastoid: return _jsonManifest["mastoidReg"].template get<std::string>(); break;
-    case ETemplateImages::Nasal: return _jsonManifest["nasalReg"].template get<std::string>(); break;
-    case ETemplateImages::Skull: return _jsonManifest["skullReg"].template get<std::string>(); break;
-    case ETemplateImages::T1: return _jsonManifest["template"].template get<std::string>(); break;
+    case ETemplateImages::GM: return "GMReg"; break;
+    case ETemplateImages::WM: return "WMReg"; break;
+    case ETemplateImages::CSF: return "CSFReg"; break;
+    case ETemplateImages::Brain: return "brainMask"; break;
+    case ETemplateImages::Frontal: return "frontalReg"; break;
+    case ETemplateImages::Mastoid: return "mastoidReg"; break;
+    case ETemplateImages::Nasal: return "nasalReg"; break;
+    case ETemplateImages::Skull: return "skullReg"; break;
+    case ETemplateImages::T1: return "template"; break;
     default: return "";
   }
 
   return "";
 }
 
+inline std::string TemplateController::GetFileName(const ETemplateImages e){
+
+  const std::string key = GetManifestKey(e);
+  if (key.empty())
+    return "";
+
+  return _jsonManifest[key].template get<std::string>();
+}
+
+inline std::string TemplateController::GetFingerprint(){
+
+  if (!_inMemoryFingerprint.empty())
+    return _inMemoryFingerprint;
+
+  //The bundle header holds a hash of every volume.
+  if (_bundle)
+    return _bundle->GetFingerprint();
+
+  ck::Hasher h;
+  h.Add(ck::HashFile(_manifestPath));
+
+  const ETemplateImages all[] = {
+    ETemplateImages::GM, ETemplateImages::WM, ETemplateImages::CSF,
+    ETemplateImages::Brain, ETemplateImages::Frontal, ETemplateImages::Mastoid,
+    ETemplateImages::Nasal, ETemplateImages::Skull, ETemplateImages::T1
+  };
+
+  for (auto e : all)
+    h.Add(ck::HashFile(GetFilePath(e)));
+
+  return h.GetHex();
+}
+
+template< typename TImage >
+void TemplateController::CompileBundle(const boost::filesystem::path &dst){
+
+  const ETemplateImages all[] = {
+    ETemplateImages::GM, ETemplateImages::WM, ETemplateImages::CSF,
+    ETemplateImages::Brain, ETemplateImages::Frontal, ETemplateImages::Mastoid,
+    ETemplateImages::Nasal, ETemplateImages::Skull, ETemplateImages::T1
+  };
+
+  std::map<std::string, typename TImage::ConstPointer> volumes;
+  for (auto e : all)
+    volumes[GetManifestKey(e)] = GetImage<TImage>(e);
+
+  TemplateBundle::Write<TImage>(dst, _jsonManifest, volumes, GetManifestKey(ETemplateImages::T1));
+
+}
+
+template< typename TImage >
+void TemplateController::SetImages(const std::map<ETemplateImages, typename TImage::ConstPointer> &images,
+  const boost::filesystem::path &dir){
+
+  const ETemplateImages all[] = {
+    ETemplateImages::GM, ETemplateImages::WM, ETemplateImages::CSF,
+    ETemplateImages::Brain, ETemplateImages::Frontal, ETemplateImages::Mastoid,
+    ETemplateImages::Nasal, ETemplateImages::Skull, ETemplateImages::T1
+  };
+
+  nlohmann::json manifest = nlohmann::json::object();
+  ck::Hasher h;
+
+  for (auto e : all){
+    auto it = images.find(e);
+    if (it == images.end() || !it->second){
+      LOG(ERROR) << "Template " << GetManifestKey(e) << " was not supplied!";
+      throw false;
+    }
+    manifest[GetManifestKey(e)] = GetManifestKey(e) + ".nii";
+    h.AddImage(it->second.GetPointer());
+  }
+
+  try {
+    boost::filesystem::create_directories(dir);
+  } catch (const boost::filesystem::filesystem_error &e){
+    LOG(ERROR) << "Cannot create template folder : " << dir;
+    throw false;
+  }
+
+  //Uncompressed, so that each registration reads it quickly.
+  typedef itk::ImageFileWriter<TImage> WriterType;
+  typename WriterType::Pointer writer = WriterType::New();
+  writer->SetFileName((dir / manifest[GetManifestKey(ETemplateImages::T1)].template get<std::string>()).string());
+  writer->SetInput(images.at(ETemplateImages::T1));
+
+  try {
+    writer->Update();
+  } catch (itk::ExceptionObject &ex){
+    LOG(ERROR) << "Could not write registration template to " << dir;
+    throw(ex);
+  }
+
+  //Written so that SetPath() on it, e.g. from a filter's parameters,
+  //keeps these templates.
+  const boost::filesystem::path manifestPath = dir / "manifest.json";
+  std::ofstream ofs(manifestPath.string());
+  ofs << manifest.dump(4) << std::endl;
+  if (!ofs.good()){
+    LOG(ERROR) << "Could not write " << manifestPath;
+    throw false;
+  }
+
+  _jsonManifest = manifest;
+  _rootDir = dir;
+  _manifestPath = manifestPath;
+  _bundle = nullptr;
+  _inMemoryFingerprint = h.GetHex();
+
+  std::lock_guard<std::mutex> lock(_cacheMutex);
+  _imageCache.clear();
+  for (auto e : all)
+    _imageCache[e] = images.at(e).GetPointer();
+
+}
+
+template< typename TImage >
+typename TImage::ConstPointer TemplateController::GetImage(const ETemplateImages e){
+
+  std::lock_guard<std::mutex> lock(_cacheMutex);
+
+  auto it = _imageCache.find(e);
+  if (it != _imageCache.end()){
+    const TImage *img = dynamic_cast<const TImage *>(it->second.GetPointer());
+    if (img != nullptr)
+      return img;
+  }
+
+  if (_bundle){
+    typename TImage::ConstPointer img = _bundle->GetImage<TImage>(GetManifestKey(e));
+    _imageCache[e] = img.GetPointer();
+    return img;
+  }
+
+  typedef itk::ImageFileReader<TImage> ReaderType;
+  typename ReaderType::Pointer reader = ReaderType::New();
+  reader->SetFileName(GetFilePath(e).string());
+
+  try {
+    reader->Update();
+  } catch (itk::ExceptionObject &ex){
+    LOG(ERROR) << "Could not read template " << GetFilePath(e);
+    throw(ex);
+  }
+
+  typename TImage::Pointer img = reader->GetOutput();
+  img->DisconnectPipeline();
+
+  LOG(INFO) << "Cached template " << GetFileName(e);
+  _imageCache[e] = img.GetPointer();
+
+  return img.GetPointer();
+}
+
 }// end namespace tc
 
 #endif
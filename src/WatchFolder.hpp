@@ -0,0 +1,285 @@
+/*
+   WatchFolder.hpp
+
+   Author:      Benjamin A. Thomas
+
+   Copyright 2018 Institute of Nuclear Medicine, University College London.
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+
+ */
+
+#pragma once
+
+#ifndef _WATCHFOLDER_HPP_
+#define _WATCHFOLDER_HPP_
+
+#include <boost/filesystem.hpp>
+#include <glog/logging.h>
+
+#include <chrono>
+#include <map>
+#include <set>
+#include <string>
+
+#include <poll.h>
+#include <sys/inotify.h>
+#include <unistd.h>
+
+/*
+  Watches a drop directory for study exports. Each top-level subdirectory
+  is one study. A study is complete when its marker file appears, or when
+  nothing in it has changed for the quiescence period. Subdirectories
+  whose names start with '.' are ignored, so they can be used to archive
+  processed studies.
+*/
+
+namespace wf {
+
+class WatchFolder {
+
+public:
+
+  typedef std::chrono::steady_clock ClockType;
+
+  explicit WatchFolder(const boost::filesystem::path &root);
+  ~WatchFolder();
+
+  void SetQuiescenceSeconds(unsigned int s){ _quiescence = std::chrono::seconds(s); };
+  void SetMarkerFileName(const std::string &s){ _marker = s; };
+
+  //Blocks until a study is complete and returns its directory. Returns an
+  //empty path if timeoutSeconds (if > 0) passes first.
+  boost::filesystem::path Next(unsigned int timeoutSeconds = 0);
+
+protected:
+
+  void AddWatch(const boost::filesystem::path &dir, const boost::filesystem::path &study);
+  void AddStudy(const boost::filesystem::path &study);
+  void RemoveWatches(const boost::filesystem::path &study);
+  void ReadEvents();
+  void Rescan();
+  bool IsComplete(const boost::filesystem::path &study, ClockType::time_point lastActivity) const;
+
+  boost::filesystem::path _root;
+  int _fd = -1;
+
+  std::string _marker = "COMPLETE";
+  ClockType::duration _quiescence = std::chrono::seconds(30);
+
+  //Watch descriptor -> study it belongs to (empty for the root).
+  std::map<int, boost::filesystem::path> _watches;
+  //Studies not yet returned -> time of their last change.
+  std::map<boost::filesystem::path, ClockType::time_point> _pending;
+  //Studies already returned, so a rescan does not queue them again.
+  std::set<boost::filesystem::path> _returned;
+
+  WatchFolder(const WatchFolder &); //purposely not implemented
+  void operator=(const WatchFolder &);  //purposely not implemented
+
+};
+
+inline WatchFolder::WatchFolder(const boost::filesystem::path &root) : _root(root) {
+
+  if (!boost::filesystem::is_directory(_root)){
+    LOG(ERROR) << "Watch folder: " << _root << " does not appear to be a directory!";
+    throw false;
+  }
+
+  _fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+  if (_fd < 0){
+    LOG(ERROR) << "Unable to initialise inotify!";
+    throw false;
+  }
+
+  AddWatch(_root, boost::filesystem::path());
+  Rescan();
+
+}
+
+inline WatchFolder::~WatchFolder(){
+
+  if (_fd >= 0)
+    close(_fd);
+
+}
+
+inline void WatchFolder::AddWatch(const boost::filesystem::path &dir, const boost::filesystem::path &study){
+
+  const uint32_t mask = IN_CREATE | IN_MOVED_TO | IN_CLOSE_WRITE | IN_MODIFY | IN_DELETE_SELF;
+  const int wd = inotify_add_watch(_fd, dir.string().c_str(), mask);
+
+  if (wd < 0){
+    LOG(WARNING) << "Unable to watch " << dir;
+    return;
+  }
+
+  _watches[wd] = study;
+
+}
+
+//Watches a study and every directory below it. Files already there count
+//as activity now, so a study copied in before startup still has to settle.
+inline void WatchFolder::AddStudy(const boost::filesystem::path &study){
+
+  if (_pending.find(study) == _pending.end())
+    LOG(INFO) << "Watch folder: new study " << study;
+
+  _pending[study] = ClockType::now();
+  AddWatch(study, study);
+
+  boost::system::error_code ec;
+  for (boost::filesystem::recursive_directory_iterator it(study, ec), end; it != end; it.increment(ec)){
+    if (ec)
+      break;
+    if (boost::filesystem::is_directory(it->path()))
+      AddWatch(it->path(), study);
+  }
+
+}
+
+//Stops watching a study once it has been returned, so that moving or
+//deleting it afterwards generates no events.
+inline void WatchFolder::RemoveWatches(const boost::filesystem::path &study){
+
+  for (auto it = _watches.begin(); it != _watches.end(); ){
+    if (it->second == study){
+      inotify_rm_watch(_fd, it->first);
+      it = _watches.erase(it);
+    }
+    else
+      ++it;
+  }
+
+}
+
+//Picks up every study in the root, apart from those already returned.
+//Returned studies that have since been moved away are forgotten, so a
+//new study under the same name is still picked up.
+inline void WatchFolder::Rescan(){
+
+  for (auto it = _returned.begin(); it != _returned.end(); ){
+    if (!boost::filesystem::exists(*it))
+      it = _returned.erase(it);
+    else
+      ++it;
+  }
+
+  for (boost::filesystem::directory_iterator it(_root), end; it != end; ++it){
+    const boost::filesystem::path &p = it->path();
+    if (boost::filesystem::is_directory(p) && p.filename().string()[0] != '.' && _returned.count(p) == 0)
+      AddStudy(p);
+  }
+
+}
+
+inline void WatchFolder::ReadEvents(){
+
+  alignas(inotify_event) char buf[64 * 1024];
+
+  for (;;){
+    const ssize_t len = read(_fd, buf, sizeof(buf));
+    if (len <= 0)
+      break;
+
+    for (char *p = buf; p < buf + len; p += sizeof(inotify_event) + reinterpret_cast<inotify_event *>(p)->len){
+      const inotify_event *e = reinterpret_cast<inotify_event *>(p);
+
+      if (e->mask & IN_Q_OVERFLOW){
+        LOG(WARNING) << "Watch folder: event queue overflowed, rescanning.";
+        Rescan();
+        continue;
+      }
+
+      auto w = _watches.find(e->wd);
+      if (w == _watches.end())
+        continue;
+
+      if (e->mask & (IN_DELETE_SELF | IN_IGNORED)){
+        _watches.erase(w);
+        continue;
+      }
+
+      const std::string name = (e->len > 0) ? std::string(e->name) : std::string();
+      const boost::filesystem::path study = w->second;
+
+      if (study.empty()){
+        //Something appeared in the root: a new study, unless hidden. It
+        //replaces any earlier study of the same name.
+        boost::filesystem::path p = _root / name;
+        if (!name.empty() && name[0] != '.' && boost::filesystem::is_directory(p)){
+          _returned.erase(p);
+          AddStudy(p);
+        }
+        continue;
+      }
+
+      //Studies already returned are no longer tracked.
+      if (_pending.find(study) == _pending.end())
+        continue;
+
+      _pending[study] = ClockType::now();
+
+      //A new directory inside a study: watch it, and anything already in it.
+      if ((e->mask & IN_ISDIR) && (e->mask & (IN_CREATE | IN_MOVED_TO)))
+        AddStudy(study);
+    }
+  }
+
+}
+
+inline bool WatchFolder::IsComplete(const boost::filesystem::path &study, ClockType::time_point lastActivity) const {
+
+  if (!_marker.empty() && boost::filesystem::exists(study / _marker))
+    return true;
+
+  return (ClockType::now() - lastActivity) >= _quiescence;
+
+}
+
+inline boost::filesystem::path WatchFolder::Next(unsigned int timeoutSeconds){
+
+  const ClockType::time_point deadline = ClockType::now() + std::chrono::seconds(timeoutSeconds);
+
+  for (;;){
+    ReadEvents();
+
+    for (auto it = _pending.begin(); it != _pending.end(); ++it){
+      if (!boost::filesystem::exists(it->first)){
+        RemoveWatches(it->first);
+        _pending.erase(it);
+        break;
+      }
+
+      if (IsComplete(it->first, it->second)){
+        boost::filesystem::path study = it->first;
+        _pending.erase(it);
+        _returned.insert(study);
+        RemoveWatches(study);
+        LOG(INFO) << "Watch folder: study complete " << study;
+        return study;
+      }
+    }
+
+    if (timeoutSeconds > 0 && ClockType::now() >= deadline)
+      return boost::filesystem::path();
+
+    //Wake on new events, or after a second to re-check quiescence.
+    pollfd pfd = { _fd, POLLIN, 0 };
+    poll(&pfd, 1, 1000);
+  }
+
+}
+
+}// namespace wf
+
+#endif
@@ -0,0 +1,98 @@
+/*
+   resolute.h
+
+   Author:      Benjamin A. Thomas
+
+   Copyright 2018 Institute of Nuclear Medicine, University College London.
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+
+ */
+
+#ifndef _RESOLUTE_H_
+#define _RESOLUTE_H_
+
+#include <stddef.h>
+
+/*
+  C interface to libresolute. It mirrors ResoluteAPI.hpp: see there for
+  the meaning of each field. Strings may be NULL where empty is allowed.
+*/
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef enum {
+  RESOLUTE_OK = 0,
+  RESOLUTE_INVALID_ARGUMENT = 1,
+  RESOLUTE_FAILED = 2
+} resolute_status;
+
+typedef struct {
+  unsigned int size[3];
+  double spacing[3];
+  double origin[3];
+  double direction[9];
+} resolute_geometry;
+
+typedef struct {
+  resolute_geometry geometry;
+  const float *data;
+} resolute_volume;
+
+typedef struct {
+  const char *path;
+  resolute_volume gm, wm, csf, brain, frontal, mastoid, nasal, skull, t1;
+} resolute_templates;
+
+typedef struct {
+  const char *reg_name;
+  const char *reg_args;
+  const char *scratch_dir;
+  int keep_scratch;
+  int write_intermediates;
+  const char *extra_json;
+} resolute_params;
+
+typedef struct {
+  double wall_seconds;
+  double peak_resident_mb;
+  unsigned int soft_tissue_ute1;
+  unsigned int soft_tissue_ute2;
+  int cropped_to_head;
+} resolute_metrics;
+
+typedef struct resolute_processor resolute_processor;
+
+/* Defaults, as for a default-constructed resolute::Parameters. */
+void resolute_params_init(resolute_params *params);
+
+resolute_status resolute_processor_create(const resolute_templates *templates, resolute_processor **processor);
+void resolute_processor_destroy(resolute_processor *processor);
+
+/* Writes the mu-map (cm-1, MRAC grid) to mu_map, which must hold
+   mu_map_length floats. metrics may be NULL. */
+resolute_status resolute_compute(resolute_processor *processor,
+  const resolute_volume *mrac, const resolute_volume *ute1, const resolute_volume *ute2,
+  const resolute_params *params, float *mu_map, size_t mu_map_length, resolute_metrics *metrics);
+
+/* Message of the last failure on the calling thread. */
+const char *resolute_last_error(void);
+
+const char *resolute_version(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
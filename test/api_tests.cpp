@@ -0,0 +1,72 @@
+/*
+   api_tests.cpp
+
+   Author:      Benjamin A. Thomas
+
+   Copyright 2018 Institute of Nuclear Medicine, University College London.
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+
+ */
+
+
+#include "ResoluteAPI.hpp"
+#include "resolute.h"
+#include <gtest/gtest.h>
+
+#include <string>
+#include <vector>
+
+namespace {
+
+resolute::VolumeView MakeView(unsigned int n, const std::vector<float> &buf){
+
+  resolute::VolumeView v = resolute::VolumeView();
+  for (unsigned int d = 0; d < 3; ++d){
+    v.geometry.size[d] = n;
+    v.geometry.spacing[d] = 2.0;
+    v.geometry.direction[4 * d] = 1.0;
+  }
+  v.data = buf.data();
+  return v;
+}
+
+TEST(API, CRejectsNullArguments) {
+
+  resolute_processor *processor = NULL;
+  EXPECT_EQ(RESOLUTE_INVALID_ARGUMENT, resolute_processor_create(NULL, &processor));
+  EXPECT_TRUE(processor == NULL);
+  EXPECT_FALSE(std::string(resolute_last_error()).empty());
+
+  float mu = 0;
+  EXPECT_EQ(RESOLUTE_INVALID_ARGUMENT, resolute_compute(NULL, NULL, NULL, NULL, NULL, &mu, 1, NULL));
+}
+
+TEST(API, InMemoryTemplatesAndGridCheck) {
+
+  const std::vector<float> tpl(8 * 8 * 8, 0.0f);
+  resolute::Templates t = resolute::Templates();
+  t.gm = t.wm = t.csf = t.brain = t.frontal = MakeView(8, tpl);
+  t.mastoid = t.nasal = t.skull = t.t1 = MakeView(8, tpl);
+
+  resolute::Processor processor(t);
+
+  //Inputs must share one grid; this fails before registration.
+  const std::vector<float> big(8 * 8 * 8, 1.0f), small(4 * 4 * 4, 1.0f);
+  EXPECT_THROW(processor.Compute(MakeView(8, big), MakeView(4, small), MakeView(8, big)), resolute::Error);
+
+  //Every template is required.
+  t.skull.data = nullptr;
+  EXPECT_THROW(resolute::Processor incomplete(t), resolute::Error);
+}
+
+}
@@ -0,0 +1,379 @@
+/*
+   benchmark_stages.cpp
+
+   Author:      Benjamin A. Thomas
+
+   Copyright 2018 Institute of Nuclear Medicine, University College London.
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+
+   This program benchmarks the RESOLUTE stages on a synthetic dual-echo UTE
+   head phantom, with a matching MRAC and synthetic (pre-warped) templates.
+ */
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <map>
+#include <random>
+#include <sstream>
+#include <thread>
+
+#include <boost/filesystem.hpp>
+#include <boost/program_options.hpp>
+#include <glog/logging.h>
+#include <nlohmann/json.hpp>
+
+#include <itkImage.h>
+#include <itkImageRegionIteratorWithIndex.h>
+#include <itkMultiThreader.h>
+
+#include "Resolute.hpp"
+#include "Parallel.hpp"
+
+namespace po = boost::program_options;
+namespace fs = boost::filesystem;
+using json = nlohmann::json;
+
+typedef itk::Image<float, 3> ImageType;
+
+//Exposes the protected stages so they can be timed one by one.
+class BenchmarkFilter : public ns::ResoluteImageFilter<ImageType, ImageType>
+{
+public:
+  typedef BenchmarkFilter Self;
+  typedef ns::ResoluteImageFilter<ImageType, ImageType> Superclass;
+  typedef itk::SmartPointer< Self > Pointer;
+
+  itkNewMacro(Self);
+  itkTypeMacro(BenchmarkFilter, ResoluteImageFilter);
+
+  using Superclass::CalculateHistogram;
+  using Superclass::FindClusterCoords;
+  using Superclass::CropToHead;
+  using Superclass::CropImage;
+  using Superclass::NormaliseUTE;
+  using Superclass::MakeAirMask;
+  using Superclass::MakePatientVolumeMask;
+  using Superclass::MakeR2s;
+  using Superclass::ApplyAlgorithm;
+
+  const ImageType *GetR2s() const { return this->_R2s; };
+
+  //Stand-in for registration and warping: the templates are already in
+  //patient space, so they only need cropping like the inputs.
+  void SetWarpedTemplate(tc::ETemplateImages e, const ImageType *img){
+    this->StoreWarpedTemplate(e, this->CropImage(img));
+  };
+
+  //Voxels each stage works on: the histogram, and the grid before and
+  //after cropping to the head.
+  double GetHistogramVoxels() const { return this->_histogram->GetLargestPossibleRegion().GetNumberOfPixels(); };
+  double GetInputVoxels() { return this->GetMRACImage()->GetLargestPossibleRegion().GetNumberOfPixels(); };
+  double GetCroppedVoxels() const { return this->_mrac->GetLargestPossibleRegion().GetNumberOfPixels(); };
+
+protected:
+  BenchmarkFilter(){};
+};
+
+//Images of the synthetic head, all on one grid.
+struct Phantom {
+  ImageType::Pointer ute1, ute2, mrac;
+  std::map<tc::ETemplateImages, ImageType::Pointer> templates;
+};
+
+ImageType::Pointer NewImage(unsigned int n, double spacing){
+
+  ImageType::SizeType size;
+  size.Fill(n);
+
+  ImageType::SpacingType sp;
+  sp.Fill(spacing);
+
+  ImageType::PointType origin;
+  origin.Fill(-0.5 * n * spacing);
+
+  ImageType::Pointer img = ImageType::New();
+  img->SetRegions(size);
+  img->SetSpacing(sp);
+  img->SetOrigin(origin);
+  img->Allocate();
+  img->FillBuffer(0);
+
+  return img;
+}
+
+//Ellipsoidal head in a 300 mm field of view (as the mMR UTE at 192^3):
+//scalp, skull, brain (GM shell around WM), ventricles, a frontal sinus,
+//mastoids, skull base and nasal region. UTE2 decays from UTE1 with
+//tissue R2*, plus Gaussian noise.
+Phantom MakePhantom(unsigned int n, unsigned int seed){
+
+  const double FOV = 300.0;
+  const double spacing = FOV / n;
+  const double dTE = (2.46 - 0.07) / 1000.0;
+
+  Phantom p;
+  p.ute1 = NewImage(n, spacing);
+  p.ute2 = NewImage(n, spacing);
+  p.mrac = NewImage(n, spacing);
+
+  const tc::ETemplateImages templateTypes[] = {
+    tc::ETemplateImages::GM, tc::ETemplateImages::WM, tc::ETemplateImages::CSF,
+    tc::ETemplateImages::Brain, tc::ETemplateImages::Frontal, tc::ETemplateImages::Mastoid,
+    tc::ETemplateImages::Nasal, tc::ETemplateImages::Skull
+  };
+
+  for (auto t : templateTypes)
+    p.templates[t] = NewImage(n, spacing);
+
+  std::mt19937 rng(seed);
+  std::normal_distribution<float> noise(0.0, 10.0);
+
+  auto sphere = [](const ImageType::PointType &x, double cx, double cy, double cz, double r){
+    return (x[0]-cx)*(x[0]-cx) + (x[1]-cy)*(x[1]-cy) + (x[2]-cz)*(x[2]-cz) <= r*r;
+  };
+
+  itk::ImageRegionIteratorWithIndex<ImageType> it(p.ute1, p.ute1->GetLargestPossibleRegion());
+
+  for (it.GoToBegin(); !it.IsAtEnd(); ++it){
+    const ImageType::IndexType idx = it.GetIndex();
+    ImageType::PointType x;
+    p.ute1->TransformIndexToPhysicalPoint(idx, x);
+
+    const double d = std::sqrt( (x[0]/75.0)*(x[0]/75.0) + (x[1]/95.0)*(x[1]/95.0) + (x[2]/110.0)*(x[2]/110.0) );
+
+    const bool head = d <= 1.0;
+    const bool skull = head && d > 0.84 && d <= 0.93;
+    const bool brain = d <= 0.84;
+    const bool sinus = sphere(x, 0, 72, 25, 10);
+    const bool ventricle = sphere(x, 0, 0, 10, 12);
+    const bool mastoid = sphere(x, 62, -15, -45, 8) || sphere(x, -62, -15, -45, 8);
+    const bool skullBase = skull && x[2] < -30;
+    const bool nasal = head && x[1] > 55 && x[2] < -10 && x[2] > -60;
+
+    double s0 = 15.0, r2s = 0.0;
+    if (head)      { s0 = 600.0; r2s = 60.0; }  //scalp and soft tissue
+    if (skull)     { s0 = 500.0; r2s = 900.0; }
+    if (brain)     { s0 = 550.0; r2s = 40.0; }
+    if (ventricle) { s0 = 400.0; r2s = 10.0; }
+    if (sinus)     { s0 = 15.0; r2s = 0.0; }
+
+    const float v1 = std::fabs(s0 + noise(rng)) + 1.0f;
+    const float v2 = std::fabs(s0 * std::exp(-r2s * dTE) + noise(rng)) + 1.0f;
+
+    it.Set(v1);
+    p.ute2->SetPixel(idx, v2);
+    p.mrac->SetPixel(idx, (head && !sinus) ? 1000.0f : 0.0f);
+
+    //Smooth GM/WM boundary, so the tissue maps are true probabilities.
+    const double wm = brain ? std::min(1.0, std::max(0.0, (0.66 - d) / 0.06)) : 0.0;
+    const double gm = brain ? 1.0 - wm : 0.0;
+
+    p.templates[tc::ETemplateImages::WM]->SetPixel(idx, ventricle ? 0.0 : wm);
+    p.templates[tc::ETemplateImages::GM]->SetPixel(idx, ventricle ? 0.0 : gm);
+    p.templates[tc::ETemplateImages::CSF]->SetPixel(idx, ventricle ? 1.0 : 0.0);
+    p.templates[tc::ETemplateImages::Brain]->SetPixel(idx, brain);
+    p.templates[tc::ETemplateImages::Frontal]->SetPixel(idx, sinus);
+    p.templates[tc::ETemplateImages::Mastoid]->SetPixel(idx, mastoid);
+    p.templates[tc::ETemplateImages::Nasal]->SetPixel(idx, nasal);
+    p.templates[tc::ETemplateImages::Skull]->SetPixel(idx, skullBase);
+  }
+
+  return p;
+}
+
+//Writes a manifest naming the synthetic templates. Only the file names
+//are used: the templates are handed straight to the filter.
+fs::path WriteManifest(const fs::path &dir){
+
+  json manifest = {
+    {"GMReg", "GM.nii.gz"}, {"WMReg", "WM.nii.gz"}, {"CSFReg", "CSF.nii.gz"},
+    {"brainMask", "brain_mask.nii.gz"}, {"frontalReg", "frontal.nii.gz"},
+    {"mastoidReg", "mastoid.nii.gz"}, {"nasalReg", "nasal.nii.gz"},
+    {"skullReg", "skull_base.nii.gz"}, {"template", "T1.nii.gz"}
+  };
+
+  fs::path manifestPath = dir;
+  manifestPath /= "manifest.json";
+
+  std::ofstream ofs(manifestPath.string());
+  ofs << manifest.dump(4);
+
+  return manifestPath;
+}
+
+std::vector<unsigned int> ParseList(const std::string &s){
+
+  std::vector<unsigned int> values;
+  std::stringstream ss(s);
+  std::string item;
+
+  while (std::getline(ss, item, ','))
+    if (!item.empty())
+      values.push_back(std::stoul(item));
+
+  return values;
+}
+
+//Times of each stage over the repeats, and the voxels it works on.
+struct StageTimes {
+  std::map<std::string, std::vector<double> > seconds;
+  std::map<std::string, double> voxels;
+};
+
+//One pass over every stage on a fresh filter, in pipeline order. Nothing
+//is written to disk, so the timings are of the stages alone.
+void RunStages(const Phantom &p, const json &params, const fs::path &workDir, StageTimes &times){
+
+  BenchmarkFilter::Pointer filter = BenchmarkFilter::New();
+  filter->SetJSONParams(params);
+  filter->SetOutputDirectory(workDir);
+  filter->SetMRACImage(p.mrac);
+  filter->SetUTEImage1(p.ute1);
+  filter->SetUTEImage2(p.ute2);
+  filter->SetMaskImage(p.ute2);
+
+  //The voxel count is read after the stage has run, as the crop sets it.
+  auto timeStage = [&](const std::string &name, std::function<void()> fn, std::function<double()> voxels){
+    const auto start = std::chrono::steady_clock::now();
+    fn();
+    const std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    times.seconds[name].push_back(elapsed.count());
+    times.voxels[name] = voxels();
+  };
+
+  auto input = [&](){ return filter->GetInputVoxels(); };
+  auto cropped = [&](){ return filter->GetCroppedVoxels(); };
+
+  timeStage("CalculateHistogram", [&](){ filter->CalculateHistogram(); }, input);
+  timeStage("FindClusterCoords", [&](){ filter->FindClusterCoords(); },
+    [&](){ return filter->GetHistogramVoxels(); });
+  timeStage("CropToHead", [&](){ filter->CropToHead(); }, input);
+  timeStage("NormaliseUTE", [&](){ filter->NormaliseUTE(); }, cropped);
+  timeStage("MakeAirMask", [&](){ filter->MakeAirMask(); }, cropped);
+  timeStage("MakePatientVolumeMask", [&](){ filter->MakePatientVolumeMask(); }, cropped);
+  timeStage("MakeR2s", [&](){ filter->MakeR2s(); }, cropped);
+
+  for (const auto &t : p.templates)
+    filter->SetWarpedTemplate(t.first, t.second);
+
+  for (auto backend : {ns::ESmoothingBackend::Recursive, ns::ESmoothingBackend::Discrete}){
+    const std::string name = (backend == ns::ESmoothingBackend::Recursive) ?
+      "SmoothR2s (recursive)" : "SmoothR2s (discrete)";
+    timeStage(name, [&](){ ns::SmoothImage<ImageType>(filter->GetR2s(), filter->FWHM, backend); }, cropped);
+  }
+
+  timeStage("ApplyAlgorithm", [&](){ filter->ApplyAlgorithm(); }, cropped);
+
+}
+
+int main(int argc, char **argv)
+{
+
+  std::string sizeList, threadList, outputFile, workDirectory;
+  unsigned int repeats = 3;
+
+  po::options_description desc("Options");
+  desc.add_options()
+    ("help,h", "Print help information")
+    ("sizes", po::value<std::string>(&sizeList)->default_value("96,192"), "Phantom sizes (voxels per side)")
+    ("threads", po::value<std::string>(&threadList)->default_value("1,4"), "Thread counts")
+    ("repeats", po::value<unsigned int>(&repeats)->default_value(3), "Repeats per configuration")
+    ("output,o", po::value<std::string>(&outputFile)->default_value("benchmark.json"), "JSON results file")
+    ("work-dir", po::value<std::string>(&workDirectory)->default_value(""), "Scratch directory (default: temp.)");
+
+  po::variables_map vm;
+  try {
+    po::store(po::parse_command_line(argc, argv, desc), vm);
+    if (vm.count("help")) {
+      std::cout << argv[0] << std::endl << desc << std::endl;
+      return EXIT_SUCCESS;
+    }
+    po::notify(vm);
+  } catch (po::error& e) {
+    std::cerr << "ERROR: " << e.what() << std::endl << std::endl;
+    std::cerr << desc << std::endl;
+    return EXIT_FAILURE;
+  }
+
+  google::InitGoogleLogging(argv[0]);
+  FLAGS_logtostderr = 1;
+  FLAGS_minloglevel = google::WARNING;
+
+  fs::path workRoot = workDirectory.empty() ?
+    fs::temp_directory_path() / fs::unique_path("resolute-bench-%%%%-%%%%") : fs::path(workDirectory);
+  fs::create_directories(workRoot);
+
+  const fs::path manifestPath = WriteManifest(workRoot);
+
+  json params;
+  params["regTemplatePath"] = manifestPath.string();
+  params["writeIntermediates"] = false;
+
+  json results = json::array();
+
+  for (unsigned int n : ParseList(sizeList)){
+
+    const Phantom phantom = MakePhantom(n, 2018);
+
+    for (unsigned int threads : ParseList(threadList)){
+
+      itk::MultiThreader::SetGlobalDefaultNumberOfThreads(threads);
+      ns::SetNumberOfWorkerThreads(threads);
+
+      fs::path workDir = workRoot;
+      workDir /= std::to_string(n) + "-" + std::to_string(threads);
+      fs::create_directories(workDir);
+
+      StageTimes times;
+      for (unsigned int r = 0; r < repeats; ++r)
+        RunStages(phantom, params, workDir, times);
+
+      for (auto &t : times.seconds){
+        std::vector<double> v = t.second;
+        const double nVox = times.voxels[t.first];
+        std::sort(v.begin(), v.end());
+        const double median = v[v.size() / 2];
+
+        results.push_back({
+          {"stage", t.first},
+          {"size", n},
+          {"threads", threads},
+          {"repeats", v.size()},
+          {"minSeconds", v.front()},
+          {"medianSeconds", median},
+          {"maxSeconds", v.back()},
+          {"voxels", nVox},
+          {"mvoxPerSecond", nVox / 1e6 / v.front()}
+        });
+
+        std::cout << n << "^3\t" << threads << " thr\t" << t.first << "\t" << v.front() << " s" << std::endl;
+      }
+    }
+  }
+
+  json report;
+  report["hardwareConcurrency"] = std::thread::hardware_concurrency();
+  report["results"] = results;
+
+  std::ofstream ofs(outputFile);
+  ofs << report.dump(2) << std::endl;
+
+  if (workDirectory.empty())
+    fs::remove_all(workRoot);
+
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,131 @@
+/*
+   bundle_tests.cpp
+
+   Author:      Benjamin A. Thomas
+
+   Copyright 2018 Institute of Nuclear Medicine, University College London.
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+   
+ */
+
+
+#include "TemplateBundle.hpp"
+#include <gtest/gtest.h>
+
+#include <iterator>
+
+#include <itkImageRegionIteratorWithIndex.h>
+
+namespace {
+
+namespace fs = boost::filesystem;
+
+typedef itk::Image<float, 3> ImageType;
+
+ImageType::Pointer MakeVolume(float (*value)(const ImageType::IndexType &)){
+
+  ImageType::SizeType size;
+  size.Fill(6);
+  ImageType::Pointer img = ImageType::New();
+  img->SetRegions(size);
+  ImageType::SpacingType spacing;
+  spacing.Fill(1.5);
+  img->SetSpacing(spacing);
+  img->Allocate();
+
+  for (itk::ImageRegionIteratorWithIndex<ImageType> it(img, img->GetLargestPossibleRegion()); !it.IsAtEnd(); ++it)
+    it.Set(value(it.GetIndex()));
+
+  return img;
+}
+
+TEST(TemplateBundleTest, VolumesRoundTripInSmallestExactType)
+{
+  const fs::path dir = fs::temp_directory_path() / fs::unique_path();
+  fs::create_directories(dir);
+  const fs::path bundlePath = dir / "templates.rtb";
+
+  ImageType::Pointer mask = MakeVolume([](const ImageType::IndexType &i){ return float(i[0] > 2); });
+  ImageType::Pointer map = MakeVolume([](const ImageType::IndexType &i){ return 0.1f * i[1] + 0.01f * i[2]; });
+
+  nlohmann::json manifest = { {"brainMask", "brain.nii.gz"}, {"template", "t1.nii.gz"} };
+  std::map<std::string, ImageType::ConstPointer> volumes;
+  volumes["brainMask"] = mask.GetPointer();
+  volumes["template"] = map.GetPointer();
+
+  tc::TemplateBundle::Write<ImageType>(bundlePath, manifest, volumes, "template");
+
+  ASSERT_TRUE(tc::TemplateBundle::IsBundle(bundlePath));
+  EXPECT_FALSE(tc::TemplateBundle::IsBundle(dir / "templates-template.nii"));
+
+  {
+    tc::TemplateBundle bundle(bundlePath);
+    EXPECT_EQ(bundle.GetManifest()["brainMask"], "brain.nii.gz");
+    EXPECT_TRUE(fs::exists(bundle.GetRegistrationTemplatePath()));
+    EXPECT_EQ(bundle.GetFingerprint().size(), 16u);
+
+    for (const auto &kv : volumes){
+      ImageType::ConstPointer img = bundle.GetImage<ImageType>(kv.first);
+      EXPECT_EQ(img->GetSpacing(), kv.second->GetSpacing());
+
+      const std::size_t n = img->GetLargestPossibleRegion().GetNumberOfPixels();
+      for (std::size_t i = 0; i < n; ++i)
+        ASSERT_EQ(img->GetBufferPointer()[i], kv.second->GetBufferPointer()[i]);
+    }
+  }
+
+  fs::remove_all(dir);
+}
+
+TEST(TemplateBundleTest, MappedImagesOutliveBundleAndRewrite)
+{
+  const fs::path dir = fs::temp_directory_path() / fs::unique_path();
+  fs::create_directories(dir);
+  const fs::path bundlePath = dir / "templates.rtb";
+
+  ImageType::Pointer map = MakeVolume([](const ImageType::IndexType &i){ return 0.1f * i[1] + 0.01f * i[2]; });
+  ImageType::Pointer other = MakeVolume([](const ImageType::IndexType &i){ return 0.5f + i[0]; });
+
+  nlohmann::json manifest = { {"template", "t1.nii.gz"} };
+  std::map<std::string, ImageType::ConstPointer> volumes;
+  volumes["template"] = map.GetPointer();
+
+  tc::TemplateBundle::Write<ImageType>(bundlePath, manifest, volumes, "template");
+
+  EXPECT_FALSE(tc::TemplateBundle::IsInUse(bundlePath));
+
+  //Read without a copy, then the bundle is released and rewritten.
+  ImageType::ConstPointer img;
+  {
+    tc::TemplateBundle bundle(bundlePath);
+    EXPECT_TRUE(tc::TemplateBundle::IsInUse(bundlePath));
+    img = bundle.GetImage<ImageType>("template");
+  }
+
+  //The image still holds the mapping.
+  EXPECT_TRUE(tc::TemplateBundle::IsInUse(bundlePath));
+
+  volumes["template"] = other.GetPointer();
+  tc::TemplateBundle::Write<ImageType>(bundlePath, manifest, volumes, "template");
+
+  const std::size_t n = img->GetLargestPossibleRegion().GetNumberOfPixels();
+  for (std::size_t i = 0; i < n; ++i)
+    ASSERT_EQ(img->GetBufferPointer()[i], map->GetBufferPointer()[i]);
+
+  //Only the bundle and its NIfTI copy are left.
+  EXPECT_EQ(std::distance(fs::directory_iterator(dir), fs::directory_iterator()), 2);
+
+  fs::remove_all(dir);
+}
+
+}
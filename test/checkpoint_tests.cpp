@@ -0,0 +1,93 @@
+/*
+   checkpoint_tests.cpp
+
+   Author:      Benjamin A. Thomas
+
+   Copyright 2018 Institute of Nuclear Medicine, University College London.
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+   
+ */
+
+
+#include "Checkpoint.hpp"
+#include <gtest/gtest.h>
+
+#include <fstream>
+
+namespace {
+
+namespace fs = boost::filesystem;
+
+class CheckpointTest : public ::testing::Test {
+protected:
+  void SetUp() override {
+    _dir = fs::temp_directory_path() / fs::unique_path();
+    fs::create_directories(_dir);
+  }
+
+  void TearDown() override {
+    fs::remove_all(_dir);
+  }
+
+  fs::path _dir;
+};
+
+TEST(HasherTest, FieldsAreSeparated)
+{
+  EXPECT_NE(ck::Hasher().Add(std::string("ab")).Add(std::string("c")).Get(),
+            ck::Hasher().Add(std::string("a")).Add(std::string("bc")).Get());
+  EXPECT_EQ(ck::Hasher().Add(std::string("abc")).GetHex(), ck::Hasher().Add(std::string("abc")).GetHex());
+  EXPECT_EQ(ck::Hasher().GetHex().size(), 16u);
+}
+
+TEST_F(CheckpointTest, StageIsReusedOnlyWhileUnchanged)
+{
+  const fs::path out = _dir / "ANTs-Affine.txt";
+  std::ofstream(out.string()) << "transform";
+
+  {
+    ck::CheckpointStore store(_dir);
+    EXPECT_FALSE(store.IsValid("registration", "abc"));
+    store.Commit("registration", "abc", { out });
+  }
+
+  //Read back by a new run.
+  ck::CheckpointStore store(_dir);
+  EXPECT_TRUE(store.IsValid("registration", "abc"));
+  EXPECT_FALSE(store.IsValid("registration", "abd"));
+
+  //A truncated output invalidates the stage.
+  std::ofstream(out.string()) << "trans";
+  EXPECT_FALSE(store.IsValid("registration", "abc"));
+
+  std::ofstream(out.string()) << "transform";
+  EXPECT_TRUE(store.IsValid("registration", "abc"));
+
+  store.Invalidate("registration");
+  EXPECT_FALSE(ck::CheckpointStore(_dir).IsValid("registration", "abc"));
+}
+
+TEST_F(CheckpointTest, FileLockReportsFailure)
+{
+  {
+    ck::FileLock lock(_dir / "lock");
+    EXPECT_TRUE(lock.IsLocked());
+  }
+
+  //Released with the object, so it can be taken again.
+  EXPECT_TRUE(ck::FileLock(_dir / "lock").IsLocked());
+
+  EXPECT_FALSE(ck::FileLock(_dir / "missing" / "lock").IsLocked());
+}
+
+}
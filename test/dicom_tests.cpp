@@ -20,10 +20,123 @@
 
 #include <gtest/gtest.h>
 
+#include "ExtractDicomImages.hpp"
+
+#include <fstream>
+
+#include <gdcmWriter.h>
+
+namespace fs = boost::filesystem;
+
 namespace {
 /*
 TEST(DICOM, dcmodifyExists){
    EXPECT_EQ(0, system("dcmodify --version"));
 }*/
 
+void AddElement(gdcm::DataSet &ds, uint16_t group, uint16_t element, gdcm::VR::VRType vr, std::string value){
+
+  if (value.size() % 2)
+    value += (vr == gdcm::VR::UI) ? '\0' : ' ';
+
+  gdcm::DataElement de(gdcm::Tag(group, element));
+  de.SetVR(vr);
+  de.SetByteValue(value.c_str(), static_cast<uint32_t>(value.size()));
+  ds.Insert(de);
+}
+
+gdcm::DataSet MakeRecord(const std::string &type){
+  gdcm::DataSet record;
+  AddElement(record, 0x0004, 0x1430, gdcm::VR::CS, type);
+  return record;
+}
+
+gdcm::DataSet MakeImageRecord(const std::string &fileID, const std::string &imageNo){
+  gdcm::DataSet record = MakeRecord("IMAGE");
+  AddElement(record, 0x0004, 0x1500, gdcm::VR::CS, fileID);
+  AddElement(record, 0x0020, 0x0013, gdcm::VR::IS, imageNo);
+  return record;
+}
+
+bool WriteDicomDir(const fs::path &dst, const std::vector<gdcm::DataSet> &records){
+
+  gdcm::SmartPointer<gdcm::SequenceOfItems> sq = new gdcm::SequenceOfItems;
+  sq->SetLengthToUndefined();
+  for (const gdcm::DataSet &r : records){
+    gdcm::Item item;
+    item.SetVLToUndefined();
+    item.SetNestedDataSet(r);
+    sq->AddItem(item);
+  }
+
+  gdcm::DataElement seq(gdcm::Tag(0x0004, 0x1220));
+  seq.SetVR(gdcm::VR::SQ);
+  seq.SetValue(*sq);
+  seq.SetVLToUndefined();
+
+  gdcm::Writer writer;
+  writer.GetFile().GetDataSet().Insert(seq);
+
+  gdcm::FileMetaInformation &header = writer.GetFile().GetHeader();
+  header.SetDataSetTransferSyntax(gdcm::TransferSyntax::ExplicitVRLittleEndian);
+  AddElement(header, 0x0002, 0x0002, gdcm::VR::UI, "1.2.840.10008.1.3.10");
+  AddElement(header, 0x0002, 0x0003, gdcm::VR::UI, "1.2.826.0.1.3680043.9.6705.1");
+  AddElement(header, 0x0002, 0x0010, gdcm::VR::UI, "1.2.840.10008.1.2.1");
+
+  writer.CheckFileMetaInformationOff();
+  writer.SetFileName(dst.string().c_str());
+  return writer.Write();
+}
+
+}
+
+//The listed files are empty, so the index can only come from the
+//DICOMDIR. The UTE records carry their TE, so no header is read either.
+TEST(DICOM, IndexesFromDicomDir){
+
+  const fs::path root = fs::temp_directory_path() / fs::unique_path();
+  fs::create_directories(root / "data");
+  const char *const files[] = { "im1", "im2", "im3" };
+  for (const char *f : files)
+    std::ofstream((root / "data" / f).string());
+
+  std::vector<gdcm::DataSet> records;
+
+  records.push_back(MakeRecord("STUDY"));
+  AddElement(records.back(), 0x0020, 0x000d, gdcm::VR::UI, "1.2.34");
+
+  records.push_back(MakeRecord("SERIES"));
+  AddElement(records.back(), 0x0020, 0x000e, gdcm::VR::UI, "1.2.34.1");
+  AddElement(records.back(), 0x0008, 0x103e, gdcm::VR::LO, "MRACHEAD");
+  AddElement(records.back(), 0x0020, 0x0011, gdcm::VR::IS, "10");
+  records.push_back(MakeImageRecord("DATA\\IM2", "2"));
+  records.push_back(MakeImageRecord("DATA\\IM1", "1"));
+
+  records.push_back(MakeRecord("SERIES"));
+  AddElement(records.back(), 0x0020, 0x000e, gdcm::VR::UI, "1.2.34.2");
+  AddElement(records.back(), 0x0008, 0x103e, gdcm::VR::LO, "UTE2");
+  AddElement(records.back(), 0x0020, 0x0011, gdcm::VR::IS, "12");
+  records.push_back(MakeImageRecord("DATA\\IM3", "1"));
+  AddElement(records.back(), 0x0018, 0x0081, gdcm::VR::DS, "0.07");
+
+  ASSERT_TRUE(WriteDicomDir(root / "DICOMDIR", records));
+
+  dcm::UTETree tree(root);
+  ASSERT_EQ(1, tree.GetNoOfStudies());
+  EXPECT_EQ("1.2.34", tree.GetStudyUID(1));
+  EXPECT_EQ(2, tree.GetNoOfSeries("1.2.34"));
+
+  std::string uid;
+  ASSERT_TRUE(tree.TryFindMuMapUID("1.2.34", "MRAC", uid));
+  EXPECT_EQ("1.2.34.1", uid);
+
+  const std::vector<fs::path> mrac = tree.GetSeriesFileList(uid);
+  ASSERT_EQ(2u, mrac.size());
+  EXPECT_EQ(root / "data" / "im1", mrac[0]);
+  EXPECT_EQ(root / "data" / "im2", mrac[1]);
+
+  ASSERT_TRUE(tree.TryFindUTEUID("1.2.34", "UTE", "0.07", uid));
+  EXPECT_EQ("1.2.34.2", uid);
+
+  fs::remove_all(root);
 }
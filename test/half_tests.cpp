@@ -0,0 +1,278 @@
+/*
+   half_tests.cpp
+
+   Author:      Benjamin A. Thomas
+
+   Copyright 2018 Institute of Nuclear Medicine, University College London.
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+
+ */
+
+
+#include "HalfFloat.hpp"
+#include "Resolute.hpp"
+#include <gtest/gtest.h>
+
+#include <cmath>
+#include <fstream>
+#include <limits>
+#include <map>
+#include <random>
+
+#include <itkImageRegionIteratorWithIndex.h>
+
+namespace {
+
+TEST(HalfFloat, ExactValuesRoundTrip) {
+
+  const float exact[] = { 0.0f, -0.0f, 1.0f, -2.5f, 100.0f, 300.0f, 800.0f, 1200.0f, 1600.0f,
+                          2048.0f, 65504.0f, 6.103515625e-05f, 5.9604644775390625e-08f };
+
+  for (float v : exact)
+    EXPECT_EQ(v, ns::HalfToFloat(ns::FloatToHalf(v))) << v;
+
+  EXPECT_EQ(0x3c00, ns::FloatToHalf(1.0f));
+  EXPECT_EQ(0x7bff, ns::FloatToHalf(65504.0f));
+}
+
+TEST(HalfFloat, RoundsToNearestEven) {
+
+  //2049 lies halfway between 2048 and 2050: ties go to the even mantissa.
+  EXPECT_EQ(2048.0f, ns::HalfToFloat(ns::FloatToHalf(2049.0f)));
+  EXPECT_EQ(2052.0f, ns::HalfToFloat(ns::FloatToHalf(2051.0f)));
+  EXPECT_EQ(2050.0f, ns::HalfToFloat(ns::FloatToHalf(2050.9f)));
+
+  //Relative error bound over the normal range.
+  for (float v = 6.2e-5f; v < 65000.0f; v *= 1.0137f){
+    const float h = ns::HalfToFloat(ns::FloatToHalf(v));
+    EXPECT_LE(std::abs(h - v), v * std::ldexp(1.0f, -11)) << v;
+  }
+}
+
+TEST(HalfFloat, SpecialValues) {
+
+  EXPECT_TRUE(std::isinf(ns::HalfToFloat(ns::FloatToHalf(1e6f))));
+  EXPECT_TRUE(std::isinf(ns::HalfToFloat(ns::FloatToHalf(std::numeric_limits<float>::infinity()))));
+  EXPECT_TRUE(std::isnan(ns::HalfToFloat(ns::FloatToHalf(std::numeric_limits<float>::quiet_NaN()))));
+  EXPECT_EQ(0.0f, ns::HalfToFloat(ns::FloatToHalf(1e-9f)));
+}
+
+//The mu-map is built from R2* through GetMU, and from thresholds on R2*,
+//smoothed R2* and the normalised UTE sum. The thresholds are exact in
+//half precision, and the mu values stay within 0.2% of float.
+TEST(HalfFloat, MuMapWithinTolerance) {
+
+  for (float r = 0.0f; r <= 10000.0f; r += 0.37f){
+    const float mu = ns::GetMU(r);
+    const float muHalf = ns::GetMU(ns::HalfToFloat(ns::FloatToHalf(r)));
+    EXPECT_LE(std::abs(muHalf - mu), 2e-3f * std::abs(mu) + 1e-6f) << r;
+  }
+}
+
+TEST(HalfFloat, ExpandSlabMatchesVolume) {
+
+  typedef itk::Image<float, 3> ImageType;
+
+  ImageType::SizeType size = {{ 7, 5, 6 }};
+  ImageType::Pointer img = ImageType::New();
+  img->SetRegions(size);
+  img->Allocate();
+
+  float *buf = img->GetBufferPointer();
+  for (std::size_t i = 0; i < img->GetLargestPossibleRegion().GetNumberOfPixels(); ++i)
+    buf[i] = 0.5f * i - 40.0f;
+
+  ns::HalfImageType::Pointer half = ns::CompressToHalf<ImageType>(img);
+
+  ImageType::RegionType slab = img->GetLargestPossibleRegion();
+  slab.SetIndex(2, 2);
+  slab.SetSize(2, 3);
+
+  ImageType::Pointer expanded = ns::ExpandFromHalf<ImageType>(half, slab);
+
+  itk::ImageRegionConstIterator<ImageType> inIt(img, slab);
+  itk::ImageRegionConstIterator<ImageType> outIt(expanded, slab);
+  for (; !inIt.IsAtEnd(); ++inIt, ++outIt)
+    EXPECT_EQ(inIt.Get(), outIt.Get());
+}
+
+typedef itk::Image<float, 3> PhantomImageType;
+
+//Runs the stages of GenerateData from the histogram to the decision rules,
+//with the registration replaced by templates already in patient space.
+class PrecisionFilter : public ns::ResoluteImageFilter<PhantomImageType, PhantomImageType>
+{
+public:
+  typedef PrecisionFilter Self;
+  typedef ns::ResoluteImageFilter<PhantomImageType, PhantomImageType> Superclass;
+  typedef itk::SmartPointer< Self > Pointer;
+
+  itkNewMacro(Self);
+  itkTypeMacro(PrecisionFilter, ResoluteImageFilter);
+
+  PhantomImageType::Pointer Run(bool half, const std::map<tc::ETemplateImages, PhantomImageType::Pointer> &templates){
+
+    this->_bHalfPrecision = half;
+
+    this->CalculateHistogram();
+    this->FindClusterCoords();
+    this->CropToHead();
+    this->NormaliseUTE();
+    this->MakeAirMask();
+    this->MakePatientVolumeMask();
+    this->MakeR2s();
+
+    if (half){
+      this->_sumUTEHalf = ns::CompressToHalf<PhantomImageType>(this->_sumUTE);
+      this->_sumUTE = nullptr;
+    }
+
+    for (const auto &t : templates)
+      this->StoreWarpedTemplate(t.first, this->CropImage(t.second));
+
+    this->ApplyAlgorithm();
+    return this->_resolute;
+  };
+
+protected:
+  PrecisionFilter(){};
+};
+
+PhantomImageType::Pointer NewPhantomImage(unsigned int n, double spacing){
+
+  PhantomImageType::SizeType size;
+  size.Fill(n);
+  PhantomImageType::SpacingType sp;
+  sp.Fill(spacing);
+  PhantomImageType::PointType origin;
+  origin.Fill(-0.5 * n * spacing);
+
+  PhantomImageType::Pointer img = PhantomImageType::New();
+  img->SetRegions(size);
+  img->SetSpacing(sp);
+  img->SetOrigin(origin);
+  img->Allocate();
+  img->FillBuffer(0);
+
+  return img;
+}
+
+//The mu-maps of a small head phantom (scalp, skull, brain, a ventricle
+//and a sinus) agree between half and float intermediates, apart from the
+//odd voxel whose R2* rounds across a decision threshold.
+TEST(HalfFloat, PhantomMuMapMatchesFloat) {
+
+  const unsigned int n = 48;
+  const double spacing = 300.0 / n;
+  const double dTE = (2.46 - 0.07) / 1000.0;
+
+  PhantomImageType::Pointer ute1 = NewPhantomImage(n, spacing);
+  PhantomImageType::Pointer ute2 = NewPhantomImage(n, spacing);
+  PhantomImageType::Pointer mrac = NewPhantomImage(n, spacing);
+
+  const tc::ETemplateImages templateTypes[] = {
+    tc::ETemplateImages::GM, tc::ETemplateImages::WM, tc::ETemplateImages::CSF,
+    tc::ETemplateImages::Brain, tc::ETemplateImages::Frontal, tc::ETemplateImages::Mastoid,
+    tc::ETemplateImages::Nasal, tc::ETemplateImages::Skull
+  };
+
+  std::map<tc::ETemplateImages, PhantomImageType::Pointer> templates;
+  for (auto t : templateTypes)
+    templates[t] = NewPhantomImage(n, spacing);
+
+  std::mt19937 rng(2018);
+  std::normal_distribution<float> noise(0.0, 10.0);
+
+  for (itk::ImageRegionIteratorWithIndex<PhantomImageType> it(ute1, ute1->GetLargestPossibleRegion()); !it.IsAtEnd(); ++it){
+    const PhantomImageType::IndexType idx = it.GetIndex();
+    PhantomImageType::PointType x;
+    ute1->TransformIndexToPhysicalPoint(idx, x);
+
+    const double d = std::sqrt( (x[0]/75.0)*(x[0]/75.0) + (x[1]/95.0)*(x[1]/95.0) + (x[2]/110.0)*(x[2]/110.0) );
+    const bool head = d <= 1.0;
+    const bool skull = head && d > 0.84 && d <= 0.93;
+    const bool brain = d <= 0.84;
+    const bool ventricle = x[0]*x[0] + x[1]*x[1] + (x[2]-10)*(x[2]-10) <= 12*12;
+    const bool sinus = x[0]*x[0] + (x[1]-72)*(x[1]-72) + (x[2]-25)*(x[2]-25) <= 10*10;
+
+    double s0 = 15.0, r2s = 0.0;
+    if (head)      { s0 = 600.0; r2s = 60.0; }
+    if (skull)     { s0 = 500.0; r2s = 900.0; }
+    if (brain)     { s0 = 550.0; r2s = 40.0; }
+    if (ventricle) { s0 = 400.0; r2s = 10.0; }
+    if (sinus)     { s0 = 15.0; r2s = 0.0; }
+
+    it.Set(std::fabs(s0 + noise(rng)) + 1.0f);
+    ute2->SetPixel(idx, std::fabs(s0 * std::exp(-r2s * dTE) + noise(rng)) + 1.0f);
+    mrac->SetPixel(idx, (head && !sinus) ? 1000.0f : 0.0f);
+
+    const double wm = brain ? std::min(1.0, std::max(0.0, (0.66 - d) / 0.06)) : 0.0;
+    templates[tc::ETemplateImages::WM]->SetPixel(idx, ventricle ? 0.0 : wm);
+    templates[tc::ETemplateImages::GM]->SetPixel(idx, (ventricle || !brain) ? 0.0 : 1.0 - wm);
+    templates[tc::ETemplateImages::CSF]->SetPixel(idx, ventricle);
+    templates[tc::ETemplateImages::Brain]->SetPixel(idx, brain);
+    templates[tc::ETemplateImages::Frontal]->SetPixel(idx, sinus);
+    templates[tc::ETemplateImages::Skull]->SetPixel(idx, skull && x[2] < -30);
+  }
+
+  const boost::filesystem::path dir = boost::filesystem::temp_directory_path() / boost::filesystem::unique_path();
+  boost::filesystem::create_directories(dir);
+
+  //Only the file names in the manifest are used.
+  nlohmann::json manifest = {
+    {"GMReg", "GM.nii.gz"}, {"WMReg", "WM.nii.gz"}, {"CSFReg", "CSF.nii.gz"},
+    {"brainMask", "brain_mask.nii.gz"}, {"frontalReg", "frontal.nii.gz"},
+    {"mastoidReg", "mastoid.nii.gz"}, {"nasalReg", "nasal.nii.gz"},
+    {"skullReg", "skull_base.nii.gz"}, {"template", "T1.nii.gz"}
+  };
+  std::ofstream((dir / "manifest.json").string()) << manifest.dump(4);
+
+  nlohmann::json params;
+  params["regTemplatePath"] = (dir / "manifest.json").string();
+  params["writeIntermediates"] = false;
+
+  PhantomImageType::Pointer mu[2];
+  for (int half = 0; half < 2; ++half){
+    PrecisionFilter::Pointer filter = PrecisionFilter::New();
+    filter->SetJSONParams(params);
+    filter->SetOutputDirectory(dir);
+    filter->SetMRACImage(mrac);
+    filter->SetUTEImage1(ute1);
+    filter->SetUTEImage2(ute2);
+    filter->SetMaskImage(ute2);
+    mu[half] = filter->Run(half == 1, templates);
+  }
+
+  boost::filesystem::remove_all(dir);
+
+  const std::size_t nVox = mu[0]->GetLargestPossibleRegion().GetNumberOfPixels();
+  ASSERT_EQ(nVox, mu[1]->GetLargestPossibleRegion().GetNumberOfPixels());
+
+  double sumDiff = 0.0;
+  std::size_t tissue = 0, flipped = 0;
+  for (std::size_t i = 0; i < nVox; ++i){
+    const double diff = std::fabs(mu[0]->GetBufferPointer()[i] - mu[1]->GetBufferPointer()[i]);
+    sumDiff += diff;
+    tissue += (mu[0]->GetBufferPointer()[i] > 0.09f);
+    flipped += (diff > 1e-3);
+  }
+
+  //The phantom produced a real mu-map.
+  EXPECT_GT(tissue, nVox / 20);
+
+  //Mean within 0.1% of soft tissue, and under 0.5% of voxels changed class.
+  EXPECT_LT(sumDiff / nVox, 1e-4);
+  EXPECT_LT(flipped, nVox / 200);
+}
+
+}
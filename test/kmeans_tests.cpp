@@ -0,0 +1,105 @@
+/*
+   kmeans_tests.cpp
+
+   Author:      Benjamin A. Thomas
+
+   Copyright 2018 Institute of Nuclear Medicine, University College London.
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+   
+ */
+
+#include "HistogramKMeans.hpp"
+#include <gtest/gtest.h>
+
+#include <random>
+
+namespace {
+
+//Plain Lloyd's algorithm over every bin, as run by the previous ITK estimator.
+void BruteForceKMeans(const std::vector<float> &h, unsigned int nx, unsigned int ny,
+                      double ox, double oy, double sx, double sy, double c[2][3]){
+
+  for (int it = 0; it < 500; ++it){
+    double acc[2][4] = {{0,0,0,0},{0,0,0,0}};
+    for (unsigned int j = 0; j < ny; ++j){
+      for (unsigned int i = 0; i < nx; ++i){
+        const double p[3] = {ox + i * sx, oy + j * sy, h[j * nx + i]};
+        double d[2] = {0, 0};
+        for (int k = 0; k < 2; ++k)
+          for (int n = 0; n < 3; ++n)
+            d[k] += (p[n] - c[k][n]) * (p[n] - c[k][n]);
+        const int k = (d[0] <= d[1]) ? 0 : 1;
+        acc[k][0] += 1;
+        for (int n = 0; n < 3; ++n)
+          acc[k][n+1] += p[n];
+      }
+    }
+
+    double change = 0;
+    for (int k = 0; k < 2; ++k){
+      if (acc[k][0] == 0) continue;
+      for (int n = 0; n < 3; ++n){
+        const double v = acc[k][n+1] / acc[k][0];
+        change += (v - c[k][n]) * (v - c[k][n]);
+        c[k][n] = v;
+      }
+    }
+    if (change == 0) break;
+  }
+}
+
+TEST(KMeans, MatchesLloydOverAllBins){
+
+  const unsigned int nx = 160, ny = 140;
+  const double ox = 0.5, oy = 0.5, sx = 0.996, sy = 0.994;
+
+  std::vector<float> h(nx * ny, 0);
+  std::mt19937 rng(42);
+  std::normal_distribution<double> air(30, 8), tissue(95, 14);
+
+  for (int n = 0; n < 200000; ++n){
+    const int i = air(rng), j = air(rng);
+    if (i >= 0 && j >= 0 && i < (int)nx && j < (int)ny) h[j * nx + i] += 1;
+  }
+  for (int n = 0; n < 300000; ++n){
+    const int i = tissue(rng), j = 0.8 * tissue(rng);
+    if (i >= 0 && j >= 0 && i < (int)nx && j < (int)ny) h[j * nx + i] += 1;
+  }
+  for (auto &v : h) v = std::min(v, 2000.0f);
+
+  double c[2][3] = {{100, 100, 1000}, {100, 100, 0}};
+  BruteForceKMeans(h, nx, ny, ox, oy, sx, sy, c);
+
+  ns::HistogramKMeans kmeans;
+  kmeans.SetHistogram(h.data(), nx, ny);
+  kmeans.SetOrigin(ox, oy);
+  kmeans.SetSpacing(sx, sy);
+  kmeans.SetTolerance(0);
+  kmeans.SetInitialCentroids({100, 100, 1000}, {100, 100, 0});
+  kmeans.Compute();
+
+  EXPECT_NEAR(c[0][0], kmeans.GetCentroid(0).x, 1e-6);
+  EXPECT_NEAR(c[0][1], kmeans.GetCentroid(0).y, 1e-6);
+  EXPECT_NEAR(c[0][2], kmeans.GetCentroid(0).c, 1e-6);
+  EXPECT_NEAR(c[1][0], kmeans.GetCentroid(1).x, 1e-6);
+  EXPECT_NEAR(c[1][1], kmeans.GetCentroid(1).y, 1e-6);
+
+  std::vector<float> labels(nx * ny);
+  kmeans.Classify(labels.data());
+
+  //The peak of the tissue cluster must be labelled as soft tissue.
+  EXPECT_EQ(1, labels[76 * nx + 95]);
+  EXPECT_EQ(0, labels[0]);
+}
+
+}
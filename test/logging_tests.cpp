@@ -0,0 +1,105 @@
+/*
+   logging_tests.cpp
+
+   Author:      Benjamin A. Thomas
+
+   Copyright 2018 Institute of Nuclear Medicine, University College London.
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+
+ */
+
+
+#include "AsyncLog.hpp"
+#include <gtest/gtest.h>
+
+#include <ctime>
+#include <set>
+#include <thread>
+#include <vector>
+
+namespace {
+
+//Records what reaches the INFO log, and on which thread.
+class CaptureLogger : public google::base::Logger {
+
+public:
+  void Write(bool, time_t, const char *message, int length) override {
+    std::lock_guard<std::mutex> lock(mutex);
+    messages.push_back(std::string(message, length));
+    threads.insert(std::this_thread::get_id());
+  };
+  void Flush() override {};
+  google::uint32 LogSize() override { return 0; };
+
+  std::mutex mutex;
+  std::vector<std::string> messages;
+  std::set<std::thread::id> threads;
+};
+
+class AsyncLogTest : public ::testing::Test {
+protected:
+  void SetUp() override {
+    _original = google::base::GetLogger(google::INFO);
+    google::base::SetLogger(google::INFO, &_capture);
+  }
+
+  void TearDown() override {
+    mon::AsyncLog::GetInstance().Shutdown();
+    google::base::SetLogger(google::INFO, _original);
+  }
+
+  //Writes a record as glog does once logging is initialised.
+  static void WriteInfo(const std::string &message){
+    const std::string record = "I " + message + "\n";
+    google::base::GetLogger(google::INFO)->Write(false, std::time(0), record.data(), record.size());
+  }
+
+  google::base::Logger *_original;
+  CaptureLogger _capture;
+};
+
+TEST_F(AsyncLogTest, WritesInOrderOnBackgroundThread)
+{
+  mon::AsyncLog &log = mon::AsyncLog::GetInstance();
+  log.Install(1 << 20, false);
+
+  const uint64_t dropped = log.GetDroppedCount();
+  for (int i = 0; i < 100; ++i)
+    WriteInfo("record " + std::to_string(i));
+
+  log.Drain();
+
+  ASSERT_EQ(100u, _capture.messages.size());
+  for (int i = 0; i < 100; ++i)
+    EXPECT_NE(std::string::npos, _capture.messages[i].find("record " + std::to_string(i)));
+
+  EXPECT_EQ(0u, _capture.threads.count(std::this_thread::get_id()));
+  EXPECT_EQ(dropped, log.GetDroppedCount());
+}
+
+TEST_F(AsyncLogTest, DropsAndCountsWhenFull)
+{
+  mon::AsyncLog &log = mon::AsyncLog::GetInstance();
+  log.Install(0, false);
+
+  const uint64_t dropped = log.GetDroppedCount();
+  for (int i = 0; i < 10; ++i)
+    WriteInfo("record " + std::to_string(i));
+
+  log.Drain();
+
+  EXPECT_TRUE(_capture.messages.empty());
+  EXPECT_EQ(dropped + 10, log.GetDroppedCount());
+}
+
+}
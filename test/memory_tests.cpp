@@ -0,0 +1,66 @@
+/*
+   memory_tests.cpp
+
+   Author:      Benjamin A. Thomas
+
+   Copyright 2018 Institute of Nuclear Medicine, University College London.
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+   
+ */
+
+#include "MemoryMonitor.hpp"
+#include <gtest/gtest.h>
+
+namespace {
+
+//The test binary does not link AllocationHooks.hpp, so large blocks are
+//reported to the counters by hand.
+TEST(MemoryMonitor, NestedStagePeaks)
+{
+  const std::size_t MB = 1 << 20;
+  mon::MemoryMonitor &monitor = mon::MemoryMonitor::GetInstance();
+
+  const int64_t base = mon::detail::GetAllocationCounters().liveLargeBytes.load();
+  const std::size_t first = monitor.GetReport()["stages"].size();
+
+  {
+    mon::ScopedMemoryStage outer("outer");
+    mon::detail::OnLargeAllocation(4 * MB);
+    {
+      mon::ScopedMemoryStage inner("inner");
+      mon::detail::OnLargeAllocation(8 * MB);
+      mon::detail::OnLargeDeallocation(8 * MB);
+    }
+    mon::detail::OnLargeDeallocation(4 * MB);
+  }
+
+  nlohmann::json stages = monitor.GetReport()["stages"];
+  ASSERT_EQ(stages.size(), first + 2);
+
+  const nlohmann::json &outer = stages[first];
+  const nlohmann::json &inner = stages[first + 1];
+
+  EXPECT_EQ(outer["name"], "outer");
+  EXPECT_EQ(outer["depth"], 0);
+  EXPECT_EQ(outer["largeAllocations"], 2);
+  EXPECT_EQ(outer["peakImageBytes"].get<int64_t>() - base, static_cast<int64_t>(12 * MB));
+  EXPECT_EQ(outer["liveImageBytesEnd"].get<int64_t>(), base);
+
+  EXPECT_EQ(inner["name"], "inner");
+  EXPECT_EQ(inner["depth"], 1);
+  EXPECT_EQ(inner["largeAllocations"], 1);
+  EXPECT_EQ(inner["liveImageBytesStart"].get<int64_t>() - base, static_cast<int64_t>(4 * MB));
+  EXPECT_EQ(inner["peakImageBytes"].get<int64_t>() - base, static_cast<int64_t>(12 * MB));
+}
+
+}
@@ -0,0 +1,92 @@
+/*
+   metrics_tests.cpp
+
+   Author:      Benjamin A. Thomas
+
+   Copyright 2018 Institute of Nuclear Medicine, University College London.
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+
+ */
+
+
+#include "Metrics.hpp"
+#include <gtest/gtest.h>
+
+#include <fstream>
+#include <sstream>
+
+namespace {
+
+namespace fs = boost::filesystem;
+
+TEST(Metrics, TextFormat)
+{
+  mon::MetricsRegistry &metrics = mon::MetricsRegistry::GetInstance();
+
+  const double before = metrics.Get("resolute_failures_total", { { "stage", "test \"quoted\"" } });
+  metrics.Increment("resolute_failures_total", 1.0, { { "stage", "test \"quoted\"" } });
+  metrics.Increment("resolute_failures_total", 2.0, { { "stage", "test \"quoted\"" } });
+  EXPECT_EQ(before + 3.0, metrics.Get("resolute_failures_total", { { "stage", "test \"quoted\"" } }));
+
+  metrics.Set("resolute_peak_rss_bytes", 1024.0);
+  metrics.Set("resolute_peak_rss_bytes", 2048.0);
+
+  const std::string text = metrics.GetText();
+  EXPECT_NE(std::string::npos, text.find("# TYPE resolute_failures_total counter\n"));
+  EXPECT_NE(std::string::npos, text.find("# HELP resolute_peak_rss_bytes "));
+  EXPECT_NE(std::string::npos, text.find("# TYPE resolute_peak_rss_bytes gauge\n"));
+  EXPECT_NE(std::string::npos, text.find("resolute_peak_rss_bytes 2048\n"));
+  EXPECT_NE(std::string::npos, text.find("resolute_failures_total{stage=\"test \\\"quoted\\\"\"} "));
+}
+
+TEST(Metrics, RecordRunLabelsStages)
+{
+  mon::MetricsRegistry &metrics = mon::MetricsRegistry::GetInstance();
+  const double before = metrics.Get("resolute_stage_seconds_total", { { "stage", "metrics-test" } });
+
+  {
+    mon::ScopedStage stage("metrics-test");
+  }
+
+  metrics.RecordRun(true);
+
+  EXPECT_GE(metrics.Get("resolute_stage_duration_seconds", { { "stage", "metrics-test" } }), 0.0);
+  EXPECT_GE(metrics.Get("resolute_stage_seconds_total", { { "stage", "metrics-test" } }), before);
+  EXPECT_GE(metrics.Get("resolute_runs_total", { { "result", "success" } }), 1.0);
+  EXPECT_NE(std::string::npos, metrics.GetText().find("resolute_stage_duration_seconds{stage=\"metrics-test\"}"));
+}
+
+TEST(Metrics, WritesTextfile)
+{
+  const fs::path dst = fs::temp_directory_path() / fs::unique_path("%%%%-%%%%.prom");
+
+  mon::MetricsRegistry &metrics = mon::MetricsRegistry::GetInstance();
+  metrics.Increment("resolute_files_indexed_total", 5.0);
+  metrics.WriteTextfile(dst);
+
+  std::ifstream ifs(dst.string());
+  std::stringstream contents;
+  contents << ifs.rdbuf();
+  EXPECT_EQ(metrics.GetText(), contents.str());
+
+  //Only the renamed file is left behind.
+  std::size_t files = 0;
+  for (fs::directory_iterator it(dst.parent_path()), end; it != end; ++it)
+    if (it->path().filename().string().find(dst.filename().string()) == 0)
+      files++;
+  EXPECT_EQ(1u, files);
+
+  fs::remove(dst);
+}
+
+}
@@ -0,0 +1,194 @@
+/*
+   morphology_tests.cpp
+
+   Author:      Benjamin A. Thomas
+
+   Copyright 2018 Institute of Nuclear Medicine, University College London.
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+   
+ */
+
+#include <itkImage.h>
+#include <itkBinaryBallStructuringElement.h>
+#include <itkBinaryMorphologicalClosingImageFilter.h>
+#include <itkConnectedComponentImageFilter.h>
+
+#include "MaskMorphology.hpp"
+#include <gtest/gtest.h>
+
+#include <random>
+
+namespace {
+
+typedef itk::Image<unsigned char, 3> MaskImageType;
+typedef itk::Image<unsigned int, 3> LabelImageType;
+
+MaskImageType::Pointer MakeRandomMask(unsigned int seed){
+
+  MaskImageType::SizeType size = {{23, 19, 17}};
+
+  MaskImageType::Pointer img = MaskImageType::New();
+  img->SetRegions(size);
+  img->Allocate();
+
+  std::mt19937 rng(seed);
+  std::bernoulli_distribution coin(0.12);
+
+  unsigned char *buf = img->GetBufferPointer();
+  for (std::size_t i = 0; i < img->GetLargestPossibleRegion().GetNumberOfPixels(); ++i)
+    buf[i] = coin(rng);
+
+  return img;
+}
+
+TEST(Morphology, ClosingMatchesITKBall){
+
+  for (unsigned int radius = 1; radius <= 4; ++radius){
+    MaskImageType::Pointer img = MakeRandomMask(radius);
+
+    typedef itk::BinaryBallStructuringElement<unsigned char, 3> StructuringElementType;
+    StructuringElementType ball;
+    ball.SetRadius(radius);
+    ball.CreateStructuringElement();
+
+    typedef itk::BinaryMorphologicalClosingImageFilter<MaskImageType, MaskImageType, StructuringElementType> ClosingType;
+    ClosingType::Pointer closing = ClosingType::New();
+    closing->SetInput(img);
+    closing->SetForegroundValue(1);
+    closing->SetKernel(ball);
+    closing->Update();
+
+    const MaskImageType::SizeType sz = img->GetLargestPossibleRegion().GetSize();
+    const std::size_t size[3] = {sz[0], sz[1], sz[2]};
+    std::vector<unsigned char> mask(img->GetBufferPointer(), img->GetBufferPointer() + sz[0] * sz[1] * sz[2]);
+    ns::BinaryClosingBall(mask.data(), size, radius);
+
+    const unsigned char *ref = closing->GetOutput()->GetBufferPointer();
+    for (std::size_t i = 0; i < mask.size(); ++i)
+      ASSERT_EQ(ref[i], mask[i]) << "radius " << radius << ", voxel " << i;
+  }
+}
+
+TEST(Morphology, SlabClosingMatchesWholeVolume){
+
+  MaskImageType::Pointer img = MakeRandomMask(11);
+
+  const MaskImageType::SizeType sz = img->GetLargestPossibleRegion().GetSize();
+  const std::size_t size[3] = {sz[0], sz[1], sz[2]};
+  const unsigned char *in = img->GetBufferPointer();
+
+  for (unsigned int radius = 1; radius <= 3; ++radius){
+    std::vector<unsigned char> whole(in, in + sz[0] * sz[1] * sz[2]);
+    ns::BinaryClosingBall(whole.data(), size, radius);
+
+    //From one plane per slab up to the whole volume.
+    const std::size_t budgets[] = { 1, 20000, 60000, 0 };
+    for (std::size_t budget : budgets){
+      std::vector<unsigned char> slabs(whole.size(), 9);
+      ns::BinaryClosingBallInSlabs(in, slabs.data(), size, radius, budget);
+      ASSERT_EQ(whole, slabs) << "radius " << radius << ", budget " << budget;
+    }
+  }
+}
+
+TEST(Morphology, LabelsMatchITKConnectedComponents){
+
+  MaskImageType::Pointer img = MakeRandomMask(7);
+
+  typedef itk::ConnectedComponentImageFilter<MaskImageType, LabelImageType> ConnectedType;
+  ConnectedType::Pointer connected = ConnectedType::New();
+  connected->SetInput(img);
+  connected->Update();
+
+  const MaskImageType::SizeType sz = img->GetLargestPossibleRegion().GetSize();
+  const std::size_t size[3] = {sz[0], sz[1], sz[2]};
+
+  std::vector<uint32_t> labels;
+  EXPECT_EQ(connected->GetObjectCount(), ns::LabelConnectedComponents(img->GetBufferPointer(), size, labels));
+
+  const unsigned int *ref = connected->GetOutput()->GetBufferPointer();
+  for (std::size_t i = 0; i < labels.size(); ++i)
+    ASSERT_EQ(ref[i], labels[i]) << "voxel " << i;
+}
+
+TEST(Morphology, FillHoles){
+
+  const std::size_t size[3] = {7, 7, 7};
+  std::vector<unsigned char> mask(7 * 7 * 7, 0);
+
+  //Hollow cube with a one-voxel cavity.
+  for (std::size_t z = 2; z <= 4; ++z)
+    for (std::size_t y = 2; y <= 4; ++y)
+      for (std::size_t x = 2; x <= 4; ++x)
+        mask[(z * 7 + y) * 7 + x] = 1;
+  mask[(3 * 7 + 3) * 7 + 3] = 0;
+
+  ns::FillHoles(mask.data(), size);
+
+  EXPECT_EQ(1, mask[(3 * 7 + 3) * 7 + 3]);
+  EXPECT_EQ(0, mask[0]);
+}
+
+TEST(Morphology, ForegroundThreshold){
+
+  //1..200 and background: the 99th percentile is 199.
+  std::vector<float> img(300, 0.0f);
+  for (int i = 0; i < 200; ++i)
+    img[i] = i + 1.0f;
+  img[250] = -50.0f;
+
+  EXPECT_FLOAT_EQ(19.9f, ns::GetForegroundThreshold(img.data(), img.size(), 0.1));
+  //A few bright outliers above the percentile do not move it far.
+  img[299] = 1e6f;
+  EXPECT_NEAR(19.9f, ns::GetForegroundThreshold(img.data(), img.size(), 0.1), 0.2f);
+
+  const std::vector<float> empty(10, 0.0f);
+  EXPECT_EQ(0.0f, ns::GetForegroundThreshold(empty.data(), empty.size(), 0.1));
+}
+
+//The registration metric mask: a head is kept whole, with its dark
+//interior, and the faint background around it is left out.
+TEST(Morphology, TemplateHeadMask){
+
+  const std::size_t n = 21;
+  const std::size_t size[3] = {n, n, n};
+  std::vector<float> t1(n * n * n);
+  std::vector<unsigned char> head(t1.size());
+
+  std::mt19937 rng(3);
+  std::uniform_real_distribution<float> noise(0.0f, 5.0f);
+
+  for (std::size_t z = 0, i = 0; z < n; ++z)
+    for (std::size_t y = 0; y < n; ++y)
+      for (std::size_t x = 0; x < n; ++x, ++i){
+        const double r2 = (x - 10.0) * (x - 10.0) + (y - 10.0) * (y - 10.0) + (z - 10.0) * (z - 10.0);
+        head[i] = (r2 <= 8 * 8) ? 1 : 0;
+        //Ventricle-like interior darker than the threshold.
+        t1[i] = (r2 <= 3 * 3) ? 2.0f : (head[i] ? 100.0f : noise(rng));
+      }
+
+  const float threshold = ns::GetForegroundThreshold(t1.data(), t1.size(), 0.1);
+  EXPECT_FLOAT_EQ(10.0f, threshold);
+
+  std::vector<unsigned char> mask(t1.size());
+  for (std::size_t i = 0; i < t1.size(); ++i)
+    mask[i] = (t1[i] > threshold) ? 1 : 0;
+
+  ns::BinaryClosingBall(mask.data(), size, 2);
+  ns::FillHoles(mask.data(), size);
+
+  for (std::size_t i = 0; i < mask.size(); ++i)
+    ASSERT_EQ(head[i], mask[i]) << "voxel " << i;
+}
+
+}
@@ -0,0 +1,89 @@
+/*
+   preview_tests.cpp
+
+   Author:      Benjamin A. Thomas
+
+   Copyright 2018 Institute of Nuclear Medicine, University College London.
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+
+ */
+
+#include "Preview.hpp"
+#include <gtest/gtest.h>
+
+#include <itkImage.h>
+#include <itkImageRegionIteratorWithIndex.h>
+
+namespace {
+
+typedef itk::Image<float, 3> ImageType;
+
+//Two regions split at x = 8, on a 16^3 grid with 1.5 mm voxels.
+ImageType::Pointer MakeDecisions(){
+
+  ImageType::SizeType size;
+  size.Fill(16);
+  ImageType::SpacingType spacing;
+  spacing.Fill(1.5);
+  ImageType::PointType origin;
+  origin.Fill(-12.0);
+
+  ImageType::Pointer img = ImageType::New();
+  img->SetRegions(size);
+  img->SetSpacing(spacing);
+  img->SetOrigin(origin);
+  img->Allocate();
+
+  for (itk::ImageRegionIteratorWithIndex<ImageType> it(img, img->GetLargestPossibleRegion()); !it.IsAtEnd(); ++it)
+    it.Set(it.GetIndex()[0] < 8 ? 0.099f : 0.01f);
+
+  return img;
+}
+
+TEST(Preview, ShrinkKeepsPhysicalExtent)
+{
+  ImageType::Pointer full = MakeDecisions();
+
+  for (unsigned int factor : {2u, 4u}){
+    ImageType::Pointer shrunk = ns::ShrinkImage<ImageType>(full.GetPointer(), factor);
+
+    EXPECT_EQ(16u / factor, shrunk->GetLargestPossibleRegion().GetSize()[0]);
+    EXPECT_DOUBLE_EQ(1.5 * factor, shrunk->GetSpacing()[0]);
+
+    //The first voxel centre is the centre of the first bin.
+    ImageType::IndexType first = shrunk->GetLargestPossibleRegion().GetIndex();
+    ImageType::PointType p;
+    shrunk->TransformIndexToPhysicalPoint(first, p);
+    EXPECT_NEAR(-12.0 + 0.75 * (factor - 1), p[0], 1e-9);
+  }
+}
+
+TEST(Preview, UpsampledDecisionsKeepRegionValues)
+{
+  ImageType::Pointer full = MakeDecisions();
+  ImageType::Pointer shrunk = ns::ShrinkImage<ImageType>(full.GetPointer(), 4);
+  ImageType::Pointer up = ns::UpsampleDecisions<ImageType>(shrunk.GetPointer(), full.GetPointer());
+
+  EXPECT_EQ(full->GetLargestPossibleRegion(), up->GetLargestPossibleRegion());
+  EXPECT_EQ(full->GetSpacing(), up->GetSpacing());
+  EXPECT_EQ(full->GetOrigin(), up->GetOrigin());
+
+  //The boundary falls between bins, so every voxel is restored exactly,
+  //and no value between the two regions is made up.
+  itk::ImageRegionIteratorWithIndex<ImageType> a(full, full->GetLargestPossibleRegion());
+  itk::ImageRegionIteratorWithIndex<ImageType> b(up, up->GetLargestPossibleRegion());
+  for (; !a.IsAtEnd(); ++a, ++b)
+    ASSERT_EQ(a.Get(), b.Get()) << a.GetIndex();
+}
+
+}
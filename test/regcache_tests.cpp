@@ -0,0 +1,144 @@
+/*
+   regcache_tests.cpp
+
+   Author:      Benjamin A. Thomas
+
+   Copyright 2018 Institute of Nuclear Medicine, University College London.
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+   
+ */
+
+
+#include "RegistrationCache.hpp"
+#include <gtest/gtest.h>
+
+#include <fstream>
+
+#include <itkImageRegionIteratorWithIndex.h>
+
+namespace {
+
+namespace fs = boost::filesystem;
+
+typedef itk::Image< itk::Vector<float, 3>, 3 > FieldType;
+
+class RegistrationCacheTest : public ::testing::Test {
+protected:
+  void SetUp() override {
+    _root = fs::temp_directory_path() / fs::unique_path();
+    fs::create_directories(_root / "study");
+  }
+
+  void TearDown() override {
+    fs::remove_all(_root);
+  }
+
+  //Stands in for an ANTS run: an affine and a smooth inverse warp.
+  fs::path WriteResult(const std::string &name){
+    const fs::path prefix = _root / "study" / name;
+
+    std::ofstream((prefix.string() + "Affine.txt")) << "#Insight Transform File V1.0\n";
+
+    FieldType::SizeType size;
+    size.Fill(8);
+    FieldType::Pointer field = FieldType::New();
+    field->SetRegions(size);
+    field->Allocate();
+
+    for (itk::ImageRegionIteratorWithIndex<FieldType> it(field, field->GetLargestPossibleRegion()); !it.IsAtEnd(); ++it){
+      FieldType::PixelType v;
+      for (unsigned int d = 0; d < 3; ++d)
+        v[d] = 0.37f * it.GetIndex()[d] - 1.1f;
+      it.Set(v);
+    }
+
+    typedef itk::ImageFileWriter<FieldType> WriterType;
+    WriterType::Pointer writer = WriterType::New();
+    writer->SetFileName(prefix.string() + "InverseWarp.nii.gz");
+    writer->SetInput(field);
+    writer->Update();
+
+    _field = field;
+    return prefix;
+  }
+
+  fs::path _root;
+  FieldType::Pointer _field;
+};
+
+TEST_F(RegistrationCacheTest, HitRestoresPackedFields)
+{
+  reg::RegistrationCache cache(_root / "cache", 0);
+
+  const fs::path prefix = WriteResult("ANTs-");
+  EXPECT_FALSE(cache.Fetch("abc", _root / "study" / "missed-"));
+  cache.Store("abc", prefix);
+
+  const fs::path restored = _root / "study" / "restored-";
+  ASSERT_TRUE(cache.Fetch("abc", restored));
+  EXPECT_TRUE(fs::exists(restored.string() + "Affine.txt"));
+
+  typedef itk::ImageFileReader<FieldType> ReaderType;
+  ReaderType::Pointer reader = ReaderType::New();
+  reader->SetFileName(restored.string() + "InverseWarp.nii.gz");
+  reader->Update();
+
+  //Half a 16-bit step of the largest displacement.
+  const double tolerance = 0.5 * 1.49 / 32767 + 1e-6;
+
+  itk::ImageRegionConstIterator<FieldType> a(_field, _field->GetLargestPossibleRegion());
+  itk::ImageRegionConstIterator<FieldType> b(reader->GetOutput(), _field->GetLargestPossibleRegion());
+  for (; !a.IsAtEnd(); ++a, ++b)
+    for (unsigned int d = 0; d < 3; ++d)
+      EXPECT_NEAR(a.Get()[d], b.Get()[d], tolerance);
+
+  const reg::RegistrationCache::Statistics s = cache.GetStatistics();
+  EXPECT_EQ(s.hits, 1u);
+  EXPECT_EQ(s.misses, 1u);
+  EXPECT_EQ(s.stores, 1u);
+  EXPECT_EQ(s.entries, 1u);
+}
+
+TEST_F(RegistrationCacheTest, LeastRecentlyUsedEntryIsEvicted)
+{
+  //Smaller than any entry: only the newest survives.
+  reg::RegistrationCache cache(_root / "cache", 1);
+
+  cache.Store("first", WriteResult("first-"));
+  cache.Store("second", WriteResult("second-"));
+
+  EXPECT_FALSE(cache.Fetch("first", _root / "study" / "x-"));
+  EXPECT_TRUE(cache.Fetch("second", _root / "study" / "y-"));
+  EXPECT_EQ(cache.GetStatistics().evictions, 1u);
+}
+
+TEST_F(RegistrationCacheTest, FetchRemovesStaleFiles)
+{
+  reg::RegistrationCache cache(_root / "cache", 0);
+  cache.Store("abc", WriteResult("ANTs-"));
+
+  //Left by an earlier run; the entry has no forward warp.
+  const fs::path restored = _root / "study" / "restored-";
+  std::ofstream((restored.string() + "Warp.nii.gz")) << "stale";
+
+  ASSERT_TRUE(cache.Fetch("abc", restored));
+  EXPECT_TRUE(fs::exists(restored.string() + "InverseWarp.nii.gz"));
+  EXPECT_FALSE(fs::exists(restored.string() + "Warp.nii.gz"));
+
+  //A miss leaves nothing behind either.
+  std::ofstream((restored.string() + "Affine.txt")) << "stale";
+  EXPECT_FALSE(cache.Fetch("other", restored));
+  EXPECT_FALSE(fs::exists(restored.string() + "Affine.txt"));
+}
+
+}
@@ -0,0 +1,164 @@
+/*
+   registration_tests.cpp
+
+   Author:      Benjamin A. Thomas
+
+   Copyright 2018 Institute of Nuclear Medicine, University College London.
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+
+ */
+
+
+#include "RegistrationFactory.hpp"
+#include <gtest/gtest.h>
+
+#include <cmath>
+#include <fstream>
+
+#include <itkImageRegionIteratorWithIndex.h>
+
+namespace {
+
+namespace fs = boost::filesystem;
+
+typedef itk::Image<float, 3> ImageType;
+
+class RegistrationBackendTest : public ::testing::Test {
+protected:
+  void SetUp() override {
+    _root = fs::temp_directory_path() / fs::unique_path();
+    fs::create_directories(_root);
+  }
+
+  void TearDown() override {
+    fs::remove_all(_root);
+  }
+
+  //An ellipsoid and a smaller sphere, shifted by shiftX mm.
+  fs::path WritePhantom(const std::string &name, double shiftX){
+
+    ImageType::SizeType size;
+    size.Fill(32);
+    ImageType::SpacingType spacing;
+    spacing.Fill(2.0);
+
+    ImageType::Pointer img = ImageType::New();
+    img->SetRegions(size);
+    img->SetSpacing(spacing);
+    img->Allocate();
+
+    for (itk::ImageRegionIteratorWithIndex<ImageType> it(img, img->GetLargestPossibleRegion()); !it.IsAtEnd(); ++it){
+      ImageType::PointType p;
+      img->TransformIndexToPhysicalPoint(it.GetIndex(), p);
+      const double x = p[0] - 32.0 - shiftX, y = p[1] - 30.0, z = p[2] - 32.0;
+      const double e = (x * x) / 400.0 + (y * y) / 196.0 + (z * z) / 256.0;
+      const double s = ((x - 8.0) * (x - 8.0) + (y - 10.0) * (y - 10.0) + z * z) / 16.0;
+      it.Set(static_cast<float>(1000.0 * std::exp(-e) + 500.0 * std::exp(-s)));
+    }
+
+    const fs::path file = _root / name;
+    typedef itk::ImageFileWriter<ImageType> WriterType;
+    WriterType::Pointer writer = WriterType::New();
+    writer->SetFileName(file.string());
+    writer->SetInput(img);
+    writer->Update();
+    return file;
+  }
+
+  fs::path _root;
+};
+
+TEST(RegistrationFactory, SelectsBackendByName)
+{
+  EXPECT_EQ("ANTS", reg::CreateRegistrationBackend<ImageType>("ANTS")->GetName());
+  EXPECT_EQ("antsRegistration", reg::CreateRegistrationBackend<ImageType>("antsRegistration")->GetName());
+  EXPECT_EQ("demons", reg::CreateRegistrationBackend<ImageType>("demons")->GetName());
+  EXPECT_THROW(reg::CreateRegistrationBackend<ImageType>("elastix"), bool);
+}
+
+TEST(RegistrationFactory, AddsMaskArgumentOnce)
+{
+  EXPECT_EQ("-m CC[<%%REF%%>,<%%FLOAT%%>,1,4] -x <%%MASK%%>",
+    reg::AddMaskArgument("-m CC[<%%REF%%>,<%%FLOAT%%>,1,4]"));
+
+  //Already placed, e.g. with a second mask for the moving image.
+  const std::string placed = "-x [<%%MASK%%>,moving_mask.nii.gz] -m CC[<%%REF%%>,<%%FLOAT%%>,1,4]";
+  EXPECT_EQ(placed, reg::AddMaskArgument(placed));
+  EXPECT_EQ(placed, reg::AddMaskArgument(reg::AddMaskArgument(placed)));
+}
+
+TEST_F(RegistrationBackendTest, DemonsAffineRecoversShift)
+{
+  std::unique_ptr<reg::RegistrationBackend<ImageType>> backend =
+    reg::CreateRegistrationBackend<ImageType>("demons");
+
+  backend->SetParams(backend->GetDefaultAffineArgs());
+  backend->SetOutputDirectory(_root);
+  backend->SetOutputPrefix("demons-");
+  backend->SetReferenceFileName(WritePhantom("ref.nii.gz", 0.0));
+  backend->SetFloatingFileName(WritePhantom("float.nii.gz", 4.0));
+  backend->Update();
+
+  const reg::Transforms t = backend->GetTransforms();
+  EXPECT_TRUE(t.inverseWarp.IsNull());
+
+  //Floating -> reference undoes the shift.
+  reg::CompositeTransformType::InputPointType p;
+  p[0] = 36.0; p[1] = 30.0; p[2] = 32.0;
+  const reg::CompositeTransformType::OutputPointType q = t.GetInverse()->TransformPoint(p);
+  EXPECT_NEAR(32.0, q[0], 1.0);
+  EXPECT_NEAR(30.0, q[1], 1.0);
+  EXPECT_NEAR(32.0, q[2], 1.0);
+}
+
+TEST_F(RegistrationBackendTest, DemonsWritesInverseWarp)
+{
+  std::unique_ptr<reg::RegistrationBackend<ImageType>> backend =
+    reg::CreateRegistrationBackend<ImageType>("demons");
+
+  backend->SetParams("--affine-iterations 50 --iterations 10x5 --sigma 1.5 --histogram-match 0");
+  backend->SetOutputDirectory(_root);
+  backend->SetOutputPrefix("demons-");
+  backend->SetReferenceFileName(WritePhantom("ref.nii.gz", 0.0));
+  backend->SetFloatingFileName(WritePhantom("float.nii.gz", 2.0));
+  backend->Update();
+
+  EXPECT_TRUE(fs::exists(_root / "demons-Affine.txt"));
+  EXPECT_TRUE(fs::exists(_root / "demons-InverseWarp.nii.gz"));
+  EXPECT_TRUE(backend->GetTransforms().inverseWarp.IsNotNull());
+
+  //Unknown arguments are rejected.
+  backend->SetParams("--smoothing 2");
+  EXPECT_THROW(backend->Update(), bool);
+}
+
+TEST_F(RegistrationBackendTest, UpdateRemovesStaleWarp)
+{
+  std::unique_ptr<reg::RegistrationBackend<ImageType>> backend =
+    reg::CreateRegistrationBackend<ImageType>("demons");
+
+  //Left by an earlier deformable run with the same prefix.
+  std::ofstream((_root / "demons-InverseWarp.nii.gz").string()) << "stale";
+
+  backend->SetParams(backend->GetDefaultAffineArgs());
+  backend->SetOutputDirectory(_root);
+  backend->SetOutputPrefix("demons-");
+  backend->SetReferenceFileName(WritePhantom("ref.nii.gz", 0.0));
+  backend->SetFloatingFileName(WritePhantom("float.nii.gz", 4.0));
+  backend->Update();
+
+  EXPECT_FALSE(fs::exists(_root / "demons-InverseWarp.nii.gz"));
+  EXPECT_TRUE(backend->GetTransforms().inverseWarp.IsNull());
+}
+
+}
@@ -21,8 +21,50 @@
 #include "Resolute.hpp"
 #include <gtest/gtest.h>
 
+#include <algorithm>
+#include <limits>
+#include <vector>
+
 namespace {
 
+typedef itk::Image<float, 3> ImageType;
+
+//Exposes the conversion of the warped templates to 8 bits.
+class TemplateFilter : public ns::ResoluteImageFilter<ImageType, ImageType>
+{
+public:
+  typedef TemplateFilter Self;
+  typedef ns::ResoluteImageFilter<ImageType, ImageType> Superclass;
+  typedef itk::SmartPointer< Self > Pointer;
+
+  itkNewMacro(Self);
+  itkTypeMacro(TemplateFilter, ResoluteImageFilter);
+
+  using Superclass::StoreWarpedTemplate;
+  using Superclass::GetWarpedTemplate;
+  using Superclass::GetBrainTissue;
+  using Superclass::PROBABILITY_ONE;
+
+protected:
+  TemplateFilter(){};
+};
+
+//A row of voxels holding values.
+ImageType::Pointer MakeRow(const std::vector<float> &values){
+
+  ImageType::SizeType size;
+  size[0] = values.size();
+  size[1] = 1;
+  size[2] = 1;
+
+  ImageType::Pointer img = ImageType::New();
+  img->SetRegions(size);
+  img->Allocate();
+  std::copy(values.begin(), values.end(), img->GetBufferPointer());
+
+  return img;
+}
+
 TEST(Resolute, R2StoHU){
    EXPECT_NEAR(330, ns::GetHUfromR2s(100.0), 10);
    EXPECT_NEAR(615, ns::GetHUfromR2s(200.0), 10);
@@ -49,4 +91,49 @@ TEST(Resolute, R2StoLAC){
    EXPECT_NEAR(0.177, ns::GetMU(1000.0), 0.001);
 }
 
-}
\ No newline at end of file
+//The brain branch of the decision rules (brain mask == 1, then
+//GM + WM > 0.5) and the mask tests take the same branch on the 8-bit
+//templates as on the float ones, including at the thresholds.
+TEST(Resolute, EightBitTemplatesDecideAsFloat){
+
+  std::vector<float> gm, wm;
+
+  //Sums on, and within a fixed point step of, one half.
+  for (int k = -400; k <= 400; ++k){
+    const float sum = 0.5f + k * 1e-5f;
+    gm.push_back(0.4f * sum);
+    wm.push_back(sum - gm.back());
+  }
+
+  const float eps = std::numeric_limits<float>::epsilon();
+  const float pairs[][2] = {
+    {0.25f, 0.25f}, {0.5f, 0.0f}, {0.0f, 0.5f}, {0.3f, 0.2f}, {0.5f, eps},
+    {0.25f, 0.2499f}, {0.25f, 0.2501f}, {0.0f, 0.0f}, {1.0f, 0.0f}, {0.7f, 0.6f}, {-0.1f, 0.3f}
+  };
+  for (const auto &p : pairs){
+    gm.push_back(p[0]);
+    wm.push_back(p[1]);
+  }
+
+  std::vector<float> mask = { 0.0f, -0.0f, 1.0f, 0.5f, 2.0f, eps, 1.0f - eps, 1.0f + 2 * eps, -1.0f };
+  mask.resize(gm.size(), 1.0f);
+
+  TemplateFilter::Pointer filter = TemplateFilter::New();
+  filter->StoreWarpedTemplate(tc::ETemplateImages::Brain, MakeRow(mask));
+  filter->StoreWarpedTemplate(tc::ETemplateImages::GM, MakeRow(gm));
+  filter->StoreWarpedTemplate(tc::ETemplateImages::WM, MakeRow(wm));
+
+  const unsigned char *brain = filter->GetWarpedTemplate(tc::ETemplateImages::Brain)->GetBufferPointer();
+  const unsigned char *tissue = filter->GetBrainTissue()->GetBufferPointer();
+
+  for (std::size_t i = 0; i < gm.size(); ++i){
+    const float sum = gm[i] + wm[i];
+    EXPECT_EQ(sum > 0.5, 2 * tissue[i] > TemplateFilter::PROBABILITY_ONE) << "GM " << gm[i] << ", WM " << wm[i];
+    //Still a probability, to within a step.
+    EXPECT_NEAR(std::min(1.0f, std::max(0.0f, sum)), tissue[i] / 255.0, 1.0 / 255) << "GM " << gm[i] << ", WM " << wm[i];
+    EXPECT_EQ(mask[i] == 0, brain[i] == 0) << "mask " << mask[i];
+    EXPECT_EQ(mask[i] == 1, brain[i] == 1) << "mask " << mask[i];
+  }
+}
+
+}
@@ -0,0 +1,93 @@
+/*
+   scheduler_tests.cpp
+
+   Author:      Benjamin A. Thomas
+
+   Copyright 2018 Institute of Nuclear Medicine, University College London.
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+   
+ */
+
+#include "BatchScheduler.hpp"
+#include <gtest/gtest.h>
+
+#include <atomic>
+#include <chrono>
+
+namespace {
+
+struct TestJob {
+  int id;
+  std::vector<int> stagesRun;
+};
+
+}
+
+TEST(PipelineScheduler, JobsPassEveryStageInOrder)
+{
+  std::vector<TestJob> jobs(10);
+  for (int i = 0; i < 10; ++i)
+    jobs[i].id = i;
+
+  ns::PipelineScheduler<TestJob> scheduler(0);
+  for (int s = 0; s < 3; ++s){
+    scheduler.AddStage("stage" + std::to_string(s), 2, [s](TestJob &j){
+      j.stagesRun.push_back(s);
+      return true;
+    });
+  }
+
+  EXPECT_EQ(scheduler.Run(jobs), 10u);
+
+  for (const TestJob &j : jobs)
+    EXPECT_EQ(j.stagesRun, std::vector<int>({0, 1, 2}));
+}
+
+TEST(PipelineScheduler, BudgetLimitsJobsInFlightAndFailuresLeave)
+{
+  std::vector<TestJob> jobs(8);
+  for (int i = 0; i < 8; ++i)
+    jobs[i].id = i;
+
+  std::atomic<int> inFlight(0), maxInFlight(0);
+
+  //Each job costs 1 of a budget of 2.
+  ns::PipelineScheduler<TestJob> scheduler(2);
+  scheduler.SetCostFunction([](const TestJob &){ return std::size_t(1); });
+
+  scheduler.AddStage("load", 1, [&](TestJob &){
+    const int n = ++inFlight;
+    int m = maxInFlight.load();
+    while (n > m && !maxInFlight.compare_exchange_weak(m, n)) {}
+    std::this_thread::sleep_for(std::chrono::milliseconds(5));
+    return true;
+  });
+
+  scheduler.AddStage("compute", 1, [&](TestJob &j){
+    std::this_thread::sleep_for(std::chrono::milliseconds(5));
+    if (j.id == 3){
+      --inFlight;
+      return false;
+    }
+    return true;
+  });
+
+  scheduler.AddStage("export", 1, [&](TestJob &){
+    --inFlight;
+    return true;
+  });
+
+  EXPECT_EQ(scheduler.Run(jobs), 7u);
+  EXPECT_EQ(inFlight.load(), 0);
+  EXPECT_LE(maxInFlight.load(), 2);
+}
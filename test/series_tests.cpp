@@ -0,0 +1,135 @@
+/*
+   series_tests.cpp
+
+   Author:      Benjamin A. Thomas
+
+   Copyright 2018 Institute of Nuclear Medicine, University College London.
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+
+ */
+
+#include "SeriesProgress.hpp"
+#include <gtest/gtest.h>
+
+namespace {
+
+typedef dcm::SeriesProgress::ClockType ClockType;
+
+const ClockType::duration quiescence = std::chrono::seconds(2);
+const ClockType::duration timeout = std::chrono::seconds(10);
+
+//An axial slice at position z (mm).
+dcm::ReceivedInstance MakeSlice(double z, unsigned int imagesInAcquisition){
+
+  dcm::ReceivedInstance r;
+  r.seriesUID = "1.2.3";
+  r.imagesInAcquisition = imagesInAcquisition;
+  r.hasGeometry = true;
+  const double axial[6] = { 1, 0, 0, 0, 1, 0 };
+  std::copy(axial, axial + 6, r.orientation);
+  r.slicePosition = z;
+  return r;
+}
+
+TEST(SeriesProgress, CompleteAfterQuiescenceWithAllImages)
+{
+  const ClockType::time_point t0 = ClockType::now();
+
+  dcm::SeriesProgress s;
+  EXPECT_FALSE(s.IsComplete(t0 + timeout, quiescence, timeout));
+
+  //Out of order, as a sender may send them.
+  const double z[] = { 3.0, 0.0, 6.0, 1.5, 4.5 };
+  for (double p : z)
+    s.Add(MakeSlice(p, 5), t0);
+
+  EXPECT_EQ(5u, s.GetReceived());
+  EXPECT_TRUE(s.IsEvenlySpaced());
+  EXPECT_FALSE(s.IsComplete(t0 + std::chrono::seconds(1), quiescence, timeout));
+  EXPECT_TRUE(s.IsComplete(t0 + quiescence, quiescence, timeout));
+}
+
+TEST(SeriesProgress, WaitsForTimeoutWhenImagesAreMissing)
+{
+  const ClockType::time_point t0 = ClockType::now();
+
+  dcm::SeriesProgress s;
+  for (int i = 0; i < 4; ++i)
+    s.Add(MakeSlice(1.5 * i, 10), t0);
+
+  EXPECT_FALSE(s.IsComplete(t0 + quiescence, quiescence, timeout));
+  EXPECT_TRUE(s.IsComplete(t0 + timeout, quiescence, timeout));
+
+  //Without a count the timeout is the only signal.
+  dcm::SeriesProgress u;
+  for (int i = 0; i < 4; ++i)
+    u.Add(MakeSlice(1.5 * i, 0), t0);
+
+  EXPECT_FALSE(u.IsComplete(t0 + quiescence, quiescence, timeout));
+  EXPECT_TRUE(u.IsComplete(t0 + timeout, quiescence, timeout));
+}
+
+TEST(SeriesProgress, RejectsGapsAndRepeats)
+{
+  const ClockType::time_point t0 = ClockType::now();
+
+  //The count is met, but one slice is missing and another repeated.
+  dcm::SeriesProgress gap;
+  const double z[] = { 0.0, 1.5, 1.5, 4.5, 6.0 };
+  for (double p : z)
+    gap.Add(MakeSlice(p, 5), t0);
+
+  EXPECT_FALSE(gap.IsEvenlySpaced());
+  EXPECT_FALSE(gap.IsComplete(t0 + timeout, quiescence, timeout));
+
+  //The missing slice arrives late; the repeat is still there.
+  gap.Add(MakeSlice(3.0, 5), t0 + timeout);
+  EXPECT_FALSE(gap.IsEvenlySpaced());
+
+  //Every slice at one position.
+  dcm::SeriesProgress same;
+  for (int i = 0; i < 3; ++i)
+    same.Add(MakeSlice(0.0, 3), t0);
+  EXPECT_FALSE(same.IsEvenlySpaced());
+
+  //Small jitter in the positions is accepted.
+  dcm::SeriesProgress jitter;
+  const double zj[] = { 0.0, 1.52, 2.98, 4.5 };
+  for (double p : zj)
+    jitter.Add(MakeSlice(p, 4), t0);
+  EXPECT_TRUE(jitter.IsEvenlySpaced());
+}
+
+TEST(SeriesProgress, ChecksOrientationAndGeometry)
+{
+  const ClockType::time_point t0 = ClockType::now();
+
+  dcm::SeriesProgress tilted;
+  tilted.Add(MakeSlice(0.0, 2), t0);
+  dcm::ReceivedInstance r = MakeSlice(1.5, 2);
+  r.orientation[1] = 0.1;
+  tilted.Add(r, t0);
+  EXPECT_FALSE(tilted.IsEvenlySpaced());
+
+  //Multi-frame and other instances without per-slice geometry are not
+  //checked.
+  dcm::SeriesProgress noGeometry;
+  dcm::ReceivedInstance m = MakeSlice(0.0, 1);
+  m.hasGeometry = false;
+  noGeometry.Add(m, t0);
+  noGeometry.Add(MakeSlice(0.0, 1), t0);
+  EXPECT_TRUE(noGeometry.IsEvenlySpaced());
+  EXPECT_TRUE(noGeometry.IsComplete(t0 + quiescence, quiescence, timeout));
+}
+
+}
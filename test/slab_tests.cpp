@@ -0,0 +1,67 @@
+/*
+   slab_tests.cpp
+
+   Author:      Benjamin A. Thomas
+
+   Copyright 2018 Institute of Nuclear Medicine, University College London.
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+   
+ */
+
+#include "SlabScheduler.hpp"
+#include <gtest/gtest.h>
+
+namespace {
+
+TEST(SlabScheduler, NoBudgetGivesOneSlab)
+{
+  std::vector<ns::Slab> slabs = ns::MakeSlabs(127, 4096, 0, 2);
+
+  ASSERT_EQ(slabs.size(), 1u);
+  EXPECT_EQ(slabs[0].first, 0u);
+  EXPECT_EQ(slabs[0].last, 127u);
+  EXPECT_EQ(slabs[0].haloFirst, 0u);
+  EXPECT_EQ(slabs[0].haloLast, 127u);
+}
+
+TEST(SlabScheduler, SlabsCoverVolumeWithinBudget)
+{
+  const std::size_t nz = 101, bytesPerPlane = 1000, halo = 3;
+  const std::size_t budget = 20 * bytesPerPlane;
+
+  std::vector<ns::Slab> slabs = ns::MakeSlabs(nz, bytesPerPlane, budget, halo);
+
+  ASSERT_FALSE(slabs.empty());
+  EXPECT_EQ(slabs.front().first, 0u);
+  EXPECT_EQ(slabs.back().last, nz);
+
+  for (std::size_t s = 0; s < slabs.size(); ++s){
+    if (s > 0)
+      EXPECT_EQ(slabs[s].first, slabs[s-1].last);
+
+    EXPECT_LE((slabs[s].haloLast - slabs[s].haloFirst) * bytesPerPlane, budget);
+    EXPECT_EQ(slabs[s].haloFirst, slabs[s].first > halo ? slabs[s].first - halo : 0);
+    EXPECT_EQ(slabs[s].haloLast, std::min(slabs[s].last + halo, nz));
+  }
+}
+
+TEST(SlabScheduler, TinyBudgetGivesSinglePlanes)
+{
+  std::vector<ns::Slab> slabs = ns::MakeSlabs(5, 1000, 10, 1);
+
+  ASSERT_EQ(slabs.size(), 5u);
+  for (std::size_t s = 0; s < slabs.size(); ++s)
+    EXPECT_EQ(slabs[s].last - slabs[s].first, 1u);
+}
+
+}
@@ -0,0 +1,149 @@
+/*
+   smoothing_tests.cpp
+
+   Author:      Benjamin A. Thomas
+
+   Copyright 2018 Institute of Nuclear Medicine, University College London.
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+   
+ */
+
+#include <itkImage.h>
+#include <itkImageRegionIteratorWithIndex.h>
+
+#include "GaussianSmoothing.hpp"
+#include <gtest/gtest.h>
+
+namespace {
+
+typedef itk::Image<float, 3> ImageType;
+
+//Ball phantom on an mMR UTE-like grid (1.5625 mm isotropic).
+ImageType::Pointer MakeBallPhantom(){
+
+  ImageType::SizeType size;
+  size.Fill(64);
+
+  ImageType::SpacingType spacing;
+  spacing.Fill(1.5625);
+
+  ImageType::Pointer img = ImageType::New();
+  img->SetRegions(size);
+  img->SetSpacing(spacing);
+  img->Allocate();
+
+  itk::ImageRegionIteratorWithIndex<ImageType> it(img, img->GetLargestPossibleRegion());
+  for (it.GoToBegin(); !it.IsAtEnd(); ++it){
+    const ImageType::IndexType idx = it.GetIndex();
+    const double r2 = (idx[0] - 32) * (idx[0] - 32) + (idx[1] - 30) * (idx[1] - 30) + (idx[2] - 33) * (idx[2] - 33);
+    it.Set(r2 <= 14 * 14 ? 1000.0 : 0.0);
+  }
+
+  return img;
+}
+
+//Mean and largest difference between the two backends, over the voxels
+//within 1% of the edge step of the ball's surface.
+void CompareBackends(double fwhm, double maxTolerance, double meanTolerance){
+
+  ImageType::Pointer img = MakeBallPhantom();
+
+  ImageType::Pointer discrete = ns::SmoothImage<ImageType>(img.GetPointer(), fwhm, ns::ESmoothingBackend::Discrete);
+  ImageType::Pointer recursive = ns::SmoothImage<ImageType>(img.GetPointer(), fwhm, ns::ESmoothingBackend::Recursive);
+
+  itk::ImageRegionConstIterator<ImageType> dIt(discrete, discrete->GetLargestPossibleRegion());
+  itk::ImageRegionConstIterator<ImageType> rIt(recursive, recursive->GetLargestPossibleRegion());
+
+  double maxDiff = 0.0, sumDiff = 0.0;
+  unsigned long n = 0;
+
+  for (; !dIt.IsAtEnd(); ++dIt, ++rIt){
+    if (dIt.Get() < 10.0 || dIt.Get() > 990.0)
+      continue;
+    const double d = std::fabs(dIt.Get() - rIt.Get());
+    maxDiff = std::max(maxDiff, d);
+    sumDiff += d;
+    ++n;
+  }
+
+  ASSERT_GT(n, 0u);
+  EXPECT_LT(maxDiff, maxTolerance);
+  EXPECT_LT(sumDiff / n, meanTolerance);
+}
+
+//The R2* smoothing (3 mm, 0.82 voxel) and the 5 mm output smoothing are
+//below two voxels of sigma, so a recursive request gets the discrete
+//filter and the R2* thresholds see the same values.
+TEST(Smoothing, RecursiveMatchesDiscreteR2s){
+   CompareBackends(3.0, 1e-3, 1e-4);
+}
+
+TEST(Smoothing, RecursiveMatchesDiscreteOutput){
+   CompareBackends(5.0, 1e-3, 1e-4);
+}
+
+//Above two voxels the recursive filter is used. It stays within 2.5% of
+//the step and 0.5% on average (25 and 5 s^-1 of a 1000 s^-1 edge, inside
+//the R2* decision margins).
+TEST(Smoothing, RecursiveMatchesDiscreteWide){
+   CompareBackends(8.0, 25.0, 5.0);
+}
+
+TEST(Smoothing, RecursiveFallsBackBelowTwoVoxels){
+   EXPECT_EQ(ns::ESmoothingBackend::Discrete,
+     ns::SelectSmoothingBackend(ns::ESmoothingBackend::Recursive, ns::FWHMToSigma(3.0), 1.5625));
+   EXPECT_EQ(ns::ESmoothingBackend::Recursive,
+     ns::SelectSmoothingBackend(ns::ESmoothingBackend::Recursive, 2.0 * 1.5625, 1.5625));
+   EXPECT_EQ(ns::ESmoothingBackend::Discrete,
+     ns::SelectSmoothingBackend(ns::ESmoothingBackend::Discrete, 10.0, 1.5625));
+}
+
+TEST(Smoothing, DefaultBackendIsDiscrete){
+   EXPECT_EQ(ns::ESmoothingBackend::Discrete, ns::GetSmoothingBackend("discrete"));
+   EXPECT_EQ(ns::ESmoothingBackend::Recursive, ns::GetSmoothingBackend("recursive"));
+   EXPECT_EQ(ns::ESmoothingBackend::Discrete, ns::GetSmoothingBackend("unknown"));
+}
+
+void CompareSlabs(ns::ESmoothingBackend backend, double fwhm, double maxTolerance){
+
+  ImageType::Pointer img = MakeBallPhantom();
+
+  ImageType::Pointer whole = ns::SmoothImage<ImageType>(img.GetPointer(), fwhm, backend);
+  //A few planes per slab.
+  ImageType::Pointer slabs = ns::SmoothImageInSlabs<ImageType>(img.GetPointer(), fwhm, 1024 * 1024, backend);
+
+  itk::ImageRegionConstIterator<ImageType> wIt(whole, whole->GetLargestPossibleRegion());
+  itk::ImageRegionConstIterator<ImageType> sIt(slabs, slabs->GetLargestPossibleRegion());
+
+  double maxDiff = 0.0;
+  for (; !wIt.IsAtEnd(); ++wIt, ++sIt)
+    maxDiff = std::max(maxDiff, std::fabs(static_cast<double>(wIt.Get() - sIt.Get())));
+
+  EXPECT_LT(maxDiff, maxTolerance);
+}
+
+TEST(Smoothing, DiscreteSlabsMatchWholeVolume){
+   CompareSlabs(ns::ESmoothingBackend::Discrete, 3.0, 1e-3);
+}
+
+//Wide enough for the recursive filter, which restarts at the slab edges.
+TEST(Smoothing, RecursiveSlabsMatchWholeVolume){
+   CompareSlabs(ns::ESmoothingBackend::Recursive, 8.0, 5.0);
+}
+
+TEST(Smoothing, FWHMToSigma){
+   EXPECT_NEAR(1.274, ns::FWHMToSigma(3.0), 0.001);
+   EXPECT_NEAR(2.123, ns::FWHMToSigma(5.0), 0.001);
+}
+
+}
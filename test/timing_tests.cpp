@@ -0,0 +1,138 @@
+/*
+   timing_tests.cpp
+
+   Author:      Benjamin A. Thomas
+
+   Copyright 2018 Institute of Nuclear Medicine, University College London.
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+
+ */
+
+#include "StageTimer.hpp"
+#include <gtest/gtest.h>
+
+#include <chrono>
+#include <fstream>
+#include <thread>
+
+namespace {
+
+namespace fs = boost::filesystem;
+
+mon::TimingRecorder::Event MakeEvent(const std::string &name, int64_t startUs, int64_t wallUs, unsigned int threads){
+
+  mon::TimingRecorder::Event e;
+  e.name = name;
+  e.category = "step";
+  e.tid = 1;
+  e.startUs = startUs;
+  e.wallUs = wallUs;
+  e.cpuUs = 2 * wallUs;
+  e.readBytes = 100;
+  e.writtenBytes = 10;
+  e.threads = threads;
+  return e;
+}
+
+TEST(Timing, SummaryTotalsRepeatedSteps)
+{
+  mon::TimingRecorder &rec = mon::TimingRecorder::GetInstance();
+  rec.Clear();
+
+  rec.AddEvent(MakeEvent("Smooth R2*", 0, 1000000, 4));
+  rec.AddEvent(MakeEvent("Decision rules", 1000000, 500000, 2));
+  rec.AddEvent(MakeEvent("Smooth R2*", 1500000, 3000000, 8));
+
+  const nlohmann::json summary = rec.GetSummary();
+
+  //Events in completion order, totals in order of first completion.
+  ASSERT_EQ(3u, summary["events"].size());
+  EXPECT_EQ("Decision rules", summary["events"][1]["name"].get<std::string>());
+
+  const nlohmann::json &stages = summary["stages"];
+  ASSERT_EQ(2u, stages.size());
+  EXPECT_EQ("Smooth R2*", stages[0]["name"].get<std::string>());
+  EXPECT_EQ(2u, stages[0]["count"].get<unsigned int>());
+  EXPECT_DOUBLE_EQ(4.0, stages[0]["wallSeconds"].get<double>());
+  EXPECT_DOUBLE_EQ(8.0, stages[0]["cpuSeconds"].get<double>());
+  EXPECT_EQ(200, stages[0]["readBytes"].get<int64_t>());
+  EXPECT_EQ(20, stages[0]["writtenBytes"].get<int64_t>());
+  EXPECT_EQ(8u, stages[0]["maxThreads"].get<unsigned int>());
+  EXPECT_EQ(1u, stages[1]["count"].get<unsigned int>());
+
+  rec.Clear();
+  EXPECT_EQ(0u, rec.GetSummary()["events"].size());
+}
+
+TEST(Timing, ChromeTraceHasCompleteEvents)
+{
+  mon::TimingRecorder &rec = mon::TimingRecorder::GetInstance();
+  rec.Clear();
+
+  rec.AddEvent(MakeEvent("registration", 250, 4000, 1));
+
+  const nlohmann::json trace = rec.GetChromeTrace();
+  ASSERT_EQ(1u, trace["traceEvents"].size());
+
+  const nlohmann::json &e = trace["traceEvents"][0];
+  EXPECT_EQ("X", e["ph"].get<std::string>());
+  EXPECT_EQ(250, e["ts"].get<int64_t>());
+  EXPECT_EQ(4000, e["dur"].get<int64_t>());
+  EXPECT_EQ(1u, e["tid"].get<std::size_t>());
+  EXPECT_DOUBLE_EQ(8.0, e["args"]["cpu_ms"].get<double>());
+
+  rec.Clear();
+}
+
+TEST(Timing, ScopedTimerRecordsItsScope)
+{
+  mon::TimingRecorder &rec = mon::TimingRecorder::GetInstance();
+  rec.Clear();
+
+  {
+    mon::ScopedTimer timer("sleep", "test");
+    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+  }
+
+  const nlohmann::json summary = rec.GetSummary();
+  ASSERT_EQ(1u, summary["events"].size());
+
+  const nlohmann::json &e = summary["events"][0];
+  EXPECT_EQ("sleep", e["name"].get<std::string>());
+  EXPECT_EQ("test", e["category"].get<std::string>());
+  EXPECT_GE(e["wallSeconds"].get<double>(), 0.02);
+  EXPECT_GE(e["threads"].get<unsigned int>(), 1u);
+  EXPECT_GE(summary["totalWallSeconds"].get<double>(), e["wallSeconds"].get<double>());
+
+  rec.Clear();
+}
+
+TEST(Timing, WritesSummary)
+{
+  const fs::path dst = fs::temp_directory_path() / fs::unique_path("%%%%-%%%%.json");
+
+  mon::TimingRecorder &rec = mon::TimingRecorder::GetInstance();
+  rec.Clear();
+  rec.AddEvent(MakeEvent("export", 0, 1000, 1));
+  rec.WriteSummary(dst);
+
+  std::ifstream ifs(dst.string());
+  const nlohmann::json written = nlohmann::json::parse(ifs);
+  ASSERT_EQ(1u, written["stages"].size());
+  EXPECT_EQ("export", written["stages"][0]["name"].get<std::string>());
+
+  rec.Clear();
+  fs::remove(dst);
+}
+
+}
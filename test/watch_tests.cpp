@@ -0,0 +1,103 @@
+/*
+   watch_tests.cpp
+
+   Author:      Benjamin A. Thomas
+
+   Copyright 2018 Institute of Nuclear Medicine, University College London.
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+   
+ */
+
+#include "WatchFolder.hpp"
+#include <gtest/gtest.h>
+
+#include <fstream>
+
+namespace {
+
+namespace fs = boost::filesystem;
+
+class WatchFolderTest : public ::testing::Test {
+protected:
+  void SetUp() override {
+    _root = fs::temp_directory_path() / fs::unique_path();
+    fs::create_directories(_root);
+  }
+
+  void TearDown() override {
+    fs::remove_all(_root);
+  }
+
+  fs::path _root;
+};
+
+//Exposes the rescan done when the event queue overflows.
+class RescanningWatchFolder : public wf::WatchFolder {
+public:
+  explicit RescanningWatchFolder(const fs::path &root) : wf::WatchFolder(root) {};
+  using wf::WatchFolder::Rescan;
+};
+
+TEST_F(WatchFolderTest, MarkerFileCompletesStudy)
+{
+  wf::WatchFolder watcher(_root);
+  watcher.SetQuiescenceSeconds(3600);
+
+  fs::path study = _root / "study1";
+  fs::create_directories(study / "series1");
+  std::ofstream((study / "series1" / "IM1.dcm").string()) << "x";
+
+  EXPECT_TRUE(watcher.Next(1).empty());
+
+  std::ofstream((study / "COMPLETE").string());
+  EXPECT_EQ(watcher.Next(5), study);
+
+  //Returned once only.
+  EXPECT_TRUE(watcher.Next(1).empty());
+}
+
+TEST_F(WatchFolderTest, QuiescenceCompletesStudyAndHiddenDirsAreIgnored)
+{
+  fs::path existing = _root / "study1";
+  fs::create_directories(existing);
+  fs::create_directories(_root / ".done");
+
+  wf::WatchFolder watcher(_root);
+  watcher.SetMarkerFileName("");
+  watcher.SetQuiescenceSeconds(1);
+
+  EXPECT_EQ(watcher.Next(5), existing);
+  EXPECT_TRUE(watcher.Next(2).empty());
+}
+
+TEST_F(WatchFolderTest, RescanSkipsReturnedStudies)
+{
+  fs::path study = _root / "study1";
+  fs::create_directories(study);
+
+  RescanningWatchFolder watcher(_root);
+  watcher.SetMarkerFileName("");
+  watcher.SetQuiescenceSeconds(1);
+
+  EXPECT_EQ(watcher.Next(5), study);
+
+  watcher.Rescan();
+  EXPECT_TRUE(watcher.Next(2).empty());
+
+  //A new study under the same name is still picked up.
+  fs::remove_all(study);
+  fs::create_directories(study);
+  EXPECT_EQ(watcher.Next(5), study);
+}
+
+}